@@ -0,0 +1,683 @@
+#include "nbody.h"
+
+
+/**
+ * Spread the low 21 bits of a value so two zero bits follow every bit
+ * @param v, the value
+ * @return the spread value
+ */
+static inline unsigned long long bh_spread(unsigned long long v) {
+	v &= 0x1fffffULL;
+	v = (v | v << 32) & 0x1f00000000ffffULL;
+	v = (v | v << 16) & 0x1f0000ff0000ffULL;
+	v = (v | v << 8) & 0x100f00f00f00f00fULL;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2) & 0x1249249249249249ULL;
+	return v;
+}
+
+
+/**
+ * Morton key of a position inside the root cube
+ * Every level of the tree takes three bits, x being the highest of them
+ * @param s, the tree state holding the root cube
+ * @param x, the x position
+ * @param y, the y position
+ * @param z, the z position
+ * @return the key
+ */
+static inline unsigned long long bh_key(const struct bh_state* s, double x, double y, double z) {
+	const double cells = (double)(1 << BH_MAX_DEPTH);
+	const double last = cells - 1.0;
+	double scale = cells / s->size;
+	double u = fmin(fmax((x - s->min_x) * scale, 0.0), last);
+	double v = fmin(fmax((y - s->min_y) * scale, 0.0), last);
+	double w = fmin(fmax((z - s->min_z) * scale, 0.0), last);
+	return bh_spread((unsigned long long)u) << 2 | bh_spread((unsigned long long)v) << 1 | bh_spread((unsigned long long)w);
+}
+
+
+/**
+ * The octant of a key below a cell of the given depth
+ * @param key, the key
+ * @param depth, the depth of the cell, 0 for the root
+ * @return the octant from 0 to 7
+ */
+static inline unsigned int bh_octant(unsigned long long key, int depth) {
+	return (key >> (3 * (BH_MAX_DEPTH - 1 - depth))) & 7;
+}
+
+
+/**
+ * Order entries by key, ties by index so the tree never depends on timing
+ * @param a, the first entry
+ * @param b, the second entry
+ * @return negative, zero or positive as for qsort
+ */
+static int bh_entry_compare(const void* a, const void* b) {
+	const struct bh_entry* e1 = a;
+	const struct bh_entry* e2 = b;
+	if (e1->key != e2->key) {
+		return e1->key < e2->key ? -1 : 1;
+	}
+	return e1->index < e2->index ? -1 : e1->index > e2->index;
+}
+
+
+/**
+ * Take a contiguous block of nodes from a pool, growing it by a chunk if needed
+ * @param pool, the pool
+ * @param n, the number of nodes, at most BH_POOL_CHUNK
+ * @return the first node or NULL if out of memory
+ */
+static struct bh_node* bh_pool_alloc(struct bh_pool* pool, size_t n) {
+
+	// Start the next chunk if the block does not fit
+	if (pool->used + n > BH_POOL_CHUNK) {
+		pool->chunk++;
+		pool->used = 0;
+	}
+
+	if (pool->chunk >= pool->n_chunks) {
+		struct bh_node** chunks = realloc(pool->chunks, sizeof(struct bh_node*) * (pool->n_chunks + 1));
+		if (chunks == NULL) {
+			return NULL;
+		}
+		pool->chunks = chunks;
+		pool->chunks[pool->n_chunks] = aligned_alloc(CACHE_LINE, sizeof(struct bh_node) * BH_POOL_CHUNK);
+		if (pool->chunks[pool->n_chunks] == NULL) {
+			return NULL;
+		}
+		pool->n_chunks++;
+	}
+
+	struct bh_node* nodes = pool->chunks[pool->chunk] + pool->used;
+	pool->used += n;
+	return nodes;
+}
+
+
+/**
+ * Set the distance within which a node is too close to use its multipole
+ * Barnes' criterion adds the offset of the centre of mass so a body can never
+ * accept a cell it lies in for theta below 1
+ * @param node, the node with its moments computed
+ * @param x, the x corner of the cell
+ * @param y, the y corner of the cell
+ * @param z, the z corner of the cell
+ * @param size, the side of the cell
+ * @param theta, the opening angle, 0 opens every node
+ */
+static void bh_set_open(struct bh_node* node, double x, double y, double z, double size, double theta) {
+	double half = size * 0.5;
+	double dx = node->com_x - (x + half);
+	double dy = node->com_y - (y + half);
+	double dz = node->com_z - (z + half);
+	double radius = size / theta + sqrt(dx * dx + dy * dy + dz * dz);
+	node->open2 = theta > 0.0 ? radius * radius : INFINITY;
+}
+
+
+/**
+ * Compute the monopole, quadrupole and radius of a leaf from its bodies
+ * @param s, the tree state holding the sorted copies
+ * @param node, the leaf
+ * @param x, the x corner of the cell
+ * @param y, the y corner of the cell
+ * @param z, the z corner of the cell
+ * @param size, the side of the cell
+ */
+static void bh_leaf_moments(const struct bh_state* s, struct bh_node* node, double x, double y, double z, double size) {
+	double mass = 0, com_x = 0, com_y = 0, com_z = 0;
+	for (size_t k = node->first; k < node->first + node->count; k++) {
+		mass += s->sorted_mass[k];
+		com_x += s->sorted_mass[k] * s->sorted_x[k];
+		com_y += s->sorted_mass[k] * s->sorted_y[k];
+		com_z += s->sorted_mass[k] * s->sorted_z[k];
+	}
+
+	// A massless cell pulls nothing so any centre will do
+	if (mass > 0.0) {
+		node->com_x = com_x / mass;
+		node->com_y = com_y / mass;
+		node->com_z = com_z / mass;
+	} else {
+		node->com_x = x + size * 0.5;
+		node->com_y = y + size * 0.5;
+		node->com_z = z + size * 0.5;
+	}
+	node->mass = mass;
+
+	double radius = 0.0;
+	memset(node->quad, 0, sizeof(node->quad));
+	for (size_t k = node->first; k < node->first + node->count; k++) {
+		double m = s->sorted_mass[k];
+		double dx = s->sorted_x[k] - node->com_x;
+		double dy = s->sorted_y[k] - node->com_y;
+		double dz = s->sorted_z[k] - node->com_z;
+		double d2 = dx * dx + dy * dy + dz * dz;
+		node->quad[0] += m * (3 * dx * dx - d2);
+		node->quad[1] += m * 3 * dx * dy;
+		node->quad[2] += m * 3 * dx * dz;
+		node->quad[3] += m * (3 * dy * dy - d2);
+		node->quad[4] += m * 3 * dy * dz;
+		node->quad[5] += m * (3 * dz * dz - d2);
+		radius = fmax(radius, d2);
+	}
+	node->radius = sqrt(radius);
+}
+
+
+/**
+ * Combine the moments of the children into their parent
+ * Each child quadrupole is shifted from its centre of mass to the parent's
+ * and the radius holds every child's sphere, or the cell if that is smaller
+ * @param node, the parent with its children set
+ * @param x, the x corner of the cell
+ * @param y, the y corner of the cell
+ * @param z, the z corner of the cell
+ * @param size, the side of the cell
+ */
+static void bh_merge_moments(struct bh_node* node, double x, double y, double z, double size) {
+	double mass = 0, com_x = 0, com_y = 0, com_z = 0;
+	size_t count = 0;
+	for (size_t c = 0; c < node->n_children; c++) {
+		const struct bh_node* child = node->children + c;
+		mass += child->mass;
+		com_x += child->mass * child->com_x;
+		com_y += child->mass * child->com_y;
+		com_z += child->mass * child->com_z;
+		count += child->count;
+	}
+
+	if (mass > 0.0) {
+		node->com_x = com_x / mass;
+		node->com_y = com_y / mass;
+		node->com_z = com_z / mass;
+	} else {
+		node->com_x = x + size * 0.5;
+		node->com_y = y + size * 0.5;
+		node->com_z = z + size * 0.5;
+	}
+	node->mass = mass;
+	node->count = count;
+
+	double radius = 0.0;
+	memset(node->quad, 0, sizeof(node->quad));
+	for (size_t c = 0; c < node->n_children; c++) {
+		const struct bh_node* child = node->children + c;
+		double m = child->mass;
+		double dx = child->com_x - node->com_x;
+		double dy = child->com_y - node->com_y;
+		double dz = child->com_z - node->com_z;
+		double d2 = dx * dx + dy * dy + dz * dz;
+		node->quad[0] += child->quad[0] + m * (3 * dx * dx - d2);
+		node->quad[1] += child->quad[1] + m * 3 * dx * dy;
+		node->quad[2] += child->quad[2] + m * 3 * dx * dz;
+		node->quad[3] += child->quad[3] + m * (3 * dy * dy - d2);
+		node->quad[4] += child->quad[4] + m * 3 * dy * dz;
+		node->quad[5] += child->quad[5] + m * (3 * dz * dz - d2);
+		if (child->count > 0) {
+			radius = fmax(radius, sqrt(d2) + child->radius);
+		}
+	}
+
+	// The children's spheres can reach past the corners of the cell
+	double corner = 0.0;
+	for (int octant = 0; octant < 8; octant++) {
+		double cx = x + ((octant >> 2) & 1) * size - node->com_x;
+		double cy = y + ((octant >> 1) & 1) * size - node->com_y;
+		double cz = z + (octant & 1) * size - node->com_z;
+		corner = fmax(corner, cx * cx + cy * cy + cz * cz);
+	}
+	node->radius = fmin(radius, sqrt(corner));
+}
+
+
+/**
+ * Recursively build the subtree of a cell over a sorted range of bodies
+ * @param s, the tree state
+ * @param pool, the pool of the building thread
+ * @param node, the node of the cell
+ * @param first, the first sorted body in the cell
+ * @param last, one past the last sorted body in the cell
+ * @param depth, the depth of the cell, 0 for the root
+ * @param x, the x corner of the cell
+ * @param y, the y corner of the cell
+ * @param z, the z corner of the cell
+ * @param size, the side of the cell
+ */
+static void bh_build(struct bh_state* s, struct bh_pool* pool, struct bh_node* node, size_t first, size_t last,
+		int depth, double x, double y, double z, double size) {
+	node->first = first;
+	node->count = last - first;
+	node->children = NULL;
+	node->n_children = 0;
+
+	// Count the bodies in each octant, the keys are sorted so octants are runs
+	size_t split[9] = { 0 };
+	unsigned int n_children = 0;
+	if (last - first > s->leaf_size && depth < BH_MAX_DEPTH) {
+		for (size_t k = first; k < last; k++) {
+			split[bh_octant(s->sorted[k].key, depth) + 1]++;
+		}
+		for (int octant = 0; octant < 8; octant++) {
+			n_children += split[octant + 1] > 0;
+			split[octant + 1] += split[octant];
+		}
+		node->children = bh_pool_alloc(pool, n_children);
+	}
+
+	// Small cells, the deepest cells and cells the pool could not split are leaves
+	if (node->children == NULL) {
+		bh_leaf_moments(s, node, x, y, z, size);
+		bh_set_open(node, x, y, z, size, s->theta);
+		return;
+	}
+
+	double half = size * 0.5;
+	struct bh_node* child = node->children;
+	for (int octant = 0; octant < 8; octant++) {
+		if (split[octant] == split[octant + 1]) {
+			continue;
+		}
+		bh_build(s, pool, child++, first + split[octant], first + split[octant + 1], depth + 1,
+				x + ((octant >> 2) & 1) * half, y + ((octant >> 1) & 1) * half, z + (octant & 1) * half, half);
+	}
+	node->n_children = n_children;
+	bh_merge_moments(node, x, y, z, size);
+	bh_set_open(node, x, y, z, size, s->theta);
+}
+
+
+/**
+ * Get the corner and side of a cell of the shared top levels
+ * @param s, the tree state holding the root cube
+ * @param depth, the depth of the cell
+ * @param index, the morton index of the cell within its level
+ * @param x, set to the x corner
+ * @param y, set to the y corner
+ * @param z, set to the z corner
+ * @return the side of the cell
+ */
+static double bh_top_cell(const struct bh_state* s, int depth, size_t index, double* x, double* y, double* z) {
+	double size = s->size;
+	*x = s->min_x;
+	*y = s->min_y;
+	*z = s->min_z;
+	for (int level = depth - 1; level >= 0; level--) {
+		size *= 0.5;
+		size_t octant = (index >> (3 * level)) & 7;
+		*x += ((octant >> 2) & 1) * size;
+		*y += ((octant >> 1) & 1) * size;
+		*z += (octant & 1) * size;
+	}
+	return size;
+}
+
+
+/**
+ * The first node of a level of the shared top levels
+ * @param depth, the depth of the level
+ * @return the offset into the top nodes
+ */
+static inline size_t bh_top_offset(int depth) {
+	return ((1 << (3 * depth)) - 1) / 7;
+}
+
+
+/**
+ * The first bucket built by a thread, buckets are split so every thread
+ * sorts and builds about the same number of bodies
+ * @param s, the tree state with the bucket starts set
+ * @param id, the thread
+ * @return the first bucket of the thread
+ */
+static size_t bh_first_bucket(const struct bh_state* s, size_t id) {
+	if (id >= s->n_threads) {
+		return BH_BUCKETS;
+	}
+	size_t target = id * s->n_bodies / s->n_threads;
+	size_t bucket = 0;
+	while (bucket < BH_BUCKETS && s->bucket_start[bucket] < target) {
+		bucket++;
+	}
+	return bucket;
+}
+
+
+/**
+ * Sort one bucket, copy its bodies in tree order and build its subtree
+ * @param arg, the Barnes-Hut job
+ * @param id, the thread running the task, whose pool the nodes come from
+ * @param bucket, the bucket
+ */
+static void bh_bucket_task(void* arg, size_t id, size_t bucket) {
+	const struct bh_job* job = arg;
+	struct bh_state* s = job->tree;
+	const struct bodies* b = job->source;
+	size_t first = s->bucket_start[bucket], last = s->bucket_start[bucket + 1];
+	qsort(s->sorted + first, last - first, sizeof(struct bh_entry), bh_entry_compare);
+	for (size_t k = first; k < last; k++) {
+		size_t i = s->sorted[k].index;
+		s->sorted_x[k] = b->x[i];
+		s->sorted_y[k] = b->y[i];
+		s->sorted_z[k] = b->z[i];
+		s->sorted_mass[k] = b->mass[i];
+	}
+	double x, y, z;
+	double cell = bh_top_cell(s, BH_TOP_DEPTH, bucket, &x, &y, &z);
+	bh_build(s, s->pools + id, s->top + bh_top_offset(BH_TOP_DEPTH) + bucket, first, last, BH_TOP_DEPTH, x, y, z, cell);
+}
+
+
+/**
+ * Rebuild the octree from the current positions, called by every thread
+ * The root cube and the morton keys come from each thread's own slice, the
+ * keys are scattered into 512 buckets by a counting sort and the buckets
+ * are then sorted and built into subtrees by whichever thread steals them,
+ * each thread allocating from its own pool, the top three levels are
+ * joined last by the first thread
+ * @param s, the tree state
+ * @param b, the body store
+ * @param id, the thread
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param pool, the pool running every thread
+ */
+static void bh_build_parallel(struct bh_state* s, const struct bodies* b, size_t id, size_t start, size_t end, struct thread_pool* pool) {
+	double* bounds = s->bounds + id * 6;
+	bounds[0] = bounds[1] = bounds[2] = INFINITY;
+	bounds[3] = bounds[4] = bounds[5] = -INFINITY;
+	for (size_t i = start; i < end; i++) {
+		bounds[0] = fmin(bounds[0], b->x[i]);
+		bounds[1] = fmin(bounds[1], b->y[i]);
+		bounds[2] = fmin(bounds[2], b->z[i]);
+		bounds[3] = fmax(bounds[3], b->x[i]);
+		bounds[4] = fmax(bounds[4], b->y[i]);
+		bounds[5] = fmax(bounds[5], b->z[i]);
+	}
+	pool_wait(pool);
+
+	// Every thread reduces the bounds itself so they all agree on the cube
+	double low[3] = { INFINITY, INFINITY, INFINITY }, high[3] = { -INFINITY, -INFINITY, -INFINITY };
+	for (size_t t = 0; t < s->n_threads; t++) {
+		for (int axis = 0; axis < 3; axis++) {
+			low[axis] = fmin(low[axis], s->bounds[t * 6 + axis]);
+			high[axis] = fmax(high[axis], s->bounds[t * 6 + 3 + axis]);
+		}
+	}
+	double size = fmax(fmax(high[0] - low[0], high[1] - low[1]), high[2] - low[2]);
+	size = size > 0.0 ? size * (1.0 + 1e-9) : 1.0;
+	if (id == 0) {
+		s->min_x = low[0];
+		s->min_y = low[1];
+		s->min_z = low[2];
+		s->size = size;
+	}
+	struct bh_state cube = { .min_x = low[0], .min_y = low[1], .min_z = low[2], .size = size };
+
+	// Key this thread's bodies and count them per bucket
+	size_t* histogram = s->histogram + id * BH_BUCKETS;
+	memset(histogram, 0, sizeof(size_t) * BH_BUCKETS);
+	for (size_t i = start; i < end; i++) {
+		s->entries[i].key = bh_key(&cube, b->x[i], b->y[i], b->z[i]);
+		s->entries[i].index = i;
+		histogram[s->entries[i].key >> (3 * (BH_MAX_DEPTH - BH_TOP_DEPTH))]++;
+	}
+	pool_wait(pool);
+
+	// Where this thread's bodies go inside each bucket, thread 0 also keeps the bucket starts
+	size_t offset[BH_BUCKETS];
+	size_t total = 0;
+	for (size_t bucket = 0; bucket < BH_BUCKETS; bucket++) {
+		if (id == 0) {
+			s->bucket_start[bucket] = total;
+		}
+		for (size_t t = 0; t < s->n_threads; t++) {
+			if (t == id) {
+				offset[bucket] = total;
+			}
+			total += s->histogram[t * BH_BUCKETS + bucket];
+		}
+	}
+	if (id == 0) {
+		s->bucket_start[BH_BUCKETS] = total;
+	}
+	for (size_t i = start; i < end; i++) {
+		s->sorted[offset[s->entries[i].key >> (3 * (BH_MAX_DEPTH - BH_TOP_DEPTH))]++] = s->entries[i];
+	}
+	pool_wait(pool);
+
+	// Buckets start out shared by bodies and are stolen when a thread runs dry
+	s->pools[id].chunk = 0;
+	s->pools[id].used = 0;
+	struct bh_job job = { .tree = s, .source = b };
+	pool_steal(pool, id, bh_first_bucket(s, id), bh_first_bucket(s, id + 1), bh_bucket_task, &job);
+
+	// Join the buckets under the top levels, children are the next level's run of 8
+	if (id == 0) {
+		for (int depth = BH_TOP_DEPTH - 1; depth >= 0; depth--) {
+			for (size_t index = 0; index < ((size_t)1 << (3 * depth)); index++) {
+				struct bh_node* node = s->top + bh_top_offset(depth) + index;
+				double x, y, z;
+				double cell = bh_top_cell(s, depth, index, &x, &y, &z);
+				node->children = s->top + bh_top_offset(depth + 1) + index * 8;
+				node->n_children = 8;
+				node->first = s->bucket_start[index << (3 * (BH_TOP_DEPTH - depth))];
+				bh_merge_moments(node, x, y, z, cell);
+				bh_set_open(node, x, y, z, cell, s->theta);
+			}
+		}
+	}
+	pool_wait(pool);
+}
+
+
+/**
+ * Walk the tree for the acceleration on a point, without the gravitational constant
+ * Accepted nodes contribute their monopole and quadrupole, opened leaves
+ * are summed directly with coincident bodies treated as in the direct kernels
+ * @param s, the built tree
+ * @param x, the x position
+ * @param y, the y position
+ * @param z, the z position
+ * @param acc, set to the x, y and z acceleration
+ */
+static void bh_acceleration(const struct bh_state* s, double x, double y, double z, double* acc) {
+	const double min_dist2 = MIN_DISTANCE * MIN_DISTANCE;
+	const struct bh_node* stack[BH_STACK_SIZE];
+	size_t top = 0;
+	double acc_x = 0, acc_y = 0, acc_z = 0;
+
+	stack[top++] = s->top;
+	while (top > 0) {
+		const struct bh_node* node = stack[--top];
+		if (node->count == 0) {
+			continue;
+		}
+
+		double rx = x - node->com_x;
+		double ry = y - node->com_y;
+		double rz = z - node->com_z;
+		double r2 = rx * rx + ry * ry + rz * rz;
+
+		// Far enough for the multipole, phi = -M / r - r.Q.r / (2 r^5)
+		if (r2 > node->open2) {
+			const double* q = node->quad;
+			double inv_r2 = 1.0 / r2;
+			double inv_r3 = inv_r2 * sqrt(inv_r2);
+			double inv_r5 = inv_r3 * inv_r2;
+			double qx = q[0] * rx + q[1] * ry + q[2] * rz;
+			double qy = q[1] * rx + q[3] * ry + q[4] * rz;
+			double qz = q[2] * rx + q[4] * ry + q[5] * rz;
+			double radial = -node->mass * inv_r3 - 2.5 * (rx * qx + ry * qy + rz * qz) * inv_r5 * inv_r2;
+			acc_x += radial * rx + qx * inv_r5;
+			acc_y += radial * ry + qy * inv_r5;
+			acc_z += radial * rz + qz * inv_r5;
+			continue;
+		}
+
+		if (node->n_children == 0) {
+			for (size_t k = node->first; k < node->first + node->count; k++) {
+				double x_dist = s->sorted_x[k] - x;
+				double y_dist = s->sorted_y[k] - y;
+				double z_dist = s->sorted_z[k] - z;
+				double dist2 = x_dist * x_dist + y_dist * y_dist + z_dist * z_dist;
+				// The body itself and coincident bodies have no direction
+				if (dist2 == 0.0) {
+					dist2 = min_dist2;
+				}
+				double s_k = s->sorted_mass[k] / (dist2 * sqrt(dist2));
+				acc_x += x_dist * s_k;
+				acc_y += y_dist * s_k;
+				acc_z += z_dist * s_k;
+			}
+			continue;
+		}
+
+		for (size_t c = 0; c < node->n_children; c++) {
+			stack[top++] = node->children + c;
+		}
+	}
+
+	acc[0] = acc_x;
+	acc[1] = acc_y;
+	acc[2] = acc_z;
+}
+
+
+/**
+ * Allocate the Barnes-Hut state for a body store and a number of threads
+ * @param b, the body store
+ * @param n_threads, the number of threads that will call bh_step
+ * @param params, the engine parameters, theta is the opening angle
+ * @return the state or NULL if invalid
+ */
+void* bh_create(const struct bodies* b, size_t n_threads, const struct engine_params* params) {
+
+	// If the parameters are invalid
+	if (b == NULL || n_threads == 0 || params == NULL || params->theta < 0.0) {
+		return NULL;
+	}
+
+	struct bh_state* s = calloc(1, sizeof(struct bh_state));
+	if (s == NULL) {
+		return NULL;
+	}
+
+	size_t n = b->n_bodies;
+	s->theta = params->theta;
+	s->leaf_size = BH_LEAF_SIZE;
+	s->n_bodies = n;
+	s->n_threads = n_threads;
+	s->bounds = malloc(sizeof(double) * 6 * n_threads);
+	s->histogram = malloc(sizeof(size_t) * BH_BUCKETS * n_threads);
+	s->entries = malloc(sizeof(struct bh_entry) * n);
+	s->sorted = malloc(sizeof(struct bh_entry) * n);
+	s->sorted_x = malloc(sizeof(double) * n);
+	s->sorted_y = malloc(sizeof(double) * n);
+	s->sorted_z = malloc(sizeof(double) * n);
+	s->sorted_mass = malloc(sizeof(double) * n);
+	s->pools = calloc(n_threads, sizeof(struct bh_pool));
+	if (s->bounds == NULL || s->histogram == NULL || s->entries == NULL || s->sorted == NULL || s->sorted_x == NULL
+			|| s->sorted_y == NULL || s->sorted_z == NULL || s->sorted_mass == NULL || s->pools == NULL) {
+		bh_destroy(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+/**
+ * Clear up all memory associated with the Barnes-Hut state
+ * @param state, the state
+ */
+void bh_destroy(void* state) {
+	struct bh_state* s = state;
+
+	// If it is already NULL
+	if (s == NULL) {
+		return;
+	}
+
+	if (s->pools != NULL) {
+		for (size_t t = 0; t < s->n_threads; t++) {
+			for (size_t c = 0; c < s->pools[t].n_chunks; c++) {
+				free(s->pools[t].chunks[c]);
+			}
+			free(s->pools[t].chunks);
+		}
+	}
+	free(s->pools);
+	free(s->sorted_mass);
+	free(s->sorted_z);
+	free(s->sorted_y);
+	free(s->sorted_x);
+	free(s->sorted);
+	free(s->entries);
+	free(s->histogram);
+	free(s->bounds);
+	free(s);
+}
+
+
+/**
+ * Walk the tree for a run of bodies in tree order and kick them
+ * @param arg, the Barnes-Hut job
+ * @param id, the thread running the task
+ * @param task, the run of BH_WALK_TASK bodies
+ */
+static void bh_walk_task(void* arg, size_t id, size_t task) {
+	const struct bh_job* job = arg;
+	const struct bh_state* s = job->tree;
+	struct bodies* b = job->target;
+	size_t first = task * BH_WALK_TASK;
+	size_t last = first + BH_WALK_TASK < s->n_bodies ? first + BH_WALK_TASK : s->n_bodies;
+
+	// Neighbouring walks in tree order find the same nodes in cache
+	for (size_t k = first; k < last; k++) {
+		size_t i = s->sorted[k].index;
+		double acc[3];
+		bh_acceleration(s, s->sorted_x[k], s->sorted_y[k], s->sorted_z[k], acc);
+		b->velocity_x[i] += GCONST * acc[0] * job->dt;
+		b->velocity_y[i] += GCONST * acc[1] * job->dt;
+		b->velocity_z[i] += GCONST * acc[2] * job->dt;
+	}
+}
+
+
+/**
+ * Barnes-Hut step of one thread, the tree is rebuilt by every thread and
+ * walked in runs of bodies in tree order that the threads steal from each
+ * other, then this thread's bodies are moved
+ * @param state, the Barnes-Hut state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, unused, the tree keeps no potential
+ */
+void bh_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential) {
+	struct bh_state* s = state;
+
+	// Check if the parameters are invalid
+	if (s == NULL || b == NULL || b->n_bodies != s->n_bodies || n_threads != s->n_threads || end > b->n_bodies) {
+		return;
+	}
+
+	bh_build_parallel(s, b, id, start, end, pool);
+
+	// Every kick is done when the stealing returns so this thread's bodies can move
+	size_t n_tasks = (s->n_bodies + BH_WALK_TASK - 1) / BH_WALK_TASK;
+	struct bh_job job = { .tree = s, .source = b, .target = b, .dt = dt };
+	pool_steal(pool, id, id * n_tasks / n_threads, (id + 1) * n_tasks / n_threads, bh_walk_task, &job);
+	for (size_t i = start; i < end; i++) {
+		b->x[i] += b->velocity_x[i] * dt;
+		b->y[i] += b->velocity_y[i] * dt;
+		b->z[i] += b->velocity_z[i] * dt;
+	}
+}
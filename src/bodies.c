@@ -0,0 +1,543 @@
+#include "nbody.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Pages of new body stores, normal, thp or huge
+static int bodies_pages = BODY_PAGES_NORMAL;
+
+// Snapshot file the next body store is kept in or NULL for memory
+static const char* bodies_store = NULL;
+
+
+/**
+ * Round a number of doubles up so that every array starts on a cache line
+ * @param n_bodies, the number of bodies in each array
+ * @return the padded number of doubles in each array
+ */
+size_t bodies_stride(size_t n_bodies) {
+	size_t per_line = CACHE_LINE / sizeof(double);
+	return ((n_bodies + per_line - 1) / per_line) * per_line;
+}
+
+
+/**
+ * Allocate the block of a body store without touching it, so its pages are
+ * placed on the node of whichever thread writes them first
+ * Explicit huge pages fall back to transparent ones when none are reserved
+ * @param size, the size of the block in bytes
+ * @param pages, the pages asked for
+ * @param mapped, set to the size of the mapping or 0 if it was allocated
+ * @param used, set to the pages that back the block
+ * @return the block or NULL if it could not be allocated
+ */
+static double* bodies_block(size_t size, int pages, size_t* mapped, int* used) {
+	*mapped = 0;
+	*used = pages;
+	if (pages == BODY_PAGES_NORMAL) {
+		return aligned_alloc(CACHE_LINE, size);
+	}
+
+	// Huge pages are only used for whole pages
+	size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	if (pages == BODY_PAGES_HUGE) {
+		void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (block != MAP_FAILED) {
+			*mapped = size;
+			return block;
+		}
+		*used = BODY_PAGES_THP;
+	}
+	double* block = aligned_alloc(HUGE_PAGE_SIZE, size);
+	if (block != NULL && madvise(block, size, MADV_HUGEPAGE) != 0) {
+		*used = BODY_PAGES_NORMAL;
+	}
+	return block;
+}
+
+
+/**
+ * Map a new snapshot file shared as the block of a body store, the kernel
+ * writes pages it takes back to the file so the store may exceed memory
+ * A new file reads as zeros so its pages are not touched
+ * @param path, the path of the file, replaced if it exists
+ * @param size, the size of the block in bytes
+ * @param mapped, set to the size of the mapping with the header
+ * @param file, set to the descriptor of the file
+ * @return the block after the header or NULL if the file cannot be mapped
+ */
+static double* bodies_store_block(const char* path, size_t size, size_t* mapped, int* file) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+	size_t total = SNAPSHOT_DATA_OFFSET + size;
+	void* base = ftruncate(fd, (off_t)total) == 0 ? mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (base == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	*mapped = total;
+	*file = fd;
+	return (double*)((char*)base + SNAPSHOT_DATA_OFFSET);
+}
+
+
+/**
+ * Write the header of a store kept in a file so the file is a snapshot of its bodies
+ * @param b, the body store
+ */
+static void bodies_store_finish(const struct bodies* b) {
+	struct snapshot_header* header = b->memory;
+	memset(header, 0, SNAPSHOT_DATA_OFFSET);
+	memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+	header->version = SNAPSHOT_VERSION;
+	header->order = SNAPSHOT_ORDER;
+	header->arrays = BODY_ARRAYS;
+	header->n_bodies = b->n_bodies;
+	header->stride = b->stride;
+	header->checksum = snapshot_checksum(b->x, b->stride * BODY_ARRAYS);
+	msync(b->memory, b->mapped, MS_SYNC);
+	close(b->file);
+}
+
+
+/**
+ * Free the block of a body store
+ * @param block, the block
+ * @param mapped, the size of the mapping or 0 if it was allocated
+ */
+static void bodies_block_free(void* block, size_t mapped) {
+	if (mapped > 0) {
+		munmap(block, mapped);
+	} else {
+		free(block);
+	}
+}
+
+
+/**
+ * Point the arrays of a body store into a block
+ * @param b, the body store
+ * @param block, the block of BODY_ARRAYS arrays of stride doubles
+ */
+static void bodies_attach(struct bodies* b, double* block) {
+	size_t stride = b->stride;
+	b->memory = block;
+	b->x = block;
+	b->y = block + stride;
+	b->z = block + stride * 2;
+	b->velocity_x = block + stride * 3;
+	b->velocity_y = block + stride * 4;
+	b->velocity_z = block + stride * 5;
+	b->mass = block + stride * 6;
+}
+
+
+/**
+ * Allocate a structure of arrays body store with every array aligned to a cache line
+ * All values are zero initialised
+ * @param n_bodies, the number of bodies
+ * @return the body store or NULL if invalid
+ */
+struct bodies* bodies_create(size_t n_bodies) {
+
+	// If the parameter is invalid
+	if (n_bodies == 0) {
+		return NULL;
+	}
+
+	struct bodies* b = malloc(sizeof(struct bodies));
+	if (b == NULL) {
+		return NULL;
+	}
+
+	// All seven arrays live in one block so they are freed together
+	size_t stride = bodies_stride(n_bodies);
+	size_t size = sizeof(double) * stride * BODY_ARRAYS;
+	b->n_bodies = n_bodies;
+	b->stride = stride;
+	b->file = -1;
+
+	// Only the first store after the selection goes to the file
+	if (bodies_store != NULL) {
+		const char* path = bodies_store;
+		bodies_store = NULL;
+		double* block = bodies_store_block(path, size, &b->mapped, &b->file);
+		if (block == NULL) {
+			free(b);
+			return NULL;
+		}
+		b->pages = BODY_PAGES_FILE;
+		bodies_attach(b, block);
+		b->memory = (char*)block - SNAPSHOT_DATA_OFFSET;
+		return b;
+	}
+
+	double* block = bodies_block(size, bodies_pages, &b->mapped, &b->pages);
+	if (block == NULL) {
+		free(b);
+		return NULL;
+	}
+	memset(block, 0, size);
+	bodies_attach(b, block);
+	return b;
+}
+
+
+/**
+ * Clear up all memory associated with the body store
+ * @param b, the body store
+ */
+void bodies_destroy(struct bodies* b) {
+
+	// If it is already NULL
+	if (b == NULL) {
+		return;
+	}
+
+	// A store in a file is left as a snapshot of its last bodies
+	if (b->file >= 0) {
+		bodies_store_finish(b);
+	}
+	bodies_block_free(b->memory, b->mapped);
+	free(b);
+}
+
+
+/**
+ * Select the pages that back the body stores created after this call
+ * @param name, normal, thp for transparent huge pages or huge for explicit huge pages
+ * @return 0 if selected or 1 if it is unknown
+ */
+int bodies_pages_select(const char* name) {
+
+	// If the parameter is invalid
+	if (name == NULL) {
+		return 1;
+	}
+
+	const char* names[] = { "normal", "thp", "huge" };
+	for (int pages = BODY_PAGES_NORMAL; pages <= BODY_PAGES_HUGE; pages++) {
+		if (strcmp(name, names[pages]) == 0) {
+			bodies_pages = pages;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/**
+ * Get the name of the pages that back a body store
+ * @param b, the body store
+ * @return normal, thp, huge or file
+ */
+const char* bodies_pages_name(const struct bodies* b) {
+	const char* names[] = { "normal", "thp", "huge", "file" };
+	return b != NULL ? names[b->pages] : names[BODY_PAGES_NORMAL];
+}
+
+
+/**
+ * Keep the next body store created in a snapshot file instead of memory,
+ * the file is mapped shared so a store larger than memory is paged to it,
+ * and when the store is destroyed the file is left as its snapshot
+ * @param path, the path of the file, replaced if it exists
+ * @return 0 if selected or 1 if invalid
+ */
+int bodies_store_select(const char* path) {
+
+	// If the parameter is invalid
+	if (path == NULL || *path == '\0') {
+		return 1;
+	}
+
+	bodies_store = path;
+	return 0;
+}
+
+
+/**
+ * Move a body store into the file selected by bodies_store_select, a store
+ * mapped from a snapshot only reads its file so its pages stay clean
+ * @param b, the body store, destroyed when moved
+ * @return the store in the file, b when no file is selected or NULL if it cannot be created
+ */
+struct bodies* bodies_to_store(struct bodies* b) {
+
+	// If there is nothing to move
+	if (b == NULL || bodies_store == NULL) {
+		return b;
+	}
+
+	struct bodies* moved = bodies_create(b->n_bodies);
+	if (moved != NULL) {
+		memcpy(moved->x, b->x, sizeof(double) * b->stride * BODY_ARRAYS);
+	}
+	bodies_destroy(b);
+	return moved;
+}
+
+
+/**
+ * Ask the kernel to read the positions and masses of [start, end) of a store
+ * kept in a file ahead of their use, stores in memory are left alone
+ * @param b, the body store
+ * @param start, the first body
+ * @param end, one past the last body
+ */
+void bodies_read_ahead(const struct bodies* b, size_t start, size_t end) {
+
+	// If there is nothing to read
+	if (b == NULL || b->file < 0 || start >= end) {
+		return;
+	}
+
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	double* arrays[] = { b->x, b->y, b->z, b->mass };
+	for (size_t k = 0; k < 4; k++) {
+		uintptr_t first = (uintptr_t)(arrays[k] + start) & ~(page - 1);
+		uintptr_t last = (uintptr_t)(arrays[k] + end);
+		madvise((void*)first, last - first, MADV_WILLNEED);
+	}
+}
+
+
+/**
+ * Start writing [start, end) of n_arrays arrays from array back to the file
+ * of a store kept in one, without waiting, stores in memory are left alone
+ * Written pages are clean so the kernel can drop them without writing them
+ * @param b, the body store
+ * @param array, the first array, 0 for x up to 6 for mass
+ * @param n_arrays, the number of arrays
+ * @param start, the first body
+ * @param end, one past the last body
+ */
+void bodies_write_back(const struct bodies* b, size_t array, size_t n_arrays, size_t start, size_t end) {
+
+	// If there is nothing to write
+	if (b == NULL || b->file < 0 || start >= end) {
+		return;
+	}
+
+	for (size_t k = array; k < array + n_arrays && k < BODY_ARRAYS; k++) {
+		off_t offset = SNAPSHOT_DATA_OFFSET + (off_t)(sizeof(double) * (k * b->stride + start));
+		sync_file_range(b->file, offset, (off_t)(sizeof(double) * (end - start)), SYNC_FILE_RANGE_WRITE);
+	}
+}
+
+
+/**
+ * Find the bodies one thread of a run steps, every slice but the first starts
+ * on a whole cache line of the body arrays so two threads moving their own
+ * bodies never write the same line
+ * @param n_bodies, the number of bodies
+ * @param n_threads, the number of threads
+ * @param id, the thread
+ * @param start, set to the first body of the thread
+ * @param end, set to one past the last body of the thread
+ */
+void bodies_slice(size_t n_bodies, size_t n_threads, size_t id, size_t* start, size_t* end) {
+	size_t per_line = CACHE_LINE / sizeof(double);
+	size_t first = id * n_bodies / n_threads;
+	size_t last = (id + 1) * n_bodies / n_threads;
+	*start = first - first % per_line;
+	*end = id == n_threads - 1 ? n_bodies : last - last % per_line;
+}
+
+
+/**
+ * Copy one thread's slice of every array into the new block, the last thread
+ * takes the rest of each array with its padding, the arrays are read from x
+ * since the memory of a mapped snapshot starts at its header
+ * @param arg, the place job
+ * @param id, the thread
+ */
+static void bodies_place_job(void* arg, size_t id) {
+	const struct place_job* job = arg;
+	const struct bodies* b = job->source;
+	size_t start, end;
+	bodies_slice(b->n_bodies, job->n_threads, id, &start, &end);
+	end = id == job->n_threads - 1 ? b->stride : end;
+	const double* source = b->x;
+	for (size_t array = 0; array < BODY_ARRAYS; array++) {
+		memcpy(job->block + array * b->stride + start, source + array * b->stride + start, sizeof(double) * (end - start));
+	}
+}
+
+
+/**
+ * Move a body store into memory first touched by the threads of a pool
+ * Each thread copies its slice from bodies_slice, so with pinned threads
+ * the pages of a slice land on the node of the thread that steps it
+ * @param b, the body store
+ * @param p, the pool
+ * @return 0 if moved or 1 if invalid, kept in a file or out of memory, the store is unchanged then
+ */
+int bodies_place(struct bodies* b, struct thread_pool* p) {
+
+	// If the parameters are invalid, a store in a file stays in its file
+	if (b == NULL || p == NULL || p->n_threads > b->n_bodies || b->file >= 0) {
+		return 1;
+	}
+
+	size_t mapped;
+	int pages;
+	double* block = bodies_block(sizeof(double) * b->stride * BODY_ARRAYS, b->pages, &mapped, &pages);
+	if (block == NULL) {
+		return 1;
+	}
+	struct place_job job = { .source = b, .block = block, .n_threads = p->n_threads };
+	pool_run(p, bodies_place_job, &job);
+
+	bodies_block_free(b->memory, b->mapped);
+	b->mapped = mapped;
+	b->pages = pages;
+	bodies_attach(b, block);
+	return 0;
+}
+
+
+/**
+ * Copy an array of struct body pointers into a new body store
+ * NULL entries are stored as massless bodies at the origin
+ * @param bodies, the struct array of bodies
+ * @param n_bodies, the number of bodies
+ * @return the body store or NULL if invalid
+ */
+struct bodies* bodies_from_structs(struct body** bodies, size_t n_bodies) {
+
+	// If the parameters are invalid
+	if (bodies == NULL || n_bodies == 0) {
+		return NULL;
+	}
+
+	struct bodies* b = bodies_create(n_bodies);
+	if (b == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < n_bodies; i++) {
+		if (bodies[i] == NULL) {
+			continue;
+		}
+		b->x[i] = bodies[i]->x;
+		b->y[i] = bodies[i]->y;
+		b->z[i] = bodies[i]->z;
+		b->velocity_x[i] = bodies[i]->velocity_x;
+		b->velocity_y[i] = bodies[i]->velocity_y;
+		b->velocity_z[i] = bodies[i]->velocity_z;
+		b->mass[i] = bodies[i]->mass;
+	}
+	return b;
+}
+
+
+/**
+ * Copy the body store back into an array of struct body pointers
+ * NULL entries are skipped
+ * @param b, the body store
+ * @param bodies, the struct array of bodies to write into
+ */
+void bodies_to_structs(const struct bodies* b, struct body** bodies) {
+
+	// If the parameters are invalid
+	if (b == NULL || bodies == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < b->n_bodies; i++) {
+		if (bodies[i] == NULL) {
+			continue;
+		}
+		bodies[i]->x = b->x[i];
+		bodies[i]->y = b->y[i];
+		bodies[i]->z = b->z[i];
+		bodies[i]->velocity_x = b->velocity_x[i];
+		bodies[i]->velocity_y = b->velocity_y[i];
+		bodies[i]->velocity_z = b->velocity_z[i];
+		bodies[i]->mass = b->mass[i];
+	}
+}
+
+
+/**
+ * Allocate a new struct body array holding a copy of the body store
+ * @param b, the body store
+ * @return the struct array of bodies or NULL if invalid
+ */
+struct body** bodies_to_new_structs(const struct bodies* b) {
+
+	// If the parameter is invalid
+	if (b == NULL) {
+		return NULL;
+	}
+
+	struct body** bodies = malloc(sizeof(struct body*) * b->n_bodies);
+	for (size_t i = 0; i < b->n_bodies; i++) {
+		bodies[i] = malloc(sizeof(struct body));
+	}
+	bodies_to_structs(b, bodies);
+	return bodies;
+}
+
+
+/**
+ * Allocate zeroed velocity change buffers for the symmetric parallel step
+ * Each buffer holds x, y and z arrays padded and aligned like the body store
+ * @param n_buffers, the number of buffers, one per thread
+ * @param n_bodies, the number of bodies
+ * @return the buffers or NULL if invalid
+ */
+struct force_buffers* force_buffers_create(size_t n_buffers, size_t n_bodies) {
+
+	// If the parameters are invalid
+	if (n_buffers == 0 || n_bodies == 0) {
+		return NULL;
+	}
+
+	struct force_buffers* f = malloc(sizeof(struct force_buffers));
+	if (f == NULL) {
+		return NULL;
+	}
+
+	f->stride = bodies_stride(n_bodies);
+	f->n_buffers = n_buffers;
+	size_t size = sizeof(double) * f->stride * 3 * n_buffers;
+	f->memory = aligned_alloc(CACHE_LINE, size);
+	if (f->memory == NULL) {
+		free(f);
+		return NULL;
+	}
+	memset(f->memory, 0, size);
+	return f;
+}
+
+
+/**
+ * Get one of the x, y or z arrays of a buffer
+ * @param f, the buffers
+ * @param buffer, the index of the buffer
+ * @param axis, 0 for x, 1 for y and 2 for z
+ * @return the array of the axis
+ */
+double* force_buffer(const struct force_buffers* f, size_t buffer, size_t axis) {
+	return f->memory + (buffer * 3 + axis) * f->stride;
+}
+
+
+/**
+ * Clear up all memory associated with the buffers
+ * @param f, the buffers
+ */
+void force_buffers_destroy(struct force_buffers* f) {
+
+	// If it is already NULL
+	if (f == NULL) {
+		return;
+	}
+
+	free(f->memory);
+	free(f);
+}
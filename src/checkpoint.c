@@ -0,0 +1,394 @@
+#include "nbody.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <signal.h>
+#include <unistd.h>
+
+
+// What the signals asked for since thread 0 last looked, CHECKPOINT_WRITE and CHECKPOINT_STOP or'd together
+static _Atomic int checkpoint_signal;
+
+
+/**
+ * Ask for a checkpoint from a signal handler, SIGTERM also stops the run
+ * @param signal, the signal
+ */
+static void checkpoint_handler(int signal) {
+	atomic_fetch_or(&checkpoint_signal, signal == SIGTERM ? CHECKPOINT_STOP : CHECKPOINT_WRITE);
+}
+
+
+/**
+ * Copy a name into a fixed field of a checkpoint, cut short if it does not fit
+ * @param field, the field of CHECKPOINT_NAME bytes
+ * @param name, the name
+ */
+static void checkpoint_name(char* field, const char* name) {
+	memset(field, 0, CHECKPOINT_NAME);
+	strncpy(field, name, CHECKPOINT_NAME - 1);
+}
+
+
+/**
+ * Set up the checkpoints of a run and catch SIGTERM and SIGUSR1 to ask for one
+ * @param path, the path the checkpoints are renamed to
+ * @param every, the number of steps between checkpoints or 0 for only when a signal asks
+ * @param engine, the force engine
+ * @param params, the parameters of the engine
+ * @param schedule, when the energy is measured or NULL
+ * @param iterations, the number of steps of the run
+ * @param dt, the change in time of a step
+ * @param threaded, whether the run is threaded
+ * @param n_threads, the number of threads of the run
+ * @return the checkpoints or NULL if invalid
+ */
+struct checkpoint* checkpoint_open(const char* path, size_t every, const struct engine* engine,
+		const struct engine_params* params, struct energy_schedule* schedule, size_t iterations, double dt,
+		int threaded, size_t n_threads) {
+
+	// If the parameters are invalid
+	if (path == NULL || engine == NULL || params == NULL || n_threads == 0) {
+		return NULL;
+	}
+
+	struct checkpoint* c = aligned_alloc(CACHE_LINE, sizeof(struct checkpoint));
+	if (c == NULL) {
+		return NULL;
+	}
+	memset(c, 0, sizeof(struct checkpoint));
+	atomic_init(&c->written, 0);
+	atomic_init(&c->failed, 0);
+	c->fd = -1;
+	c->every = every;
+	c->stopped = SIZE_MAX;
+	c->schedule = schedule;
+	c->path = strdup(path);
+	c->temporary = malloc(strlen(path) + sizeof(".tmp"));
+	c->sums = malloc(sizeof(uint64_t) * 2 * (BODY_ARRAYS + 1) * n_threads);
+	if (c->path == NULL || c->temporary == NULL || c->sums == NULL) {
+		free(c->path);
+		free(c->temporary);
+		free(c->sums);
+		free(c);
+		return NULL;
+	}
+	sprintf(c->temporary, "%s.tmp", path);
+
+	// Everything but the step and a periodic box is the same for every checkpoint of the run
+	struct checkpoint_state* s = &c->state;
+	memcpy(s->magic, CHECKPOINT_MAGIC, sizeof(s->magic));
+	s->version = CHECKPOINT_VERSION;
+	s->threaded = threaded != 0;
+	s->n_threads = n_threads;
+	s->iterations = iterations;
+	s->dt = dt;
+	checkpoint_name(s->engine, engine->name);
+	checkpoint_name(s->kernel, force_kernel_active()->name);
+	checkpoint_name(s->precision, force_precision_active()->name);
+	s->theta = params->theta;
+	s->order = params->order;
+	s->grid = params->grid;
+	s->periodic = (uint64_t)params->periodic;
+	s->split = params->split;
+	memcpy(s->origin, params->origin, sizeof(s->origin));
+	s->box = params->box;
+	if (schedule != NULL) {
+		s->energy_every = schedule->every;
+		s->energy_seconds = schedule->seconds;
+		s->from_force = (uint64_t)schedule->from_force;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = checkpoint_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+	return c;
+}
+
+
+/**
+ * Decide whether a checkpoint is written after a step, called by thread 0 only,
+ * every every steps or when a signal has asked, never at the first step of
+ * the run or after the last
+ * @param c, the checkpoints or NULL for none
+ * @param step, the number of steps done
+ * @param first, the step the run started from
+ * @param iterations, the number of steps of the run
+ * @return CHECKPOINT_NONE, CHECKPOINT_WRITE or CHECKPOINT_STOP to write one and stop
+ */
+int checkpoint_due(struct checkpoint* c, size_t step, size_t first, size_t iterations) {
+	if (c == NULL || step == iterations) {
+		return CHECKPOINT_NONE;
+	}
+	int asked = atomic_exchange(&checkpoint_signal, 0);
+	if (asked & CHECKPOINT_STOP) {
+		return CHECKPOINT_STOP;
+	}
+	if (asked || (c->every > 0 && step != first && step % c->every == 0)) {
+		return CHECKPOINT_WRITE;
+	}
+	return CHECKPOINT_NONE;
+}
+
+
+/**
+ * Find the next step after which a checkpoint may be due, a signal is looked
+ * for at least every CHECKPOINT_SEGMENT steps
+ * @param c, the checkpoints or NULL for none
+ * @param step, the number of steps done
+ * @param iterations, the step to stop at if nothing is due before
+ * @return the step, at most iterations
+ */
+size_t checkpoint_next(const struct checkpoint* c, size_t step, size_t iterations) {
+	size_t next = c != NULL ? step + CHECKPOINT_SEGMENT : iterations;
+	if (c != NULL && c->every > 0) {
+		size_t periodic = (step / c->every + 1) * c->every;
+		next = periodic < next ? periodic : next;
+	}
+	return next < iterations ? next : iterations;
+}
+
+
+/**
+ * Open the temporary file of a checkpoint after a step, called by thread 0
+ * only, before the barrier that lets every thread call checkpoint_copy
+ * @param c, the checkpoints
+ * @param b, the body store
+ * @param step, the number of steps done
+ * @param engine, the force engine
+ * @param state, the state of the engine, asked for what recreates it
+ */
+void checkpoint_acquire(struct checkpoint* c, const struct bodies* b, size_t step, const struct engine* engine, void* state) {
+	c->started = energy_clock();
+	c->bodies = b;
+	atomic_store_explicit(&c->failed, 0, memory_order_relaxed);
+	c->state.step = step;
+	if (engine->keep != NULL) {
+		struct engine_params params = { 0 };
+		engine->keep(state, &params);
+		memcpy(c->state.origin, params.origin, sizeof(c->state.origin));
+		c->state.box = params.box;
+	}
+
+	// The file is sized up front so every thread writes its slice at its place
+	c->fd = open(c->temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (c->fd >= 0 && ftruncate(c->fd, SNAPSHOT_DATA_OFFSET + sizeof(double) * b->stride * BODY_ARRAYS) != 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+
+/**
+ * Combine the checksums of the slices into the snapshot checksum of the whole
+ * file, the words of each column in order with its padding as zeros
+ * @param c, the checkpoints
+ * @param n_threads, the number of threads that wrote slices
+ * @return the checksum
+ */
+static uint64_t checkpoint_checksum(const struct checkpoint* c, size_t n_threads) {
+	const struct bodies* b = c->bodies;
+	uint64_t sum = 0, weighted = 0;
+	for (size_t column = 0; column < BODY_ARRAYS; column++) {
+		size_t covered = 0;
+		for (size_t id = 0; id < n_threads; id++) {
+			const uint64_t* sums = c->sums + 2 * (BODY_ARRAYS + 1) * id;
+			size_t length = (size_t)(sums[1] - sums[0]);
+
+			// Each word of a slice adds every word before it once more to the weighted sum
+			weighted += sums[2 + 2 * column + 1] + (uint64_t)length * sum;
+			sum += sums[2 + 2 * column];
+			covered += length;
+		}
+		weighted += (uint64_t)(b->stride - covered) * sum;
+	}
+	return sum ^ (weighted << 1 | weighted >> 63);
+}
+
+
+/**
+ * Write a slice of the body store into the checkpoint being taken, called by
+ * every thread of the pool, the last to finish writes the header, syncs the
+ * file and renames it over the last checkpoint
+ * @param c, the checkpoints
+ * @param id, the thread
+ * @param n_threads, the number of threads writing the checkpoint
+ * @param start, the first body of the slice
+ * @param end, one past the last body of the slice
+ */
+void checkpoint_copy(struct checkpoint* c, size_t id, size_t n_threads, size_t start, size_t end) {
+	const struct bodies* b = c->bodies;
+	uint64_t* sums = c->sums + 2 * (BODY_ARRAYS + 1) * id;
+	sums[0] = start;
+	sums[1] = end;
+	int failed = 0;
+	for (size_t column = 0; column < BODY_ARRAYS; column++) {
+		const double* values = b->x + column * b->stride + start;
+		uint64_t sum = 0, weighted = 0;
+		for (size_t i = 0; i < end - start; i++) {
+			uint64_t word;
+			memcpy(&word, values + i, sizeof(word));
+			sum += word;
+			weighted += sum;
+		}
+		sums[2 + 2 * column] = sum;
+		sums[2 + 2 * column + 1] = weighted;
+		uint64_t offset = SNAPSHOT_DATA_OFFSET + sizeof(double) * (column * b->stride + start);
+		failed |= c->fd < 0 || trajectory_pwrite(c->fd, values, sizeof(double) * (end - start), offset);
+	}
+	if (failed) {
+		atomic_store_explicit(&c->failed, 1, memory_order_relaxed);
+	}
+
+	// The writes and sums of the other threads are seen by the last through the counter
+	if (atomic_fetch_add_explicit(&c->written, 1, memory_order_acq_rel) + 1 != n_threads) {
+		return;
+	}
+	atomic_store_explicit(&c->written, 0, memory_order_relaxed);
+	struct checkpoint_state* s = &c->state;
+	if (c->schedule != NULL) {
+		s->initial = c->schedule->initial;
+		s->max_drift = c->schedule->max_drift;
+		s->n_measured = c->schedule->n_measured;
+	}
+	struct snapshot_header header = { .version = SNAPSHOT_VERSION, .order = SNAPSHOT_ORDER, .arrays = BODY_ARRAYS,
+		.n_bodies = b->n_bodies, .stride = b->stride, .checksum = checkpoint_checksum(c, n_threads) };
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+	// Only a complete file on disk replaces the last checkpoint
+	failed = atomic_load_explicit(&c->failed, memory_order_relaxed) || c->fd < 0 || trajectory_pwrite(c->fd, &header, sizeof(header), 0)
+			|| trajectory_pwrite(c->fd, s, sizeof(*s), sizeof(header)) || fsync(c->fd) != 0;
+	if (c->fd >= 0) {
+		failed |= close(c->fd) != 0;
+		c->fd = -1;
+	}
+	failed = failed || rename(c->temporary, c->path) != 0;
+	if (!failed) {
+		char* directory = strdup(c->path);
+		int fd = directory != NULL ? open(dirname(directory), O_RDONLY) : -1;
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+		free(directory);
+		c->n_written++;
+		double seconds = energy_clock() - c->started;
+		c->longest = seconds > c->longest ? seconds : c->longest;
+	} else {
+		unlink(c->temporary);
+		fprintf(stderr, "Error writing checkpoint %s at step %zu.\n", c->path, (size_t)s->step);
+	}
+	atomic_store_explicit(&c->failed, failed, memory_order_relaxed);
+	if (c->due[s->step % 3] == CHECKPOINT_STOP) {
+		c->stopped = s->step;
+	}
+}
+
+
+/**
+ * Print how many checkpoints were written and how long the longest took
+ * @param c, the checkpoints or NULL for none
+ */
+void checkpoint_report(const struct checkpoint* c) {
+
+	// If the parameter is invalid
+	if (c == NULL) {
+		return;
+	}
+
+	printf("Checkpoint: %zu written to %s, the longest in %.3f s\n", c->n_written, c->path, c->longest);
+	if (c->stopped != SIZE_MAX) {
+		printf("Stopped at step %zu, continue with --resume %s\n", c->stopped, c->path);
+	}
+}
+
+
+/**
+ * Stop catching the signals and clear up all memory associated with the checkpoints
+ * @param c, the checkpoints
+ * @return 0 if the last checkpoint was written or 1 if it failed
+ */
+int checkpoint_close(struct checkpoint* c) {
+
+	// If it is already NULL
+	if (c == NULL) {
+		return 0;
+	}
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	atomic_store(&checkpoint_signal, 0);
+	int failed = atomic_load(&c->failed);
+	free(c->path);
+	free(c->temporary);
+	free(c->sums);
+	free(c);
+	return failed;
+}
+
+
+/**
+ * Read the run state of a checkpoint, its bodies are loaded as a snapshot
+ * @param path, the path of the checkpoint
+ * @param state, where the run state goes
+ * @return 0 if read or 1 if the file is not a checkpoint
+ */
+int checkpoint_read(const char* path, struct checkpoint_state* state) {
+
+	// If the parameters are invalid
+	if (path == NULL || state == NULL) {
+		return 1;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 1;
+	}
+	struct snapshot_header header;
+	int failed = pread(fd, &header, sizeof(header), 0) != sizeof(header)
+			|| memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+			|| pread(fd, state, sizeof(*state), sizeof(header)) != sizeof(*state)
+			|| memcmp(state->magic, CHECKPOINT_MAGIC, sizeof(state->magic)) != 0 || state->version != CHECKPOINT_VERSION
+			|| state->step > state->iterations || state->n_threads == 0
+			|| memchr(state->engine, 0, CHECKPOINT_NAME) == NULL || memchr(state->kernel, 0, CHECKPOINT_NAME) == NULL
+			|| memchr(state->precision, 0, CHECKPOINT_NAME) == NULL;
+	close(fd);
+	return failed;
+}
+
+
+/**
+ * Set up a run to continue from the state of a checkpoint, selecting its
+ * kernel and precision and filling in its engine, parameters and energy schedule
+ * @param state, the run state
+ * @param engine, where the engine goes
+ * @param params, where the parameters go
+ * @param schedule, the energy schedule, its log is kept
+ * @return 0 if set up or 1 if the engine, kernel or precision is not available
+ */
+int checkpoint_restore(const struct checkpoint_state* state, const struct engine** engine, struct engine_params* params,
+		struct energy_schedule* schedule) {
+
+	// If the parameters are invalid
+	if (state == NULL || engine == NULL || params == NULL || schedule == NULL) {
+		return 1;
+	}
+
+	*engine = engine_find(state->engine);
+	if (*engine == NULL || force_kernel_select(state->kernel) || force_precision_select(state->precision)) {
+		return 1;
+	}
+	*params = (struct engine_params){ .theta = state->theta, .order = state->order, .grid = state->grid,
+		.periodic = (int)state->periodic, .split = state->split, .box = state->box };
+	memcpy(params->origin, state->origin, sizeof(params->origin));
+	schedule->every = state->energy_every;
+	schedule->seconds = state->energy_seconds;
+	schedule->from_force = (int)state->from_force;
+	schedule->initial = state->initial;
+	schedule->max_drift = state->max_drift;
+	schedule->n_measured = state->n_measured;
+	return 0;
+}
@@ -0,0 +1,522 @@
+#include "nbody.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Powers of ten a double holds exactly
+static const double csv_powers[CSV_FAST_EXPONENT + 1] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// 5^q from q = -CSV_POWER_RANGE up, shifted to 128 bits, truncated or one above for negative q
+static const uint64_t csv_fives[2 * CSV_POWER_RANGE + 1][2] = {
+	{ 0xa87fea27a539e9a5ULL, 0x3f2398d747b36224ULL },
+	{ 0xd29fe4b18e88640eULL, 0x8eec7f0d19a03aadULL },
+	{ 0x83a3eeeef9153e89ULL, 0x1953cf68300424acULL },
+	{ 0xa48ceaaab75a8e2bULL, 0x5fa8c3423c052dd7ULL },
+	{ 0xcdb02555653131b6ULL, 0x3792f412cb06794dULL },
+	{ 0x808e17555f3ebf11ULL, 0xe2bbd88bbee40bd0ULL },
+	{ 0xa0b19d2ab70e6ed6ULL, 0x5b6aceaeae9d0ec4ULL },
+	{ 0xc8de047564d20a8bULL, 0xf245825a5a445275ULL },
+	{ 0xfb158592be068d2eULL, 0xeed6e2f0f0d56712ULL },
+	{ 0x9ced737bb6c4183dULL, 0x55464dd69685606bULL },
+	{ 0xc428d05aa4751e4cULL, 0xaa97e14c3c26b886ULL },
+	{ 0xf53304714d9265dfULL, 0xd53dd99f4b3066a8ULL },
+	{ 0x993fe2c6d07b7fabULL, 0xe546a8038efe4029ULL },
+	{ 0xbf8fdb78849a5f96ULL, 0xde98520472bdd033ULL },
+	{ 0xef73d256a5c0f77cULL, 0x963e66858f6d4440ULL },
+	{ 0x95a8637627989aadULL, 0xdde7001379a44aa8ULL },
+	{ 0xbb127c53b17ec159ULL, 0x5560c018580d5d52ULL },
+	{ 0xe9d71b689dde71afULL, 0xaab8f01e6e10b4a6ULL },
+	{ 0x9226712162ab070dULL, 0xcab3961304ca70e8ULL },
+	{ 0xb6b00d69bb55c8d1ULL, 0x3d607b97c5fd0d22ULL },
+	{ 0xe45c10c42a2b3b05ULL, 0x8cb89a7db77c506aULL },
+	{ 0x8eb98a7a9a5b04e3ULL, 0x77f3608e92adb242ULL },
+	{ 0xb267ed1940f1c61cULL, 0x55f038b237591ed3ULL },
+	{ 0xdf01e85f912e37a3ULL, 0x6b6c46dec52f6688ULL },
+	{ 0x8b61313bbabce2c6ULL, 0x2323ac4b3b3da015ULL },
+	{ 0xae397d8aa96c1b77ULL, 0xabec975e0a0d081aULL },
+	{ 0xd9c7dced53c72255ULL, 0x96e7bd358c904a21ULL },
+	{ 0x881cea14545c7575ULL, 0x7e50d64177da2e54ULL },
+	{ 0xaa242499697392d2ULL, 0xdde50bd1d5d0b9e9ULL },
+	{ 0xd4ad2dbfc3d07787ULL, 0x955e4ec64b44e864ULL },
+	{ 0x84ec3c97da624ab4ULL, 0xbd5af13bef0b113eULL },
+	{ 0xa6274bbdd0fadd61ULL, 0xecb1ad8aeacdd58eULL },
+	{ 0xcfb11ead453994baULL, 0x67de18eda5814af2ULL },
+	{ 0x81ceb32c4b43fcf4ULL, 0x80eacf948770ced7ULL },
+	{ 0xa2425ff75e14fc31ULL, 0xa1258379a94d028dULL },
+	{ 0xcad2f7f5359a3b3eULL, 0x096ee45813a04330ULL },
+	{ 0xfd87b5f28300ca0dULL, 0x8bca9d6e188853fcULL },
+	{ 0x9e74d1b791e07e48ULL, 0x775ea264cf55347eULL },
+	{ 0xc612062576589ddaULL, 0x95364afe032a819eULL },
+	{ 0xf79687aed3eec551ULL, 0x3a83ddbd83f52205ULL },
+	{ 0x9abe14cd44753b52ULL, 0xc4926a9672793543ULL },
+	{ 0xc16d9a0095928a27ULL, 0x75b7053c0f178294ULL },
+	{ 0xf1c90080baf72cb1ULL, 0x5324c68b12dd6339ULL },
+	{ 0x971da05074da7beeULL, 0xd3f6fc16ebca5e04ULL },
+	{ 0xbce5086492111aeaULL, 0x88f4bb1ca6bcf585ULL },
+	{ 0xec1e4a7db69561a5ULL, 0x2b31e9e3d06c32e6ULL },
+	{ 0x9392ee8e921d5d07ULL, 0x3aff322e62439fd0ULL },
+	{ 0xb877aa3236a4b449ULL, 0x09befeb9fad487c3ULL },
+	{ 0xe69594bec44de15bULL, 0x4c2ebe687989a9b4ULL },
+	{ 0x901d7cf73ab0acd9ULL, 0x0f9d37014bf60a11ULL },
+	{ 0xb424dc35095cd80fULL, 0x538484c19ef38c95ULL },
+	{ 0xe12e13424bb40e13ULL, 0x2865a5f206b06fbaULL },
+	{ 0x8cbccc096f5088cbULL, 0xf93f87b7442e45d4ULL },
+	{ 0xafebff0bcb24aafeULL, 0xf78f69a51539d749ULL },
+	{ 0xdbe6fecebdedd5beULL, 0xb573440e5a884d1cULL },
+	{ 0x89705f4136b4a597ULL, 0x31680a88f8953031ULL },
+	{ 0xabcc77118461cefcULL, 0xfdc20d2b36ba7c3eULL },
+	{ 0xd6bf94d5e57a42bcULL, 0x3d32907604691b4dULL },
+	{ 0x8637bd05af6c69b5ULL, 0xa63f9a49c2c1b110ULL },
+	{ 0xa7c5ac471b478423ULL, 0x0fcf80dc33721d54ULL },
+	{ 0xd1b71758e219652bULL, 0xd3c36113404ea4a9ULL },
+	{ 0x83126e978d4fdf3bULL, 0x645a1cac083126eaULL },
+	{ 0xa3d70a3d70a3d70aULL, 0x3d70a3d70a3d70a4ULL },
+	{ 0xccccccccccccccccULL, 0xcccccccccccccccdULL },
+	{ 0x8000000000000000ULL, 0x0000000000000000ULL },
+	{ 0xa000000000000000ULL, 0x0000000000000000ULL },
+	{ 0xc800000000000000ULL, 0x0000000000000000ULL },
+	{ 0xfa00000000000000ULL, 0x0000000000000000ULL },
+	{ 0x9c40000000000000ULL, 0x0000000000000000ULL },
+	{ 0xc350000000000000ULL, 0x0000000000000000ULL },
+	{ 0xf424000000000000ULL, 0x0000000000000000ULL },
+	{ 0x9896800000000000ULL, 0x0000000000000000ULL },
+	{ 0xbebc200000000000ULL, 0x0000000000000000ULL },
+	{ 0xee6b280000000000ULL, 0x0000000000000000ULL },
+	{ 0x9502f90000000000ULL, 0x0000000000000000ULL },
+	{ 0xba43b74000000000ULL, 0x0000000000000000ULL },
+	{ 0xe8d4a51000000000ULL, 0x0000000000000000ULL },
+	{ 0x9184e72a00000000ULL, 0x0000000000000000ULL },
+	{ 0xb5e620f480000000ULL, 0x0000000000000000ULL },
+	{ 0xe35fa931a0000000ULL, 0x0000000000000000ULL },
+	{ 0x8e1bc9bf04000000ULL, 0x0000000000000000ULL },
+	{ 0xb1a2bc2ec5000000ULL, 0x0000000000000000ULL },
+	{ 0xde0b6b3a76400000ULL, 0x0000000000000000ULL },
+	{ 0x8ac7230489e80000ULL, 0x0000000000000000ULL },
+	{ 0xad78ebc5ac620000ULL, 0x0000000000000000ULL },
+	{ 0xd8d726b7177a8000ULL, 0x0000000000000000ULL },
+	{ 0x878678326eac9000ULL, 0x0000000000000000ULL },
+	{ 0xa968163f0a57b400ULL, 0x0000000000000000ULL },
+	{ 0xd3c21bcecceda100ULL, 0x0000000000000000ULL },
+	{ 0x84595161401484a0ULL, 0x0000000000000000ULL },
+	{ 0xa56fa5b99019a5c8ULL, 0x0000000000000000ULL },
+	{ 0xcecb8f27f4200f3aULL, 0x0000000000000000ULL },
+	{ 0x813f3978f8940984ULL, 0x4000000000000000ULL },
+	{ 0xa18f07d736b90be5ULL, 0x5000000000000000ULL },
+	{ 0xc9f2c9cd04674edeULL, 0xa400000000000000ULL },
+	{ 0xfc6f7c4045812296ULL, 0x4d00000000000000ULL },
+	{ 0x9dc5ada82b70b59dULL, 0xf020000000000000ULL },
+	{ 0xc5371912364ce305ULL, 0x6c28000000000000ULL },
+	{ 0xf684df56c3e01bc6ULL, 0xc732000000000000ULL },
+	{ 0x9a130b963a6c115cULL, 0x3c7f400000000000ULL },
+	{ 0xc097ce7bc90715b3ULL, 0x4b9f100000000000ULL },
+	{ 0xf0bdc21abb48db20ULL, 0x1e86d40000000000ULL },
+	{ 0x96769950b50d88f4ULL, 0x1314448000000000ULL },
+	{ 0xbc143fa4e250eb31ULL, 0x17d955a000000000ULL },
+	{ 0xeb194f8e1ae525fdULL, 0x5dcfab0800000000ULL },
+	{ 0x92efd1b8d0cf37beULL, 0x5aa1cae500000000ULL },
+	{ 0xb7abc627050305adULL, 0xf14a3d9e40000000ULL },
+	{ 0xe596b7b0c643c719ULL, 0x6d9ccd05d0000000ULL },
+	{ 0x8f7e32ce7bea5c6fULL, 0xe4820023a2000000ULL },
+	{ 0xb35dbf821ae4f38bULL, 0xdda2802c8a800000ULL },
+	{ 0xe0352f62a19e306eULL, 0xd50b2037ad200000ULL },
+	{ 0x8c213d9da502de45ULL, 0x4526f422cc340000ULL },
+	{ 0xaf298d050e4395d6ULL, 0x9670b12b7f410000ULL },
+	{ 0xdaf3f04651d47b4cULL, 0x3c0cdd765f114000ULL },
+	{ 0x88d8762bf324cd0fULL, 0xa5880a69fb6ac800ULL },
+	{ 0xab0e93b6efee0053ULL, 0x8eea0d047a457a00ULL },
+	{ 0xd5d238a4abe98068ULL, 0x72a4904598d6d880ULL },
+	{ 0x85a36366eb71f041ULL, 0x47a6da2b7f864750ULL },
+	{ 0xa70c3c40a64e6c51ULL, 0x999090b65f67d924ULL },
+	{ 0xd0cf4b50cfe20765ULL, 0xfff4b4e3f741cf6dULL },
+	{ 0x82818f1281ed449fULL, 0xbff8f10e7a8921a4ULL },
+	{ 0xa321f2d7226895c7ULL, 0xaff72d52192b6a0dULL },
+	{ 0xcbea6f8ceb02bb39ULL, 0x9bf4f8a69f764490ULL },
+	{ 0xfee50b7025c36a08ULL, 0x02f236d04753d5b4ULL },
+	{ 0x9f4f2726179a2245ULL, 0x01d762422c946590ULL },
+	{ 0xc722f0ef9d80aad6ULL, 0x424d3ad2b7b97ef5ULL },
+	{ 0xf8ebad2b84e0d58bULL, 0xd2e0898765a7deb2ULL },
+	{ 0x9b934c3b330c8577ULL, 0x63cc55f49f88eb2fULL },
+	{ 0xc2781f49ffcfa6d5ULL, 0x3cbf6b71c76b25fbULL },
+};
+
+
+/**
+ * Round mantissa * 10^exponent to a double with the 128 bit products of
+ * Eisel and Lemire, the product of the mantissa and the closest 128 bits of
+ * the power of ten leaves the 53 bits of the result and enough below them to
+ * round, unless the bits below sit on a halfway point too close to tell
+ * @param mantissa, the decimal digits, not zero
+ * @param exponent, the power of ten, within CSV_POWER_RANGE
+ * @param value, set to the magnitude
+ * @return 0 if rounded or 1 if the product cannot tell, or the result is subnormal or infinite
+ */
+static int csv_round(uint64_t mantissa, int exponent, double* value) {
+	const uint64_t* five = csv_fives[exponent + CSV_POWER_RANGE];
+	int shift = __builtin_clzll(mantissa);
+	uint64_t w = mantissa << shift;
+
+	// The low word of the power only matters when the high product is close to a halfway point
+	unsigned __int128 product = (unsigned __int128)w * five[0];
+	uint64_t upper = (uint64_t)(product >> 64), lower = (uint64_t)product;
+	if ((upper & 0x1ff) == 0x1ff && lower + w < lower) {
+		unsigned __int128 low_product = (unsigned __int128)w * five[1];
+		uint64_t middle = lower + (uint64_t)(low_product >> 64);
+		upper += middle < lower;
+		if (middle + 1 == 0 && (upper & 0x1ff) == 0x1ff && (uint64_t)low_product + w < (uint64_t)low_product) {
+			return 1;
+		}
+		lower = middle;
+	}
+
+	uint64_t top = upper >> 63;
+	uint64_t bits = upper >> (top + 9);
+	shift += (int)(1 ^ top);
+	if (lower == 0 && (upper & 0x1ff) == 0 && (bits & 3) == 1) {
+		return 1;
+	}
+	bits = (bits + (bits & 1)) >> 1;
+	if (bits >= (1ULL << 53)) {
+		bits = 1ULL << 52;
+		shift--;
+	}
+	bits &= ~(1ULL << 52);
+
+	// log2(10) * exponent in fixed point gives the binary exponent of the power
+	int64_t biased = (((152170 + 65536) * (int64_t)exponent) >> 16) + 1024 + 63 - shift;
+	if (biased < 1 || biased > 2046) {
+		return 1;
+	}
+	bits |= (uint64_t)biased << 52;
+	memcpy(value, &bits, sizeof(double));
+	return 0;
+}
+
+
+/**
+ * Parse a decimal number of a csv, correctly rounded like strtod in the C locale
+ * A number of at most 2^53 without its point and at most 22 powers of ten
+ * from it is exact in a double, so one multiply or divide rounds it
+ * correctly, up to 19 digits csv_round rounds it with integer products and
+ * any other number is copied out and given to strtod
+ * @param p, the first character, spaces before the number are skipped
+ * @param end, one past the last character that may be read
+ * @param value, set to the number
+ * @return one past the number or NULL if there is no number
+ */
+const char* csv_number(const char* p, const char* end, double* value) {
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	const char* start = p;
+	int negative = p < end && *p == '-';
+	p += p < end && (*p == '-' || *p == '+');
+
+	// Leading zeros carry no digits and every digit after the point lowers the exponent
+	uint64_t mantissa = 0;
+	int significant = 0, exponent = 0, digits = 0, exact = 1;
+	for (int fraction = 0; p < end; p++) {
+		if (*p == '.' && !fraction) {
+			fraction = 1;
+			continue;
+		}
+		if (*p < '0' || *p > '9') {
+			break;
+		}
+		digits++;
+		exponent -= fraction;
+		if (mantissa == 0 && *p == '0') {
+			continue;
+		}
+		if (significant < CSV_FAST_DIGITS) {
+			mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+			significant++;
+		} else {
+			exact = 0;
+		}
+	}
+	if (digits == 0) {
+		return NULL;
+	}
+
+	// The exponent needs a digit or it is not part of the number
+	if (p + 1 < end && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		int sign = q < end && *q == '-' ? -1 : 1;
+		q += q < end && (*q == '-' || *q == '+');
+		if (q < end && *q >= '0' && *q <= '9') {
+			int power = 0;
+			for (; q < end && *q >= '0' && *q <= '9'; q++) {
+				power = power < 100000 ? power * 10 + (*q - '0') : power;
+			}
+			exponent += sign * power;
+			p = q;
+		}
+	}
+
+	if (exact && mantissa <= (1ULL << 53) && exponent >= -CSV_FAST_EXPONENT && exponent <= CSV_FAST_EXPONENT) {
+		double m = (double)mantissa;
+		m = exponent < 0 ? m / csv_powers[-exponent] : m * csv_powers[exponent];
+		*value = negative ? -m : m;
+		return p;
+	}
+	if (exact && mantissa != 0 && exponent >= -CSV_POWER_RANGE && exponent <= CSV_POWER_RANGE
+			&& csv_round(mantissa, exponent, value) == 0) {
+		*value = negative ? -*value : *value;
+		return p;
+	}
+
+	// The text is not terminated so strtod reads a copy
+	char number[CSV_MAX_NUMBER];
+	size_t len = (size_t)(p - start);
+	if (len >= sizeof(number)) {
+		return NULL;
+	}
+	memcpy(number, start, len);
+	number[len] = '\0';
+	char* number_end;
+	*value = strtod(number, &number_end);
+	return number_end == number + len ? p : NULL;
+}
+
+
+/**
+ * Check whether a line holds nothing but white space
+ * @param line, the first character of the line
+ * @param end, one past its last character
+ * @return 1 if it is blank or 0 if not
+ */
+static int csv_blank(const char* line, const char* end) {
+	for (; line < end; line++) {
+		if (*line != ' ' && *line != '\t' && *line != '\r' && *line != '\n') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/**
+ * Parse one body of a csv, x,y,z,velocity_x,velocity_y,velocity_z,mass
+ * @param line, the first character of the line
+ * @param end, one past its last character
+ * @param values, set to the seven values
+ * @return NULL if parsed or what is wrong with the line
+ */
+static const char* csv_line(const char* line, const char* end, double values[BODY_ARRAYS]) {
+	for (int k = 0; k < BODY_ARRAYS; k++) {
+		line = csv_number(line, end, values + k);
+		if (line == NULL) {
+			return k == 0 ? "expected a number" : "expected a number after a comma";
+		}
+		while (line < end && (*line == ' ' || *line == '\t')) {
+			line++;
+		}
+		if (k < BODY_ARRAYS - 1) {
+			if (line == end || *line != ',') {
+				return line == end || *line == '\n' || *line == '\r' ? "fewer than 7 values" : "expected a comma";
+			}
+			line++;
+		}
+	}
+	return csv_blank(line, end) ? NULL : *line == ',' ? "more than 7 values" : "unexpected text after the mass";
+}
+
+
+/**
+ * Count the lines and the bodies of one chunk, every line that is not blank is a body
+ * @param arg, the csv job
+ * @param id, the thread running the task
+ * @param task, the chunk
+ */
+static void csv_count_task(void* arg, size_t id, size_t task) {
+	struct csv_chunk* c = ((struct csv_job*)arg)->chunks + task;
+	for (const char* line = c->start; line < c->end; ) {
+		const char* next = memchr(line, '\n', (size_t)(c->end - line));
+		next = next == NULL ? c->end : next + 1;
+		c->n_lines++;
+		c->n_bodies += !csv_blank(line, next);
+		line = next;
+	}
+}
+
+
+/**
+ * Parse the bodies of one chunk into the body store from its first body on
+ * A bad line is left as a massless body and counted for the report
+ * @param arg, the csv job
+ * @param id, the thread running the task
+ * @param task, the chunk
+ */
+static void csv_parse_task(void* arg, size_t id, size_t task) {
+	const struct csv_job* job = arg;
+	struct csv_chunk* c = job->chunks + task;
+	struct bodies* b = job->bodies;
+	size_t body = c->first_body;
+	for (const char* line = c->start; line < c->end; ) {
+		const char* next = memchr(line, '\n', (size_t)(c->end - line));
+		next = next == NULL ? c->end : next + 1;
+		if (!csv_blank(line, next)) {
+			double v[BODY_ARRAYS];
+			if (csv_line(line, next, v) == NULL) {
+				b->x[body] = v[0];
+				b->y[body] = v[1];
+				b->z[body] = v[2];
+				b->velocity_x[body] = v[3];
+				b->velocity_y[body] = v[4];
+				b->velocity_z[body] = v[5];
+				b->mass[body] = v[6];
+			} else {
+				c->n_errors++;
+			}
+			body++;
+		}
+		line = next;
+	}
+}
+
+
+/**
+ * Print the bad lines of a chunk on stderr as path:line: reason
+ * Bad lines are rare so the chunk is parsed again rather than keeping them all
+ * @param c, the chunk
+ * @param path, the path of the csv
+ * @param n_reported, the number of bad lines printed so far, at most CSV_MAX_ERRORS are printed
+ */
+static void csv_report(const struct csv_chunk* c, const char* path, size_t* n_reported) {
+	size_t line_number = c->first_line;
+	for (const char* line = c->start; line < c->end && *n_reported < CSV_MAX_ERRORS; line_number++) {
+		const char* next = memchr(line, '\n', (size_t)(c->end - line));
+		next = next == NULL ? c->end : next + 1;
+		double v[BODY_ARRAYS];
+		const char* error = csv_blank(line, next) ? NULL : csv_line(line, next, v);
+		if (error != NULL) {
+			fprintf(stderr, "%s:%zu: %s\n", path, line_number, error);
+			(*n_reported)++;
+		}
+		line = next;
+	}
+}
+
+
+/**
+ * Steal the chunks of a csv job, each thread starts on an even share
+ * @param arg, the csv job
+ * @param id, the thread
+ */
+static void csv_count_job(void* arg, size_t id) {
+	const struct csv_job* job = arg;
+	size_t n_threads = job->pool->n_threads;
+	pool_steal(job->pool, id, id * job->n_chunks / n_threads, (id + 1) * job->n_chunks / n_threads, csv_count_task, arg);
+}
+
+
+/**
+ * Steal the chunks of a csv job, each thread starts on an even share
+ * @param arg, the csv job
+ * @param id, the thread
+ */
+static void csv_parse_job(void* arg, size_t id) {
+	const struct csv_job* job = arg;
+	size_t n_threads = job->pool->n_threads;
+	pool_steal(job->pool, id, id * job->n_chunks / n_threads, (id + 1) * job->n_chunks / n_threads, csv_parse_task, arg);
+}
+
+
+/**
+ * Load a csv of bodies, one x,y,z,velocity_x,velocity_y,velocity_z,mass line each
+ * The file is mapped and cut into chunks that start on a new line, the
+ * threads count the bodies of each chunk, which places every chunk in the
+ * store, then parse their chunks into it, the text is only parsed once,
+ * blank lines are skipped and the bad lines are reported on stderr
+ * @param path, the path of the csv
+ * @param n_threads, the number of threads that parse it
+ * @return the body store or NULL if the file cannot be read, has no bodies or has a bad line
+ */
+struct bodies* bodies_parse_csv(const char* path, size_t n_threads) {
+
+	// If the parameters are invalid
+	if (path == NULL || n_threads == 0) {
+		return NULL;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = (size_t)st.st_size;
+	const char* text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED) {
+		return NULL;
+	}
+
+	// Enough chunks to steal from without making small files worth a thread each
+	size_t n_chunks = n_threads * POOL_TASKS_PER_THREAD;
+	n_chunks = n_chunks < size / CSV_MIN_CHUNK + 1 ? n_chunks : size / CSV_MIN_CHUNK + 1;
+	struct csv_job job = { .pool = pool_create(n_threads), .chunks = calloc(n_chunks, sizeof(struct csv_chunk)),
+		.n_chunks = n_chunks };
+	if (job.pool == NULL || job.chunks == NULL) {
+		pool_destroy(job.pool);
+		free(job.chunks);
+		munmap((void*)text, size);
+		return NULL;
+	}
+
+	// Each chunk ends on the first new line of the file from the last byte of its even share
+	const char* start = text;
+	for (size_t k = 0; k < n_chunks; k++) {
+		const char* end = text + size;
+		if (k + 1 < n_chunks) {
+			end = text + (k + 1) * size / n_chunks;
+			end = end > start ? end : start + 1;
+			const char* newline = memchr(end - 1, '\n', (size_t)(text + size - end + 1));
+			end = newline == NULL ? text + size : newline + 1;
+		}
+		job.chunks[k].start = start;
+		job.chunks[k].end = end;
+		start = end;
+	}
+	pool_run(job.pool, csv_count_job, &job);
+
+	size_t n_bodies = 0, n_lines = 0;
+	for (size_t k = 0; k < n_chunks; k++) {
+		job.chunks[k].first_body = n_bodies;
+		job.chunks[k].first_line = n_lines + 1;
+		n_bodies += job.chunks[k].n_bodies;
+		n_lines += job.chunks[k].n_lines;
+	}
+	job.bodies = bodies_create(n_bodies);
+	if (job.bodies != NULL) {
+		pool_run(job.pool, csv_parse_job, &job);
+	}
+
+	// The chunks are in file order so the bad lines are reported in order
+	size_t n_errors = 0, n_reported = 0;
+	for (size_t k = 0; k < n_chunks; k++) {
+		if (job.chunks[k].n_errors > 0) {
+			csv_report(job.chunks + k, path, &n_reported);
+			n_errors += job.chunks[k].n_errors;
+		}
+	}
+	if (n_errors > n_reported) {
+		fprintf(stderr, "%s: %zu more bad lines\n", path, n_errors - n_reported);
+	}
+	int failed = job.bodies == NULL || n_errors > 0;
+	pool_destroy(job.pool);
+	free(job.chunks);
+	munmap((void*)text, size);
+	if (failed) {
+		bodies_destroy(job.bodies);
+		return NULL;
+	}
+	return job.bodies;
+}
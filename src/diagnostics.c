@@ -0,0 +1,185 @@
+#include "nbody.h"
+#include <time.h>
+
+
+/**
+ * Read the wall clock
+ * @return the seconds of a monotonic clock
+ */
+static double energy_clock(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+
+/**
+ * Set how often the energy is measured
+ * @param s, the schedule
+ * @param cadence, end for only the first and last step, a number of steps
+ * or a number of seconds of wall clock followed by s such as 0.5s
+ * @return 0 if set or 1 if the cadence is invalid
+ */
+int energy_schedule_parse(struct energy_schedule* s, const char* cadence) {
+
+	// If the parameters are invalid
+	if (s == NULL || cadence == NULL || cadence[0] == '\0') {
+		return 1;
+	}
+
+	if (strcmp(cadence, "end") == 0) {
+		s->every = 0;
+		s->seconds = 0.0;
+		return 0;
+	}
+
+	char* end = NULL;
+	errno = 0;
+	if (cadence[strlen(cadence) - 1] == 's') {
+		double seconds = strtod(cadence, &end);
+		if (errno || end != cadence + strlen(cadence) - 1 || !(seconds > 0.0)) {
+			return 1;
+		}
+		s->every = 0;
+		s->seconds = seconds;
+		return 0;
+	}
+
+	unsigned long long every = strtoull(cadence, &end, 10);
+	if (errno || *end != '\0' || every == 0 || cadence[0] == '-') {
+		return 1;
+	}
+	s->every = (size_t)every;
+	s->seconds = 0.0;
+	return 0;
+}
+
+
+/**
+ * Check whether the energy is measured after a step
+ * The state before the first step and after the last are always measured
+ * @param s, the schedule or NULL to only measure those two
+ * @param step, the number of steps done
+ * @param iterations, the number of steps of the run
+ * @return 1 if it is measured or 0 if not
+ */
+int energy_due(const struct energy_schedule* s, size_t step, size_t iterations) {
+	if (step == 0 || step == iterations) {
+		return 1;
+	}
+	if (s == NULL) {
+		return 0;
+	}
+	if (s->every > 0 && step % s->every == 0) {
+		return 1;
+	}
+	return s->seconds > 0.0 && energy_clock() - s->last_time >= s->seconds;
+}
+
+
+/**
+ * Find the next step after which the energy may be due, the steps before it
+ * can run without looking at the schedule
+ * A wall clock cadence is looked at every ENERGY_SEGMENT steps
+ * @param s, the schedule or NULL to only measure the first and last step
+ * @param step, the number of steps done
+ * @param iterations, the number of steps of the run
+ * @return the step, at most iterations
+ */
+size_t energy_next(const struct energy_schedule* s, size_t step, size_t iterations) {
+	size_t next = iterations;
+	if (s != NULL && s->every > 0) {
+		next = (step / s->every + 1) * s->every;
+	} else if (s != NULL && s->seconds > 0.0) {
+		next = step + ENERGY_SEGMENT;
+	}
+	return next < iterations ? next : iterations;
+}
+
+
+/**
+ * Measure the total energy after a step, called by every thread of a pool
+ * With from_force the potential is the one the engine's force pass found for
+ * the positions the step started from, so no pairs are visited again, before
+ * the first step or when the engine keeps no potential the pairs are summed
+ * @param s, the schedule or NULL for the pair sum
+ * @param b, the body store
+ * @param engine, the force engine
+ * @param state, the state of the engine
+ * @param pool, the pool running the job
+ * @param id, the thread
+ * @param step, the number of steps done
+ * @return the total energy on thread 0 and 0.0 on the others, or -1.0 if invalid
+ */
+double energy_measure(const struct energy_schedule* s, const struct bodies* b, const struct engine* engine, void* state,
+		struct thread_pool* pool, size_t id, size_t step) {
+
+	// Return if the parameters are invalid
+	if (b == NULL || engine == NULL || pool == NULL) {
+		return -1.0;
+	}
+
+	if (s == NULL || !s->from_force || engine->potential == NULL || step == 0) {
+		return bodies_energy_parallel(b, pool, id);
+	}
+
+	// Every kick is done once the threads meet
+	pool_wait(pool);
+	if (id != 0) {
+		return 0.0;
+	}
+	double kinetic = 0.0;
+	for (size_t i = 0; i < b->n_bodies; i++) {
+		kinetic += b->mass[i] * (b->velocity_x[i] * b->velocity_x[i] + b->velocity_y[i] * b->velocity_y[i] + b->velocity_z[i] * b->velocity_z[i]) / 2;
+	}
+	return kinetic + engine->potential(state);
+}
+
+
+/**
+ * Record a measured energy, the first one is the reference of the drift
+ * A row of step, simulated time, energy and relative drift is written to the log if there is one
+ * @param s, the schedule
+ * @param step, the number of steps done
+ * @param time, the simulated time
+ * @param energy, the total energy
+ */
+void energy_record(struct energy_schedule* s, size_t step, double time, double energy) {
+
+	// If the parameter is invalid
+	if (s == NULL) {
+		return;
+	}
+
+	if (s->n_measured == 0) {
+		s->initial = energy;
+		s->max_drift = 0.0;
+		if (s->log != NULL) {
+			fprintf(s->log, "step,time,energy,drift\n");
+		}
+	}
+
+	// Drift is relative unless the system starts with no energy
+	double drift = s->initial != 0.0 ? (energy - s->initial) / fabs(s->initial) : energy;
+	s->max_drift = fabs(drift) > s->max_drift ? fabs(drift) : s->max_drift;
+	s->n_measured++;
+	s->last_time = energy_clock();
+	if (s->log != NULL) {
+		fprintf(s->log, "%zu,%.17g,%.17g,%.17g\n", step, time, energy, drift);
+	}
+}
+
+
+/**
+ * Print how many times the energy was measured and its largest drift
+ * @param s, the schedule
+ */
+void energy_report(const struct energy_schedule* s) {
+
+	// If the parameter is invalid
+	if (s == NULL || s->n_measured == 0) {
+		return;
+	}
+
+	printf("Energy measured %zu times, max drift %e\n", s->n_measured, s->max_drift);
+}
@@ -0,0 +1,177 @@
+#include "nbody.h"
+
+
+/**
+ * Allocate the tiles and per thread buffers of the direct engine
+ * @param b, the body store, packed into the tiles
+ * @param n_threads, the number of threads that will call direct_step
+ * @param params, unused
+ * @return the state or NULL if invalid
+ */
+static void* direct_create(const struct bodies* b, size_t n_threads, const struct engine_params* params) {
+
+	// If the parameters are invalid
+	if (b == NULL || n_threads == 0) {
+		return NULL;
+	}
+
+	struct direct_state* s = malloc(sizeof(struct direct_state));
+	if (s == NULL) {
+		return NULL;
+	}
+	s->tiles = body_tiles_create(b->n_bodies);
+	s->buffers = force_buffers_create(n_threads, b->n_bodies);
+	s->lanes = pool_lanes_create(n_threads);
+	s->shares = calloc(n_threads * POOL_TASKS_PER_THREAD, sizeof(double));
+	s->potential = 0.0;
+	if (s->tiles == NULL || s->buffers == NULL || s->lanes == NULL || s->shares == NULL) {
+		body_tiles_destroy(s->tiles);
+		force_buffers_destroy(s->buffers);
+		free(s->lanes);
+		free(s->shares);
+		free(s);
+		return NULL;
+	}
+	for (size_t i = 0; i < n_threads; i++) {
+		pool_lane_reset(s->lanes + i, i * POOL_TASKS_PER_THREAD, (i + 1) * POOL_TASKS_PER_THREAD);
+	}
+	body_tiles_pack(s->tiles, b, 0, b->n_bodies);
+	cache_block_sizes(NULL, NULL);
+	return s;
+}
+
+
+/**
+ * Clear up all memory associated with the direct engine
+ * @param state, the state
+ */
+static void direct_destroy(void* state) {
+	struct direct_state* s = state;
+
+	// If it is already NULL
+	if (s == NULL) {
+		return;
+	}
+
+	force_buffers_destroy(s->buffers);
+	body_tiles_destroy(s->tiles);
+	free(s->lanes);
+	free(s->shares);
+	free(s);
+}
+
+
+/**
+ * Add the pairs of one share of the pair triangle to the buffer of the thread whose lane holds it
+ * When the job asks for it the share's potential is summed in the same pass
+ * @param job, the direct job
+ * @param owner, the thread whose lane holds the share
+ * @param share, the share
+ */
+static void direct_share(const struct direct_job* job, size_t owner, size_t share) {
+	const struct force_buffers* f = job->state->buffers;
+	size_t row_start = pair_partition(job->n_bodies, job->n_tasks, share);
+	size_t row_end = pair_partition(job->n_bodies, job->n_tasks, share + 1);
+	if (job->with_potential) {
+		job->state->shares[share] = force_pair_rows_potential(job->state->tiles, force_buffer(f, owner, 0),
+				force_buffer(f, owner, 1), force_buffer(f, owner, 2), row_start, row_end, job->dt);
+		return;
+	}
+	force_pair_rows(job->state->tiles, force_buffer(f, owner, 0), force_buffer(f, owner, 1), force_buffer(f, owner, 2),
+			row_start, row_end, job->dt);
+}
+
+
+/**
+ * Direct step of one thread, every pair is computed once in a share of the
+ * pair triangle, each thread's lane holds its shares and whichever thread
+ * runs a share adds it to the buffer of the lane's thread, a lane runs its
+ * shares one at a time in order, so each buffer always takes the same pairs
+ * in the same order, and a thread done with its own lane takes shares from
+ * the lanes of slower threads, then after the barrier this thread's bodies
+ * take every buffer's changes and move, asked for the potential the first
+ * thread sums the shares in order, so a run repeats bit for bit on the same threads
+ * @param state, the direct state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, 1 to leave the potential energy of the starting positions for direct_potential
+ */
+static void direct_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential) {
+	struct direct_state* s = state;
+	struct direct_job job = { .state = s, .n_bodies = b->n_bodies, .n_tasks = n_threads * POOL_TASKS_PER_THREAD, .dt = dt,
+		.with_potential = with_potential };
+
+	// This thread's own lane first, then the lanes of the others
+	for (size_t k = 0; k < n_threads; k++) {
+		size_t owner = (id + k) % n_threads, share;
+		for (size_t round = 0; !pool_lane_done(s->lanes + owner); round++) {
+			if (pool_lane_enter(s->lanes + owner, &share)) {
+				direct_share(&job, owner, share);
+				pool_lane_leave(s->lanes + owner, 1);
+			} else {
+				pool_pause(pool, round);
+			}
+		}
+	}
+	pool_wait(pool);
+
+	// Every share is done so the potential is summed in share order and the lanes can start over
+	if (with_potential && id == 0) {
+		double potential = 0.0;
+		for (size_t share = 0; share < job.n_tasks; share++) {
+			potential += s->shares[share];
+		}
+		s->potential = -GCONST * potential;
+	}
+	pool_lane_reset(s->lanes + id, id * POOL_TASKS_PER_THREAD, (id + 1) * POOL_TASKS_PER_THREAD);
+	bodies_merge_parallel(b, s->tiles, s->buffers, start, end, dt);
+}
+
+
+/**
+ * Potential energy of the positions the last step asked for it started from
+ * @param state, the direct state
+ * @return the potential energy
+ */
+static double direct_potential(void* state) {
+	const struct direct_state* s = state;
+	return s->potential;
+}
+
+
+// Every engine, the first is the default
+static const struct engine engines[] = {
+	{ "direct", direct_create, direct_destroy, direct_step, direct_potential, NULL, NULL },
+	{ "bh", bh_create, bh_destroy, bh_step, NULL, NULL, NULL },
+	{ "fmm", fmm_create, fmm_destroy, fmm_step, fmm_potential, NULL, NULL },
+	{ "pm", pm_create, pm_destroy, pm_step, NULL, NULL, pm_keep },
+	{ "p3m", p3m_create, p3m_destroy, p3m_step, NULL, NULL, p3m_keep },
+	{ "flow", flow_create, flow_destroy, flow_step, flow_potential, flow_run, NULL },
+	{ "stream", stream_create, stream_destroy, stream_step, stream_potential, NULL, NULL },
+};
+
+
+/**
+ * Find an engine by name
+ * @param name, the name of the engine
+ * @return the engine or NULL if unknown
+ */
+const struct engine* engine_find(const char* name) {
+
+	// If the parameter is invalid
+	if (name == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+		if (strcmp(engines[i].name, name) == 0) {
+			return engines + i;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,291 @@
+#include "nbody.h"
+
+
+/**
+ * Find the task of two blocks, the tasks run along the rows of the upper triangle
+ * @param n_blocks, the number of blocks
+ * @param row, the first block
+ * @param col, the second block, at least row
+ * @return the task
+ */
+static inline size_t flow_task_index(size_t n_blocks, size_t row, size_t col) {
+	return row * n_blocks - row * (row - 1) / 2 + col - row;
+}
+
+
+/**
+ * Allocate the double buffered tiles, the counters and the queue of the dataflow engine
+ * The blocks are a whole number of tiles, small enough that each thread starts
+ * with several rows of tasks and no larger than a j block of cache_block_sizes
+ * @param b, the body store, packed into both tiles
+ * @param n_threads, the number of threads that will call flow_run
+ * @param params, unused
+ * @return the state or NULL if invalid
+ */
+void* flow_create(const struct bodies* b, size_t n_threads, const struct engine_params* params) {
+
+	// If the parameters are invalid
+	if (b == NULL || b->n_bodies == 0 || n_threads == 0) {
+		return NULL;
+	}
+
+	struct flow_state* s = malloc(sizeof(struct flow_state));
+	if (s == NULL) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(struct flow_state));
+
+	size_t j_block;
+	cache_block_sizes(NULL, &j_block);
+	size_t block = (b->n_bodies + FLOW_BLOCKS_PER_THREAD * n_threads - 1) / (FLOW_BLOCKS_PER_THREAD * n_threads);
+	block += (TILE_WIDTH - block % TILE_WIDTH) % TILE_WIDTH;
+	s->block = block > j_block ? j_block : block;
+	s->n_blocks = (b->n_bodies + s->block - 1) / s->block;
+	s->n_tasks = s->n_blocks * (s->n_blocks + 1) / 2;
+
+	s->tiles[0] = body_tiles_create(b->n_bodies);
+	s->tiles[1] = body_tiles_create(b->n_bodies);
+	s->buffers = force_buffers_create(n_threads, b->n_bodies);
+	s->pairs = malloc(sizeof(size_t) * 2 * s->n_tasks);
+	s->pending = malloc(sizeof(_Atomic int) * 2 * s->n_blocks);
+	s->waiting = malloc(sizeof(_Atomic int) * 2 * s->n_tasks);
+	s->released = malloc(sizeof(_Atomic size_t) * s->n_tasks);
+	s->lanes = pool_lanes_create(n_threads);
+	s->shares = calloc(s->n_tasks, sizeof(double));
+	if (s->tiles[0] == NULL || s->tiles[1] == NULL || s->buffers == NULL || s->pairs == NULL
+			|| s->pending == NULL || s->waiting == NULL || s->released == NULL || s->lanes == NULL
+			|| s->shares == NULL) {
+		flow_destroy(s);
+		return NULL;
+	}
+
+	for (size_t row = 0; row < s->n_blocks; row++) {
+		for (size_t col = row; col < s->n_blocks; col++) {
+			size_t task = flow_task_index(s->n_blocks, row, col);
+			s->pairs[2 * task] = row;
+			s->pairs[2 * task + 1] = col;
+		}
+	}
+	body_tiles_pack(s->tiles[0], b, 0, b->n_bodies);
+	body_tiles_pack(s->tiles[1], b, 0, b->n_bodies);
+	return s;
+}
+
+
+/**
+ * Clear up all memory associated with the dataflow engine
+ * @param state, the state
+ */
+void flow_destroy(void* state) {
+	struct flow_state* s = state;
+
+	// If it is already NULL
+	if (s == NULL) {
+		return;
+	}
+
+	body_tiles_destroy(s->tiles[0]);
+	body_tiles_destroy(s->tiles[1]);
+	force_buffers_destroy(s->buffers);
+	free(s->pairs);
+	free(s->pending);
+	free(s->waiting);
+	free(s->released);
+	free(s->lanes);
+	free(s->shares);
+	free(s);
+}
+
+
+/**
+ * Reset the counters of both parities, release every task of the first step
+ * and give each lane its range of the tasks for every step of the run
+ * Only thread 0 calls it, before the barrier that starts a run
+ * @param s, the state
+ * @param n_threads, the number of threads
+ * @param steps, the number of steps of the run
+ */
+static void flow_prepare(struct flow_state* s, size_t n_threads, size_t steps) {
+	for (size_t parity = 0; parity < 2; parity++) {
+		for (size_t block = 0; block < s->n_blocks; block++) {
+			atomic_store_explicit(&s->pending[parity * s->n_blocks + block], (int)s->n_blocks, memory_order_relaxed);
+		}
+		for (size_t task = 0; task < s->n_tasks; task++) {
+			int blocks = s->pairs[2 * task] == s->pairs[2 * task + 1] ? 1 : 2;
+			atomic_store_explicit(&s->waiting[parity * s->n_tasks + task], blocks, memory_order_relaxed);
+		}
+	}
+	for (size_t task = 0; task < s->n_tasks; task++) {
+		atomic_store_explicit(&s->released[task], steps > 0 ? 1 : 0, memory_order_relaxed);
+	}
+	for (size_t id = 0; id < n_threads; id++) {
+		pool_lane_reset(s->lanes + id, 0, steps * ((id + 1) * s->n_tasks / n_threads - id * s->n_tasks / n_threads));
+	}
+}
+
+
+/**
+ * Move a block whose every task of a step is done and release the tasks of the
+ * next step that were only waiting on it
+ * The buffers of the block are summed and cleared before any task of the next
+ * step can add to them and its new positions go to the tiles that step reads
+ * @param job, the run
+ * @param step, the step of the run
+ * @param block, the block
+ */
+static void flow_move(const struct flow_job* job, size_t step, size_t block) {
+	struct flow_state* s = job->state;
+	size_t start = block * s->block;
+	size_t end = start + s->block < job->bodies->n_bodies ? start + s->block : job->bodies->n_bodies;
+	bodies_merge_parallel(job->bodies, s->tiles[(s->current + step + 1) % 2], s->buffers, start, end, job->dt);
+
+	// Nothing of the step after next can reach the block before it is released below
+	atomic_store_explicit(&s->pending[(step % 2) * s->n_blocks + block], (int)s->n_blocks, memory_order_relaxed);
+	if (step + 1 < job->steps) {
+		for (size_t other = 0; other < s->n_blocks; other++) {
+			size_t row = other < block ? other : block;
+			size_t col = other < block ? block : other;
+			size_t task = flow_task_index(s->n_blocks, row, col);
+			_Atomic int* waiting = &s->waiting[((step + 1) % 2) * s->n_tasks + task];
+			if (atomic_fetch_sub_explicit(waiting, 1, memory_order_acq_rel) == 1) {
+				atomic_store_explicit(waiting, row == col ? 1 : 2, memory_order_relaxed);
+				atomic_store_explicit(&s->released[task], step + 2, memory_order_release);
+			}
+		}
+	}
+}
+
+
+/**
+ * Add the pairs of one task to the buffer of the thread whose lane holds it, then
+ * count the task off both of its blocks, the thread that finishes a block moves it
+ * @param job, the run
+ * @param owner, the thread whose lane holds the task
+ * @param item, the step of the run times the number of tasks plus the task
+ */
+static void flow_task(const struct flow_job* job, size_t owner, size_t item) {
+	struct flow_state* s = job->state;
+	size_t step = item / s->n_tasks, task = item % s->n_tasks;
+	size_t row = s->pairs[2 * task], col = s->pairs[2 * task + 1];
+	size_t n_bodies = job->bodies->n_bodies;
+	size_t i_end = (row + 1) * s->block < n_bodies ? (row + 1) * s->block : n_bodies;
+	size_t j_end = (col + 1) * s->block < n_bodies ? (col + 1) * s->block : n_bodies;
+	int with_potential = job->with_potential && step + 1 == job->steps;
+
+	double potential = force_pair_block(s->tiles[(s->current + step) % 2], force_buffer(s->buffers, owner, 0),
+			force_buffer(s->buffers, owner, 1), force_buffer(s->buffers, owner, 2), row * s->block, i_end,
+			col * s->block, j_end, job->dt, with_potential);
+	if (with_potential) {
+		s->shares[task] = potential;
+	}
+
+	_Atomic int* pending = s->pending + (step % 2) * s->n_blocks;
+	if (atomic_fetch_sub_explicit(&pending[row], 1, memory_order_acq_rel) == 1) {
+		flow_move(job, step, row);
+	}
+	if (col != row && atomic_fetch_sub_explicit(&pending[col], 1, memory_order_acq_rel) == 1) {
+		flow_move(job, step, col);
+	}
+}
+
+
+/**
+ * Dataflow steps of one thread, each thread's lane holds a range of the
+ * tasks for every step in order, and whichever thread runs a task adds it
+ * to the buffer of the lane's thread, a task of the next step starts as soon
+ * as the two blocks it reads have moved, so the steps of a run overlap and
+ * only its start and end wait on the pool's barrier, a thread whose own lane
+ * is done or waiting on a block runs the ready tasks of the other lanes,
+ * a lane runs its tasks one at a time in order so every buffer takes the
+ * same pairs in the same order and a run repeats bit for bit on the same
+ * threads, asked for the potential the first thread sums the shares of the
+ * last step in order
+ * @param state, the dataflow state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param steps, the number of steps
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, 1 to leave the potential energy the last step started from for flow_potential
+ */
+void flow_run(void* state, struct bodies* b, size_t id, size_t n_threads, size_t steps, double dt, struct thread_pool* pool, int with_potential) {
+	struct flow_state* s = state;
+	struct flow_job job = { .state = s, .bodies = b, .steps = steps, .dt = dt, .with_potential = with_potential };
+	if (id == 0) {
+		flow_prepare(s, n_threads, steps);
+	}
+	pool_wait(pool);
+
+	for (size_t round = 0; ; round++) {
+		int done = 1, ran = 0;
+
+		// This thread's own lane first, then the lanes of the others
+		for (size_t k = 0; k < n_threads; k++) {
+			size_t owner = (id + k) % n_threads, position;
+			done &= pool_lane_done(s->lanes + owner);
+			if (!pool_lane_enter(s->lanes + owner, &position)) {
+				continue;
+			}
+
+			// The task is released once both of its blocks have moved in the step before
+			size_t first = owner * s->n_tasks / n_threads, length = (owner + 1) * s->n_tasks / n_threads - first;
+			size_t step = position / length, task = first + position % length;
+			int ready = atomic_load_explicit(&s->released[task], memory_order_acquire) > step;
+			if (ready) {
+				flow_task(&job, owner, step * s->n_tasks + task);
+				ran = 1;
+			}
+			pool_lane_leave(s->lanes + owner, ready);
+		}
+		if (done) {
+			break;
+		}
+		if (ran) {
+			round = 0;
+		} else {
+			pool_pause(pool, round);
+		}
+	}
+	pool_wait(pool);
+
+	// Every share is done so the potential is summed in task order
+	if (id == 0) {
+		s->current = (s->current + steps) % 2;
+		if (with_potential && steps > 0) {
+			double potential = 0.0;
+			for (size_t task = 0; task < s->n_tasks; task++) {
+				potential += s->shares[task];
+			}
+			s->potential = -GCONST * potential;
+		}
+	}
+}
+
+
+/**
+ * One dataflow step of one thread, a run of a single step
+ * @param state, the dataflow state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, unused, the blocks are moved by whichever thread finishes them
+ * @param end, unused
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, 1 to leave the potential energy of the starting positions for flow_potential
+ */
+void flow_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential) {
+	flow_run(state, b, id, n_threads, 1, dt, pool, with_potential);
+}
+
+
+/**
+ * Potential energy of the positions the last step asked for it started from
+ * @param state, the dataflow state
+ * @return the potential energy
+ */
+double flow_potential(void* state) {
+	const struct flow_state* s = state;
+	return s->potential;
+}
@@ -0,0 +1,725 @@
+#include "nbody.h"
+
+
+/**
+ * Take the coefficients of one node from a pool, growing it by a chunk if needed
+ * @param pool, the pool
+ * @param n, the number of coefficients, at most FMM_POOL_CHUNK
+ * @return the coefficients or NULL if out of memory
+ */
+static double* fmm_pool_alloc(struct fmm_pool* pool, size_t n) {
+
+	// Start the next chunk if the block does not fit
+	if (pool->used + n > FMM_POOL_CHUNK) {
+		pool->chunk++;
+		pool->used = 0;
+	}
+
+	if (pool->chunk >= pool->n_chunks) {
+		double** chunks = realloc(pool->chunks, sizeof(double*) * (pool->n_chunks + 1));
+		if (chunks == NULL) {
+			return NULL;
+		}
+		pool->chunks = chunks;
+		pool->chunks[pool->n_chunks] = aligned_alloc(CACHE_LINE, sizeof(double) * FMM_POOL_CHUNK);
+		if (pool->chunks[pool->n_chunks] == NULL) {
+			return NULL;
+		}
+		pool->n_chunks++;
+	}
+
+	double* coeff = pool->chunks[pool->chunk] + pool->used;
+	pool->used += n;
+	return coeff;
+}
+
+
+/**
+ * The coefficient of a multi-index
+ * @param s, the fmm state
+ * @param x, the power of x
+ * @param y, the power of y
+ * @param z, the power of z
+ * @return the index into an expansion
+ */
+static inline size_t fmm_index(const struct fmm_state* s, size_t x, size_t y, size_t z) {
+	return s->index[(x * (s->order + 1) + y) * (s->order + 1) + z];
+}
+
+
+/**
+ * Fill d^n / n! for every coefficient n
+ * @param s, the fmm state
+ * @param x, the x offset
+ * @param y, the y offset
+ * @param z, the z offset
+ * @param out, set to the scaled powers, n_coeff long
+ */
+static void fmm_scaled_powers(const struct fmm_state* s, double x, double y, double z, double* out) {
+	double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1], pz[FMM_MAX_ORDER + 1];
+	px[0] = py[0] = pz[0] = 1.0;
+	for (size_t i = 1; i <= s->order; i++) {
+		px[i] = px[i - 1] * x;
+		py[i] = py[i - 1] * y;
+		pz[i] = pz[i - 1] * z;
+	}
+	for (size_t i = 0; i < s->n_coeff; i++) {
+		const unsigned int* n = s->powers[i];
+		out[i] = px[n[0]] * py[n[1]] * pz[n[2]] * s->inv_factorial[n[0]] * s->inv_factorial[n[1]] * s->inv_factorial[n[2]];
+	}
+}
+
+
+/**
+ * Every derivative of 1 / r at a point up to the expansion order
+ * Uses the McMurchie-Davidson recurrence for the point charge, aux[m][n]
+ * holds the derivative n of (-1)^m (2m - 1)!! / r^(2m + 1)
+ * @param s, the fmm state
+ * @param x, the x offset
+ * @param y, the y offset
+ * @param z, the z offset
+ * @param d, set to the derivatives, n_coeff long
+ */
+static void fmm_derivatives(const struct fmm_state* s, double x, double y, double z, double* d) {
+	const size_t nc = s->n_coeff, p = s->order;
+	double aux[(FMM_MAX_ORDER + 1) * FMM_MAX_COEFF];
+
+	double inv_r2 = 1.0 / (x * x + y * y + z * z);
+	double value = sqrt(inv_r2);
+	aux[0] = value;
+	for (size_t m = 1; m <= p; m++) {
+		value *= -(double)(2 * m - 1) * inv_r2;
+		aux[m * nc] = value;
+	}
+
+	// Coefficients are ordered by degree so both terms are already known
+	for (size_t i = 1; i < nc; i++) {
+		const unsigned int* n = s->powers[i];
+		size_t degree = n[0] + n[1] + n[2];
+		int axis = n[0] > 0 ? 0 : n[1] > 0 ? 1 : 2;
+		double offset = axis == 0 ? x : axis == 1 ? y : z;
+		unsigned int lower[3] = { n[0], n[1], n[2] };
+		lower[axis]--;
+		size_t once = fmm_index(s, lower[0], lower[1], lower[2]);
+		size_t twice = once;
+		if (lower[axis] > 0) {
+			lower[axis]--;
+			twice = fmm_index(s, lower[0], lower[1], lower[2]);
+		}
+		for (size_t m = 0; m + degree <= p; m++) {
+			double v = offset * aux[(m + 1) * nc + once];
+			if (twice != once) {
+				v += (n[axis] - 1) * aux[(m + 1) * nc + twice];
+			}
+			aux[m * nc + i] = v;
+		}
+	}
+	memcpy(d, aux, sizeof(double) * nc);
+}
+
+
+/**
+ * Add the bodies of a cell to a multipole about a centre of mass
+ * @param s, the fmm state
+ * @param centre, the cell holding the multipole
+ * @param node, the cell whose bodies are added, centre or one of its children
+ */
+static void fmm_p2m(const struct fmm_state* s, struct bh_node* centre, const struct bh_node* node) {
+	const struct bh_state* t = s->tree;
+	double powers[FMM_MAX_COEFF];
+	double* multipole = centre->expansion;
+	for (size_t k = node->first; k < node->first + node->count; k++) {
+		fmm_scaled_powers(s, centre->com_x - t->sorted_x[k], centre->com_y - t->sorted_y[k], centre->com_z - t->sorted_z[k], powers);
+		for (size_t i = 0; i < s->n_coeff; i++) {
+			multipole[i] += t->sorted_mass[k] * powers[i];
+		}
+	}
+}
+
+
+/**
+ * Shift the multipole of a child to its parent's centre and add it
+ * @param s, the fmm state
+ * @param parent, the parent
+ * @param child, the child
+ */
+static void fmm_m2m(const struct fmm_state* s, struct bh_node* parent, const struct bh_node* child) {
+	double powers[FMM_MAX_COEFF];
+	fmm_scaled_powers(s, parent->com_x - child->com_x, parent->com_y - child->com_y, parent->com_z - child->com_z, powers);
+	for (size_t i = 0; i < s->n_pairs; i++) {
+		const struct fmm_pair* pair = s->pairs + i;
+		parent->expansion[pair->sum] += child->expansion[pair->a] * powers[pair->b];
+	}
+}
+
+
+/**
+ * Add the field of a source multipole to the local expansion of a target
+ * @param s, the fmm state
+ * @param target, the target cell
+ * @param source, the well separated source cell
+ */
+static void fmm_m2l(const struct fmm_state* s, struct bh_node* target, const struct bh_node* source) {
+	double derivatives[FMM_MAX_COEFF];
+	fmm_derivatives(s, target->com_x - source->com_x, target->com_y - source->com_y, target->com_z - source->com_z, derivatives);
+	double* local = target->expansion + s->n_coeff;
+	const double* multipole = source->expansion;
+
+	// Pairs are grouped by a so each local coefficient is summed in a register
+	for (size_t a = 0; a < s->n_coeff; a++) {
+		double sum = 0.0;
+		for (size_t i = s->pair_start[a]; i < s->pair_start[a + 1]; i++) {
+			sum += multipole[s->pairs[i].b] * derivatives[s->pairs[i].sum];
+		}
+		local[a] += sum;
+	}
+}
+
+
+/**
+ * Shift the local expansion of a parent to its child's centre and add it
+ * @param s, the fmm state
+ * @param parent, the parent
+ * @param child, the child
+ */
+static void fmm_l2l(const struct fmm_state* s, const struct bh_node* parent, struct bh_node* child) {
+	double powers[FMM_MAX_COEFF];
+	fmm_scaled_powers(s, child->com_x - parent->com_x, child->com_y - parent->com_y, child->com_z - parent->com_z, powers);
+	const double* from = parent->expansion + s->n_coeff;
+	double* to = child->expansion + s->n_coeff;
+	for (size_t a = 0; a < s->n_coeff; a++) {
+		double sum = 0.0;
+		for (size_t i = s->pair_start[a]; i < s->pair_start[a + 1]; i++) {
+			sum += from[s->pairs[i].sum] * powers[s->pairs[i].b];
+		}
+		to[a] += sum;
+	}
+}
+
+
+/**
+ * Evaluate a local expansion at the bodies of a cell
+ * @param s, the fmm state
+ * @param centre, the cell holding the local expansion
+ * @param node, the cell whose bodies are evaluated, centre or one of its children
+ */
+static void fmm_l2p(struct fmm_state* s, const struct bh_node* centre, const struct bh_node* node) {
+	const struct bh_state* t = s->tree;
+	const double* local = centre->expansion + s->n_coeff;
+	double powers[FMM_MAX_COEFF];
+	for (size_t k = node->first; k < node->first + node->count; k++) {
+		fmm_scaled_powers(s, t->sorted_x[k] - centre->com_x, t->sorted_y[k] - centre->com_y, t->sorted_z[k] - centre->com_z, powers);
+		double potential = 0, acc_x = 0, acc_y = 0, acc_z = 0;
+		for (size_t i = 0; i < s->n_coeff; i++) {
+			const unsigned int* n = s->powers[i];
+			potential += local[i] * powers[i];
+			// The gradient drops one degree of the expansion
+			if (n[0] + n[1] + n[2] < s->order) {
+				acc_x += local[fmm_index(s, n[0] + 1, n[1], n[2])] * powers[i];
+				acc_y += local[fmm_index(s, n[0], n[1] + 1, n[2])] * powers[i];
+				acc_z += local[fmm_index(s, n[0], n[1], n[2] + 1)] * powers[i];
+			}
+		}
+		s->potential[k] += potential;
+		s->acc_x[k] += acc_x;
+		s->acc_y[k] += acc_y;
+		s->acc_z[k] += acc_z;
+	}
+}
+
+
+/**
+ * Direct sum from the bodies of a source cell onto the bodies of a target
+ * Coincident bodies are treated as in energy, every body skips itself
+ * @param s, the fmm state
+ * @param target, the target cell
+ * @param source, the source cell
+ */
+static void fmm_p2p(struct fmm_state* s, const struct bh_node* target, const struct bh_node* source) {
+	const struct bh_state* t = s->tree;
+	for (size_t k = target->first; k < target->first + target->count; k++) {
+		double x = t->sorted_x[k], y = t->sorted_y[k], z = t->sorted_z[k];
+		double potential = 0, acc_x = 0, acc_y = 0, acc_z = 0;
+		for (size_t j = source->first; j < source->first + source->count; j++) {
+			double x_dist = t->sorted_x[j] - x;
+			double y_dist = t->sorted_y[j] - y;
+			double z_dist = t->sorted_z[j] - z;
+			double dist2 = x_dist * x_dist + y_dist * y_dist + z_dist * z_dist;
+			if (dist2 == 0.0) {
+				potential += j == k ? 0.0 : t->sorted_mass[j] / MIN_DISTANCE;
+				continue;
+			}
+			double inv_dist = 1.0 / sqrt(dist2);
+			double m_inv = t->sorted_mass[j] * inv_dist;
+			double s_j = m_inv * inv_dist * inv_dist;
+			potential += m_inv;
+			acc_x += x_dist * s_j;
+			acc_y += y_dist * s_j;
+			acc_z += z_dist * s_j;
+		}
+		s->potential[k] += potential;
+		s->acc_x[k] += acc_x;
+		s->acc_y[k] += acc_y;
+		s->acc_z[k] += acc_z;
+	}
+}
+
+
+/**
+ * Dual tree walk of a target cell against a source cell
+ * Only the target side is written so walks of disjoint targets can run at
+ * once, well separated pairs become multipole to local steps and pairs
+ * too close or too small for that are summed directly, as are cells the
+ * pools had no room to give expansions
+ * @param s, the fmm state
+ * @param target, the target cell
+ * @param source, the source cell
+ */
+static void fmm_interact(struct fmm_state* s, struct bh_node* target, struct bh_node* source) {
+	if (target->count == 0 || source->count == 0) {
+		return;
+	}
+
+	// A cell against itself splits into every pair of its children
+	if (target == source) {
+		if (target->n_children == 0 || (size_t)target->count * target->count <= s->p2p_limit) {
+			fmm_p2p(s, target, target);
+			return;
+		}
+		for (size_t a = 0; a < target->n_children; a++) {
+			for (size_t b = 0; b < target->n_children; b++) {
+				fmm_interact(s, target->children + a, target->children + b);
+			}
+		}
+		return;
+	}
+
+	if ((size_t)target->count * source->count <= s->p2p_limit) {
+		fmm_p2p(s, target, source);
+		return;
+	}
+
+	double dx = target->com_x - source->com_x;
+	double dy = target->com_y - source->com_y;
+	double dz = target->com_z - source->com_z;
+	double reach = target->radius + source->radius;
+	if (reach * reach < s->theta * s->theta * (dx * dx + dy * dy + dz * dz) && target->expansion != NULL && source->expansion != NULL) {
+		fmm_m2l(s, target, source);
+		return;
+	}
+
+	if (target->n_children == 0 && source->n_children == 0) {
+		fmm_p2p(s, target, source);
+		return;
+	}
+
+	// Split the larger cell
+	if (target->n_children == 0 || (source->n_children > 0 && source->radius > target->radius)) {
+		for (size_t b = 0; b < source->n_children; b++) {
+			fmm_interact(s, target, source->children + b);
+		}
+	} else {
+		for (size_t a = 0; a < target->n_children; a++) {
+			fmm_interact(s, target->children + a, source);
+		}
+	}
+}
+
+
+/**
+ * Clear the expansions of a subtree that could not be given any
+ * @param node, the root of the subtree
+ */
+static void fmm_unexpanded(struct bh_node* node) {
+	node->expansion = NULL;
+	for (size_t c = 0; c < node->n_children; c++) {
+		fmm_unexpanded(node->children + c);
+	}
+}
+
+
+/**
+ * Give every node of a subtree its expansions and compute the multipoles
+ * @param s, the fmm state
+ * @param pool, the pool of the calling thread
+ * @param node, the root of the subtree, its expansion already set
+ */
+static void fmm_upward(struct fmm_state* s, struct fmm_pool* pool, struct bh_node* node) {
+	memset(node->expansion, 0, sizeof(double) * 2 * s->n_coeff);
+	if (node->n_children == 0) {
+		fmm_p2m(s, node, node);
+		return;
+	}
+	for (size_t c = 0; c < node->n_children; c++) {
+		struct bh_node* child = node->children + c;
+		child->expansion = fmm_pool_alloc(pool, 2 * s->n_coeff);
+		// Without memory the subtree is summed directly wherever it is met
+		if (child->expansion == NULL) {
+			fmm_unexpanded(child);
+			fmm_p2m(s, node, child);
+			continue;
+		}
+		fmm_upward(s, pool, child);
+		fmm_m2m(s, node, child);
+	}
+}
+
+
+/**
+ * Push the local expansions of a subtree down to its bodies
+ * @param s, the fmm state
+ * @param node, the root of the subtree
+ */
+static void fmm_downward(struct fmm_state* s, struct bh_node* node) {
+	if (node->n_children == 0) {
+		fmm_l2p(s, node, node);
+		return;
+	}
+	for (size_t c = 0; c < node->n_children; c++) {
+		struct bh_node* child = node->children + c;
+		if (child->expansion == NULL) {
+			fmm_l2p(s, node, child);
+			continue;
+		}
+		fmm_l2l(s, node, child);
+		fmm_downward(s, child);
+	}
+}
+
+
+/**
+ * Give the subtree of one bucket its expansions and multipoles
+ * @param arg, the fmm state
+ * @param id, the thread running the task, whose pool the expansions come from
+ * @param bucket, the bucket
+ */
+static void fmm_upward_task(void* arg, size_t id, size_t bucket) {
+	struct fmm_state* s = arg;
+	struct bh_node* root = s->tree->top + bh_top_offset(BH_TOP_DEPTH) + bucket;
+	root->expansion = s->top_expansions + (bh_top_offset(BH_TOP_DEPTH) + bucket) * 2 * s->n_coeff;
+	fmm_upward(s, s->pools + id, root);
+}
+
+
+/**
+ * Walk one bucket against the whole tree and push its locals down to its bodies
+ * Targets are the bucket's own bodies so every write stays in it
+ * @param arg, the fmm state
+ * @param id, the thread running the task
+ * @param bucket, the bucket
+ */
+static void fmm_interact_task(void* arg, size_t id, size_t bucket) {
+	struct fmm_state* s = arg;
+	struct bh_state* t = s->tree;
+	struct bh_node* root = t->top + bh_top_offset(BH_TOP_DEPTH) + bucket;
+	size_t first = t->bucket_start[bucket], last = t->bucket_start[bucket + 1];
+	memset(s->acc_x + first, 0, sizeof(double) * (last - first));
+	memset(s->acc_y + first, 0, sizeof(double) * (last - first));
+	memset(s->acc_z + first, 0, sizeof(double) * (last - first));
+	memset(s->potential + first, 0, sizeof(double) * (last - first));
+	fmm_interact(s, root, t->top);
+	fmm_downward(s, root);
+}
+
+
+/**
+ * Evaluate the acceleration and potential of every body, called by every thread
+ * The tree is built as for Barnes-Hut, then the threads steal buckets to
+ * compute their multipoles, the first thread joins the top levels and the
+ * threads steal buckets again to walk them and push down their locals,
+ * every body's results are ready when this returns
+ * @param s, the fmm state
+ * @param b, the body store
+ * @param id, the thread
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param pool, the pool running every thread
+ */
+static void fmm_evaluate(struct fmm_state* s, const struct bodies* b, size_t id, size_t start, size_t end, struct thread_pool* pool) {
+	struct bh_state* t = s->tree;
+	bh_build_parallel(t, b, id, start, end, pool);
+
+	s->pools[id].chunk = 0;
+	s->pools[id].used = 0;
+	size_t first_bucket = bh_first_bucket(t, id), last_bucket = bh_first_bucket(t, id + 1);
+	pool_steal(pool, id, first_bucket, last_bucket, fmm_upward_task, s);
+
+	if (id == 0) {
+		for (int depth = BH_TOP_DEPTH - 1; depth >= 0; depth--) {
+			for (size_t index = 0; index < ((size_t)1 << (3 * depth)); index++) {
+				struct bh_node* node = t->top + bh_top_offset(depth) + index;
+				node->expansion = s->top_expansions + (bh_top_offset(depth) + index) * 2 * s->n_coeff;
+				memset(node->expansion, 0, sizeof(double) * 2 * s->n_coeff);
+				for (size_t c = 0; c < node->n_children; c++) {
+					fmm_m2m(s, node, node->children + c);
+				}
+			}
+		}
+	}
+	pool_wait(pool);
+	pool_steal(pool, id, first_bucket, last_bucket, fmm_interact_task, s);
+}
+
+
+/**
+ * Allocate the fast multipole state for a body store and a number of threads
+ * @param b, the body store
+ * @param n_threads, the number of threads that will call fmm_step
+ * @param params, the engine parameters, theta is the opening angle of the
+ * well separated test and order the order of the expansions
+ * @return the state or NULL if invalid
+ */
+void* fmm_create(const struct bodies* b, size_t n_threads, const struct engine_params* params) {
+
+	// If the parameters are invalid
+	if (b == NULL || n_threads == 0 || params == NULL || params->theta <= 0.0 || params->theta >= 1.0
+			|| params->order == 0 || params->order > FMM_MAX_ORDER) {
+		return NULL;
+	}
+
+	struct fmm_state* s = calloc(1, sizeof(struct fmm_state));
+	if (s == NULL) {
+		return NULL;
+	}
+
+	size_t p = params->order;
+	s->theta = params->theta;
+	s->order = p;
+	s->n_coeff = (p + 1) * (p + 2) * (p + 3) / 6;
+	s->tree = bh_create(b, n_threads, params);
+	s->powers = malloc(sizeof(unsigned int[3]) * s->n_coeff);
+	s->index = malloc(sizeof(unsigned int) * (p + 1) * (p + 1) * (p + 1));
+	s->inv_factorial = malloc(sizeof(double) * (p + 1));
+	s->top_expansions = malloc(sizeof(double) * 2 * s->n_coeff * BH_TOP_NODES);
+	s->pools = calloc(n_threads, sizeof(struct fmm_pool));
+	s->acc_x = malloc(sizeof(double) * b->n_bodies);
+	s->acc_y = malloc(sizeof(double) * b->n_bodies);
+	s->acc_z = malloc(sizeof(double) * b->n_bodies);
+	s->potential = malloc(sizeof(double) * b->n_bodies);
+	if (s->tree != NULL) {
+		s->tree->leaf_size = FMM_LEAF_SIZE;
+	}
+	if (s->tree == NULL || s->powers == NULL || s->index == NULL || s->inv_factorial == NULL || s->top_expansions == NULL
+			|| s->pools == NULL || s->acc_x == NULL || s->acc_y == NULL || s->acc_z == NULL || s->potential == NULL) {
+		fmm_destroy(s);
+		return NULL;
+	}
+
+	// Multi-indices by degree, the derivative recurrence depends on it
+	size_t i = 0;
+	for (size_t degree = 0; degree <= p; degree++) {
+		for (size_t x = degree + 1; x-- > 0;) {
+			for (size_t y = degree - x + 1; y-- > 0;) {
+				size_t z = degree - x - y;
+				s->powers[i][0] = x;
+				s->powers[i][1] = y;
+				s->powers[i][2] = z;
+				s->index[(x * (p + 1) + y) * (p + 1) + z] = i++;
+			}
+		}
+	}
+	s->inv_factorial[0] = 1.0;
+	for (size_t n = 1; n <= p; n++) {
+		s->inv_factorial[n] = s->inv_factorial[n - 1] / n;
+	}
+
+	// Every pair of coefficients whose degrees add up to at most the order
+	for (size_t a = 0; a < s->n_coeff; a++) {
+		for (size_t c = 0; c < s->n_coeff; c++) {
+			s->n_pairs += s->powers[a][0] + s->powers[a][1] + s->powers[a][2] + s->powers[c][0] + s->powers[c][1] + s->powers[c][2] <= p;
+		}
+	}
+	s->pairs = malloc(sizeof(struct fmm_pair) * s->n_pairs);
+	s->pair_start = malloc(sizeof(size_t) * (s->n_coeff + 1));
+	if (s->pairs == NULL || s->pair_start == NULL) {
+		fmm_destroy(s);
+		return NULL;
+	}
+	size_t k = 0;
+	for (size_t a = 0; a < s->n_coeff; a++) {
+		s->pair_start[a] = k;
+		for (size_t c = 0; c < s->n_coeff; c++) {
+			const unsigned int* na = s->powers[a];
+			const unsigned int* nb = s->powers[c];
+			if (na[0] + na[1] + na[2] + nb[0] + nb[1] + nb[2] <= p) {
+				s->pairs[k++] = (struct fmm_pair){ a, c, fmm_index(s, na[0] + nb[0], na[1] + nb[1], na[2] + nb[2]) };
+			}
+		}
+	}
+
+	s->pair_start[s->n_coeff] = k;
+
+	// A direct pair costs about a tenth of a coefficient pair and a derivative term
+	s->p2p_limit = (2 * s->n_pairs + 3 * (p + 1) * s->n_coeff) / 10;
+	return s;
+}
+
+
+/**
+ * Clear up all memory associated with the fast multipole state
+ * @param state, the state
+ */
+void fmm_destroy(void* state) {
+	struct fmm_state* s = state;
+
+	// If it is already NULL
+	if (s == NULL) {
+		return;
+	}
+
+	if (s->pools != NULL) {
+		for (size_t t = 0; t < s->tree->n_threads; t++) {
+			for (size_t c = 0; c < s->pools[t].n_chunks; c++) {
+				free(s->pools[t].chunks[c]);
+			}
+			free(s->pools[t].chunks);
+		}
+	}
+	free(s->pools);
+	free(s->potential);
+	free(s->acc_z);
+	free(s->acc_y);
+	free(s->acc_x);
+	free(s->top_expansions);
+	free(s->pair_start);
+	free(s->pairs);
+	free(s->inv_factorial);
+	free(s->index);
+	free(s->powers);
+	bh_destroy(s->tree);
+	free(s);
+}
+
+
+/**
+ * Fast multipole step of one thread, once every bucket is evaluated the
+ * bodies of this thread's starting buckets are kicked, then its own bodies move
+ * @param state, the fmm state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, unused, the potential is always evaluated
+ */
+void fmm_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential) {
+	struct fmm_state* s = state;
+
+	// Check if the parameters are invalid
+	if (s == NULL || b == NULL || b->n_bodies != s->tree->n_bodies || n_threads != s->tree->n_threads || end > b->n_bodies) {
+		return;
+	}
+
+	fmm_evaluate(s, b, id, start, end, pool);
+
+	const struct bh_state* t = s->tree;
+	size_t first = t->bucket_start[bh_first_bucket(t, id)], last = t->bucket_start[bh_first_bucket(t, id + 1)];
+	for (size_t k = first; k < last; k++) {
+		size_t i = t->sorted[k].index;
+		b->velocity_x[i] += GCONST * s->acc_x[k] * dt;
+		b->velocity_y[i] += GCONST * s->acc_y[k] * dt;
+		b->velocity_z[i] += GCONST * s->acc_z[k] * dt;
+	}
+
+	// Wait for every kick before this thread's bodies move
+	pool_wait(pool);
+	for (size_t i = start; i < end; i++) {
+		b->x[i] += b->velocity_x[i] * dt;
+		b->y[i] += b->velocity_y[i] * dt;
+		b->z[i] += b->velocity_z[i] * dt;
+	}
+}
+
+
+/**
+ * Potential energy of the last step's evaluation, each pair counted once
+ * @param state, the fmm state
+ * @return the potential energy
+ */
+double fmm_potential(void* state) {
+	const struct fmm_state* s = state;
+	const struct bh_state* t = s->tree;
+	double potential = 0.0;
+	for (size_t k = 0; k < t->n_bodies; k++) {
+		potential += t->sorted_mass[k] * s->potential[k];
+	}
+	return -GCONST * potential / 2;
+}
+
+
+/**
+ * Measure the fast multipole error against the direct sum on a sample of bodies
+ * The potential energy of the sampled bodies is computed as energy does
+ * @param b, the body store, left unchanged
+ * @param params, the engine parameters to measure
+ * @param samples, the number of bodies to sample
+ * @param force_rms, set to the rms relative error of the sampled accelerations
+ * @return the relative error of the sampled potential energy or -1.0 if invalid
+ */
+double fmm_error(const struct bodies* b, const struct engine_params* params, size_t samples, double* force_rms) {
+
+	// If the parameters are invalid
+	if (b == NULL || samples == 0 || force_rms == NULL) {
+		return -1.0;
+	}
+
+	struct fmm_state* s = fmm_create(b, 1, params);
+	struct thread_pool* pool = pool_create(1);
+	if (s == NULL || pool == NULL) {
+		fmm_destroy(s);
+		pool_destroy(pool);
+		return -1.0;
+	}
+	fmm_evaluate(s, b, 0, 0, b->n_bodies, pool);
+	pool_destroy(pool);
+
+	// Where each body landed in the sorted copies
+	size_t n = b->n_bodies;
+	samples = samples > n ? n : samples;
+	size_t* slot = malloc(sizeof(size_t) * n);
+	if (slot == NULL) {
+		fmm_destroy(s);
+		return -1.0;
+	}
+	for (size_t k = 0; k < n; k++) {
+		slot[s->tree->sorted[k].index] = k;
+	}
+
+	double energy = 0, direct_energy = 0, error2 = 0, norm2 = 0;
+	for (size_t sample = 0; sample < samples; sample++) {
+		size_t i = sample * n / samples;
+		double potential = 0, acc_x = 0, acc_y = 0, acc_z = 0;
+		for (size_t j = 0; j < n; j++) {
+			if (j == i) {
+				continue;
+			}
+			double x_dist = b->x[j] - b->x[i];
+			double y_dist = b->y[j] - b->y[i];
+			double z_dist = b->z[j] - b->z[i];
+			double dist = sqrt(x_dist * x_dist + y_dist * y_dist + z_dist * z_dist);
+			if (dist == 0.0) {
+				potential += b->mass[j] / MIN_DISTANCE;
+				continue;
+			}
+			potential += b->mass[j] / dist;
+			double s_j = b->mass[j] / (dist * dist * dist);
+			acc_x += x_dist * s_j;
+			acc_y += y_dist * s_j;
+			acc_z += z_dist * s_j;
+		}
+
+		size_t k = slot[i];
+		direct_energy -= GCONST * b->mass[i] * potential;
+		energy -= GCONST * b->mass[i] * s->potential[k];
+		double dx = s->acc_x[k] - acc_x, dy = s->acc_y[k] - acc_y, dz = s->acc_z[k] - acc_z;
+		error2 += dx * dx + dy * dy + dz * dz;
+		norm2 += acc_x * acc_x + acc_y * acc_y + acc_z * acc_z;
+	}
+
+	free(slot);
+	fmm_destroy(s);
+	*force_rms = norm2 > 0.0 ? sqrt(error2 / norm2) : 0.0;
+	return direct_energy != 0.0 ? fabs(energy - direct_energy) / fabs(direct_energy) : 0.0;
+}
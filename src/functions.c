@@ -1,5 +1,23 @@
 #include "nbody.h"
+#include "functions.h"
 #include <errno.h>
+#include "bodies.c"
+#include "kernel.c"
+#include "topology.c"
+#include "pool.c"
+#include "barneshut.c"
+#include "fmm.c"
+#include "pm.c"
+#include "p3m.c"
+#include "flow.c"
+#include "stream.c"
+#include "engine.c"
+#include "diagnostics.c"
+#include "csv.c"
+#include "snapshot.c"
+#include "trajectory.c"
+#include "checkpoint.c"
+#include "random.c"
 
 
 /**
@@ -56,166 +74,183 @@ void update_body_position(struct body* b, double dt) {
 
 
 /**
- * Calculate the velocity of the body from all other bodies and update the positions in the process
- * Function responsible for controlling the simulation
- * @param bodies, the struct array of all the bodies
- * @param len, the length of the struct array of bodies
- * @param dt, the change in time
+ * Find the first row of a share of the pair triangle so every share has the same number of pairs
+ * Row i holds the pairs (i, j > i) so early rows hold more pairs than late ones
+ * @param len, the number of bodies
+ * @param n_shares, the number of shares
+ * @param share, the index of the share, n_shares gives len
+ * @return the first row of the share
  */
-void step(struct body** bodies, size_t len, double dt) {
+size_t pair_partition(size_t len, size_t n_shares, size_t share) {
 
-	// Check if the parameters are invalid
-	if (bodies == NULL) {
-		return;
+	// If the parameters are invalid
+	if (n_shares == 0 || share >= n_shares) {
+		return len;
 	}
 
-	// Loop through all the bodies and calculate each step
-	for (size_t i = 0; i < len; i++) {
-		// Skip if invalid
-		if (bodies[i] == NULL) {
-			continue;
+	// Pairs in the rows before r is r * (len - 1) - r * (r - 1) / 2
+	double total = (double)len * (len - 1) / 2;
+	double target = total * share / n_shares;
+	size_t low = 0, high = len;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		double pairs = (double)mid * (len - 1) - (double)mid * (mid - 1) / 2;
+		if (pairs < target) {
+			low = mid + 1;
+		} else {
+			high = mid;
 		}
-
-		// The total sum of the velocity so far
-		register double x = bodies[i]->x, y = bodies[i]->y, z = bodies[i]->z;
-		register double mass = bodies[i]->mass;
-		register double velocity_x = 0, velocity_y = 0, velocity_z = 0;
-		
-		// Loop through every other j
-		for (size_t j = i + 1; j < len; j++) {
-			// Skip if the same or invalid body
-			if (bodies[j] == NULL) {
-				printf("iuoiuo");
-				continue;
-			}
-			double dist = distance(bodies[j]->x, x, bodies[j]->y, y, bodies[j]->z, z);
-			// If they are too close
-			if (dist == 0.0) {
-				dist = 0.02;
-			}
-			double mag = magnitude(bodies[j], bodies[i], dist);
-			// Calculate the updated distances
-			double x_dist = (bodies[j]->x - x) / dist;
-			double y_dist = (bodies[j]->y - y) / dist;
-			double z_dist = (bodies[j]->z - z) / dist;
-			// Calculate the new velocity
-			velocity_x += (x_dist * mag / mass) * dt; 
-			velocity_y += (y_dist * mag / mass) * dt;
-			velocity_z += (z_dist * mag / mass) * dt;
-		
-			// Calculate the velocity for the j body by using previous values
-			bodies[j]->velocity_x += (((-1 * x_dist) * mag) / bodies[j]->mass) * dt;
-			bodies[j]->velocity_y += (((-1 * y_dist) * mag) / bodies[j]->mass) * dt;
-			bodies[j]->velocity_z += (((-1 * z_dist) * mag) / bodies[j]->mass) * dt;
-		}
-
-		// Set the old velocities to the updated ones
-		bodies[i]->velocity_x += velocity_x;
-		bodies[i]->velocity_y += velocity_y;
-		bodies[i]->velocity_z += velocity_z;
-
-		// Update the position of the body
-		update_body_position(bodies[i], dt);
 	}
+	return low;
 }
 
 
 /**
- * Calculate the velocity of the body from all other bodies and update the positions in the process
- * Function responsible for controlling the simulation
- * @param bodies, the struct array of all the bodies
- * @param len, the length of the struct array of bodies
+ * Add every thread's velocity changes to a slice of bodies and move them
+ * Called after a barrier once every pair has been added to the buffers,
+ * the buffers of the slice are cleared for the next step
+ * @param b, the body store
+ * @param t, the tiles shared by all threads
+ * @param f, the velocity change buffers, one per thread
+ * @param start, the first body this thread moves
+ * @param end, one past the last body this thread moves
  * @param dt, the change in time
- * @param barrier, the barrier of the threads maxed at number of threads
  */
-void step_parallel(struct body** bodies, size_t len, size_t start, size_t end, double dt, pthread_barrier_t* barrier) {
+void bodies_merge_parallel(struct bodies* b, struct body_tiles* t, struct force_buffers* f, size_t start, size_t end, double dt) {
 
 	// Check if the parameters are invalid
-	if (bodies == NULL || start >= end || end > len) {
+	if (b == NULL || t == NULL || f == NULL || end > b->n_bodies) {
 		return;
 	}
 
-	// Loop through all the bodies and calculate each step
-	for (size_t i = start; i < end; i++) {
-		// Skip if invalid
-		if (bodies[i] == NULL) {
-			continue;
+	// Sum the buffers in a fixed order so the result does not depend on timing
+	for (size_t buffer = 0; buffer < f->n_buffers; buffer++) {
+		double* restrict velocity_x = force_buffer(f, buffer, 0);
+		double* restrict velocity_y = force_buffer(f, buffer, 1);
+		double* restrict velocity_z = force_buffer(f, buffer, 2);
+		for (size_t i = start; i < end; i++) {
+			b->velocity_x[i] += velocity_x[i];
+			b->velocity_y[i] += velocity_y[i];
+			b->velocity_z[i] += velocity_z[i];
+			velocity_x[i] = velocity_y[i] = velocity_z[i] = 0.0;
 		}
-		// The total sum of the velocity so far
-		register double x = bodies[i]->x, y = bodies[i]->y, z = bodies[i]->z;
-		register double velocity_x = 0, velocity_y = 0, velocity_z = 0;
-		register double mass = bodies[i]->mass;
+	}
 
-		// Loop through every other j
-		for (size_t j = 0; j < len; j++) {
+	// Every force used the old positions so this thread's bodies can move
+	for (size_t i = start; i < end; i++) {
+		b->x[i] += b->velocity_x[i] * dt;
+		b->y[i] += b->velocity_y[i] * dt;
+		b->z[i] += b->velocity_z[i] * dt;
+	}
 
-			// Skip if it is the same
-			if (j == i || bodies[j] == NULL || bodies[i] == NULL) {
-				continue;
-			}
+	// The tiles are only read before the barrier so they can be updated here
+	body_tiles_pack(t, b, start, end);
+}
 
-			// Get the distance and the magnitude between the two bodies
-			double dist = distance(bodies[j]->x, x, bodies[j]->y, y, bodies[j]->z, z);
-			if (dist == 0.0) {
-				dist = 0.2;
-			}
-			double mag = magnitude(bodies[j], bodies[i], dist);
 
-			// Calculate the updated velocities
-			velocity_x += ((bodies[j]->x - x)/dist) * mag / mass * dt;
-		       	velocity_y += ((bodies[j]->y - y)/dist) * mag / mass * dt;
-			velocity_z += ((bodies[j]->z - z)/dist) * mag / mass * dt;
+/**
+ * One task of the parallel energy, a square block of the pair triangle
+ * Tasks run along the block rows, I <= J, the diagonal blocks hold half the
+ * pairs and also add the kinetic energy of their bodies
+ * @param arg, the energy job
+ * @param id, the thread running the task
+ * @param task, the block
+ */
+static void energy_task(void* arg, size_t id, size_t task) {
+	const struct energy_job* job = arg;
+	const struct bodies* b = job->bodies;
+	size_t row = 0, column = task;
+	while (column >= job->n_blocks - row) {
+		column -= job->n_blocks - row;
+		row++;
+	}
+	column += row;
+
+	size_t i_start = row * job->block, i_end = i_start + job->block < b->n_bodies ? i_start + job->block : b->n_bodies;
+	size_t j_start = column * job->block, j_end = j_start + job->block < b->n_bodies ? j_start + job->block : b->n_bodies;
+	double kinetic = 0.0;
+	if (row == column) {
+		for (size_t i = i_start; i < i_end; i++) {
+			kinetic += b->mass[i] * (b->velocity_x[i] * b->velocity_x[i] + b->velocity_y[i] * b->velocity_y[i] + b->velocity_z[i] * b->velocity_z[i]) / 2;
 		}
+	}
+	job->results[task] = kinetic - GCONST * force_potential(b, i_start, i_end, j_start, j_end);
+}
 
-		if (bodies[i] == NULL) {
-			continue;
-		}
 
-		// Set the old velocities to the updated ones
-		bodies[i]->velocity_x += velocity_x;
-		bodies[i]->velocity_y += velocity_y;
-		bodies[i]->velocity_z += velocity_z;
+/**
+ * Calculate the total energy of the simulation, called by every thread of a pool
+ * The pair triangle is cut into square blocks that the threads steal from
+ * each other and sum with the selected kernel, each block's energy is kept
+ * apart and thread 0 sums them in order so the total does not depend on
+ * which thread ran a block or on the number of threads
+ * @param b, the body store
+ * @param pool, the pool running the job
+ * @param id, the thread
+ * @return the total energy on thread 0 and 0.0 on the others, or -1.0 if invalid
+ */
+double bodies_energy_parallel(const struct bodies* b, struct thread_pool* pool, size_t id) {
 
+	// Return if the parameters are invalid
+	if (b == NULL || b->n_bodies == 0 || pool == NULL) {
+		return -1.0;
 	}
-	// Wait for the barrier
-	pthread_barrier_wait(barrier);
-	// Loop through all the bodies and update their values after all threads have finished
-	for (size_t i = start; i < end; i++) {
-		if (bodies[i] == NULL) {
-			continue;
-		}
-		update_body_position(bodies[i], dt);
+
+	// Blocks are whole tiles and few enough for one result each
+	size_t block = (b->n_bodies + ENERGY_BLOCKS - 1) / ENERGY_BLOCKS;
+	block = (block + TILE_WIDTH - 1) / TILE_WIDTH * TILE_WIDTH;
+	size_t n_blocks = (b->n_bodies + block - 1) / block;
+	size_t n_tasks = n_blocks * (n_blocks + 1) / 2;
+	struct energy_job job = { .bodies = b, .block = block, .n_blocks = n_blocks, .results = pool->results };
+	pool_steal(pool, id, id * n_tasks / pool->n_threads, (id + 1) * n_tasks / pool->n_threads, energy_task, &job);
+	if (id != 0) {
+		return 0.0;
 	}
+
+	double energy = 0.0;
+	for (size_t task = 0; task < n_tasks; task++) {
+		energy += pool->results[task];
+	}
+	return energy;
 }
 
 
 /**
  * Calculate the total energy of the simulation
- * @param bodies, the struct of all bodies
- * @param len, the length of the bodies array
- * @param start, the start index 
+ * The kinetic energy of [start, end) and the potential of every pair (i, j > i) is summed
+ * @param b, the body store
+ * @param start, the start index
  * @param end, the end index
  * @return the total energy of the system, or -1.0 if invalid
  */
-double energy(struct body** bodies, size_t len, size_t start, size_t end) {
+double bodies_energy(const struct bodies* b, size_t start, size_t end) {
 
 	// Return if the parameters are invalid
-	if (bodies == NULL || len <= 0 || start >= end) {
+	if (b == NULL || b->n_bodies == 0 || start >= end || end > b->n_bodies) {
 		return -1.0;
 	}
 
+	const double* restrict bx = b->x;
+	const double* restrict by = b->y;
+	const double* restrict bz = b->z;
+	const double* restrict m = b->mass;
+	size_t len = b->n_bodies;
+
 	register double energy = 0.0;
 	// Loop through all the bodies
 	for (size_t i = start; i < end; i++) {
-		if (bodies[i] == NULL) {
-			continue;
-		}
-		double mass = bodies[i]->mass;
-		register double x = bodies[i]->x, y = bodies[i]->y, z = bodies[i]->z;
-		energy += (mass * (bodies[i]->velocity_x * bodies[i]->velocity_x + bodies[i]->velocity_y * bodies[i]->velocity_y +  bodies[i]->velocity_z * bodies[i]->velocity_z) / 2);
+		register double mass = m[i];
+		register double x = bx[i], y = by[i], z = bz[i];
+		register double potential = 0.0;
+		energy += (mass * (b->velocity_x[i] * b->velocity_x[i] + b->velocity_y[i] * b->velocity_y[i] + b->velocity_z[i] * b->velocity_z[i]) / 2);
 		for (size_t j = i + 1; j < len; j++) {
-			energy -= GCONST * (mass * bodies[j]->mass) / distance(bodies[j]->x, x, bodies[j]->y, y, bodies[j]->z, z);
+			double dist = distance(bx[j], x, by[j], y, bz[j], z);
+			if (dist == 0.0) {
+				dist = MIN_DISTANCE;
+			}
+			potential += m[j] / dist;
 		}
+		energy -= GCONST * mass * potential;
 	}
 
 	return energy;
@@ -223,18 +258,165 @@ double energy(struct body** bodies, size_t len, size_t start, size_t end) {
 
 
 /**
- * The worker function for the threads
- * @param arg, the thread data structure
+ * Calculate the velocity of the body from all other bodies and update the positions in the process
+ * Adapter for the struct body API, the bodies are copied into a body store and stepped with the selected kernel
+ * @param bodies, the struct array of all the bodies
+ * @param len, the length of the struct array of bodies
+ * @param dt, the change in time
+ */
+void step(struct body** bodies, size_t len, double dt) {
+
+	// Check if the parameters are invalid
+	if (bodies == NULL || len == 0) {
+		return;
+	}
+
+	struct bodies* b = bodies_from_structs(bodies, len);
+	struct body_tiles* t = body_tiles_create(len);
+	bodies_step_tiled(b, t, dt);
+	bodies_to_structs(b, bodies);
+	body_tiles_destroy(t);
+	bodies_destroy(b);
+}
+
+
+/**
+ * Calculate the total energy of the simulation
+ * Adapter for the struct body API, the bodies are copied into a body store
+ * @param bodies, the struct of all bodies
+ * @param len, the length of the bodies array
+ * @param start, the start index 
+ * @param end, the end index
+ * @return the total energy of the system, or -1.0 if invalid
  */
-void* worker(void* arg) {
-	struct thread_data* tdata = (struct thread_data*)arg;
-	tdata->initial_energy = energy(tdata->bodies, tdata->n_bodies, tdata->start, tdata->end);
-	while (tdata->iterations-- > 0) {
-		pthread_barrier_wait(tdata->barrier);
-		step_parallel(tdata->bodies, tdata->n_bodies, tdata->start, tdata->end, tdata->dt, tdata->barrier);
-	}
-	tdata->final_energy = energy(tdata->bodies, tdata->n_bodies, tdata->start, tdata->end);
-	return NULL;
+double energy(struct body** bodies, size_t len, size_t start, size_t end) {
+
+	// Return if the parameters are invalid
+	if (bodies == NULL || len <= 0 || start >= end || end > len) {
+		return -1.0;
+	}
+
+	struct bodies* b = bodies_from_structs(bodies, len);
+	double e = bodies_energy(b, start, end);
+	bodies_destroy(b);
+	return e;
+}
+
+
+/**
+ * The worker function for the threads, run as a job of the pool
+ * The energy is measured when the schedule asks for it, thread 0 records it
+ * and is given the first and last energies of the whole system, the others 0,
+ * every thread copies its slice of a trajectory frame when one is due and
+ * writes its slice of a checkpoint after the energy when one is due,
+ * an engine with run is given every step up to the next one that may be measured, captured or checkpointed
+ * A run resumed from a checkpoint starts at first, whose energy was measured before the checkpoint
+ * @param arg, the thread data of every thread
+ * @param id, the thread
+ */
+void worker(void* arg, size_t id) {
+	struct thread_data* tdata = (struct thread_data*)arg + id;
+	struct energy_schedule* schedule = tdata->schedule;
+	struct trajectory* trajectory = tdata->trajectory;
+	struct checkpoint* checkpoint = tdata->checkpoint;
+
+	// An engine that runs several steps at once only stops where the energy, a frame or a checkpoint may be due
+	if (tdata->engine->run != NULL) {
+		for (size_t step = tdata->first; ; ) {
+			int capture = trajectory_due(trajectory, step, tdata->iterations);
+			if (id == 0 && schedule != NULL) {
+				schedule->due[0] = energy_due(schedule, step, tdata->iterations) && (step == 0 || step != tdata->first);
+			}
+			if (id == 0 && capture) {
+				trajectory_acquire(trajectory, step, step * tdata->dt);
+			}
+			if (id == 0 && checkpoint != NULL) {
+				checkpoint->due[step % 3] = checkpoint_due(checkpoint, step, tdata->first, tdata->iterations);
+				if (checkpoint->due[step % 3]) {
+					checkpoint_acquire(checkpoint, tdata->bodies, step, tdata->engine, tdata->state);
+				}
+			}
+			pool_wait(tdata->pool);
+
+			if (capture) {
+				trajectory_copy(trajectory, tdata->bodies, tdata->n_threads, tdata->start, tdata->end);
+			}
+
+			int due = schedule != NULL ? schedule->due[0]
+					: energy_due(NULL, step, tdata->iterations) && (step == 0 || step != tdata->first);
+			if (due) {
+				double energy = energy_measure(schedule, tdata->bodies, tdata->engine, tdata->state, tdata->pool, id, step);
+				if (id == 0) {
+					energy_record(schedule, step, step * tdata->dt, energy);
+					tdata->initial_energy = step == 0 ? energy : tdata->initial_energy;
+					tdata->final_energy = energy;
+				}
+			}
+			int save = checkpoint != NULL ? checkpoint->due[step % 3] : CHECKPOINT_NONE;
+			if (save) {
+				checkpoint_copy(checkpoint, id, tdata->n_threads, tdata->start, tdata->end);
+			}
+			if (step == tdata->iterations || save == CHECKPOINT_STOP) {
+				return;
+			}
+			size_t next = energy_next(schedule, step, tdata->iterations);
+			next = trajectory_next(trajectory, step, next);
+			next = checkpoint_next(checkpoint, step, next);
+			tdata->engine->run(tdata->state, tdata->bodies, tdata->id, tdata->n_threads, next - step, tdata->dt,
+					tdata->pool, schedule != NULL && schedule->from_force);
+			step = next;
+		}
+	}
+
+	for (size_t step = tdata->first; ; step++) {
+		// Thread 0 decides for every thread so a wall clock cadence stays in step, a step ahead so a
+		// step whose end is measured can sum the potential while it computes the forces
+		int capture = trajectory_due(trajectory, step, tdata->iterations);
+		if (id == 0 && schedule != NULL) {
+			if (step == tdata->first) {
+				schedule->due[step % 3] = energy_due(schedule, step, tdata->iterations) && step == 0;
+			}
+			schedule->due[(step + 1) % 3] = energy_due(schedule, step + 1, tdata->iterations);
+		}
+		if (id == 0 && capture) {
+			trajectory_acquire(trajectory, step, step * tdata->dt);
+		}
+		if (id == 0 && checkpoint != NULL) {
+			checkpoint->due[step % 3] = checkpoint_due(checkpoint, step, tdata->first, tdata->iterations);
+			if (checkpoint->due[step % 3]) {
+				checkpoint_acquire(checkpoint, tdata->bodies, step, tdata->engine, tdata->state);
+			}
+		}
+		pool_wait(tdata->pool);
+
+		// Positions only change after the barriers inside the step, so each slice is copied before it moves
+		if (capture) {
+			trajectory_copy(trajectory, tdata->bodies, tdata->n_threads, tdata->start, tdata->end);
+		}
+
+		int due = schedule != NULL ? schedule->due[step % 3]
+				: energy_due(NULL, step, tdata->iterations) && (step == 0 || step != tdata->first);
+		if (due) {
+			double energy = energy_measure(schedule, tdata->bodies, tdata->engine, tdata->state, tdata->pool, id, step);
+			if (id == 0) {
+				energy_record(schedule, step, step * tdata->dt, energy);
+				tdata->initial_energy = step == 0 ? energy : tdata->initial_energy;
+				tdata->final_energy = energy;
+			}
+		}
+
+		// The checkpoint follows the energy so a resumed run does not measure its first step again
+		int save = checkpoint != NULL ? checkpoint->due[step % 3] : CHECKPOINT_NONE;
+		if (save) {
+			checkpoint_copy(checkpoint, id, tdata->n_threads, tdata->start, tdata->end);
+		}
+		if (step == tdata->iterations || save == CHECKPOINT_STOP) {
+			break;
+		}
+		int with_potential = schedule != NULL && schedule->from_force && schedule->due[(step + 1) % 3];
+		tdata->engine->step(tdata->state, tdata->bodies, tdata->id, tdata->n_threads,
+				tdata->start, tdata->end, tdata->dt, tdata->pool, with_potential);
+	}
 }
 
 
@@ -247,7 +429,7 @@ void compare_energy(double initial_energy, double final_energy) {
 
 	// Compare energy states after and before calls to step
 	printf("Initial energy of system: %f\n", initial_energy);
-	printf("Final energy of system: %f\n", initial_energy);
+	printf("Final energy of system: %f\n", final_energy);
 	// Check whether final and initial energy of the system match
 	if (initial_energy - final_energy < 0.01) {
 	  printf("Equal energy states after.\n");
@@ -260,62 +442,71 @@ void compare_energy(double initial_energy, double final_energy) {
 
 
 /**
- * Generate the array of struct bodies
+ * Generate a body store of random bodies, the same bodies on every call
+ * Adapter for the original uniform box around bodies_generate
  * @param n_bodies, the number of bodies 
- * @return bodies struct array containing all randomly generated bodies
+ * @return the body store containing all randomly generated bodies
  */
-struct body** gen_random_bodies(size_t n_bodies) {
+struct bodies* bodies_gen_random(size_t n_bodies) {
+	return bodies_generate("random", n_bodies, GENERATE_SEED, 1);
+}
+
 
-	// If the parameter is invalid
-	if (n_bodies <= 0) {
+/**
+ * Read the bodies from a file into a body store
+ * @param file, the file to read from
+ * @param n_bodies, the number of bodies in the file
+ * @return the body store or NULL if invalid
+ */
+struct bodies* bodies_read_file(FILE* file, size_t n_bodies) {
+
+	// Check if the file is invalid
+	if (file == NULL || n_bodies <= 0) {
 		return NULL;
 	}
 
-	// Create and allocate the bodies struct array
-	struct body** bodies = malloc(sizeof(struct body*) * n_bodies);
-
-	srand(time(NULL));
+	// Allocate memory for the body store
+	struct bodies* b = bodies_create(n_bodies);
+	if (b == NULL) {
+		return NULL;
+	}
 
-	// For every single body allocate memory for it and initialise random values
+	// Loop through the file
 	for (size_t i = 0; i < n_bodies; i++) {
-		bodies[i] = malloc(sizeof(struct body));
-		bodies[i]->x = (double)(rand() - RAND_MAX/2);
-		bodies[i]->y = (double)(rand() - RAND_MAX/2);
-		bodies[i]->z = (double)(rand() - RAND_MAX/2);
-		bodies[i]->mass = (double)(rand()/(i + 1));
-		bodies[i]->velocity_x = (double)(rand() - RAND_MAX/2);
-		bodies[i]->velocity_y = (double)(rand() - RAND_MAX/2);
-		bodies[i]->velocity_z = (double)(rand() - RAND_MAX/2);
+		if (fscanf(file, "%lf,%lf,%lf,%lf,%lf,%lf,%lf", b->x + i, b->y + i, b->z + i, b->velocity_x + i, b->velocity_y + i, b->velocity_z + i, b->mass + i) == EOF) {
+			break;
+		}
 	}
+
+	return b;
+}
+
+
+/**
+ * Generate the array of struct bodies
+ * Adapter for the struct body API around bodies_gen_random
+ * @param n_bodies, the number of bodies 
+ * @return bodies struct array containing all randomly generated bodies
+ */
+struct body** gen_random_bodies(size_t n_bodies) {
+	struct bodies* b = bodies_gen_random(n_bodies);
+	struct body** bodies = bodies_to_new_structs(b);
+	bodies_destroy(b);
 	return bodies;
 }
 
 
 /**
  * Read the bodies from a file into a bodies struct array 
- * @param file_name, the name of the file
+ * Adapter for the struct body API around bodies_read_file
+ * @param file, the file to read from
+ * @param n_bodies, the number of bodies in the file
  * @return bodies, the struct array of bodies or NULL if invalid
  */
 struct body** read_file(FILE* file, size_t n_bodies) {
-
-	// Check if the filename is invalid
-	if (file == NULL || n_bodies <= 0) {
-		return NULL;
-	}
-
-	// Allocate memory for the bodies array struct
-	struct body** bodies = malloc(sizeof(struct body*) * n_bodies);
-
-	int r = 1;
-	int i = 0;
-
-	// Loop through the files
-	while (r != EOF && i < n_bodies) {
-		bodies[i] = malloc(sizeof(struct body));
-		fscanf(file, "%lf,%lf,%lf,%lf,%lf,%lf,%lf", &(bodies[i]->x), &(bodies[i]->y), &(bodies[i]->z), &(bodies[i]->velocity_x), &(bodies[i]->velocity_y), &(bodies[i]->velocity_z), &(bodies[i]->mass));
-		i++;
-	}
-
+	struct bodies* b = bodies_read_file(file, n_bodies);
+	struct body** bodies = bodies_to_new_structs(b);
+	bodies_destroy(b);
 	return bodies;
 }
 
@@ -21,6 +21,823 @@
 double distance(double x1, double x2, double y1, double y2, double z1, double z2);
 
 
+/**
+ * Allocate a structure of arrays body store with every array aligned to a cache line
+ * All values are zero initialised
+ * @param n_bodies, the number of bodies
+ * @return the body store or NULL if invalid
+ */
+struct bodies* bodies_create(size_t n_bodies);
+
+
+/**
+ * Clear up all memory associated with the body store
+ * @param b, the body store
+ */
+void bodies_destroy(struct bodies* b);
+
+
+/**
+ * Find the bodies one thread of a run steps, every slice but the first starts
+ * on a whole cache line of the body arrays so two threads moving their own
+ * bodies never write the same line
+ * @param n_bodies, the number of bodies
+ * @param n_threads, the number of threads
+ * @param id, the thread
+ * @param start, set to the first body of the thread
+ * @param end, set to one past the last body of the thread
+ */
+void bodies_slice(size_t n_bodies, size_t n_threads, size_t id, size_t* start, size_t* end);
+
+
+/**
+ * Select the pages that back the body stores created after this call
+ * @param name, normal, thp for transparent huge pages or huge for explicit huge pages
+ * @return 0 if selected or 1 if it is unknown
+ */
+int bodies_pages_select(const char* name);
+
+
+/**
+ * Get the name of the pages that back a body store
+ * @param b, the body store
+ * @return normal, thp, huge or file
+ */
+const char* bodies_pages_name(const struct bodies* b);
+
+
+/**
+ * Keep the next body store created in a snapshot file instead of memory,
+ * the file is mapped shared so a store larger than memory is paged to it,
+ * and when the store is destroyed the file is left as its snapshot
+ * @param path, the path of the file, replaced if it exists
+ * @return 0 if selected or 1 if invalid
+ */
+int bodies_store_select(const char* path);
+
+
+/**
+ * Move a body store into the file selected by bodies_store_select, a store
+ * mapped from a snapshot only reads its file so its pages stay clean
+ * @param b, the body store, destroyed when moved
+ * @return the store in the file, b when no file is selected or NULL if it cannot be created
+ */
+struct bodies* bodies_to_store(struct bodies* b);
+
+
+/**
+ * Ask the kernel to read the positions and masses of [start, end) of a store
+ * kept in a file ahead of their use, stores in memory are left alone
+ * @param b, the body store
+ * @param start, the first body
+ * @param end, one past the last body
+ */
+void bodies_read_ahead(const struct bodies* b, size_t start, size_t end);
+
+
+/**
+ * Start writing [start, end) of n_arrays arrays from array back to the file
+ * of a store kept in one, without waiting, stores in memory are left alone
+ * Written pages are clean so the kernel can drop them without writing them
+ * @param b, the body store
+ * @param array, the first array, 0 for x up to 6 for mass
+ * @param n_arrays, the number of arrays
+ * @param start, the first body
+ * @param end, one past the last body
+ */
+void bodies_write_back(const struct bodies* b, size_t array, size_t n_arrays, size_t start, size_t end);
+
+
+/**
+ * Move a body store into memory first touched by the threads of a pool
+ * Each thread copies its slice from bodies_slice, so with pinned threads
+ * the pages of a slice land on the node of the thread that steps it
+ * @param b, the body store
+ * @param p, the pool
+ * @return 0 if moved or 1 if invalid, kept in a file or out of memory, the store is unchanged then
+ */
+int bodies_place(struct bodies* b, struct thread_pool* p);
+
+
+/**
+ * Copy an array of struct body pointers into a new body store
+ * NULL entries are stored as massless bodies at the origin
+ * @param bodies, the struct array of bodies
+ * @param n_bodies, the number of bodies
+ * @return the body store or NULL if invalid
+ */
+struct bodies* bodies_from_structs(struct body** bodies, size_t n_bodies);
+
+
+/**
+ * Copy the body store back into an array of struct body pointers
+ * NULL entries are skipped
+ * @param b, the body store
+ * @param bodies, the struct array of bodies to write into
+ */
+void bodies_to_structs(const struct bodies* b, struct body** bodies);
+
+
+/**
+ * Allocate a new struct body array holding a copy of the body store
+ * @param b, the body store
+ * @return the struct array of bodies or NULL if invalid
+ */
+struct body** bodies_to_new_structs(const struct bodies* b);
+
+
+/**
+ * Allocate zeroed velocity change buffers for the symmetric parallel step
+ * Each buffer holds x, y and z arrays padded and aligned like the body store
+ * @param n_buffers, the number of buffers, one per thread
+ * @param n_bodies, the number of bodies
+ * @return the buffers or NULL if invalid
+ */
+struct force_buffers* force_buffers_create(size_t n_buffers, size_t n_bodies);
+
+
+/**
+ * Get one of the x, y or z arrays of a buffer
+ * @param f, the buffers
+ * @param buffer, the index of the buffer
+ * @param axis, 0 for x, 1 for y and 2 for z
+ * @return the array of the axis
+ */
+double* force_buffer(const struct force_buffers* f, size_t buffer, size_t axis);
+
+
+/**
+ * Clear up all memory associated with the buffers
+ * @param f, the buffers
+ */
+void force_buffers_destroy(struct force_buffers* f);
+
+
+/**
+ * Allocate the tiled view of a body store, padding lanes have zero mass
+ * @param n_bodies, the number of bodies to hold
+ * @return the tiles or NULL if invalid
+ */
+struct body_tiles* body_tiles_create(size_t n_bodies);
+
+
+/**
+ * Clear up all memory associated with the tiles
+ * @param t, the tiles
+ */
+void body_tiles_destroy(struct body_tiles* t);
+
+
+/**
+ * Copy the positions and masses of [start, end) into the tiles
+ * Threads packing disjoint ranges never write the same lane
+ * @param t, the tiles
+ * @param b, the body store
+ * @param start, the first body to copy
+ * @param end, one past the last body to copy
+ */
+void body_tiles_pack(struct body_tiles* t, const struct bodies* b, size_t start, size_t end);
+
+
+/**
+ * Copy the positions and masses of [start, end) into the first lanes of the
+ * tiles, the lanes after have zero mass so they pull on nothing
+ * @param t, the tiles, holding at least end - start bodies
+ * @param b, the body store
+ * @param start, the first body to copy
+ * @param end, one past the last body to copy
+ */
+void body_tiles_load(struct body_tiles* t, const struct bodies* b, size_t start, size_t end);
+
+
+/**
+ * Find a force kernel by name that the CPU can run
+ * @param name, the name of the kernel or "auto" for the widest supported one
+ * @return the kernel or NULL if it is unknown or not supported
+ */
+const struct force_kernel* force_kernel_find(const char* name);
+
+
+/**
+ * Select the force kernel used by every step
+ * @param name, the name of the kernel or "auto" for the widest supported one
+ * @return 0 if selected or 1 if it is unknown or not supported
+ */
+int force_kernel_select(const char* name);
+
+
+/**
+ * Get the selected force kernel, detecting the widest one on first use
+ * @return the force kernel
+ */
+const struct force_kernel* force_kernel_active(void);
+
+
+/**
+ * Select the accuracy of 1 / r^3 used by every step
+ * @param name, one of exact, rsqrt1 or rsqrt2
+ * @return 0 if selected or 1 if it is unknown
+ */
+int force_precision_select(const char* name);
+
+
+/**
+ * Get the selected accuracy of 1 / r^3
+ * @return the force precision
+ */
+const struct force_precision* force_precision_active(void);
+
+
+/**
+ * Add the acceleration of [start, end) to its velocity with the selected kernel and precision
+ * @param t, the tiles holding the positions of every body
+ * @param b, the body store whose velocities are updated
+ * @param start, the first body to update
+ * @param end, one past the last body to update
+ * @param dt, the change in time
+ */
+void force_kick(const struct body_tiles* t, struct bodies* b, size_t start, size_t end, double dt);
+
+
+/**
+ * Measure the error of the selected kernel and precision against the exact scalar kernel
+ * The acceleration of up to samples bodies spread over the store is compared
+ * @param b, the body store, velocities are left unchanged
+ * @param t, the tiles of the body store, packed by this call
+ * @param samples, the maximum number of bodies to compare
+ * @param rms_error, set to the root mean square relative error if not NULL
+ * @return the maximum relative error of the force or -1.0 if invalid
+ */
+double force_error(struct bodies* b, struct body_tiles* t, size_t samples, double* rms_error);
+
+
+/**
+ * Update the velocities of both bodies of every pair (i, j > i) with i in [row_start, row_end)
+ * using the selected kernel, the pairs are walked in the cache blocks of cache_block_sizes
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param row_start, the first i body
+ * @param row_end, one past the last i body
+ * @param dt, the change in time
+ */
+void force_pair_rows(const struct body_tiles* t, double* velocity_x, double* velocity_y, double* velocity_z, size_t row_start, size_t row_end, double dt);
+
+
+/**
+ * Update the velocities of both bodies of every pair (i, j > i) with i in [row_start, row_end)
+ * as force_pair_rows does and sum their potential in the same pass
+ * The distances are the ones the forces use so with an rsqrt precision the potential is approximate as well
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param row_start, the first i body
+ * @param row_end, one past the last i body
+ * @param dt, the change in time
+ * @return the sum of m_i * m_j / r over the pairs
+ */
+double force_pair_rows_potential(const struct body_tiles* t, double* velocity_x, double* velocity_y, double* velocity_z,
+		size_t row_start, size_t row_end, double dt);
+
+
+/**
+ * Update the velocities of both bodies of every pair (i, j > i) with i in [i_start, i_end)
+ * and j in [j_start, j_end) using the selected kernel, the block is walked in the cache
+ * blocks of cache_block_sizes, only the velocities and tiles of the two ranges are touched
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @param dt, the change in time
+ * @param with_potential, 1 to also sum m_i * m_j / r over the pairs
+ * @return the sum of the potential, 0.0 without with_potential or if invalid
+ */
+double force_pair_block(const struct body_tiles* t, double* velocity_x, double* velocity_y, double* velocity_z,
+		size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int with_potential);
+
+
+/**
+ * Sum m_i * m_j / r over the pairs (i, j > i) with i in [i_start, i_end) and j in [j_start, j_end)
+ * using the selected kernel, the block is walked in the cache blocks of cache_block_sizes
+ * in a fixed order so the same block always gives the same sum
+ * @param b, the body store, its arrays padded with massless bodies
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @return the sum of the block or 0.0 if invalid
+ */
+double force_potential(const struct bodies* b, size_t i_start, size_t i_end, size_t j_start, size_t j_end);
+
+
+/**
+ * Step the simulation with the selected force kernel
+ * Every pair is visited once and both bodies are updated
+ * @param b, the body store
+ * @param t, the tiles of the body store
+ * @param dt, the change in time
+ */
+void bodies_step_tiled(struct bodies* b, struct body_tiles* t, double dt);
+
+
+/**
+ * Read the size of a data or unified cache of the first cpu from sysfs
+ * @param level, the cache level, 1 for L1 and so on
+ * @return the size of the cache in bytes or 0 if unknown
+ */
+size_t cache_size(int level);
+
+
+/**
+ * Choose the block sizes of the cache blocked symmetric step
+ * A j block with its velocities fills half of L1 and an i block fills half
+ * of L2 so the j block is reused by every body of the i block from L1
+ * The sizes are detected once by whichever thread asks first and reused after
+ * @param i_block, set to the number of bodies in an i block
+ * @param j_block, set to the number of bodies in a j block
+ */
+void cache_block_sizes(size_t* i_block, size_t* j_block);
+
+
+/**
+ * List the cpus the process may run on with the node of each, node by node
+ * The cpus are the ones allowed when first asked, so threads pinned since do
+ * not shrink the list, without NUMA information in sysfs every cpu is on node 0
+ * @param cpus, set to the cpus, CPU_SETSIZE long
+ * @param nodes, set to the node of each cpu, CPU_SETSIZE long
+ * @return the number of cpus
+ */
+size_t topology_cpus(int* cpus, int* nodes);
+
+
+/**
+ * Find the node holding the page of an address
+ * @param address, the address, its page must have been touched
+ * @return the node or -1 if unknown
+ */
+int topology_node_of(const void* address);
+
+
+/**
+ * Print where each thread of a pool runs and the node of its slice of the bodies
+ * @param p, the pool
+ * @param b, the body store, sliced by bodies_slice
+ */
+void placement_report(const struct thread_pool* p, const struct bodies* b);
+
+
+/**
+ * Start a pool of threads placed as pool_pin_select asked
+ * @param n_threads, the number of threads that run each job
+ * @return the pool or NULL if invalid
+ */
+struct thread_pool* pool_create(size_t n_threads);
+
+
+/**
+ * Start a pool of threads that float, for work beside the simulation such
+ * as the trajectory writer, so it never takes the cores of the pinned pool
+ * or pins the thread that starts it
+ * @param n_threads, the number of threads that run each job
+ * @return the pool or NULL if invalid
+ */
+struct thread_pool* pool_create_unpinned(size_t n_threads);
+
+
+/**
+ * Stop the threads and clear up all memory associated with the pool
+ * @param p, the pool
+ */
+void pool_destroy(struct thread_pool* p);
+
+
+/**
+ * Run a job on every thread of the pool and wait for all of them
+ * The job is called once per thread with its id, the caller being thread 0,
+ * and may wait on the pool's barrier
+ * @param p, the pool
+ * @param job, the job
+ * @param arg, the argument passed to every call of the job
+ */
+void pool_run(struct thread_pool* p, void (*job)(void* arg, size_t id), void* arg);
+
+
+/**
+ * Run a range of tasks with work stealing, called by every thread of a job
+ * Each thread starts on its own range, the ranges together covering every
+ * task once, and takes tasks from the front of it, a thread that runs out
+ * takes the back half of another thread's range, so slow threads and
+ * expensive tasks do not leave the others waiting, every task has run on
+ * some thread when this returns
+ * @param p, the pool
+ * @param id, the thread
+ * @param first, the first task of this thread's range
+ * @param last, one past the last task of this thread's range
+ * @param task, the task, called with the thread that runs it
+ * @param arg, the argument passed to every task
+ */
+void pool_steal(struct thread_pool* p, size_t id, size_t first, size_t last, void (*task)(void* arg, size_t id, size_t task), void* arg);
+
+
+/**
+ * Wait until every thread of the pool has reached the barrier
+ * The spin barrier reads the epoch before arriving, the last thread to arrive
+ * resets the count and moves the epoch on, which releases the others, so a
+ * fast thread arriving for the next phase can never be confused with this one
+ * @param p, the pool or NULL for a single thread that never waits
+ */
+void pool_wait(struct thread_pool* p);
+
+
+/**
+ * Select the barrier of pools created after this call
+ * @param name, spin for the atomic spin then yield barrier or pthread
+ * @return 0 if selected or 1 if it is unknown
+ */
+int pool_barrier_select(const char* name);
+
+
+/**
+ * Get the name of a pool's barrier
+ * @param p, the pool
+ * @return spin or pthread
+ */
+const char* pool_barrier_name(const struct thread_pool* p);
+
+
+/**
+ * Select how the threads of pools created after this call are placed
+ * @param name, none to let them float, cores to pin each to a cpu or nodes to pin each to the cpus of a node
+ * @return 0 if selected or 1 if it is unknown
+ */
+int pool_pin_select(const char* name);
+
+
+/**
+ * Get how the threads of a pool are placed
+ * @param p, the pool
+ * @return none, cores or nodes
+ */
+const char* pool_pin_name(const struct thread_pool* p);
+
+
+/**
+ * Wait a moment for another thread, spinning while every thread of the pool has
+ * a cpu and yielding once the rounds run out or the cpus are shared
+ * @param p, the pool
+ * @param round, how many times this thread has waited in a row
+ */
+void pool_pause(const struct thread_pool* p, size_t round);
+
+
+/**
+ * Allocate the lanes of a pool's threads
+ * @param n_lanes, the number of lanes, one per thread
+ * @return the lanes, every one empty, or NULL if invalid
+ */
+struct pool_lane* pool_lanes_create(size_t n_lanes);
+
+
+/**
+ * Give a lane its tasks, no thread may use it at the same time
+ * @param l, the lane
+ * @param first, the first task
+ * @param end, one past the last task
+ */
+void pool_lane_reset(struct pool_lane* l, size_t first, size_t end);
+
+
+/**
+ * Whether every task of a lane has run
+ * @param l, the lane
+ * @return 1 if done, 0 if tasks are left
+ */
+int pool_lane_done(struct pool_lane* l);
+
+
+/**
+ * Try to take a lane to run its next task, without waiting for it
+ * A taken lane is kept from every other thread until pool_lane_leave, and
+ * what the threads before wrote for its tasks is visible
+ * @param l, the lane
+ * @param task, set to the next task of the lane
+ * @return 1 if taken, 0 if another thread has it or it is done
+ */
+int pool_lane_enter(struct pool_lane* l, size_t* task);
+
+
+/**
+ * Give back a lane taken with pool_lane_enter
+ * @param l, the lane
+ * @param ran, 1 if its next task was run, 0 if it was left for later
+ */
+void pool_lane_leave(struct pool_lane* l, int ran);
+
+
+/**
+ * Allocate the Barnes-Hut state for a body store and a number of threads
+ * @param b, the body store
+ * @param n_threads, the number of threads that will call bh_step
+ * @param params, the engine parameters, theta is the opening angle
+ * @return the state or NULL if invalid
+ */
+void* bh_create(const struct bodies* b, size_t n_threads, const struct engine_params* params);
+
+
+/**
+ * Clear up all memory associated with the Barnes-Hut state
+ * @param state, the state
+ */
+void bh_destroy(void* state);
+
+
+/**
+ * Barnes-Hut step of one thread, the tree is rebuilt by every thread and
+ * walked in runs of bodies in tree order that the threads steal from each
+ * other, then this thread's bodies are moved
+ * @param state, the Barnes-Hut state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, unused, the tree keeps no potential
+ */
+void bh_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential);
+
+
+/**
+ * Allocate the fast multipole state for a body store and a number of threads
+ * @param b, the body store
+ * @param n_threads, the number of threads that will call fmm_step
+ * @param params, the engine parameters, theta is the opening angle of the
+ * well separated test and order the order of the expansions
+ * @return the state or NULL if invalid
+ */
+void* fmm_create(const struct bodies* b, size_t n_threads, const struct engine_params* params);
+
+
+/**
+ * Clear up all memory associated with the fast multipole state
+ * @param state, the state
+ */
+void fmm_destroy(void* state);
+
+
+/**
+ * Fast multipole step of one thread, once every bucket is evaluated the
+ * bodies of this thread's starting buckets are kicked, then its own bodies move
+ * @param state, the fmm state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, unused, the potential is always evaluated
+ */
+void fmm_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential);
+
+
+/**
+ * Potential energy of the last step's evaluation, each pair counted once
+ * @param state, the fmm state
+ * @return the potential energy
+ */
+double fmm_potential(void* state);
+
+
+/**
+ * Measure the fast multipole error against the direct sum on a sample of bodies
+ * The potential energy of the sampled bodies is computed as energy does
+ * @param b, the body store, left unchanged
+ * @param params, the engine parameters to measure
+ * @param samples, the number of bodies to sample
+ * @param force_rms, set to the rms relative error of the sampled accelerations
+ * @return the relative error of the sampled potential energy or -1.0 if invalid
+ */
+double fmm_error(const struct bodies* b, const struct engine_params* params, size_t samples, double* force_rms);
+
+
+/**
+ * Allocate the particle mesh state for a body store and a number of threads
+ * @param b, the body store, a periodic box is fixed around its positions
+ * @param n_threads, the number of threads that will call pm_step
+ * @param params, the engine parameters, grid is the number of cells per
+ * side, a power of two, and periodic selects the boundary
+ * @return the state or NULL if invalid
+ */
+void* pm_create(const struct bodies* b, size_t n_threads, const struct engine_params* params);
+
+
+/**
+ * Keep the periodic box of a particle mesh so a mesh created again for the
+ * positions it has moved to uses the same box
+ * @param state, the mesh state
+ * @param params, the parameters, origin and box are set when periodic
+ */
+void pm_keep(const void* state, struct engine_params* params);
+
+
+/**
+ * Clear up all memory associated with the particle mesh state
+ * @param state, the state
+ */
+void pm_destroy(void* state);
+
+
+/**
+ * Particle mesh step of one thread, the potential is solved by every
+ * thread and this thread's bodies are kicked and moved, wrapping around
+ * the box when periodic
+ * @param state, the mesh state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, unused, the mesh keeps no potential per body
+ */
+void pm_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential);
+
+
+/**
+ * Allocate the p3m state for a body store and a number of threads
+ * @param b, the body store
+ * @param n_threads, the number of threads that will call p3m_step
+ * @param params, the engine parameters, grid and periodic set the mesh and
+ * split the scale in cells of the long range part, the pairs are cut off
+ * at P3M_CUTOFF times the split which must fit in half the grid
+ * @return the state or NULL if invalid
+ */
+void* p3m_create(const struct bodies* b, size_t n_threads, const struct engine_params* params);
+
+
+/**
+ * Keep the periodic box of the p3m mesh
+ * @param state, the p3m state
+ * @param params, the parameters, origin and box are set when periodic
+ */
+void p3m_keep(const void* state, struct engine_params* params);
+
+
+/**
+ * Clear up all memory associated with the p3m state
+ * @param state, the state
+ */
+void p3m_destroy(void* state);
+
+
+/**
+ * P3M step of one thread, the mesh potential is solved and the bodies are
+ * sorted into cells by every thread, the threads steal shares of the cells
+ * to sum their short range pairs, then each kicks and moves its own bodies
+ * @param state, the p3m state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, unused, the mesh keeps no potential per body
+ */
+void p3m_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential);
+
+
+/**
+ * Allocate the double buffered tiles, the counters and the queue of the dataflow engine
+ * The blocks are a whole number of tiles, small enough that each thread starts
+ * with several rows of tasks and no larger than a j block of cache_block_sizes
+ * @param b, the body store, packed into both tiles
+ * @param n_threads, the number of threads that will call flow_run
+ * @param params, unused
+ * @return the state or NULL if invalid
+ */
+void* flow_create(const struct bodies* b, size_t n_threads, const struct engine_params* params);
+
+
+/**
+ * Clear up all memory associated with the dataflow engine
+ * @param state, the state
+ */
+void flow_destroy(void* state);
+
+
+/**
+ * Dataflow steps of one thread, each thread's lane holds a range of the
+ * tasks for every step in order, and whichever thread runs a task adds it
+ * to the buffer of the lane's thread, a task of the next step starts as soon
+ * as the two blocks it reads have moved, so the steps of a run overlap and
+ * only its start and end wait on the pool's barrier, a thread whose own lane
+ * is done or waiting on a block runs the ready tasks of the other lanes,
+ * a lane runs its tasks one at a time in order so every buffer takes the
+ * same pairs in the same order and a run repeats bit for bit on the same
+ * threads, asked for the potential the first thread sums the shares of the
+ * last step in order
+ * @param state, the dataflow state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param steps, the number of steps
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, 1 to leave the potential energy the last step started from for flow_potential
+ */
+void flow_run(void* state, struct bodies* b, size_t id, size_t n_threads, size_t steps, double dt, struct thread_pool* pool, int with_potential);
+
+
+/**
+ * One dataflow step of one thread, a run of a single step
+ * @param state, the dataflow state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, unused, the blocks are moved by whichever thread finishes them
+ * @param end, unused
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, 1 to leave the potential energy of the starting positions for flow_potential
+ */
+void flow_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential);
+
+
+/**
+ * Potential energy of the positions the last step asked for it started from
+ * @param state, the dataflow state
+ * @return the potential energy
+ */
+double flow_potential(void* state);
+
+
+/**
+ * Allocate the j tiles and shares of the streaming engine
+ * Each thread's j tile is an i block of cache_block_sizes, so it fills half of L2
+ * @param b, the body store
+ * @param n_threads, the number of threads that will call stream_step
+ * @param params, the tile of bodies kept in memory per thread, 0 or NULL for STREAM_TILE
+ * @return the state or NULL if invalid
+ */
+void* stream_create(const struct bodies* b, size_t n_threads, const struct engine_params* params);
+
+
+/**
+ * Clear up all memory associated with the streaming engine
+ * @param state, the state
+ */
+void stream_destroy(void* state);
+
+
+/**
+ * Streaming step of one thread, the bodies of the thread are kicked one i
+ * tile at a time by every j tile of the store in order, each j tile packed
+ * into the thread's own tiles while the window after it is read ahead, so
+ * only an i tile and a j tile need to be in memory and a store kept in a
+ * file is read at the speed of the disk, each i tile's velocities are
+ * written back together once it is done, then after the barrier every
+ * thread moves its bodies and writes its positions back
+ * A body's velocity takes the j tiles in the same order on any number of
+ * threads and tiles, so the positions do not depend on either
+ * @param state, the streaming state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, 1 to leave the potential energy of the starting positions for stream_potential
+ */
+void stream_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential);
+
+
+/**
+ * Potential energy of the positions the last step asked for it started from
+ * @param state, the streaming state
+ * @return the potential energy
+ */
+double stream_potential(void* state);
+
+
+/**
+ * Find an engine by name
+ * @param name, the name of the engine
+ * @return the engine or NULL if unknown
+ */
+const struct engine* engine_find(const char* name);
+
+
 /**
  * Calculate the magnitude between different bodies in the simulation
  * @param b1, the struct of the first body
@@ -30,6 +847,14 @@ double distance(double x1, double x2, double y1, double y2, double z1, double z2
 double magnitude(struct body* b1, struct body* b2, double dist);
 
 
+/**
+* Update the position of the body
+* @param b, the body to be updated
+* @param dt, the amount to step for each iteration
+*/
+void update_body_position(struct body* b, double dt);
+
+
 /**
  * Calculate the velocity of the body from all other bodies and update the positions in the process
  * Function responsible for controlling the simulation
@@ -41,13 +866,53 @@ void step(struct body** bodies, size_t len, double dt);
 
 
 /**
- * Calculate the velocity of the body from all other bodies and update the positions in the process
- * Function responsible for controlling the simulation
- * @param bodies, the struct array of all the bodies
- * @param len, the length of the struct array of bodies
+ * Find the first row of a share of the pair triangle so every share has the same number of pairs
+ * Row i holds the pairs (i, j > i) so early rows hold more pairs than late ones
+ * @param len, the number of bodies
+ * @param n_shares, the number of shares
+ * @param share, the index of the share, n_shares gives len
+ * @return the first row of the share
+ */
+size_t pair_partition(size_t len, size_t n_shares, size_t share);
+
+
+/**
+ * Add every thread's velocity changes to a slice of bodies and move them
+ * Called after a barrier once every pair has been added to the buffers,
+ * the buffers of the slice are cleared for the next step
+ * @param b, the body store
+ * @param t, the tiles shared by all threads
+ * @param f, the velocity change buffers, one per thread
+ * @param start, the first body this thread moves
+ * @param end, one past the last body this thread moves
  * @param dt, the change in time
  */
-void step_parallel(struct body** bodies, size_t len, size_t start, size_t end, double dt, pthread_barrier_t barrier);
+void bodies_merge_parallel(struct bodies* b, struct body_tiles* t, struct force_buffers* f, size_t start, size_t end, double dt);
+
+
+/**
+ * Calculate the total energy of the simulation
+ * The kinetic energy of [start, end) and the potential of every pair (i, j > i) is summed
+ * @param b, the body store
+ * @param start, the start index
+ * @param end, the end index
+ * @return the total energy of the system, or -1.0 if invalid
+ */
+double bodies_energy(const struct bodies* b, size_t start, size_t end);
+
+
+/**
+ * Calculate the total energy of the simulation, called by every thread of a pool
+ * The pair triangle is cut into square blocks that the threads steal from
+ * each other and sum with the selected kernel, each block's energy is kept
+ * apart and thread 0 sums them in order so the total does not depend on
+ * which thread ran a block or on the number of threads
+ * @param b, the body store
+ * @param pool, the pool running the job
+ * @param id, the thread
+ * @return the total energy on thread 0 and 0.0 on the others, or -1.0 if invalid
+ */
+double bodies_energy_parallel(const struct bodies* b, struct thread_pool* pool, size_t id);
 
 
 /**
@@ -62,10 +927,14 @@ double energy(struct body** bodies, size_t len, size_t start, size_t end);
 
 
 /**
- * The worker function for the threads
- * @param arg, the thread data structure
+ * The worker function for the threads, run as a job of the pool
+ * The energy is measured when the schedule asks for it, thread 0 records it
+ * and is given the first and last energies of the whole system, the others 0,
+ * an engine with run is given every step up to the next one that may be measured
+ * @param arg, the thread data of every thread
+ * @param id, the thread
  */
-void* worker(void* arg);
+void worker(void* arg, size_t id);
 
 
 /**
@@ -76,6 +945,120 @@ void* worker(void* arg);
 void compare_energy(double initial_energy, double final_energy);
 
 
+/**
+ * Set how often the energy is measured
+ * @param s, the schedule
+ * @param cadence, end for only the first and last step, a number of steps
+ * or a number of seconds of wall clock followed by s such as 0.5s
+ * @return 0 if set or 1 if the cadence is invalid
+ */
+int energy_schedule_parse(struct energy_schedule* s, const char* cadence);
+
+
+/**
+ * Check whether the energy is measured after a step
+ * The state before the first step and after the last are always measured
+ * @param s, the schedule or NULL to only measure those two
+ * @param step, the number of steps done
+ * @param iterations, the number of steps of the run
+ * @return 1 if it is measured or 0 if not
+ */
+int energy_due(const struct energy_schedule* s, size_t step, size_t iterations);
+
+
+/**
+ * Find the next step after which the energy may be due, the steps before it
+ * can run without looking at the schedule
+ * A wall clock cadence is looked at every ENERGY_SEGMENT steps
+ * @param s, the schedule or NULL to only measure the first and last step
+ * @param step, the number of steps done
+ * @param iterations, the number of steps of the run
+ * @return the step, at most iterations
+ */
+size_t energy_next(const struct energy_schedule* s, size_t step, size_t iterations);
+
+
+/**
+ * Measure the total energy after a step, called by every thread of a pool
+ * With from_force the potential is the one the engine's force pass found for
+ * the positions the step started from, so no pairs are visited again, before
+ * the first step or when the engine keeps no potential the pairs are summed
+ * @param s, the schedule or NULL for the pair sum
+ * @param b, the body store
+ * @param engine, the force engine
+ * @param state, the state of the engine
+ * @param pool, the pool running the job
+ * @param id, the thread
+ * @param step, the number of steps done
+ * @return the total energy on thread 0 and 0.0 on the others, or -1.0 if invalid
+ */
+double energy_measure(const struct energy_schedule* s, const struct bodies* b, const struct engine* engine, void* state,
+		struct thread_pool* pool, size_t id, size_t step);
+
+
+/**
+ * Record a measured energy, the first one is the reference of the drift
+ * A row of step, simulated time, energy and relative drift is written to the log if there is one
+ * @param s, the schedule
+ * @param step, the number of steps done
+ * @param time, the simulated time
+ * @param energy, the total energy
+ */
+void energy_record(struct energy_schedule* s, size_t step, double time, double energy);
+
+
+/**
+ * Print how many times the energy was measured and its largest drift
+ * @param s, the schedule
+ */
+void energy_report(const struct energy_schedule* s);
+
+
+/**
+ * Parse a decimal number of a csv, correctly rounded like strtod in the C locale
+ * A number of at most 2^53 without its point and at most 22 powers of ten
+ * from it is exact in a double, so one multiply or divide rounds it
+ * correctly, up to 19 digits csv_round rounds it with integer products and
+ * any other number is copied out and given to strtod
+ * @param p, the first character, spaces before the number are skipped
+ * @param end, one past the last character that may be read
+ * @param value, set to the number
+ * @return one past the number or NULL if there is no number
+ */
+const char* csv_number(const char* p, const char* end, double* value);
+
+
+/**
+ * Load a csv of bodies, one x,y,z,velocity_x,velocity_y,velocity_z,mass line each
+ * The file is mapped and cut into chunks that start on a new line, the
+ * threads count the bodies of each chunk, which places every chunk in the
+ * store, then parse their chunks into it, the text is only parsed once,
+ * blank lines are skipped and the bad lines are reported on stderr
+ * @param path, the path of the csv
+ * @param n_threads, the number of threads that parse it
+ * @return the body store or NULL if the file cannot be read, has no bodies or has a bad line
+ */
+struct bodies* bodies_parse_csv(const char* path, size_t n_threads);
+
+
+/**
+ * Generate a body store of random bodies, the same bodies on every call
+ * Adapter for the original uniform box around bodies_generate
+ * @param n_bodies, the number of bodies 
+ * @return the body store containing all randomly generated bodies
+ */
+struct bodies* bodies_gen_random(size_t n_bodies);
+
+
+/**
+ * Read the bodies from a file into a body store
+ * @param file, the file to read from
+ * @param n_bodies, the number of bodies in the file
+ * @return the body store or NULL if invalid
+ */
+struct bodies* bodies_read_file(FILE* file, size_t n_bodies);
+
+
 /**
  * Generate the array of struct bodies
  * @param n_bodies, the number of bodies 
@@ -99,6 +1082,323 @@ struct body** read_file(FILE* file, size_t n_bodies);
 size_t get_file_len(FILE* f);
 
 
+/**
+ * Checksum an array of doubles as 64 bit words, two running sums so the
+ * order of the words matters as well as their values
+ * @param data, the words
+ * @param n, the number of words
+ * @return the checksum
+ */
+uint64_t snapshot_checksum(const double* data, size_t n);
+
+
+/**
+ * Write a body store as a binary snapshot
+ * @param b, the body store
+ * @param file, the file to write to, opened in binary mode
+ * @return 0 if written or 1 if invalid or the write failed
+ */
+int bodies_write_snapshot(const struct bodies* b, FILE* file);
+
+
+/**
+ * Map a binary snapshot as a body store without copying it
+ * The mapping is private so the simulation writes to its own pages and the
+ * file is never changed, every page is read once to check the checksum
+ * @param path, the path of the snapshot
+ * @return the body store or NULL if it cannot be mapped or is not a valid snapshot
+ */
+struct bodies* bodies_map_snapshot(const char* path);
+
+
+/**
+ * Load the bodies of a file, a binary snapshot is mapped, the last frame of a
+ * trajectory is decoded and anything else is parsed as csv, the bodies go
+ * to the file of bodies_store_select when there is one
+ * @param path, the path of the file
+ * @param n_threads, the number of threads that parse a csv or decode a trajectory
+ * @return the body store or NULL if the file cannot be read
+ */
+struct bodies* bodies_load(const char* path, size_t n_threads);
+
+
+/**
+ * Create a trajectory file and start its writer thread
+ * @param path, the path of the file
+ * @param n_bodies, the number of bodies of every frame
+ * @param every, the number of steps between frames
+ * @param n_buffers, the number of frames that can wait for the writer
+ * @param n_threads, the number of threads that encode each frame, the writer and n_threads - 1 more
+ * @param dt, the change in time of a step
+ * @param error, the most positions and velocities may be off by, or 0 to store them exactly
+ * @return the trajectory or NULL if invalid or the file cannot be written
+ */
+struct trajectory* trajectory_open(const char* path, size_t n_bodies, size_t every, size_t n_buffers, size_t n_threads,
+		double dt, double error);
+
+
+/**
+ * Check whether a frame is captured after a step, every every steps and after the last
+ * @param t, the trajectory or NULL for none
+ * @param step, the number of steps done
+ * @param iterations, the number of steps of the run
+ * @return 1 if it is captured or 0 if not
+ */
+int trajectory_due(const struct trajectory* t, size_t step, size_t iterations);
+
+
+/**
+ * Find the next step after which a frame is captured
+ * @param t, the trajectory or NULL for none
+ * @param step, the number of steps done
+ * @param iterations, the number of steps of the run
+ * @return the step, at most iterations
+ */
+size_t trajectory_next(const struct trajectory* t, size_t step, size_t iterations);
+
+
+/**
+ * Take the buffer of the next frame, called by thread 0 only, before the barrier
+ * that lets every thread call trajectory_copy
+ * Only when every buffer still waits for the writer does it block, which is
+ * counted as the writer falling behind
+ * @param t, the trajectory
+ * @param step, the number of steps done
+ * @param time, the simulated time
+ */
+void trajectory_acquire(struct trajectory* t, size_t step, double time);
+
+
+/**
+ * Copy a slice of the body store into the frame being captured, called by every
+ * thread of the pool, the last to finish hands the frame to the writer
+ * @param t, the trajectory
+ * @param b, the body store
+ * @param n_threads, the number of threads copying the frame
+ * @param start, the first body of the slice
+ * @param end, one past the last body of the slice
+ */
+void trajectory_copy(struct trajectory* t, const struct bodies* b, size_t n_threads, size_t start, size_t end);
+
+
+/**
+ * Print how many frames were captured, how small they were stored and how
+ * often the writer fell behind, once the writer has encoded every frame
+ * @param t, the trajectory
+ */
+void trajectory_report(struct trajectory* t);
+
+
+/**
+ * Wait for the writer to write every captured frame and the index, then close
+ * the file and clear up all memory associated with the trajectory
+ * @param t, the trajectory
+ * @return 0 if every frame was written or 1 if a write failed
+ */
+int trajectory_close(struct trajectory* t);
+
+
+/**
+ * Close a trajectory file and clear up all memory associated with its reader
+ * @param r, the reader
+ */
+void trajectory_reader_close(struct trajectory_reader* r);
+
+
+/**
+ * Open a trajectory file for random access to its frames
+ * @param path, the path of the file
+ * @param n_threads, the number of threads that decode each frame
+ * @return the reader or NULL if invalid or not a trajectory
+ */
+struct trajectory_reader* trajectory_reader_open(const char* path, size_t n_threads);
+
+
+/**
+ * Read a frame of a trajectory into a body store
+ * The frames from the key frame before it are decoded, or only those after
+ * the last frame read when it is on the way, so reading in order decodes
+ * each frame once and any frame costs at most key_interval decodes
+ * @param r, the reader
+ * @param frame, the frame, from 0 to r->n_frames - 1
+ * @param b, the body store, of the trajectory's number of bodies
+ * @return 0 if read or 1 if invalid or the frame cannot be read
+ */
+int trajectory_read(struct trajectory_reader* r, size_t frame, struct bodies* b);
+
+
+/**
+ * Load a frame of a trajectory file as a body store
+ * @param path, the path of the trajectory
+ * @param frame, the frame or SIZE_MAX for the last
+ * @param n_threads, the number of threads that decode it
+ * @return the body store or NULL if the frame cannot be read
+ */
+struct bodies* trajectory_load(const char* path, size_t frame, size_t n_threads);
+
+
+/**
+ * Set up the checkpoints of a run and catch SIGTERM and SIGUSR1 to ask for one
+ * @param path, the path the checkpoints are renamed to
+ * @param every, the number of steps between checkpoints or 0 for only when a signal asks
+ * @param engine, the force engine
+ * @param params, the parameters of the engine
+ * @param schedule, when the energy is measured or NULL
+ * @param iterations, the number of steps of the run
+ * @param dt, the change in time of a step
+ * @param threaded, whether the run is threaded
+ * @param n_threads, the number of threads of the run
+ * @return the checkpoints or NULL if invalid
+ */
+struct checkpoint* checkpoint_open(const char* path, size_t every, const struct engine* engine,
+		const struct engine_params* params, struct energy_schedule* schedule, size_t iterations, double dt,
+		int threaded, size_t n_threads);
+
+
+/**
+ * Decide whether a checkpoint is written after a step, called by thread 0 only,
+ * every every steps or when a signal has asked, never at the first step of
+ * the run or after the last
+ * @param c, the checkpoints or NULL for none
+ * @param step, the number of steps done
+ * @param first, the step the run started from
+ * @param iterations, the number of steps of the run
+ * @return CHECKPOINT_NONE, CHECKPOINT_WRITE or CHECKPOINT_STOP to write one and stop
+ */
+int checkpoint_due(struct checkpoint* c, size_t step, size_t first, size_t iterations);
+
+
+/**
+ * Find the next step after which a checkpoint may be due, a signal is looked
+ * for at least every CHECKPOINT_SEGMENT steps
+ * @param c, the checkpoints or NULL for none
+ * @param step, the number of steps done
+ * @param iterations, the step to stop at if nothing is due before
+ * @return the step, at most iterations
+ */
+size_t checkpoint_next(const struct checkpoint* c, size_t step, size_t iterations);
+
+
+/**
+ * Open the temporary file of a checkpoint after a step, called by thread 0
+ * only, before the barrier that lets every thread call checkpoint_copy
+ * @param c, the checkpoints
+ * @param b, the body store
+ * @param step, the number of steps done
+ * @param engine, the force engine
+ * @param state, the state of the engine, asked for what recreates it
+ */
+void checkpoint_acquire(struct checkpoint* c, const struct bodies* b, size_t step, const struct engine* engine, void* state);
+
+
+/**
+ * Write a slice of the body store into the checkpoint being taken, called by
+ * every thread of the pool, the last to finish writes the header, syncs the
+ * file and renames it over the last checkpoint
+ * @param c, the checkpoints
+ * @param id, the thread
+ * @param n_threads, the number of threads writing the checkpoint
+ * @param start, the first body of the slice
+ * @param end, one past the last body of the slice
+ */
+void checkpoint_copy(struct checkpoint* c, size_t id, size_t n_threads, size_t start, size_t end);
+
+
+/**
+ * Print how many checkpoints were written and how long the longest took
+ * @param c, the checkpoints or NULL for none
+ */
+void checkpoint_report(const struct checkpoint* c);
+
+
+/**
+ * Stop catching the signals and clear up all memory associated with the checkpoints
+ * @param c, the checkpoints
+ * @return 0 if the last checkpoint was written or 1 if it failed
+ */
+int checkpoint_close(struct checkpoint* c);
+
+
+/**
+ * Read the run state of a checkpoint, its bodies are loaded as a snapshot
+ * @param path, the path of the checkpoint
+ * @param state, where the run state goes
+ * @return 0 if read or 1 if the file is not a checkpoint
+ */
+int checkpoint_read(const char* path, struct checkpoint_state* state);
+
+
+/**
+ * Set up a run to continue from the state of a checkpoint, selecting its
+ * kernel and precision and filling in its engine, parameters and energy schedule
+ * @param state, the run state
+ * @param engine, where the engine goes
+ * @param params, where the parameters go
+ * @param schedule, the energy schedule, its log is kept
+ * @return 0 if set up or 1 if the engine, kernel or precision is not available
+ */
+int checkpoint_restore(const struct checkpoint_state* state, const struct engine** engine, struct engine_params* params,
+		struct energy_schedule* schedule);
+
+
+/**
+ * Philox4x32-10, ten rounds of multiplies and xors with a key bumped by the
+ * Weyl constants between rounds, the same counter and key always give the same block
+ * @param counter, the counter
+ * @param key, the key
+ * @param block, set to the four random words
+ */
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t block[4]);
+
+
+/**
+ * Start a random stream, every seed and stream pair gives its own sequence
+ * @param r, the stream
+ * @param seed, the seed, the key of every block
+ * @param stream, the number of the stream, such as a body
+ */
+void philox_init(struct philox* r, uint64_t seed, uint64_t stream);
+
+
+/**
+ * Draw a uniform number strictly between 0 and 1 from 53 random bits,
+ * so its logarithm and inverse are always finite
+ * @param r, the stream
+ * @return the number
+ */
+double philox_uniform(struct philox* r);
+
+
+/**
+ * Draw a standard normal number with the Box-Muller transform
+ * @param r, the stream
+ * @return the number
+ */
+double philox_normal(struct philox* r);
+
+
+/**
+ * Find a model of initial conditions by name
+ * @param name, the name of the model
+ * @return the model or NULL if unknown
+ */
+const struct generator* generator_find(const char* name);
+
+
+/**
+ * Generate a body store of initial conditions from a model on a pool of
+ * threads, body i comes from stream i of the seed and the centre of mass is
+ * summed chunk by chunk in order, so a seed gives the same bits on any
+ * number of threads, the centre of mass is then moved to rest at the origin
+ * @param model, the name of the model, random, plummer, cube, disk or collapse
+ * @param n_bodies, the number of bodies
+ * @param seed, the seed
+ * @param n_threads, the number of threads that generate the bodies
+ * @return the body store or NULL if invalid
+ */
+struct bodies* bodies_generate(const char* model, size_t n_bodies, uint64_t seed, size_t n_threads);
+
+
 /**
  * Clear up all memory associated with bodies
  */
@@ -0,0 +1,1102 @@
+#include "nbody.h"
+#include <float.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+
+/**
+ * Allocate the tiled view of a body store, padding lanes have zero mass
+ * @param n_bodies, the number of bodies to hold
+ * @return the tiles or NULL if invalid
+ */
+struct body_tiles* body_tiles_create(size_t n_bodies) {
+
+	// If the parameter is invalid
+	if (n_bodies == 0) {
+		return NULL;
+	}
+
+	struct body_tiles* t = malloc(sizeof(struct body_tiles));
+	if (t == NULL) {
+		return NULL;
+	}
+
+	t->n_bodies = n_bodies;
+	t->n_tiles = (n_bodies + TILE_WIDTH - 1) / TILE_WIDTH;
+	t->tiles = aligned_alloc(CACHE_LINE, sizeof(struct body_tile) * t->n_tiles);
+	if (t->tiles == NULL) {
+		free(t);
+		return NULL;
+	}
+	memset(t->tiles, 0, sizeof(struct body_tile) * t->n_tiles);
+	return t;
+}
+
+
+/**
+ * Clear up all memory associated with the tiles
+ * @param t, the tiles
+ */
+void body_tiles_destroy(struct body_tiles* t) {
+
+	// If it is already NULL
+	if (t == NULL) {
+		return;
+	}
+
+	free(t->tiles);
+	free(t);
+}
+
+
+/**
+ * Copy the positions and masses of [start, end) into the tiles
+ * Threads packing disjoint ranges never write the same lane
+ * @param t, the tiles
+ * @param b, the body store
+ * @param start, the first body to copy
+ * @param end, one past the last body to copy
+ */
+void body_tiles_pack(struct body_tiles* t, const struct bodies* b, size_t start, size_t end) {
+
+	// If the parameters are invalid
+	if (t == NULL || b == NULL || end > t->n_bodies) {
+		return;
+	}
+
+	for (size_t i = start; i < end; i++) {
+		struct body_tile* tile = t->tiles + i / TILE_WIDTH;
+		size_t lane = i % TILE_WIDTH;
+		tile->x[lane] = b->x[i];
+		tile->y[lane] = b->y[i];
+		tile->z[lane] = b->z[i];
+		tile->mass[lane] = b->mass[i];
+	}
+}
+
+
+/**
+ * Copy the positions and masses of [start, end) into the first lanes of the
+ * tiles, the lanes after have zero mass so they pull on nothing
+ * @param t, the tiles, holding at least end - start bodies
+ * @param b, the body store
+ * @param start, the first body to copy
+ * @param end, one past the last body to copy
+ */
+void body_tiles_load(struct body_tiles* t, const struct bodies* b, size_t start, size_t end) {
+
+	// If the parameters are invalid
+	if (t == NULL || b == NULL || end < start || end - start > t->n_bodies || end > b->n_bodies) {
+		return;
+	}
+
+	for (size_t i = start; i < end; i++) {
+		struct body_tile* tile = t->tiles + (i - start) / TILE_WIDTH;
+		size_t lane = (i - start) % TILE_WIDTH;
+		tile->x[lane] = b->x[i];
+		tile->y[lane] = b->y[i];
+		tile->z[lane] = b->z[i];
+		tile->mass[lane] = b->mass[i];
+	}
+	for (size_t lane = end - start; lane < t->n_tiles * TILE_WIDTH; lane++) {
+		t->tiles[lane / TILE_WIDTH].mass[lane % TILE_WIDTH] = 0.0;
+	}
+}
+
+
+/**
+ * Calculate 1 / r^3 from r^2
+ * With no newton steps the exact square root is used, otherwise the estimate
+ * from the exponent bit trick is refined by the given number of newton steps
+ * @param dist2, the squared distance
+ * @param newton_steps, the number of newton steps or 0 for the exact path
+ * @return the inverse cube of the distance
+ */
+static inline double inv_dist3_scalar(double dist2, int newton_steps) {
+	if (newton_steps == 0) {
+		return 1.0 / (dist2 * sqrt(dist2));
+	}
+
+	// Halve the exponent and negate it to get within a few percent
+	uint64_t bits;
+	memcpy(&bits, &dist2, sizeof(bits));
+	bits = RSQRT_MAGIC - (bits >> 1);
+	double y;
+	memcpy(&y, &bits, sizeof(y));
+
+	for (int k = 0; k < newton_steps; k++) {
+		y = y * (1.5 - 0.5 * dist2 * y * y);
+	}
+	return y * y * y;
+}
+
+
+/**
+ * Portable kernel, every lane of a tile is computed in a plain loop
+ * @param t, the tiles holding the positions of every body
+ * @param b, the body store whose velocities are updated
+ * @param start, the first body to update
+ * @param end, one past the last body to update
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ */
+static void kick_scalar(const struct body_tiles* t, struct bodies* b, size_t start, size_t end, double dt, int newton_steps) {
+	const double min_dist2 = MIN_DISTANCE * MIN_DISTANCE;
+
+	for (size_t i = start; i < end; i++) {
+		register double x = b->x[i], y = b->y[i], z = b->z[i];
+		register double acc_x = 0, acc_y = 0, acc_z = 0;
+
+		for (size_t k = 0; k < t->n_tiles; k++) {
+			const struct body_tile* tile = t->tiles + k;
+			for (size_t lane = 0; lane < TILE_WIDTH; lane++) {
+				double x_dist = tile->x[lane] - x;
+				double y_dist = tile->y[lane] - y;
+				double z_dist = tile->z[lane] - z;
+				double dist2 = x_dist * x_dist + y_dist * y_dist + z_dist * z_dist;
+				// The body itself and coincident bodies have no direction
+				if (dist2 == 0.0) {
+					dist2 = min_dist2;
+				}
+				double s = tile->mass[lane] * inv_dist3_scalar(dist2, newton_steps);
+				acc_x += x_dist * s;
+				acc_y += y_dist * s;
+				acc_z += z_dist * s;
+			}
+		}
+
+		b->velocity_x[i] += GCONST * acc_x * dt;
+		b->velocity_y[i] += GCONST * acc_y * dt;
+		b->velocity_z[i] += GCONST * acc_z * dt;
+	}
+}
+
+
+/**
+ * Portable symmetric kernel, the pairs i in [i_start, i_end) and j in [j_start, j_end)
+ * with j > i update both sides, the j side is subtracted from the given velocities
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, padded to whole tiles
+ * @param velocity_y, the y velocities to update, padded to whole tiles
+ * @param velocity_z, the z velocities to update, padded to whole tiles
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ * @param with_potential, 1 to also sum m_i * m_j / r, a constant so each use is specialised
+ * @return the sum of the potential or 0.0 without with_potential
+ */
+static inline __attribute__((always_inline)) double pair_block_scalar_body(const struct body_tiles* t,
+		double* restrict velocity_x, double* restrict velocity_y, double* restrict velocity_z,
+		size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int newton_steps, const int with_potential) {
+	const double min_dist2 = MIN_DISTANCE * MIN_DISTANCE;
+	size_t k_end = (j_end + TILE_WIDTH - 1) / TILE_WIDTH;
+	double sum = 0.0;
+
+	for (size_t i = i_start; i < i_end; i++) {
+		const struct body_tile* tile_i = t->tiles + i / TILE_WIDTH;
+		register double x = tile_i->x[i % TILE_WIDTH], y = tile_i->y[i % TILE_WIDTH], z = tile_i->z[i % TILE_WIDTH];
+		register double mass_dt = tile_i->mass[i % TILE_WIDTH] * GCONST * dt;
+		register double acc_x = 0, acc_y = 0, acc_z = 0, potential = 0;
+		size_t first = j_start > i ? j_start : i + 1;
+
+		for (size_t k = first / TILE_WIDTH; k < k_end; k++) {
+			const struct body_tile* tile = t->tiles + k;
+			for (size_t lane = 0; lane < TILE_WIDTH; lane++) {
+				size_t j = k * TILE_WIDTH + lane;
+				if (j < first) {
+					continue;
+				}
+				double x_dist = tile->x[lane] - x;
+				double y_dist = tile->y[lane] - y;
+				double z_dist = tile->z[lane] - z;
+				double dist2 = x_dist * x_dist + y_dist * y_dist + z_dist * z_dist;
+				dist2 = dist2 == 0.0 ? min_dist2 : dist2;
+				double inv_dist3 = inv_dist3_scalar(dist2, newton_steps);
+				double s = tile->mass[lane] * inv_dist3;
+				acc_x += x_dist * s;
+				acc_y += y_dist * s;
+				acc_z += z_dist * s;
+				if (with_potential) {
+					potential += s * dist2;
+				}
+				velocity_x[j] -= x_dist * inv_dist3 * mass_dt;
+				velocity_y[j] -= y_dist * inv_dist3 * mass_dt;
+				velocity_z[j] -= z_dist * inv_dist3 * mass_dt;
+			}
+		}
+
+		velocity_x[i] += GCONST * acc_x * dt;
+		velocity_y[i] += GCONST * acc_y * dt;
+		velocity_z[i] += GCONST * acc_z * dt;
+		if (with_potential) {
+			sum += tile_i->mass[i % TILE_WIDTH] * potential;
+		}
+	}
+	return sum;
+}
+
+
+/**
+ * Portable symmetric kernel, with_potential picks the specialised body that also sums m_i * m_j / r
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, padded to whole tiles
+ * @param velocity_y, the y velocities to update, padded to whole tiles
+ * @param velocity_z, the z velocities to update, padded to whole tiles
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ * @param with_potential, 1 to sum the potential of the pairs as well
+ * @return the sum of m_i * m_j / r over the block or 0.0 without with_potential
+ */
+static double pair_block_scalar(const struct body_tiles* t, double* restrict velocity_x, double* restrict velocity_y, double* restrict velocity_z,
+		size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int newton_steps, int with_potential) {
+	if (with_potential) {
+		return pair_block_scalar_body(t, velocity_x, velocity_y, velocity_z, i_start, i_end, j_start, j_end, dt, newton_steps, 1);
+	}
+	return pair_block_scalar_body(t, velocity_x, velocity_y, velocity_z, i_start, i_end, j_start, j_end, dt, newton_steps, 0);
+}
+
+
+/**
+ * Portable potential kernel, sums m_i * m_j / r over the pairs i in [i_start, i_end)
+ * and j in [j_start, j_end) with j > i, the square root is always exact
+ * @param b, the body store, its arrays padded with massless bodies
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @return the sum of the block
+ */
+static double potential_block_scalar(const struct bodies* b, size_t i_start, size_t i_end, size_t j_start, size_t j_end) {
+	const double* restrict bx = b->x;
+	const double* restrict by = b->y;
+	const double* restrict bz = b->z;
+	const double* restrict m = b->mass;
+	double sum = 0.0;
+
+	for (size_t i = i_start; i < i_end; i++) {
+		register double x = bx[i], y = by[i], z = bz[i];
+		register double potential = 0.0;
+		for (size_t j = j_start > i ? j_start : i + 1; j < j_end; j++) {
+			double x_dist = bx[j] - x;
+			double y_dist = by[j] - y;
+			double z_dist = bz[j] - z;
+			double dist2 = x_dist * x_dist + y_dist * y_dist + z_dist * z_dist;
+			potential += m[j] / (dist2 == 0.0 ? MIN_DISTANCE : sqrt(dist2));
+		}
+		sum += m[i] * potential;
+	}
+	return sum;
+}
+
+
+/**
+ * Sum the four lanes of an AVX register
+ * @param v, the register
+ * @return the horizontal sum
+ */
+__attribute__((target("avx2,fma")))
+static inline double hsum_avx2(__m256d v) {
+	__m128d lo = _mm256_castpd256_pd128(v);
+	__m128d hi = _mm256_extractf128_pd(v, 1);
+	lo = _mm_add_pd(lo, hi);
+	return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+
+/**
+ * Calculate 1 / r^3 from r^2 for four distances
+ * The estimate comes from the single precision rsqrt so distances outside of
+ * the float range take the exact path
+ * @param dist2, the squared distances
+ * @param newton_steps, the number of newton steps or 0 for the exact path
+ * @return the inverse cubes of the distances
+ */
+__attribute__((target("avx2,fma")))
+static inline __m256d inv_dist3_avx2(__m256d dist2, int newton_steps) {
+	const __m256d float_min = _mm256_set1_pd(FLT_MIN);
+	const __m256d float_max = _mm256_set1_pd(FLT_MAX);
+
+	__m256d outside = _mm256_or_pd(_mm256_cmp_pd(dist2, float_min, _CMP_LT_OQ), _mm256_cmp_pd(dist2, float_max, _CMP_GT_OQ));
+	if (newton_steps == 0 || _mm256_movemask_pd(outside)) {
+		return _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_mul_pd(dist2, _mm256_sqrt_pd(dist2)));
+	}
+
+	const __m256d half = _mm256_set1_pd(0.5);
+	const __m256d three_halves = _mm256_set1_pd(1.5);
+	__m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(dist2)));
+	__m256d half_dist2 = _mm256_mul_pd(half, dist2);
+	for (int k = 0; k < newton_steps; k++) {
+		y = _mm256_mul_pd(y, _mm256_fnmadd_pd(half_dist2, _mm256_mul_pd(y, y), three_halves));
+	}
+	return _mm256_mul_pd(y, _mm256_mul_pd(y, y));
+}
+
+
+/**
+ * AVX2 kernel, four j bodies are computed per instruction
+ * @param t, the tiles holding the positions of every body
+ * @param b, the body store whose velocities are updated
+ * @param start, the first body to update
+ * @param end, one past the last body to update
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ */
+__attribute__((target("avx2,fma")))
+static void kick_avx2(const struct body_tiles* t, struct bodies* b, size_t start, size_t end, double dt, int newton_steps) {
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d min_dist2 = _mm256_set1_pd(MIN_DISTANCE * MIN_DISTANCE);
+
+	for (size_t i = start; i < end; i++) {
+		__m256d x = _mm256_set1_pd(b->x[i]);
+		__m256d y = _mm256_set1_pd(b->y[i]);
+		__m256d z = _mm256_set1_pd(b->z[i]);
+		__m256d acc_x = zero, acc_y = zero, acc_z = zero;
+
+		for (size_t k = 0; k < t->n_tiles; k++) {
+			const struct body_tile* tile = t->tiles + k;
+			for (size_t lane = 0; lane < TILE_WIDTH; lane += 4) {
+				__m256d x_dist = _mm256_sub_pd(_mm256_load_pd(tile->x + lane), x);
+				__m256d y_dist = _mm256_sub_pd(_mm256_load_pd(tile->y + lane), y);
+				__m256d z_dist = _mm256_sub_pd(_mm256_load_pd(tile->z + lane), z);
+				__m256d dist2 = _mm256_fmadd_pd(x_dist, x_dist, _mm256_fmadd_pd(y_dist, y_dist, _mm256_mul_pd(z_dist, z_dist)));
+				dist2 = _mm256_blendv_pd(dist2, min_dist2, _mm256_cmp_pd(dist2, zero, _CMP_EQ_OQ));
+				__m256d s = _mm256_mul_pd(_mm256_load_pd(tile->mass + lane), inv_dist3_avx2(dist2, newton_steps));
+				acc_x = _mm256_fmadd_pd(x_dist, s, acc_x);
+				acc_y = _mm256_fmadd_pd(y_dist, s, acc_y);
+				acc_z = _mm256_fmadd_pd(z_dist, s, acc_z);
+			}
+		}
+
+		b->velocity_x[i] += GCONST * hsum_avx2(acc_x) * dt;
+		b->velocity_y[i] += GCONST * hsum_avx2(acc_y) * dt;
+		b->velocity_z[i] += GCONST * hsum_avx2(acc_z) * dt;
+	}
+}
+
+
+/**
+ * AVX2 symmetric kernel, four j bodies and their velocities are updated per instruction
+ * Lanes at or before i in the first tile are masked off
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ * @param with_potential, 1 to also sum m_i * m_j / r, a constant so each use is specialised
+ * @return the sum of the potential or 0.0 without with_potential
+ */
+__attribute__((target("avx2,fma")))
+static inline __attribute__((always_inline)) double pair_block_avx2_body(const struct body_tiles* t,
+		double* restrict velocity_x, double* restrict velocity_y, double* restrict velocity_z,
+		size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int newton_steps, const int with_potential) {
+	double sum = 0.0;
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d min_dist2 = _mm256_set1_pd(MIN_DISTANCE * MIN_DISTANCE);
+	const __m256d lanes[2] = { _mm256_set_pd(3, 2, 1, 0), _mm256_set_pd(7, 6, 5, 4) };
+	size_t k_end = (j_end + TILE_WIDTH - 1) / TILE_WIDTH;
+
+	for (size_t i = i_start; i < i_end; i++) {
+		const struct body_tile* tile_i = t->tiles + i / TILE_WIDTH;
+		__m256d x = _mm256_set1_pd(tile_i->x[i % TILE_WIDTH]);
+		__m256d y = _mm256_set1_pd(tile_i->y[i % TILE_WIDTH]);
+		__m256d z = _mm256_set1_pd(tile_i->z[i % TILE_WIDTH]);
+		__m256d mass_dt = _mm256_set1_pd(tile_i->mass[i % TILE_WIDTH] * GCONST * dt);
+		__m256d acc_x = zero, acc_y = zero, acc_z = zero, potential = zero;
+		size_t first = j_start > i ? j_start : i + 1;
+		__m256d first_lane = _mm256_set1_pd((double)(first % TILE_WIDTH));
+
+		for (size_t k = first / TILE_WIDTH; k < k_end; k++) {
+			const struct body_tile* tile = t->tiles + k;
+			for (size_t half = 0; half < 2; half++) {
+				size_t lane = half * 4;
+				size_t j = k * TILE_WIDTH + lane;
+				__m256d x_dist = _mm256_sub_pd(_mm256_load_pd(tile->x + lane), x);
+				__m256d y_dist = _mm256_sub_pd(_mm256_load_pd(tile->y + lane), y);
+				__m256d z_dist = _mm256_sub_pd(_mm256_load_pd(tile->z + lane), z);
+				__m256d dist2 = _mm256_fmadd_pd(x_dist, x_dist, _mm256_fmadd_pd(y_dist, y_dist, _mm256_mul_pd(z_dist, z_dist)));
+				dist2 = _mm256_blendv_pd(dist2, min_dist2, _mm256_cmp_pd(dist2, zero, _CMP_EQ_OQ));
+				__m256d inv_dist3 = _mm256_and_pd(inv_dist3_avx2(dist2, newton_steps), _mm256_cmp_pd(lanes[half], first_lane, _CMP_GE_OQ));
+				__m256d s = _mm256_mul_pd(_mm256_load_pd(tile->mass + lane), inv_dist3);
+				acc_x = _mm256_fmadd_pd(x_dist, s, acc_x);
+				acc_y = _mm256_fmadd_pd(y_dist, s, acc_y);
+				acc_z = _mm256_fmadd_pd(z_dist, s, acc_z);
+				if (with_potential) {
+					potential = _mm256_fmadd_pd(s, dist2, potential);
+				}
+
+				__m256d s_j = _mm256_mul_pd(inv_dist3, mass_dt);
+				_mm256_store_pd(velocity_x + j, _mm256_fnmadd_pd(x_dist, s_j, _mm256_load_pd(velocity_x + j)));
+				_mm256_store_pd(velocity_y + j, _mm256_fnmadd_pd(y_dist, s_j, _mm256_load_pd(velocity_y + j)));
+				_mm256_store_pd(velocity_z + j, _mm256_fnmadd_pd(z_dist, s_j, _mm256_load_pd(velocity_z + j)));
+			}
+			first_lane = zero;
+		}
+
+		velocity_x[i] += GCONST * hsum_avx2(acc_x) * dt;
+		velocity_y[i] += GCONST * hsum_avx2(acc_y) * dt;
+		velocity_z[i] += GCONST * hsum_avx2(acc_z) * dt;
+		if (with_potential) {
+			sum += tile_i->mass[i % TILE_WIDTH] * hsum_avx2(potential);
+		}
+	}
+	return sum;
+}
+
+
+/**
+ * AVX2 symmetric kernel, with_potential picks the specialised body that also sums m_i * m_j / r
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ * @param with_potential, 1 to sum the potential of the pairs as well
+ * @return the sum of m_i * m_j / r over the block or 0.0 without with_potential
+ */
+__attribute__((target("avx2,fma")))
+static double pair_block_avx2(const struct body_tiles* t, double* restrict velocity_x, double* restrict velocity_y, double* restrict velocity_z,
+		size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int newton_steps, int with_potential) {
+	if (with_potential) {
+		return pair_block_avx2_body(t, velocity_x, velocity_y, velocity_z, i_start, i_end, j_start, j_end, dt, newton_steps, 1);
+	}
+	return pair_block_avx2_body(t, velocity_x, velocity_y, velocity_z, i_start, i_end, j_start, j_end, dt, newton_steps, 0);
+}
+
+
+/**
+ * AVX2 potential kernel, four j bodies are summed per instruction
+ * Lanes at or before i in the first group are masked off
+ * @param b, the body store, its arrays padded with massless bodies
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @return the sum of the block
+ */
+__attribute__((target("avx2,fma")))
+static double potential_block_avx2(const struct bodies* b, size_t i_start, size_t i_end, size_t j_start, size_t j_end) {
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1.0);
+	const __m256d min_dist = _mm256_set1_pd(MIN_DISTANCE);
+	const __m256d lanes = _mm256_set_pd(3, 2, 1, 0);
+	double sum = 0.0;
+
+	for (size_t i = i_start; i < i_end; i++) {
+		__m256d x = _mm256_set1_pd(b->x[i]);
+		__m256d y = _mm256_set1_pd(b->y[i]);
+		__m256d z = _mm256_set1_pd(b->z[i]);
+		__m256d potential = zero;
+		size_t first = j_start > i ? j_start : i + 1;
+		__m256d first_lane = _mm256_set1_pd((double)(first % 4));
+
+		for (size_t j = first - first % 4; j < j_end; j += 4) {
+			__m256d x_dist = _mm256_sub_pd(_mm256_load_pd(b->x + j), x);
+			__m256d y_dist = _mm256_sub_pd(_mm256_load_pd(b->y + j), y);
+			__m256d z_dist = _mm256_sub_pd(_mm256_load_pd(b->z + j), z);
+			__m256d dist2 = _mm256_fmadd_pd(x_dist, x_dist, _mm256_fmadd_pd(y_dist, y_dist, _mm256_mul_pd(z_dist, z_dist)));
+			__m256d dist = _mm256_blendv_pd(_mm256_sqrt_pd(dist2), min_dist, _mm256_cmp_pd(dist2, zero, _CMP_EQ_OQ));
+			__m256d mass = _mm256_and_pd(_mm256_load_pd(b->mass + j), _mm256_cmp_pd(lanes, first_lane, _CMP_GE_OQ));
+			potential = _mm256_add_pd(potential, _mm256_mul_pd(mass, _mm256_div_pd(one, dist)));
+			first_lane = zero;
+		}
+		sum += b->mass[i] * hsum_avx2(potential);
+	}
+	return sum;
+}
+
+
+/**
+ * Calculate 1 / r^3 from r^2 for eight distances
+ * The estimate comes from the 14 bit double precision rsqrt
+ * @param dist2, the squared distances
+ * @param newton_steps, the number of newton steps or 0 for the exact path
+ * @return the inverse cubes of the distances
+ */
+__attribute__((target("avx512f")))
+static inline __m512d inv_dist3_avx512(__m512d dist2, int newton_steps) {
+	if (newton_steps == 0) {
+		return _mm512_div_pd(_mm512_set1_pd(1.0), _mm512_mul_pd(dist2, _mm512_sqrt_pd(dist2)));
+	}
+
+	const __m512d half = _mm512_set1_pd(0.5);
+	const __m512d three_halves = _mm512_set1_pd(1.5);
+	__m512d y = _mm512_rsqrt14_pd(dist2);
+	__m512d half_dist2 = _mm512_mul_pd(half, dist2);
+	for (int k = 0; k < newton_steps; k++) {
+		y = _mm512_mul_pd(y, _mm512_fnmadd_pd(half_dist2, _mm512_mul_pd(y, y), three_halves));
+	}
+	return _mm512_mul_pd(y, _mm512_mul_pd(y, y));
+}
+
+
+/**
+ * AVX-512 kernel, a whole tile of eight j bodies is computed per instruction
+ * @param t, the tiles holding the positions of every body
+ * @param b, the body store whose velocities are updated
+ * @param start, the first body to update
+ * @param end, one past the last body to update
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ */
+__attribute__((target("avx512f")))
+static void kick_avx512(const struct body_tiles* t, struct bodies* b, size_t start, size_t end, double dt, int newton_steps) {
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d min_dist2 = _mm512_set1_pd(MIN_DISTANCE * MIN_DISTANCE);
+
+	for (size_t i = start; i < end; i++) {
+		__m512d x = _mm512_set1_pd(b->x[i]);
+		__m512d y = _mm512_set1_pd(b->y[i]);
+		__m512d z = _mm512_set1_pd(b->z[i]);
+		__m512d acc_x = zero, acc_y = zero, acc_z = zero;
+
+		for (size_t k = 0; k < t->n_tiles; k++) {
+			const struct body_tile* tile = t->tiles + k;
+			__m512d x_dist = _mm512_sub_pd(_mm512_load_pd(tile->x), x);
+			__m512d y_dist = _mm512_sub_pd(_mm512_load_pd(tile->y), y);
+			__m512d z_dist = _mm512_sub_pd(_mm512_load_pd(tile->z), z);
+			__m512d dist2 = _mm512_fmadd_pd(x_dist, x_dist, _mm512_fmadd_pd(y_dist, y_dist, _mm512_mul_pd(z_dist, z_dist)));
+			dist2 = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(dist2, zero, _CMP_EQ_OQ), dist2, min_dist2);
+			__m512d s = _mm512_mul_pd(_mm512_load_pd(tile->mass), inv_dist3_avx512(dist2, newton_steps));
+			acc_x = _mm512_fmadd_pd(x_dist, s, acc_x);
+			acc_y = _mm512_fmadd_pd(y_dist, s, acc_y);
+			acc_z = _mm512_fmadd_pd(z_dist, s, acc_z);
+		}
+
+		b->velocity_x[i] += GCONST * _mm512_reduce_add_pd(acc_x) * dt;
+		b->velocity_y[i] += GCONST * _mm512_reduce_add_pd(acc_y) * dt;
+		b->velocity_z[i] += GCONST * _mm512_reduce_add_pd(acc_z) * dt;
+	}
+}
+
+
+/**
+ * AVX-512 symmetric kernel, a whole tile of j bodies and their velocities is updated per instruction
+ * Lanes at or before i in the first tile are masked off
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ * @param with_potential, 1 to also sum m_i * m_j / r, a constant so each use is specialised
+ * @return the sum of the potential or 0.0 without with_potential
+ */
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) double pair_block_avx512_body(const struct body_tiles* t,
+		double* restrict velocity_x, double* restrict velocity_y, double* restrict velocity_z,
+		size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int newton_steps, const int with_potential) {
+	double sum = 0.0;
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d min_dist2 = _mm512_set1_pd(MIN_DISTANCE * MIN_DISTANCE);
+	size_t k_end = (j_end + TILE_WIDTH - 1) / TILE_WIDTH;
+
+	for (size_t i = i_start; i < i_end; i++) {
+		const struct body_tile* tile_i = t->tiles + i / TILE_WIDTH;
+		__m512d x = _mm512_set1_pd(tile_i->x[i % TILE_WIDTH]);
+		__m512d y = _mm512_set1_pd(tile_i->y[i % TILE_WIDTH]);
+		__m512d z = _mm512_set1_pd(tile_i->z[i % TILE_WIDTH]);
+		__m512d mass_dt = _mm512_set1_pd(tile_i->mass[i % TILE_WIDTH] * GCONST * dt);
+		__m512d acc_x = zero, acc_y = zero, acc_z = zero, potential = zero;
+		size_t first = j_start > i ? j_start : i + 1;
+		__mmask8 mask = (__mmask8)(0xFF << (first % TILE_WIDTH));
+
+		for (size_t k = first / TILE_WIDTH; k < k_end; k++) {
+			const struct body_tile* tile = t->tiles + k;
+			size_t j = k * TILE_WIDTH;
+			__m512d x_dist = _mm512_sub_pd(_mm512_load_pd(tile->x), x);
+			__m512d y_dist = _mm512_sub_pd(_mm512_load_pd(tile->y), y);
+			__m512d z_dist = _mm512_sub_pd(_mm512_load_pd(tile->z), z);
+			__m512d dist2 = _mm512_fmadd_pd(x_dist, x_dist, _mm512_fmadd_pd(y_dist, y_dist, _mm512_mul_pd(z_dist, z_dist)));
+			dist2 = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(dist2, zero, _CMP_EQ_OQ), dist2, min_dist2);
+			__m512d inv_dist3 = _mm512_maskz_mov_pd(mask, inv_dist3_avx512(dist2, newton_steps));
+			__m512d s = _mm512_mul_pd(_mm512_load_pd(tile->mass), inv_dist3);
+			acc_x = _mm512_fmadd_pd(x_dist, s, acc_x);
+			acc_y = _mm512_fmadd_pd(y_dist, s, acc_y);
+			acc_z = _mm512_fmadd_pd(z_dist, s, acc_z);
+			if (with_potential) {
+				potential = _mm512_fmadd_pd(s, dist2, potential);
+			}
+
+			__m512d s_j = _mm512_mul_pd(inv_dist3, mass_dt);
+			_mm512_store_pd(velocity_x + j, _mm512_fnmadd_pd(x_dist, s_j, _mm512_load_pd(velocity_x + j)));
+			_mm512_store_pd(velocity_y + j, _mm512_fnmadd_pd(y_dist, s_j, _mm512_load_pd(velocity_y + j)));
+			_mm512_store_pd(velocity_z + j, _mm512_fnmadd_pd(z_dist, s_j, _mm512_load_pd(velocity_z + j)));
+			mask = 0xFF;
+		}
+
+		velocity_x[i] += GCONST * _mm512_reduce_add_pd(acc_x) * dt;
+		velocity_y[i] += GCONST * _mm512_reduce_add_pd(acc_y) * dt;
+		velocity_z[i] += GCONST * _mm512_reduce_add_pd(acc_z) * dt;
+		if (with_potential) {
+			sum += tile_i->mass[i % TILE_WIDTH] * _mm512_reduce_add_pd(potential);
+		}
+	}
+	return sum;
+}
+
+
+/**
+ * AVX-512 symmetric kernel, with_potential picks the specialised body that also sums m_i * m_j / r
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @param dt, the change in time
+ * @param newton_steps, the newton steps refining 1 / sqrt or 0 for the exact path
+ * @param with_potential, 1 to sum the potential of the pairs as well
+ * @return the sum of m_i * m_j / r over the block or 0.0 without with_potential
+ */
+__attribute__((target("avx512f")))
+static double pair_block_avx512(const struct body_tiles* t, double* restrict velocity_x, double* restrict velocity_y, double* restrict velocity_z,
+		size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int newton_steps, int with_potential) {
+	if (with_potential) {
+		return pair_block_avx512_body(t, velocity_x, velocity_y, velocity_z, i_start, i_end, j_start, j_end, dt, newton_steps, 1);
+	}
+	return pair_block_avx512_body(t, velocity_x, velocity_y, velocity_z, i_start, i_end, j_start, j_end, dt, newton_steps, 0);
+}
+
+
+/**
+ * AVX-512 potential kernel, eight j bodies are summed per instruction
+ * Lanes at or before i in the first group are masked off
+ * @param b, the body store, its arrays padded with massless bodies
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @return the sum of the block
+ */
+__attribute__((target("avx512f")))
+static double potential_block_avx512(const struct bodies* b, size_t i_start, size_t i_end, size_t j_start, size_t j_end) {
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d one = _mm512_set1_pd(1.0);
+	const __m512d min_dist = _mm512_set1_pd(MIN_DISTANCE);
+	double sum = 0.0;
+
+	for (size_t i = i_start; i < i_end; i++) {
+		__m512d x = _mm512_set1_pd(b->x[i]);
+		__m512d y = _mm512_set1_pd(b->y[i]);
+		__m512d z = _mm512_set1_pd(b->z[i]);
+		__m512d potential = zero;
+		size_t first = j_start > i ? j_start : i + 1;
+		__mmask8 mask = (__mmask8)(0xFF << (first % 8));
+
+		for (size_t j = first - first % 8; j < j_end; j += 8) {
+			__m512d x_dist = _mm512_sub_pd(_mm512_load_pd(b->x + j), x);
+			__m512d y_dist = _mm512_sub_pd(_mm512_load_pd(b->y + j), y);
+			__m512d z_dist = _mm512_sub_pd(_mm512_load_pd(b->z + j), z);
+			__m512d dist2 = _mm512_fmadd_pd(x_dist, x_dist, _mm512_fmadd_pd(y_dist, y_dist, _mm512_mul_pd(z_dist, z_dist)));
+			__m512d dist = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(dist2, zero, _CMP_EQ_OQ), _mm512_sqrt_pd(dist2), min_dist);
+			__m512d mass = _mm512_maskz_load_pd(mask, b->mass + j);
+			potential = _mm512_add_pd(potential, _mm512_mul_pd(mass, _mm512_div_pd(one, dist)));
+			mask = 0xFF;
+		}
+		sum += b->mass[i] * _mm512_reduce_add_pd(potential);
+	}
+	return sum;
+}
+
+
+/**
+ * Check whether the CPU can run the avx2 kernel
+ * @return 1 if supported else 0
+ */
+static int supports_avx2(void) {
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+
+/**
+ * Check whether the CPU can run the avx512 kernel
+ * @return 1 if supported else 0
+ */
+static int supports_avx512(void) {
+	return __builtin_cpu_supports("avx512f");
+}
+
+
+/**
+ * Check whether the CPU can run the scalar kernel
+ * @return always 1
+ */
+static int supports_scalar(void) {
+	return 1;
+}
+
+
+// Ordered from the widest kernel to the scalar fallback
+static const struct force_kernel force_kernels[] = {
+	{ "avx512", 8, kick_avx512, pair_block_avx512, potential_block_avx512, supports_avx512 },
+	{ "avx2", 4, kick_avx2, pair_block_avx2, potential_block_avx2, supports_avx2 },
+	{ "scalar", 1, kick_scalar, pair_block_scalar, potential_block_scalar, supports_scalar },
+};
+
+#define N_FORCE_KERNELS (sizeof(force_kernels) / sizeof(force_kernels[0]))
+
+static const struct force_kernel* active_kernel = NULL;
+
+// Accuracy of 1 / r^3, rsqrt modes refine a hardware estimate with newton steps
+static const struct force_precision force_precisions[] = {
+	{ "exact", 0 },
+	{ "rsqrt1", 1 },
+	{ "rsqrt2", 2 },
+};
+
+#define N_FORCE_PRECISIONS (sizeof(force_precisions) / sizeof(force_precisions[0]))
+
+static const struct force_precision* active_precision = force_precisions;
+
+
+/**
+ * Find a force kernel by name that the CPU can run
+ * @param name, the name of the kernel or "auto" for the widest supported one
+ * @return the kernel or NULL if it is unknown or not supported
+ */
+const struct force_kernel* force_kernel_find(const char* name) {
+
+	// If the parameter is invalid
+	if (name == NULL) {
+		return NULL;
+	}
+
+	__builtin_cpu_init();
+	for (size_t i = 0; i < N_FORCE_KERNELS; i++) {
+		if (!force_kernels[i].supported()) {
+			continue;
+		}
+		if (strcmp(name, "auto") == 0 || strcmp(name, force_kernels[i].name) == 0) {
+			return force_kernels + i;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Select the force kernel used by every step
+ * @param name, the name of the kernel or "auto" for the widest supported one
+ * @return 0 if selected or 1 if it is unknown or not supported
+ */
+int force_kernel_select(const char* name) {
+	const struct force_kernel* k = force_kernel_find(name);
+	if (k == NULL) {
+		return 1;
+	}
+	active_kernel = k;
+	return 0;
+}
+
+
+/**
+ * Get the selected force kernel, detecting the widest one on first use
+ * @return the force kernel
+ */
+const struct force_kernel* force_kernel_active(void) {
+	if (active_kernel == NULL) {
+		active_kernel = force_kernel_find("auto");
+	}
+	return active_kernel;
+}
+
+
+/**
+ * Select the accuracy of 1 / r^3 used by every step
+ * @param name, one of exact, rsqrt1 or rsqrt2
+ * @return 0 if selected or 1 if it is unknown
+ */
+int force_precision_select(const char* name) {
+
+	// If the parameter is invalid
+	if (name == NULL) {
+		return 1;
+	}
+
+	for (size_t i = 0; i < N_FORCE_PRECISIONS; i++) {
+		if (strcmp(name, force_precisions[i].name) == 0) {
+			active_precision = force_precisions + i;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/**
+ * Get the selected accuracy of 1 / r^3
+ * @return the force precision
+ */
+const struct force_precision* force_precision_active(void) {
+	return active_precision;
+}
+
+
+/**
+ * Add the acceleration of [start, end) to its velocity with the selected kernel and precision
+ * @param t, the tiles holding the positions of every body
+ * @param b, the body store whose velocities are updated
+ * @param start, the first body to update
+ * @param end, one past the last body to update
+ * @param dt, the change in time
+ */
+void force_kick(const struct body_tiles* t, struct bodies* b, size_t start, size_t end, double dt) {
+	force_kernel_active()->kick(t, b, start, end, dt, active_precision->newton_steps);
+}
+
+
+/**
+ * Measure the error of the selected kernel and precision against the exact scalar kernel
+ * The acceleration of up to samples bodies spread over the store is compared
+ * @param b, the body store, velocities are left unchanged
+ * @param t, the tiles of the body store, packed by this call
+ * @param samples, the maximum number of bodies to compare
+ * @param rms_error, set to the root mean square relative error if not NULL
+ * @return the maximum relative error of the force or -1.0 if invalid
+ */
+double force_error(struct bodies* b, struct body_tiles* t, size_t samples, double* rms_error) {
+
+	// If the parameters are invalid
+	if (b == NULL || t == NULL || samples == 0) {
+		return -1.0;
+	}
+
+	body_tiles_pack(t, b, 0, b->n_bodies);
+	size_t stride = b->n_bodies > samples ? b->n_bodies / samples : 1;
+	double max_error = 0.0, sum_error = 0.0;
+	size_t n = 0;
+
+	for (size_t i = 0; i < b->n_bodies; i += stride) {
+		double exact[3], approx[3];
+		double velocity_x = b->velocity_x[i], velocity_y = b->velocity_y[i], velocity_z = b->velocity_z[i];
+
+		// A unit kick from zero velocity leaves the acceleration behind
+		for (int pass = 0; pass < 2; pass++) {
+			double* acc = pass == 0 ? exact : approx;
+			b->velocity_x[i] = b->velocity_y[i] = b->velocity_z[i] = 0.0;
+			if (pass == 0) {
+				kick_scalar(t, b, i, i + 1, 1.0, 0);
+			} else {
+				force_kick(t, b, i, i + 1, 1.0);
+			}
+			acc[0] = b->velocity_x[i];
+			acc[1] = b->velocity_y[i];
+			acc[2] = b->velocity_z[i];
+		}
+		b->velocity_x[i] = velocity_x;
+		b->velocity_y[i] = velocity_y;
+		b->velocity_z[i] = velocity_z;
+
+		double norm = sqrt(exact[0] * exact[0] + exact[1] * exact[1] + exact[2] * exact[2]);
+		if (norm == 0.0) {
+			continue;
+		}
+		double dx = approx[0] - exact[0], dy = approx[1] - exact[1], dz = approx[2] - exact[2];
+		double error = sqrt(dx * dx + dy * dy + dz * dz) / norm;
+		max_error = error > max_error ? error : max_error;
+		sum_error += error * error;
+		n++;
+	}
+
+	if (rms_error != NULL) {
+		*rms_error = n > 0 ? sqrt(sum_error / n) : 0.0;
+	}
+	return max_error;
+}
+
+
+/**
+ * Walk the pairs (i, j > i) with i in [row_start, row_end) in the cache blocks of cache_block_sizes
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param row_start, the first i body
+ * @param row_end, one past the last i body
+ * @param dt, the change in time
+ * @param with_potential, 1 to also sum m_i * m_j / r over the pairs
+ * @return the sum of the potential or 0.0 without with_potential
+ */
+static double force_pair_walk(const struct body_tiles* t, double* velocity_x, double* velocity_y, double* velocity_z,
+		size_t row_start, size_t row_end, double dt, int with_potential) {
+	const struct force_kernel* k = force_kernel_active();
+	size_t len = t->n_bodies;
+	size_t i_block, j_block;
+	cache_block_sizes(&i_block, &j_block);
+	double potential = 0.0;
+
+	for (size_t i_start = row_start; i_start < row_end; i_start += i_block) {
+		size_t i_end = i_start + i_block < row_end ? i_start + i_block : row_end;
+		// j blocks start on a tile so the kernels only mask the first tile of a row
+		for (size_t j_start = i_start - i_start % TILE_WIDTH; j_start < len; j_start += j_block) {
+			size_t j_end = j_start + j_block < len ? j_start + j_block : len;
+			size_t i_last = i_end < j_end ? i_end : j_end;
+			potential += k->pair_block(t, velocity_x, velocity_y, velocity_z, i_start, i_last, j_start, j_end, dt,
+					active_precision->newton_steps, with_potential);
+		}
+	}
+	return potential;
+}
+
+
+/**
+ * Update the velocities of both bodies of every pair (i, j > i) with i in [row_start, row_end)
+ * using the selected kernel, the pairs are walked in the cache blocks of cache_block_sizes
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param row_start, the first i body
+ * @param row_end, one past the last i body
+ * @param dt, the change in time
+ */
+void force_pair_rows(const struct body_tiles* t, double* velocity_x, double* velocity_y, double* velocity_z, size_t row_start, size_t row_end, double dt) {
+	force_pair_walk(t, velocity_x, velocity_y, velocity_z, row_start, row_end, dt, 0);
+}
+
+
+/**
+ * Update the velocities of both bodies of every pair (i, j > i) with i in [row_start, row_end)
+ * as force_pair_rows does and sum their potential in the same pass
+ * The distances are the ones the forces use so with an rsqrt precision the potential is approximate as well
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param row_start, the first i body
+ * @param row_end, one past the last i body
+ * @param dt, the change in time
+ * @return the sum of m_i * m_j / r over the pairs
+ */
+double force_pair_rows_potential(const struct body_tiles* t, double* velocity_x, double* velocity_y, double* velocity_z,
+		size_t row_start, size_t row_end, double dt) {
+	return force_pair_walk(t, velocity_x, velocity_y, velocity_z, row_start, row_end, dt, 1);
+}
+
+
+/**
+ * Update the velocities of both bodies of every pair (i, j > i) with i in [i_start, i_end)
+ * and j in [j_start, j_end) using the selected kernel, the block is walked in the cache
+ * blocks of cache_block_sizes, only the velocities and tiles of the two ranges are touched
+ * @param t, the tiles holding the positions of every body
+ * @param velocity_x, the x velocities to update, aligned and padded to whole tiles
+ * @param velocity_y, the y velocities to update, aligned and padded to whole tiles
+ * @param velocity_z, the z velocities to update, aligned and padded to whole tiles
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @param dt, the change in time
+ * @param with_potential, 1 to also sum m_i * m_j / r over the pairs
+ * @return the sum of the potential, 0.0 without with_potential or if invalid
+ */
+double force_pair_block(const struct body_tiles* t, double* velocity_x, double* velocity_y, double* velocity_z,
+		size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int with_potential) {
+
+	// If the parameters are invalid
+	if (t == NULL || j_start % TILE_WIDTH != 0 || i_end > t->n_bodies || j_end > t->n_bodies) {
+		return 0.0;
+	}
+
+	const struct force_kernel* k = force_kernel_active();
+	size_t i_block, j_block;
+	cache_block_sizes(&i_block, &j_block);
+	double potential = 0.0;
+
+	for (size_t i_first = i_start; i_first < i_end; i_first += i_block) {
+		size_t i_last = i_first + i_block < i_end ? i_first + i_block : i_end;
+		// Rows only start on a later j block once their own tile is reached
+		size_t j_first = i_first - i_first % TILE_WIDTH;
+		j_first = j_first > j_start ? j_first : j_start;
+		for (; j_first < j_end; j_first += j_block) {
+			size_t j_last = j_first + j_block < j_end ? j_first + j_block : j_end;
+			potential += k->pair_block(t, velocity_x, velocity_y, velocity_z, i_first, i_last < j_last ? i_last : j_last,
+					j_first, j_last, dt, active_precision->newton_steps, with_potential);
+		}
+	}
+	return potential;
+}
+
+
+/**
+ * Sum m_i * m_j / r over the pairs (i, j > i) with i in [i_start, i_end) and j in [j_start, j_end)
+ * using the selected kernel, the block is walked in the cache blocks of cache_block_sizes
+ * in a fixed order so the same block always gives the same sum
+ * @param b, the body store, its arrays padded with massless bodies
+ * @param i_start, the first i body
+ * @param i_end, one past the last i body
+ * @param j_start, the first j body, a multiple of TILE_WIDTH
+ * @param j_end, one past the last j body, a multiple of TILE_WIDTH or the number of bodies
+ * @return the sum of the block or 0.0 if invalid
+ */
+double force_potential(const struct bodies* b, size_t i_start, size_t i_end, size_t j_start, size_t j_end) {
+
+	// If the parameters are invalid
+	if (b == NULL || j_start % TILE_WIDTH != 0 || i_end > b->n_bodies || j_end > b->n_bodies) {
+		return 0.0;
+	}
+
+	const struct force_kernel* k = force_kernel_active();
+	size_t i_block, j_block;
+	cache_block_sizes(&i_block, &j_block);
+	double sum = 0.0;
+
+	for (size_t i_first = i_start; i_first < i_end; i_first += i_block) {
+		size_t i_last = i_first + i_block < i_end ? i_first + i_block : i_end;
+		// Rows only start on a later j block once their own tile is reached
+		size_t j_first = i_first - i_first % TILE_WIDTH;
+		j_first = j_first > j_start ? j_first : j_start;
+		for (; j_first < j_end; j_first += j_block) {
+			size_t j_last = j_first + j_block < j_end ? j_first + j_block : j_end;
+			sum += k->potential_block(b, i_first, i_last < j_last ? i_last : j_last, j_first, j_last);
+		}
+	}
+	return sum;
+}
+
+
+/**
+ * Step the simulation with the selected force kernel
+ * Every pair is visited once and both bodies are updated
+ * @param b, the body store
+ * @param t, the tiles of the body store
+ * @param dt, the change in time
+ */
+void bodies_step_tiled(struct bodies* b, struct body_tiles* t, double dt) {
+
+	// If the parameters are invalid
+	if (b == NULL || t == NULL) {
+		return;
+	}
+
+	body_tiles_pack(t, b, 0, b->n_bodies);
+	force_pair_rows(t, b->velocity_x, b->velocity_y, b->velocity_z, 0, b->n_bodies, dt);
+	for (size_t i = 0; i < b->n_bodies; i++) {
+		b->x[i] += b->velocity_x[i] * dt;
+		b->y[i] += b->velocity_y[i] * dt;
+		b->z[i] += b->velocity_z[i] * dt;
+	}
+}
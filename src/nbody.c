@@ -1,27 +1,37 @@
 #include "nbody.h"
 #include "functions.c"
 
+#define USAGE "Usage: ./nbody <iterations> <change_of_time> <-b n_bodies | -f file_name> [ -model random|plummer|cube|disk|collapse ] [ -seed SEED ] [ -t NUM_THREADS] [ -k auto|avx512|avx2|scalar ] [ -p exact|rsqrt1|rsqrt2 ] [ -e direct|bh|fmm|pm|p3m|flow|stream ] [ -theta THETA ] [ -order ORDER ] [ -grid GRID ] [ -boundary isolated|periodic ] [ -split SPLIT ] [ -tile BODIES ] [ -energy end|STEPS|SECONDSs ] [ -energy-from exact|force ] [ -energy-log FILE ] [ -barrier spin|pthread ] [ -pin none|cores|nodes ] [ -pages normal|thp|huge ] [ -store FILE ] [ -traj FILE ] [ -traj-every STEPS ] [ -traj-buffers BUFFERS ] [ -traj-threads THREADS ] [ -traj-error ERROR ] [ -checkpoint FILE ] [ -checkpoint-every STEPS ]\n" \
+		"       ./nbody --resume <checkpoint_file> [ -t NUM_THREADS ] [ options other than the physics ]\n"
+
 /**
  * Manage the threaded runtime of the nbody simulation
- * @param N_THREADS, number of threads
- * @param bodies, the array of the body objects
- * @param n_bodies, the number of bodies
- * @apram iterations, the number of iterations to perform
+ * @param pool, the threads to run on
+ * @param bodies, the body store
+ * @param iterations, the number of iterations to perform
  * @param dt, the step for iterations
+ * @param engine, the force engine
+ * @param params, the parameters of the engine
+ * @param schedule, when the energy is measured
+ * @param trajectory, where the frames of positions go or NULL for none
+ * @param first, the step the run starts from, above 0 when resumed
+ * @param checkpoint, where checkpoints go or NULL for none
  */
-void run_threaded(size_t N_THREADS, struct body** bodies, size_t n_bodies, size_t iterations, double dt) {
+void run_threaded(struct thread_pool* pool, struct bodies* bodies, size_t iterations, double dt,
+		const struct engine* engine, const struct engine_params* params, struct energy_schedule* schedule,
+		struct trajectory* trajectory, size_t first, struct checkpoint* checkpoint) {
+	size_t n_bodies = bodies->n_bodies;
+	size_t N_THREADS = pool->n_threads;
 
-	// Initialise the barrier
-	pthread_barrier_t barrier;
-	if (pthread_barrier_init(&barrier, NULL, N_THREADS)) {
-		fprintf(stderr, "Error initialising barrier.\n");
+	// State shared by every thread of the engine
+	void* state = engine->create(bodies, N_THREADS, params);
+	if (state == NULL) {
+		fprintf(stderr, "Error creating the %s engine.\n", engine->name);
 		return;
 	}
 
-	// Create the threads and data ptrs
-	pthread_t* threads = malloc(sizeof(pthread_t) * N_THREADS);		
-	struct thread_data** tdata = malloc(sizeof(struct thread_data*) * N_THREADS);
-	size_t thread_segment = n_bodies/N_THREADS;
+	// Create the thread data
+	struct thread_data* tdata = aligned_alloc(CACHE_LINE, sizeof(struct thread_data) * N_THREADS);
 	
 	// Declare initial and final energy to compare
 	register double initial_energy = 0.0;
@@ -29,151 +39,463 @@ void run_threaded(size_t N_THREADS, struct body** bodies, size_t n_bodies, size_
 
 	// Loop through and initialise the thread data
 	for (size_t i = 0; i < N_THREADS; i++) {
-		tdata[i] = malloc(sizeof(struct thread_data));
-		tdata[i]->bodies = bodies;
-		tdata[i]->n_bodies = n_bodies;
-		tdata[i]->iterations = iterations;
-		tdata[i]->start = i * thread_segment;
-		tdata[i]->end = (i + 1) * thread_segment;
-		tdata[i]->initial_energy = 0;
-		tdata[i]->final_energy = 0;
-		tdata[i]->barrier = &barrier;
-		tdata[i]->dt = dt;
-
-		// If it is final thread then complete the rest
-		if (i == N_THREADS - 1) {
-			tdata[i]->end = n_bodies;
-		}
-		pthread_create(threads+i, NULL, worker, tdata[i]);
-	}
+		tdata[i].bodies = bodies;
+		tdata[i].engine = engine;
+		tdata[i].state = state;
+		tdata[i].id = i;
+		tdata[i].n_threads = N_THREADS;
+		tdata[i].n_bodies = n_bodies;
+		tdata[i].iterations = iterations;
 
-	for (int i = 0; i < N_THREADS; i++) {
-		pthread_join(threads[i], NULL);
-		initial_energy += tdata[i]->initial_energy;
-		final_energy += tdata[i]->final_energy;
+		// Slices start on whole cache lines and the final thread completes the rest
+		bodies_slice(n_bodies, N_THREADS, i, &tdata[i].start, &tdata[i].end);
+		tdata[i].initial_energy = 0;
+		tdata[i].final_energy = 0;
+		tdata[i].pool = pool;
+		tdata[i].schedule = schedule;
+		tdata[i].trajectory = trajectory;
+		tdata[i].first = first;
+		tdata[i].checkpoint = checkpoint;
+		tdata[i].dt = dt;
 	}
+	tdata[0].initial_energy = first > 0 ? schedule->initial : 0;
 
-	compare_energy(initial_energy, final_energy);
-
-	// Free data in each thread
+	// The pool's threads already exist so the run is one job
+	pool_run(pool, worker, tdata);
 	for (size_t i = 0; i < N_THREADS; i++) {
-		free(tdata[i]);
+		initial_energy += tdata[i].initial_energy;
+		final_energy += tdata[i].final_energy;
 	}
 
-	// Deallocate mmeory for threads and data
-	free(threads);
-	free(tdata);
-	pthread_barrier_destroy(&barrier);
+	if (checkpoint == NULL || checkpoint->stopped == SIZE_MAX) {
+		compare_energy(initial_energy, final_energy);
+	}
+	energy_report(schedule);
+	trajectory_report(trajectory);
+	checkpoint_report(checkpoint);
+	printf("Barrier: %s, %lu phases\n", pool_barrier_name(pool), atomic_load(&pool->epoch));
 
+	// Deallocate memory for the thread data
+	free(tdata);
+	engine->destroy(state);
 }
 
 
 /**
  * Initalise the program using the given starting parameters
- * @param bodies, the struct array of all the bodies
- * @param n_bodies, the number of bodies
+ * @param bodies, the body store
  * @param iterations, the number of iterations
  * @param df, the rate of change 
  * @param is_threaded, whether to activate parallelism or not
+ * @param engine, the force engine
+ * @param params, the parameters of the engine
+ * @param schedule, when the energy is measured
+ * @param trajectory, where the frames of positions go or NULL for none
+ * @param first, the step the run starts from, above 0 when resumed
+ * @param checkpoint, where checkpoints go or NULL for none
  */
-void init(struct body** bodies, size_t n_bodies, size_t iterations, double dt, int is_threaded, size_t N_THREADS) {
+void init(struct bodies* bodies, size_t iterations, double dt, int is_threaded, size_t N_THREADS,
+		const struct engine* engine, const struct engine_params* params, struct energy_schedule* schedule,
+		struct trajectory* trajectory, size_t first, struct checkpoint* checkpoint) {
+
+	// The threads are started once and kept for every stage of the run
+	struct thread_pool* pool = pool_create(is_threaded ? N_THREADS : 1);
+	if (pool == NULL) {
+		fprintf(stderr, "Error creating the thread pool.\n");
+		return;
+	}
+
+	// Pinned threads first touch their own slices so the pages are on their nodes, a store in a file stays there
+	if (pool->pin != POOL_PIN_NONE && bodies->file < 0 && bodies_place(bodies, pool)) {
+		fprintf(stderr, "Error placing the bodies, they stay where they were loaded.\n");
+	}
+	placement_report(pool, bodies);
+
 	// Run a threaded solution
 	if (is_threaded) {			
-		run_threaded(N_THREADS, bodies, n_bodies, iterations, dt);
+		run_threaded(pool, bodies, iterations, dt, engine, params, schedule, trajectory, first, checkpoint);
+		pool_destroy(pool);
 		return;
 	}
 
-	double initial_energy = 0, final_energy = 0;		// The final and start energies of the system
+	double initial_energy = first > 0 ? schedule->initial : 0, final_energy = 0;		// The final and start energies of the system
+	size_t n_bodies = bodies->n_bodies;
 
-	initial_energy = energy(bodies, n_bodies, 0, n_bodies);	// Get the initial energy of the system
-	// Step through a single threaded implementation
-	while (iterations-- > 0) {
-		step(bodies, n_bodies, dt);
-		initial_energy = energy(bodies, n_bodies, 0, n_bodies);	// Get the initial energy of the system
+	// A single thread runs the engine on a pool of one
+	void* state = engine->create(bodies, 1, params);
+	if (state == NULL) {
+		fprintf(stderr, "Error creating the %s engine.\n", engine->name);
+		pool_destroy(pool);
+		return;
 	}
-	final_energy = energy(bodies, n_bodies, 0, n_bodies);	// Get the energy of the system after exiting
-	compare_energy(initial_energy, final_energy);
-
 
+	// Step through a single threaded implementation, measuring the energy only when it is due
+	int due = energy_due(schedule, first, iterations) && first == 0;
+	for (size_t step = first; ; step++) {
+		if (due) {
+			final_energy = energy_measure(schedule, bodies, engine, state, pool, 0, step);
+			energy_record(schedule, step, step * dt, final_energy);
+			initial_energy = step == 0 ? final_energy : initial_energy;
+		}
+		if (trajectory_due(trajectory, step, iterations)) {
+			trajectory_acquire(trajectory, step, step * dt);
+			trajectory_copy(trajectory, bodies, 1, 0, n_bodies);
+		}
+		int save = checkpoint_due(checkpoint, step, first, iterations);
+		if (save) {
+			checkpoint->due[step % 3] = save;
+			checkpoint_acquire(checkpoint, bodies, step, engine, state);
+			checkpoint_copy(checkpoint, 0, 1, 0, n_bodies);
+		}
+		if (step == iterations || save == CHECKPOINT_STOP) {
+			break;
+		}
+		// Decided before the step so one whose end is measured sums the potential as it goes
+		due = energy_due(schedule, step + 1, iterations);
+		engine->step(state, bodies, 0, 1, 0, n_bodies, dt, pool, schedule->from_force && due);
+	}
+	if (checkpoint == NULL || checkpoint->stopped == SIZE_MAX) {
+		compare_energy(initial_energy, final_energy);
+	}
+	energy_report(schedule);
+	trajectory_report(trajectory);
+	checkpoint_report(checkpoint);
+	engine->destroy(state);
+	pool_destroy(pool);
 }
 
 
 int main(int argc, char** argv) {
+	// A resumed run takes everything that changes the result from its checkpoint
+	const char* resume = argc >= 3 && strcmp(argv[1], "--resume") == 0 ? argv[2] : NULL;
+
 	// Check if the number of arguments is valid
-	if (argc != 5 && argc != 7) {
-		fprintf(stderr, "Invalid number of arguments.\nUsage: ./nbody <iterations> <change_of_time> <-b n_bodies | -f file_name> [ -t NUM_THREADS]\n");
+	if (argc < 5 && resume == NULL) {
+		fprintf(stderr, "Invalid number of arguments.\n" USAGE);
 		return 1;
 	}
 
 	size_t n_iterations = 0, n_bodies = 0;			// Declare required variables
 	int is_threaded = 0;
-	struct body** bodies = NULL;
+	struct bodies* bodies = NULL;
 	size_t N_THREADS = 1;
+	const struct engine* engine = engine_find("direct");
+	struct engine_params params = { .theta = DEFAULT_THETA, .order = DEFAULT_FMM_ORDER, .grid = DEFAULT_PM_GRID, .periodic = 0,
+		.split = DEFAULT_P3M_SPLIT };
+	struct energy_schedule schedule = { 0 };
+	const char* energy_log = NULL;
+	const char* trajectory_path = NULL;
+	size_t trajectory_every = TRAJECTORY_EVERY, trajectory_buffers = TRAJECTORY_BUFFERS, trajectory_threads = 1;
+	double trajectory_error = 0.0;
+	const char* checkpoint_path = NULL;
+	size_t checkpoint_every = 0;
+	const struct generator* model = generator_find("random");
+	size_t seed = GENERATE_SEED, counter = 0;
 
-	// Check for the threaded parameter argument
-	if (argc == 7) {
-		if (strncmp(argv[5], "-t", 3) == 0) {		// Check if we want a threaded run
-			is_threaded = 1;
-		} else {
-			fprintf(stderr, "Invalid option.\nUsage: ./nbody <iterations> <change_of_time> <-b n_bodies | -f file_name> [ -t NUM_THREADS]\n");
+	// Check for the optional arguments
+	for (int i = resume != NULL ? 3 : 5; i < argc; i++) {
+		if (i + 1 >= argc) {				// Every option takes a value
+			fprintf(stderr, "Missing value for %s.\n" USAGE, argv[i]);
 			return 1;
 		}
-		if (long_conversion(&N_THREADS, argv[6]) || N_THREADS == 0) {
-			printf("Invalid number of threads.\n");
+
+		if (strncmp(argv[i], "-model", 7) == 0) {	// Check for the model of generated bodies
+			model = generator_find(argv[++i]);
+			if (model == NULL) {
+				fprintf(stderr, "Unknown model %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-seed", 6) == 0) {	// Check for the seed of generated bodies
+			if (long_conversion(&seed, argv[++i])) {
+				printf("Invalid seed.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-t", 3) == 0) {		// Check if we want a threaded run
+			is_threaded = 1;
+			if (long_conversion(&N_THREADS, argv[++i]) || N_THREADS == 0) {
+				printf("Invalid number of threads.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-k", 3) == 0) {	// Check for a force kernel
+			if (force_kernel_select(argv[++i])) {
+				fprintf(stderr, "Unknown or unsupported kernel %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-p", 3) == 0) {	// Check for the force precision
+			if (force_precision_select(argv[++i])) {
+				fprintf(stderr, "Unknown precision %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-e", 3) == 0) {	// Check for a force engine
+			engine = engine_find(argv[++i]);
+			if (engine == NULL) {
+				fprintf(stderr, "Unknown engine %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-theta", 7) == 0) {	// Check for the opening angle
+			if (double_conversion(&params.theta, argv[++i]) || params.theta < 0.0) {
+				printf("Invalid theta value.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-order", 7) == 0) {	// Check for the expansion order
+			if (long_conversion(&params.order, argv[++i]) || params.order == 0 || params.order > FMM_MAX_ORDER) {
+				printf("Invalid expansion order.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-grid", 6) == 0) {	// Check for the mesh size
+			if (long_conversion(&params.grid, argv[++i]) || params.grid < PM_MIN_GRID || params.grid > PM_MAX_GRID
+					|| (params.grid & (params.grid - 1)) != 0) {
+				printf("Invalid grid size, use a power of two from %d to %d.\n", PM_MIN_GRID, PM_MAX_GRID);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-boundary", 10) == 0) {	// Check for the mesh boundary
+			i++;
+			if (strcmp(argv[i], "isolated") == 0) {
+				params.periodic = 0;
+			} else if (strcmp(argv[i], "periodic") == 0) {
+				params.periodic = 1;
+			} else {
+				fprintf(stderr, "Unknown boundary %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-split", 7) == 0) {	// Check for the p3m split scale
+			if (double_conversion(&params.split, argv[++i]) || !(params.split > 0.0)) {
+				printf("Invalid split value.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-tile", 6) == 0) {	// Check for the bodies the stream engine keeps in memory
+			if (long_conversion(&params.tile, argv[++i]) || params.tile == 0) {
+				printf("Invalid tile size.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-energy", 8) == 0) {	// Check for the energy cadence
+			if (energy_schedule_parse(&schedule, argv[++i])) {
+				printf("Invalid energy cadence, use end, a number of steps or seconds such as 0.5s.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-energy-from", 13) == 0) {	// Check for the energy source
+			i++;
+			if (strcmp(argv[i], "exact") == 0) {
+				schedule.from_force = 0;
+			} else if (strcmp(argv[i], "force") == 0) {
+				schedule.from_force = 1;
+			} else {
+				fprintf(stderr, "Unknown energy source %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-energy-log", 12) == 0) {	// Check for the energy time series
+			energy_log = argv[++i];
+		} else if (strncmp(argv[i], "-barrier", 9) == 0) {	// Check for the thread barrier
+			if (pool_barrier_select(argv[++i])) {
+				fprintf(stderr, "Unknown barrier %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-pin", 5) == 0) {	// Check for the thread placement
+			if (pool_pin_select(argv[++i])) {
+				fprintf(stderr, "Unknown placement %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-pages", 7) == 0) {	// Check for the pages of the bodies
+			if (bodies_pages_select(argv[++i])) {
+				fprintf(stderr, "Unknown pages %s.\n", argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-store", 7) == 0) {	// Check for a file to keep the bodies in
+			if (bodies_store_select(argv[++i])) {
+				fprintf(stderr, "Invalid store file.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-traj", 6) == 0) {	// Check for a trajectory file
+			trajectory_path = argv[++i];
+		} else if (strncmp(argv[i], "-traj-every", 12) == 0) {	// Check for the steps between frames
+			if (long_conversion(&trajectory_every, argv[++i]) || trajectory_every == 0) {
+				printf("Invalid trajectory interval.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-traj-buffers", 14) == 0) {	// Check for the frames that can wait for the writer
+			if (long_conversion(&trajectory_buffers, argv[++i]) || trajectory_buffers == 0) {
+				printf("Invalid number of trajectory buffers.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-traj-threads", 14) == 0) {	// Check for the threads that compress frames
+			if (long_conversion(&trajectory_threads, argv[++i]) || trajectory_threads == 0) {
+				printf("Invalid number of trajectory threads.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-traj-error", 12) == 0) {	// Check for the error of quantized frames
+			if (double_conversion(&trajectory_error, argv[++i]) || !(trajectory_error >= 0.0) || isinf(trajectory_error)) {
+				printf("Invalid trajectory error.\n");
+				return 1;
+			}
+		} else if (strncmp(argv[i], "-checkpoint", 12) == 0) {	// Check for a checkpoint file
+			checkpoint_path = argv[++i];
+		} else if (strncmp(argv[i], "-checkpoint-every", 18) == 0) {	// Check for the steps between checkpoints
+			if (long_conversion(&checkpoint_every, argv[++i]) || checkpoint_every == 0) {
+				printf("Invalid checkpoint interval.\n");
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "Invalid option.\n" USAGE);
 			return 1;
 		}
 	}
 
 
-	// Get the long conversion of the iterations
-	if (long_conversion(&n_iterations, argv[1])) {
-		printf("Invalid number of iterations.\n");
-		return 1;
-	}
-
-	// Get the conversion of the double
 	double dt = 0.01;
-	if (double_conversion(&dt, argv[2])) {
-		printf("Invalid dt value.\n");
-		return 1;
+	size_t first = 0;
+	if (resume != NULL) {
 
-	}
+		// The bodies are the snapshot in the checkpoint and the run goes on with its settings
+		struct checkpoint_state saved;
+		size_t tile = params.tile;
+		bodies = bodies_to_store(bodies_map_snapshot(resume));
+		if (bodies == NULL || checkpoint_read(resume, &saved) || checkpoint_restore(&saved, &engine, &params, &schedule)) {
+			fprintf(stderr, "Cannot resume from %s, it is not a checkpoint or its engine, kernel or precision is unavailable.\n", resume);
+			bodies_destroy(bodies);
+			return 1;
+		}
+		params.tile = tile;		// The tile only changes how the stream engine reads its bodies
+		n_bodies = bodies->n_bodies;
+		n_iterations = saved.iterations;
+		dt = saved.dt;
+		first = saved.step;
+		seed = saved.seed;
+		counter = saved.counter;
+		if (!is_threaded) {
+			is_threaded = (int)saved.threaded;
+			N_THREADS = saved.n_threads;
+		} else if (!saved.threaded || N_THREADS != saved.n_threads) {
+			printf("The checkpoint ran on %zu threads, on %zu the steps may not match an uninterrupted run bit for bit.\n",
+					saved.threaded ? (size_t)saved.n_threads : 1, N_THREADS);
+		}
+		checkpoint_path = checkpoint_path != NULL ? checkpoint_path : resume;
+		printf("Resuming from step %zu of %zu\n", first, n_iterations);
+	} else {
+		// Get the long conversion of the iterations
+		if (long_conversion(&n_iterations, argv[1])) {
+			printf("Invalid number of iterations.\n");
+			return 1;
+		}
 
-	// If it is searching for a file
-	if (strncmp(argv[3], "-f", 3) == 0) {
-	
-		FILE* file = fopen(argv[4], "r");		// Open the file in read mode
-		// If the file is not found
-		if (file == NULL) {				
-			fprintf(stderr, "Cannot find file.\n");
+		// Get the conversion of the double
+		if (double_conversion(&dt, argv[2])) {
+			printf("Invalid dt value.\n");
 			return 1;
+
 		}
-		n_bodies = get_file_len(file);			// Get the length of the file
-		rewind(file);					// Rewind back to the start of the file
-		bodies = read_file(file, n_bodies);		// Read the file from the array
-		fclose(file);					// Close the file
 
-	} else if (strncmp(argv[3], "-b", 3) == 0) {
+		// If it is searching for a file
+		if (strncmp(argv[3], "-f", 3) == 0) {
+
+			bodies = bodies_load(argv[4], N_THREADS);	// Map a snapshot or parse a csv on the run's threads
+			n_bodies = bodies != NULL ? bodies->n_bodies : 0;
+			seed = 0;		// Loaded bodies came from no seed
+
+		} else if (strncmp(argv[3], "-b", 3) == 0) {
 		
-		// Get the number of bodies
-		if (long_conversion(&n_bodies, argv[4])) {
-			printf("Invalid n_bodies value.\n");
-			return 1;
+			// Get the number of bodies
+			if (long_conversion(&n_bodies, argv[4])) {
+				printf("Invalid n_bodies value.\n");
+				return 1;
+			}
+			bodies = bodies_generate(model->name, n_bodies, seed, N_THREADS);	// Generate the bodies on the run's threads
+			counter = n_bodies;
+			printf("Generated %zu bodies of the %s model from seed %zu\n", n_bodies, model->name, seed);
+
+		} else {
+			fprintf(stderr, "Invalid choice use -b or -f.\n" USAGE);
+			return -1;
 		}
-		bodies = gen_random_bodies(n_bodies);		// Generate the random bodies
+	}
 
-	} else {
-		fprintf(stderr, "Invalid choice use -b or -f.\nUsage: ./nbody <iterations> <change_of_time> <-b n_bodies | -f file_name> [ -t NUM_THREADS]\n");
-		return -1;
+	// If no bodies could be loaded
+	if (bodies == NULL) {
+		fprintf(stderr, "No bodies to simulate.\n");
+		return 1;
 	}
 
 	// If too many threads
 	if (N_THREADS > n_bodies) {
 		fprintf(stderr, "Too many threads > n_bodies.\n");
+		bodies_destroy(bodies);
 		return 1;
 	}
 
-	init(bodies, n_bodies, n_iterations, dt, is_threaded, N_THREADS);		// Initialise the steps
-	clean_up(bodies, n_bodies);					// Clean up the bodies array
-	return 0;
+	printf("Force engine: %s, kernel: %s, precision: %s\n", engine->name, force_kernel_active()->name, force_precision_active()->name);
+
+	// Measure what an approximate 1 / r^3 costs in accuracy
+	if (force_precision_active()->newton_steps > 0) {
+		struct body_tiles* tiles = body_tiles_create(n_bodies);
+		double rms_error = 0.0;
+		double max_error = force_error(bodies, tiles, FORCE_ERROR_SAMPLES, &rms_error);
+		printf("Force error against exact kernel: max %e, rms %e\n", max_error, rms_error);
+		body_tiles_destroy(tiles);
+	}
+	// Measure the multipole error on a sample so the order can be chosen per job
+	if (strcmp(engine->name, "fmm") == 0) {
+		double force_rms = 0.0;
+		double energy_error = fmm_error(bodies, &params, FMM_ERROR_SAMPLES, &force_rms);
+		if (energy_error < 0.0) {
+			fprintf(stderr, "Invalid fmm parameters, theta must be in (0, 1).\n");
+			bodies_destroy(bodies);
+			return 1;
+		}
+		printf("FMM order %zu error against direct sum on %zu bodies: energy %e, force rms %e\n",
+				params.order, n_bodies < FMM_ERROR_SAMPLES ? n_bodies : FMM_ERROR_SAMPLES, energy_error, force_rms);
+	}
+	// Without a potential from the force pass every measurement sums the pairs
+	if (schedule.from_force && engine->potential == NULL) {
+		printf("The %s engine keeps no potential, the energy is summed over pairs.\n", engine->name);
+	}
+	if (energy_log != NULL) {
+		schedule.log = fopen(energy_log, resume != NULL ? "a" : "w");		// A resumed run adds to its log
+		if (schedule.log == NULL) {
+			fprintf(stderr, "Cannot open energy log %s.\n", energy_log);
+			bodies_destroy(bodies);
+			return 1;
+		}
+	}
+	struct trajectory* trajectory = NULL;
+	if (trajectory_path != NULL) {
+		trajectory = trajectory_open(trajectory_path, n_bodies, trajectory_every, trajectory_buffers, trajectory_threads, dt,
+				trajectory_error);
+		if (trajectory == NULL) {
+			fprintf(stderr, "Cannot open trajectory %s.\n", trajectory_path);
+			if (schedule.log != NULL) {
+				fclose(schedule.log);
+			}
+			bodies_destroy(bodies);
+			return 1;
+		}
+	}
+	struct checkpoint* checkpoint = NULL;
+	if (checkpoint_path != NULL) {
+		checkpoint = checkpoint_open(checkpoint_path, checkpoint_every, engine, &params, &schedule, n_iterations, dt,
+				is_threaded, N_THREADS);
+		if (checkpoint == NULL) {
+			fprintf(stderr, "Cannot set up checkpoints to %s.\n", checkpoint_path);
+			if (schedule.log != NULL) {
+				fclose(schedule.log);
+			}
+			trajectory_close(trajectory);
+			bodies_destroy(bodies);
+			return 1;
+		}
+		checkpoint->state.seed = seed;		// Every body took its own stream of the seed
+		checkpoint->state.counter = counter;
+	}
+
+	init(bodies, n_iterations, dt, is_threaded, N_THREADS, engine, &params, &schedule, trajectory, first, checkpoint);		// Initialise the steps
+	if (schedule.log != NULL) {
+		fclose(schedule.log);
+	}
+	if (trajectory_close(trajectory)) {
+		fprintf(stderr, "Error writing trajectory %s.\n", trajectory_path);
+	}
+	int stopped = checkpoint != NULL && checkpoint->stopped != SIZE_MAX;		// A SIGTERM ended the run early
+	if (checkpoint_close(checkpoint)) {
+		fprintf(stderr, "Error writing checkpoint %s.\n", checkpoint_path);
+	}
+	bodies_destroy(bodies);						// Clean up the body store
+	return stopped ? 128 + SIGTERM : 0;
 }
@@ -1,5 +1,6 @@
 #ifndef NBODY_H
 #define NBODY_H
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,110 @@
 #include <errno.h>
 #include <stdatomic.h>
 #include <pthread.h>
+#include <complex.h>
+#include <sched.h>
+#include <stdint.h>
+
+#define PI (3.141592653589793)
+#define SOLARMASS (4 * PI * PI)
+#define NDAYS (365.25)
+#define GCONST (6.67e-11) 
+#define DEFAULT_RAND_BOUND (1000000)
+#define CACHE_LINE (64)
+#define BODY_ARRAYS (7)
+#define TILE_WIDTH (8)
+#define MIN_DISTANCE (0.02)
+#define RSQRT_MAGIC (0x5fe6eb50c7b537a9ULL)
+#define FORCE_ERROR_SAMPLES (256)
+#define POOL_RESULTS (256)
+#define ENERGY_BLOCKS (22)
+#define POOL_TASKS_PER_THREAD (8)
+#define POOL_SPINS (2048)
+#define POOL_PIN_NONE (0)
+#define POOL_PIN_CORES (1)
+#define POOL_PIN_NODES (2)
+#define BODY_PAGES_NORMAL (0)
+#define BODY_PAGES_THP (1)
+#define BODY_PAGES_HUGE (2)
+#define BODY_PAGES_FILE (3)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define TOPOLOGY_MAX_NODES (64)
+#define CSV_MIN_CHUNK (64 * 1024)
+#define CSV_MAX_NUMBER (64)
+#define CSV_FAST_DIGITS (19)
+#define CSV_FAST_EXPONENT (22)
+#define CSV_POWER_RANGE (64)
+#define CSV_MAX_ERRORS (20)
+#define SNAPSHOT_MAGIC "NBODYSNP"
+#define SNAPSHOT_VERSION (1)
+#define SNAPSHOT_ORDER (0x01020304)
+#define SNAPSHOT_DATA_OFFSET (4096)
+#define FLOW_BLOCKS_PER_THREAD (2)
+#define STREAM_TILE (1 << 20)
+#define PHILOX_M0 (0xD2511F53U)
+#define PHILOX_M1 (0xCD9E8D57U)
+#define PHILOX_W0 (0x9E3779B9U)
+#define PHILOX_W1 (0xBB67AE85U)
+#define PHILOX_ROUNDS (10)
+#define GENERATE_SEED (1)
+#define GENERATE_CHUNK (4096)
+#define GENERATE_MASS (1.989e30)
+#define GENERATE_RADIUS (1.496e11)
+#define GENERATE_RANDOM_BOUND (1073741824.0)
+#define PLUMMER_CUTOFF (10.0)
+#define DISK_HEIGHT (0.1)
+#define CUBE_ENERGY (0.9411)
+#define STREAM_WINDOW (1 << 16)
+#define ENERGY_SEGMENT (16)
+#define TRAJECTORY_MAGIC "NBODYTRJ"
+#define TRAJECTORY_INDEX_MAGIC "NBODYIDX"
+#define TRAJECTORY_VERSION (3)
+#define TRAJECTORY_OLDEST_VERSION (2)
+#define TRAJECTORY_EVERY (100)
+#define TRAJECTORY_BUFFERS (8)
+#define TRAJECTORY_CHUNK (16384)
+#define TRAJECTORY_KEY_INTERVAL (16)
+#define TRAJECTORY_LEVEL (1)
+#define TRAJECTORY_WINDOW (15)
+#define TRAJECTORY_MEMORY (8)
+#define TRAJECTORY_QUANTUM (1.999)
+#define TRAJECTORY_QUANTIZED_MAX (4503599627370496.0)
+#define TRAJECTORY_QUANTIZED_COLUMNS (6)
+#define TRAJECTORY_EXCEPTION (sizeof(uint32_t) + sizeof(double))
+#define CHECKPOINT_MAGIC "NBODYCKP"
+#define CHECKPOINT_VERSION (1)
+#define CHECKPOINT_NAME (16)
+#define CHECKPOINT_SEGMENT (16)
+#define CHECKPOINT_NONE (0)
+#define CHECKPOINT_WRITE (1)
+#define CHECKPOINT_STOP (2)
+#define DEFAULT_L1_SIZE (32 * 1024)
+#define DEFAULT_L2_SIZE (1024 * 1024)
+#define MIN_BLOCK (64)
+#define MAX_BLOCK (4096)
+#define DEFAULT_THETA (0.5)
+#define BH_TOP_DEPTH (3)
+#define BH_BUCKETS (512)
+#define BH_TOP_NODES (585)
+#define BH_MAX_DEPTH (21)
+#define BH_LEAF_SIZE (32)
+#define BH_POOL_CHUNK (4096)
+#define BH_STACK_SIZE (256)
+#define BH_WALK_TASK (64)
+#define DEFAULT_FMM_ORDER (4)
+#define FMM_MAX_ORDER (12)
+#define FMM_MAX_COEFF (455)
+#define FMM_LEAF_SIZE (64)
+#define DEFAULT_PM_GRID (64)
+#define PM_MIN_GRID (16)
+#define PM_MAX_GRID (512)
+#define PM_MARGIN (3)
+#define DEFAULT_P3M_SPLIT (1.25)
+#define P3M_CUTOFF (5.0)
+#define P3M_TABLE_SIZE (1024)
+#define P3M_MAX_CELLS (64)
+#define FMM_POOL_CHUNK (65536)
+#define FMM_ERROR_SAMPLES (256)
 
 
 struct body {
@@ -21,8 +126,824 @@ struct body {
 	double mass;
 };
 
+/*
+ * Structure of arrays body store, every array is aligned to a cache line
+ * and padded to stride doubles so the arrays never share a line, the arrays
+ * are one block of memory backed by the pages in pages, mapped is its size
+ * when it was mapped for explicit huge pages and 0 when it was allocated,
+ * memory is where that block starts, the header before x for a snapshot,
+ * a store kept in a snapshot file has pages BODY_PAGES_FILE and the file's
+ * descriptor in file, which is -1 for every other store
+ */
+struct bodies {
+	double* x;
+	double* y;
+	double* z;
+	double* velocity_x;
+	double* velocity_y;
+	double* velocity_z;
+	double* mass;
+	size_t n_bodies;
+	size_t stride;
+	void* memory;
+	size_t mapped;
+	int pages;
+	int file;
+};
+
+/*
+ * Newline aligned piece of a csv being loaded, the count pass sets n_bodies
+ * and n_lines, their sums over the chunks before give first_body and
+ * first_line, the parse pass counts its bad lines in n_errors
+ */
+struct csv_chunk {
+	const char* start;
+	const char* end;
+	size_t n_bodies;
+	size_t n_lines;
+	size_t first_body;
+	size_t first_line;
+	size_t n_errors;
+};
+
+/*
+ * Chunks of a csv shared by the threads loading it
+ */
+struct csv_job {
+	struct thread_pool* pool;
+	struct csv_chunk* chunks;
+	size_t n_chunks;
+	struct bodies* bodies;
+};
+
+/*
+ * Header of a binary snapshot, the file is this header padded to
+ * SNAPSHOT_DATA_OFFSET bytes followed by the arrays of a body store exactly
+ * as it lays them out in memory, so a mapped file is the store, order is
+ * SNAPSHOT_ORDER as written by the machine that made it and checksum is
+ * snapshot_checksum of every array with its padding
+ */
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint32_t arrays;
+	uint32_t reserved;
+	uint64_t n_bodies;
+	uint64_t stride;
+	uint64_t checksum;
+	uint8_t padding[16];
+};
+
+/*
+ * Tile of TILE_WIDTH bodies holding only what the force kernels read,
+ * the tiles form an array of structures of arrays view of the body store
+ */
+struct body_tile {
+	_Alignas(CACHE_LINE) double x[TILE_WIDTH];
+	double y[TILE_WIDTH];
+	double z[TILE_WIDTH];
+	double mass[TILE_WIDTH];
+};
+
+struct body_tiles {
+	struct body_tile* tiles;
+	size_t n_tiles;
+	size_t n_bodies;
+};
+
+/*
+ * Pairwise force kernel, kick adds the acceleration of [start, end)
+ * from every tiled body to its velocity, pair_block visits every pair of
+ * a block once and updates both sides and with with_potential also returns
+ * the sum of m_i * m_j / r, 1 / r^3 is exact when
+ * newton_steps is 0 and a refined rsqrt estimate otherwise,
+ * potential_block sums m_i * m_j / r over a block with an exact 1 / r
+ */
+struct force_kernel {
+	const char* name;
+	size_t width;
+	void (*kick)(const struct body_tiles* t, struct bodies* b, size_t start, size_t end, double dt, int newton_steps);
+	double (*pair_block)(const struct body_tiles* t, double* restrict velocity_x, double* restrict velocity_y, double* restrict velocity_z,
+			size_t i_start, size_t i_end, size_t j_start, size_t j_end, double dt, int newton_steps, int with_potential);
+	double (*potential_block)(const struct bodies* b, size_t i_start, size_t i_end, size_t j_start, size_t j_end);
+	int (*supported)(void);
+};
+
+struct force_precision {
+	const char* name;
+	int newton_steps;
+};
+
+/*
+ * Velocity change buffers, one per thread, so the symmetric parallel step
+ * can add to any body without sharing writes with another thread
+ */
+struct force_buffers {
+	double* memory;
+	size_t stride;
+	size_t n_buffers;
+};
+
+/*
+ * Tunables of the approximate engines, unused fields are ignored, a
+ * periodic mesh keeps the cube of side box at origin when box is above 0
+ * instead of fitting one around the starting positions, tile is the bodies
+ * the streaming engine keeps in memory per thread, 0 for STREAM_TILE
+ */
+struct engine_params {
+	double theta;
+	size_t order;
+	size_t grid;
+	int periodic;
+	double split;
+	double origin[3];
+	double box;
+	size_t tile;
+};
+
+/*
+ * Range of tasks a pool thread has left, first in the low and last in the
+ * high 32 bits so the owner and thieves can update it with one compare
+ * and swap, padded so each thread's range has its own cache line
+ */
+struct pool_range {
+	_Alignas(CACHE_LINE) _Atomic unsigned long long range;
+};
+
+/*
+ * Ordered lane of tasks whose results go to one thread's buffer, any thread
+ * holding busy runs the lane's next task, so the tasks always run one at a
+ * time and in order while idle threads still take them from a slow owner,
+ * next counts the tasks run and end is one past the last
+ */
+struct pool_lane {
+	_Alignas(CACHE_LINE) _Atomic int busy;
+	_Atomic size_t next;
+	size_t end;
+};
+
+struct thread_pool;
+
+struct pool_helper {
+	struct thread_pool* pool;
+	size_t id;
+	pthread_t thread;
+	int cpu;
+	int node;
+};
+
+/*
+ * Persistent threads, the caller and n_threads - 1 helpers run every job
+ * posted with pool_run and share the barrier and the stealing ranges,
+ * results holds one value per task for reductions summed in task order,
+ * with spin the barrier is the arrived count and the epoch of each phase,
+ * waiting threads spin up to spins times then yield until the last arrival
+ * moves the epoch on, otherwise it is the pthread barrier, either way epoch
+ * counts the phases, pin says how the threads were placed and each helper
+ * keeps the cpu and node it was pinned to or -1
+ */
+struct thread_pool {
+	_Alignas(CACHE_LINE) _Atomic size_t arrived;
+	_Alignas(CACHE_LINE) _Atomic unsigned long epoch;
+	_Alignas(CACHE_LINE) size_t n_threads;
+	int spin;
+	int pin;
+	size_t spins;
+	size_t n_started;
+	struct pool_helper* helpers;
+	struct pool_range* ranges;
+	pthread_barrier_t barrier;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	void (*job)(void* arg, size_t id);
+	void* arg;
+	unsigned long generation;
+	size_t running;
+	int stop;
+	double results[POOL_RESULTS];
+};
+
+/*
+ * Copy of a body store into a new block, each thread of a pool copies the
+ * slice it will step so its pages are first touched on its own node
+ */
+struct place_job {
+	const struct bodies* source;
+	double* block;
+	size_t n_threads;
+};
+
+/*
+ * Shares of the pair triangle for the parallel energy, each share writes
+ * its own result so the sum can be taken in a fixed order
+ */
+struct energy_job {
+	const struct bodies* bodies;
+	size_t block;
+	size_t n_blocks;
+	double* results;
+};
+
+/*
+ * Force engine, step is called by every thread of a pool once per iteration
+ * after the pool's barrier with positions final, it must leave [start, end)
+ * kicked and moved and may wait on the barrier or steal tasks itself,
+ * potential is NULL or gives the potential energy the last force pass found,
+ * which engines that only find it on request do when with_potential is 1,
+ * run is NULL or does several steps in one call with no barrier between
+ * them, with_potential then asking for the potential of the last step
+ */
+struct engine {
+	const char* name;
+	void* (*create)(const struct bodies* b, size_t n_threads, const struct engine_params* params);
+	void (*destroy)(void* state);
+	void (*step)(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end,
+			double dt, struct thread_pool* pool, int with_potential);
+	double (*potential)(void* state);
+	void (*run)(void* state, struct bodies* b, size_t id, size_t n_threads, size_t steps,
+			double dt, struct thread_pool* pool, int with_potential);
+	void (*keep)(const void* state, struct engine_params* params);
+};
+
+/*
+ * When the energy is measured, every steps, every seconds of wall clock or
+ * only before the first step and after the last when both are 0,
+ * from_force takes the potential from the engine's force pass instead of
+ * summing the pairs again, each measurement is a row of the drift series in log,
+ * thread 0 writes its decision for a step to due[step % 3] a step ahead, before
+ * the barrier, so a thread still reading the last two is never overwritten
+ */
+struct energy_schedule {
+	size_t every;
+	double seconds;
+	int from_force;
+	FILE* log;
+	double initial;
+	double max_drift;
+	double last_time;
+	size_t n_measured;
+	int due[3];
+};
+
+/*
+ * Header of a trajectory file, the frames that follow each store the seven
+ * arrays of a body store in chunks of chunk bodies, every key_interval-th
+ * frame is a key frame and holds the bits of each value, the frames between
+ * hold the xor of each value with the frame before, each chunk has its
+ * bytes split into eight planes and is compressed with zlib, or kept as it
+ * is when that is no smaller, a trajectory_footer closes the file
+ * With an error above 0 positions and velocities are stored as
+ * trajectory_block chunks instead, each value within error of the one written
+ */
+struct trajectory_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint64_t n_bodies;
+	uint64_t every;
+	double dt;
+	uint64_t chunk;
+	uint64_t key_interval;
+	double error;
+};
+
+/*
+ * Header of a quantized chunk, each value is the nearest multiple q of
+ * error * TRAJECTORY_QUANTUM, an absolute block stores q and a delta block
+ * stores q less the q of the frame before, minus base, in width bytes split
+ * into width planes and compressed when packed, the planes are followed by
+ * n_exceptions pairs of a uint32_t body and the bits of a value too large
+ * to quantize, whose q is stored as 0, an exact block holds the bits of
+ * each value for chunks with more exceptions than fit in the bytes they save
+ */
+struct trajectory_block {
+	int64_t base;
+	uint32_t n_exceptions;
+	uint8_t mode;
+	uint8_t width;
+	uint8_t packed;
+	uint8_t reserved;
+};
+
+enum trajectory_mode {
+	TRAJECTORY_ABSOLUTE,
+	TRAJECTORY_DELTA,
+	TRAJECTORY_EXACT
+};
+
+/*
+ * Header of a frame, followed by the stored size of each chunk, column by
+ * column, then the chunks themselves, size is the bytes of the chunks
+ */
+struct trajectory_frame {
+	uint64_t step;
+	double time;
+	uint64_t size;
+	uint64_t key;
+};
+
+/*
+ * Where a frame starts in a trajectory file, the index of every frame is
+ * written after the last frame and found through the footer at the end
+ */
+struct trajectory_index {
+	uint64_t offset;
+	uint64_t step;
+	double time;
+	uint64_t reserved;
+};
+
+struct trajectory_footer {
+	char magic[8];
+	uint64_t n_frames;
+	uint64_t index_offset;
+	uint64_t reserved;
+};
+
+/*
+ * io_uring of the trajectory writer, the rings are shared with the kernel
+ * and the indices are read and written with atomics, fd is -1 without one
+ */
+struct trajectory_uring {
+	int fd;
+	unsigned entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	size_t sq_size;
+	void* cq_ring;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+/*
+ * Trajectory output through a ring of n_buffers preallocated frames, frame
+ * k uses buffer k % n_buffers, thread 0 takes the buffer of frame published,
+ * every thread copies its slice into it and the last to count itself in
+ * copied publishes it, the writer thread encodes frames from written up to
+ * published on its own pool, frees their buffers and writes them, stalls
+ * counts the captures that found every buffer waiting for the writer and
+ * stall_seconds how long they waited, peak is the most buffers ever waiting
+ * The writer keeps the last frame in previous to xor against and encodes
+ * into two sets of chunks so one is written while the next is encoded,
+ * each set is a trajectory_frame, the chunk sizes and chunks of up to bound bytes
+ * A quantized trajectory keeps the q of the last frame in quantized and
+ * marks in exact the chunks last stored exactly, which start over absolute,
+ * scratch gives each pool thread room for the planes, q and exceptions of a chunk
+ */
+struct trajectory {
+	int fd;
+	size_t n_bodies;
+	size_t every;
+	size_t n_buffers;
+	size_t frame_size;
+	size_t chunk;
+	size_t n_chunks;
+	size_t bound;
+	char** buffers;
+	_Alignas(CACHE_LINE) _Atomic size_t copied;
+	_Alignas(CACHE_LINE) size_t published;
+	size_t written;
+	size_t peak;
+	size_t stalls;
+	double stall_seconds;
+	int closing;
+	int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t free;
+	pthread_t writer;
+	struct thread_pool* pool;
+	double* previous;
+	double error;
+	int64_t* quantized;
+	unsigned char* exact;
+	unsigned char* scratch;
+	struct z_stream_s* streams;
+	size_t n_streams;
+	unsigned char* sets[2];
+	size_t set_bytes[2];
+	uint64_t set_offset[2];
+	int pending[2];
+	uint64_t offset;
+	struct trajectory_index* index;
+	size_t n_frames;
+	size_t raw_bytes;
+	size_t stored_bytes;
+	struct trajectory_uring uring;
+};
+
+/*
+ * Chunks of one frame shared by the pool threads encoding or decoding it,
+ * values are the seven arrays of the frame one after the other n_bodies
+ * apart, blobs the chunks, at bound bytes from each other while encoding
+ * and packed at starts while decoding
+ */
+struct trajectory_job {
+	struct trajectory* trajectory;
+	struct trajectory_reader* reader;
+	double* values;
+	unsigned char* blobs;
+	uint32_t* sizes;
+	const size_t* starts;
+	int key;
+	_Atomic int failed;
+};
+
+/*
+ * Random access to the frames of a trajectory file, the index is read from
+ * the end of the file or rebuilt by walking the frames when the writer
+ * never finished it, current holds the values of frame decoded so the frame
+ * after it is decoded from it and any other from the key frame before it,
+ * and quantized the q of its quantized columns
+ */
+struct trajectory_reader {
+	int fd;
+	struct trajectory_header header;
+	size_t n_chunks;
+	size_t bound;
+	struct trajectory_index* index;
+	size_t n_frames;
+	size_t decoded;
+	double* current;
+	int64_t* quantized;
+	unsigned char* blobs;
+	size_t blobs_size;
+	uint32_t* sizes;
+	size_t* starts;
+	unsigned char* scratch;
+	struct thread_pool* pool;
+};
+
+/*
+ * Run state of a checkpoint, kept in the padding after the snapshot header
+ * so a checkpoint is also a snapshot of the bodies it stopped at, step of
+ * iterations steps are done, the engine, kernel and precision are kept by
+ * name with the parameters that recreate the engine, the energy schedule
+ * with what it measured so far, and the seed generated bodies came from
+ * with counter streams taken from it, 0 when the bodies were loaded
+ */
+struct checkpoint_state {
+	char magic[8];
+	uint32_t version;
+	uint32_t threaded;
+	uint64_t n_threads;
+	uint64_t step;
+	uint64_t iterations;
+	double dt;
+	char engine[CHECKPOINT_NAME];
+	char kernel[CHECKPOINT_NAME];
+	char precision[CHECKPOINT_NAME];
+	double theta;
+	uint64_t order;
+	uint64_t grid;
+	uint64_t periodic;
+	double split;
+	double origin[3];
+	double box;
+	uint64_t energy_every;
+	double energy_seconds;
+	uint64_t from_force;
+	double initial;
+	double max_drift;
+	uint64_t n_measured;
+	uint64_t seed;
+	uint64_t counter;
+};
+
+/*
+ * Checkpoints of a run, written to temporary and renamed over path once
+ * complete, every every steps and when a signal asks, thread 0 decides for
+ * a step in due[step % 3] before the barrier and takes the file, every
+ * thread writes its own slice of the arrays and leaves the checksum of each
+ * of its columns in sums, the last to count itself in written finishes the
+ * header, syncs the file and renames it, failed is set by any thread whose
+ * writes failed, stopped is the step a CHECKPOINT_STOP ended the run at or SIZE_MAX
+ */
+struct checkpoint {
+	char* path;
+	char* temporary;
+	size_t every;
+	int fd;
+	_Atomic int failed;
+	int due[3];
+	size_t stopped;
+	size_t n_written;
+	double started;
+	double longest;
+	struct checkpoint_state state;
+	const struct bodies* bodies;
+	struct energy_schedule* schedule;
+	uint64_t* sums;
+	_Alignas(CACHE_LINE) _Atomic size_t written;
+};
+
+/*
+ * Direct engine state, lanes holds each thread's shares of the pair triangle,
+ * a step asked for the potential leaves each share's sum of m_i * m_j / r in
+ * shares and the potential energy in potential
+ */
+struct direct_state {
+	struct body_tiles* tiles;
+	struct force_buffers* buffers;
+	struct pool_lane* lanes;
+	double* shares;
+	double potential;
+};
+
+/*
+ * Counter based random stream, every block of four words is Philox4x32-10
+ * of counter under key, the low half of counter numbers the block and the
+ * high half the stream, used is how many words of block have been taken
+ */
+struct philox {
+	uint32_t key[2];
+	uint32_t counter[4];
+	uint32_t block[4];
+	size_t used;
+};
+
+/*
+ * Model of initial conditions, body fills the seven values of one body
+ * x, y, z, velocity_x, velocity_y, velocity_z, mass from its own stream
+ */
+struct generator {
+	const char* name;
+	void (*body)(struct philox* r, size_t n_bodies, double values[BODY_ARRAYS]);
+};
+
+/*
+ * Bodies being generated in chunks of GENERATE_CHUNK bodies, each chunk
+ * leaves its mass, mass weighted position and momentum in sums so the
+ * centre of mass is added up in the same order on any number of threads
+ */
+struct generate_job {
+	struct bodies* bodies;
+	const struct generator* generator;
+	uint64_t seed;
+	size_t n_chunks;
+	size_t n_threads;
+	double* sums;
+	double centre[BODY_ARRAYS];
+	struct thread_pool* pool;
+};
+
+/*
+ * Streaming engine state, each thread keeps an i tile of tile bodies in
+ * memory and packs the bodies of every j tile into its own tiles, a step
+ * asked for the potential leaves each thread's sum of m_i * m_j / r in
+ * shares and the potential energy in potential
+ */
+struct stream_state {
+	struct body_tiles** tiles;
+	double* shares;
+	size_t n_threads;
+	size_t tile;
+	double potential;
+};
+
+/*
+ * Dataflow engine state, the bodies are split into blocks of whole tiles and
+ * each task is the pairs of two blocks, row <= col, listed in pairs, a block
+ * moves once every task of the step touching it is done, pending counting
+ * those left for each parity of the step, and a task of the next step is
+ * released once both of its blocks have moved, waiting counting those left
+ * and released counting the steps of the run released for each task, each
+ * thread's lane runs its range of the tasks step after step in lanes,
+ * positions are read from tiles[current] and written to the other tiles
+ * so the moves of one step never overwrite what that step's tasks read
+ */
+struct flow_state {
+	struct body_tiles* tiles[2];
+	size_t current;
+	struct force_buffers* buffers;
+	size_t block;
+	size_t n_blocks;
+	size_t n_tasks;
+	size_t* pairs;
+	_Atomic int* pending;
+	_Atomic int* waiting;
+	_Atomic size_t* released;
+	struct pool_lane* lanes;
+	double* shares;
+	double potential;
+};
+
+/*
+ * Arguments of one dataflow run, every thread builds the same one
+ */
+struct flow_job {
+	struct flow_state* state;
+	struct bodies* bodies;
+	size_t steps;
+	double dt;
+	int with_potential;
+};
+
+/*
+ * Octree cell, children are a contiguous block so the tree only needs one
+ * pointer per node, every node covers count bodies of the sorted copies
+ * starting at first, quad holds the traceless quadrupole xx xy xz yy yz zz
+ * about the centre of mass, radius bounds the distance from the centre of
+ * mass to every body and expansion is only set by the fmm engine
+ */
+struct bh_node {
+	double com_x;
+	double com_y;
+	double com_z;
+	double mass;
+	double quad[6];
+	double open2;
+	double radius;
+	double* expansion;
+	struct bh_node* children;
+	unsigned int n_children;
+	unsigned int count;
+	size_t first;
+};
+
+/*
+ * Chunked node pool, chunks are kept between steps so rebuilding the tree
+ * allocates nothing once the largest tree has been seen
+ */
+struct bh_pool {
+	struct bh_node** chunks;
+	size_t n_chunks;
+	size_t chunk;
+	size_t used;
+};
+
+struct bh_entry {
+	unsigned long long key;
+	size_t index;
+};
+
+struct bh_state {
+	double theta;
+	size_t leaf_size;
+	size_t n_bodies;
+	size_t n_threads;
+	double min_x;
+	double min_y;
+	double min_z;
+	double size;
+	double* bounds;
+	size_t* histogram;
+	size_t bucket_start[BH_BUCKETS + 1];
+	struct bh_entry* entries;
+	struct bh_entry* sorted;
+	double* sorted_x;
+	double* sorted_y;
+	double* sorted_z;
+	double* sorted_mass;
+	struct bh_pool* pools;
+	struct bh_node top[BH_TOP_NODES];
+};
+
+/*
+ * Chunked pool of expansion coefficients, one per thread like the node pools
+ */
+struct fmm_pool {
+	double** chunks;
+	size_t n_chunks;
+	size_t chunk;
+	size_t used;
+};
+
+/*
+ * Coefficient a + b of the cartesian expansions, |a| + |b| <= order,
+ * the one table drives the translations and the multipole to local step,
+ * it is grouped by a and pair_start gives where each group begins
+ */
+struct fmm_pair {
+	unsigned int a;
+	unsigned int b;
+	unsigned int sum;
+};
+
+/*
+ * Fast multipole state on the Barnes-Hut octree, expansions are taylor
+ * series of 1 / r about each centre of mass up to the given order, the
+ * accelerations and potentials are kept in the order of the sorted copies
+ */
+struct fmm_state {
+	struct bh_state* tree;
+	double theta;
+	size_t order;
+	size_t n_coeff;
+	size_t n_pairs;
+	size_t p2p_limit;
+	unsigned int (*powers)[3];
+	unsigned int* index;
+	struct fmm_pair* pairs;
+	size_t* pair_start;
+	double* inv_factorial;
+	double* top_expansions;
+	struct fmm_pool* pools;
+	double* acc_x;
+	double* acc_y;
+	double* acc_z;
+	double* potential;
+};
+
+/*
+ * Particle mesh state, masses are deposited on a grid of cells per side
+ * and the potential is solved with n point FFTs per side, n is the grid
+ * when periodic and twice it when isolated so the images never overlap,
+ * green holds the transform of the potential of a unit mass with a cell of 1,
+ * only the long range part when split, the scale in cells, is not 0
+ */
+struct pm_state {
+	size_t grid;
+	size_t n;
+	int periodic;
+	double split;
+	size_t n_bodies;
+	size_t n_threads;
+	double origin_x;
+	double origin_y;
+	double origin_z;
+	double box;
+	double h;
+	double* bounds;
+	double* masses;
+	double* green;
+	double complex* work;
+	double complex* twiddle;
+	double complex* lines;
+	size_t* reverse;
+};
+
+/*
+ * P3M state, the mesh solves the long range part and the pairs closer
+ * than cutoff cells are summed from a cell list with sides at least the
+ * cutoff, bodies are sorted by cell into the sorted copies and cost holds
+ * the running total of pairs so threads can split the cells evenly
+ */
+struct p3m_state {
+	struct pm_state* mesh;
+	double cutoff;
+	size_t dims;
+	size_t n_cells;
+	size_t n_bodies;
+	size_t n_threads;
+	size_t* counts;
+	size_t* cell_start;
+	double* cost;
+	size_t* cell_of;
+	size_t* sorted_index;
+	double* sorted_x;
+	double* sorted_y;
+	double* sorted_z;
+	double* sorted_mass;
+	double* acc_x;
+	double* acc_y;
+	double* acc_z;
+	double* table;
+};
+
+/*
+ * Arguments of the stolen Barnes-Hut tasks, buckets are built from the
+ * source positions and walks kick the target velocities
+ */
+struct bh_job {
+	struct bh_state* tree;
+	const struct bodies* source;
+	struct bodies* target;
+	double dt;
+};
+
+/*
+ * Arguments of the direct shares, n_tasks shares of the pair triangle
+ */
+struct direct_job {
+	struct direct_state* state;
+	size_t n_bodies;
+	size_t n_tasks;
+	double dt;
+	int with_potential;
+};
+
+/*
+ * Arguments of one thread of a run, aligned so each thread's data, where it
+ * writes its energies, starts on its own cache line and shares none with
+ * the next thread's, start and end are from bodies_slice
+ */
 struct thread_data {
-	struct body** bodies;
+	_Alignas(CACHE_LINE) struct bodies* bodies;
+	const struct engine* engine;
+	void* state;
+	size_t id;
+	size_t n_threads;
 	size_t n_bodies;
 	size_t iterations;
 	size_t start;
@@ -30,15 +951,13 @@ struct thread_data {
 	double initial_energy;
 	double final_energy;
 	double dt;
-	pthread_barrier_t* barrier;
+	struct thread_pool* pool;
+	struct energy_schedule* schedule;
+	struct trajectory* trajectory;
+	size_t first;
+	struct checkpoint* checkpoint;
 };
 
-#define PI (3.141592653589793)
-#define SOLARMASS (4 * PI * PI)
-#define NDAYS (365.25)
-#define GCONST (6.67e-11) 
-#define DEFAULT_RAND_BOUND (1000000)
-
 /*
 void step(struct body** bodies, size_t n_bodies, double dt);
 void step_parallel(struct body** bodies, size_t len, size_t start, size_t end, double dt);
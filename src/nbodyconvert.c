@@ -0,0 +1,55 @@
+#include "nbody.h"
+#include "functions.c"
+#include <unistd.h>
+
+#define USAGE "Usage: ./nbody-convert <input_file> <snapshot_file> [frame]\n"
+
+/**
+ * Convert a csv of bodies, one x,y,z,velocity_x,velocity_y,velocity_z,mass
+ * row per body, or a frame of a trajectory into a binary snapshot that nbody
+ * and nbody-gui map with -f
+ * @param argc, the number of arguments
+ * @param argv, the csv, snapshot or trajectory to read, the snapshot to write
+ * and for a trajectory the frame, the last by default
+ * @return 0 if converted or 1 otherwise
+ */
+int main(int argc, char** argv) {
+
+	// If the arguments are invalid
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "Invalid number of arguments.\n" USAGE);
+		return 1;
+	}
+
+	// A csv is parsed and a trajectory decoded on every core
+	long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n_threads = n_cores < 1 ? 1 : (size_t)n_cores, frame = 0;
+	if (argc == 4 && long_conversion(&frame, argv[3])) {
+		fprintf(stderr, "Invalid frame.\n" USAGE);
+		return 1;
+	}
+	struct bodies* bodies = argc == 4 ? trajectory_load(argv[1], frame, n_threads) : bodies_load(argv[1], n_threads);
+	if (bodies == NULL) {
+		fprintf(stderr, "Cannot read %s.\n", argv[1]);
+		return 1;
+	}
+
+	FILE* file = fopen(argv[2], "wb");
+	if (file == NULL) {
+		fprintf(stderr, "Cannot create %s.\n", argv[2]);
+		bodies_destroy(bodies);
+		return 1;
+	}
+
+	// A failed write or close leaves a file that will not map so it is removed
+	int failed = bodies_write_snapshot(bodies, file);
+	failed = fclose(file) != 0 || failed;
+	if (failed) {
+		fprintf(stderr, "Error writing %s.\n", argv[2]);
+		remove(argv[2]);
+	} else {
+		printf("Wrote %zu bodies to %s\n", bodies->n_bodies, argv[2]);
+	}
+	bodies_destroy(bodies);
+	return failed;
+}
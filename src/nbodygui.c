@@ -2,6 +2,7 @@
 #include "functions.c"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL2_gfxPrimitives.h>
+#include <unistd.h>
 
 #define MAX_RADIUS (20)
 
@@ -14,9 +15,9 @@
  * @param n_bodies, the number of bodies
  * @param dt, the amount to step for each of the iterations
  * @param scale, the scale of the window 
- * @return the malloced bodies array of body structs
+ * @return the body store or NULL if invalid
  */
-struct body** process_arguments(char** argv, size_t* width, size_t* height, size_t* n_iterations, size_t* n_bodies, double* dt, double* scale) {
+struct bodies* process_arguments(char** argv, size_t* width, size_t* height, size_t* n_iterations, size_t* n_bodies, double* dt, double* scale) {
 
 	// Extract the arguments from the command line
 	if (long_conversion(width, argv[1])) return NULL;		// Convert the width
@@ -25,23 +26,20 @@ struct body** process_arguments(char** argv, size_t* width, size_t* height, size
 	if (double_conversion(dt, argv[4])) return NULL;		// Conert the dt
 	if (double_conversion(scale, argv[7])) return NULL;		// Conert the scale
 
-	struct body** bodies = NULL;
+	struct bodies* bodies = NULL;
 
 	// If it is searching for a file
 	if (strncmp(argv[5], "-f", 3) == 0) {
-	
-		FILE* file = fopen(argv[6], "r");		// Open the file in read mode
 
-		// If the file is not found
-		if (file == NULL) {				
-			fprintf(stderr, "Cannot find file.\n");
+		long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+		bodies = bodies_load(argv[6], n_cores < 1 ? 1 : (size_t)n_cores);	// Map a snapshot or parse a csv on every core
+
+		// If the file cannot be read
+		if (bodies == NULL) {
+			fprintf(stderr, "Cannot read file.\n");
 			return NULL;
 		}
-
-		*n_bodies = get_file_len(file);			// Get the length of the file
-		rewind(file);					// Rewind back to the start of the file
-		bodies = read_file(file, *n_bodies);		// Read the file from the array
-		fclose(file);					// Close the file
+		*n_bodies = bodies->n_bodies;
 
 	} else if (strncmp(argv[5], "-b", 3) == 0) {
 
@@ -49,7 +47,7 @@ struct body** process_arguments(char** argv, size_t* width, size_t* height, size
 			return NULL;
 		}
 
-		bodies = gen_random_bodies(*n_bodies);	// Generate the random bodies
+		bodies = bodies_gen_random(*n_bodies);	// Generate the random bodies
 	} 
 
 	// If invalid then print error message and exit
@@ -80,6 +78,17 @@ double scale_point(size_t a, size_t b, double min, double max, double x) {
 }
 
 
+/**
+ * Step the bodies once on every thread of the pool, the frame is drawn between jobs
+ * @param arg, the thread data of every thread
+ * @param id, the thread
+ */
+void step_job(void* arg, size_t id) {
+	struct thread_data* tdata = (struct thread_data*)arg + id;
+	tdata->engine->step(tdata->state, tdata->bodies, id, tdata->n_threads, tdata->start, tdata->end, tdata->dt, tdata->pool, 0);
+}
+
+
 int main(int argc, char** argv) {
 
 	// Check if valid number of arguments have been passed
@@ -106,7 +115,7 @@ int main(int argc, char** argv) {
 	// Retrieve the arguments
 	size_t width, height, n_iterations, n_bodies;
 	double dt, scale;
-	struct body** bodies = process_arguments(argv, &width, &height, &n_iterations, &n_bodies, &dt, &scale);
+	struct bodies* bodies = process_arguments(argv, &width, &height, &n_iterations, &n_bodies, &dt, &scale);
 
 	// If invalid arguments return
 	if (bodies == NULL || n_bodies == 0) {
@@ -116,20 +125,20 @@ int main(int argc, char** argv) {
 	// If width or height is less than 0 give error message
 	if (width <= 0 || height <= 0) {
 		printf("Invalid width or height <= 0.\n");
-		clean_up(bodies, n_bodies);
+		bodies_destroy(bodies);
 		return 1;
 	}
 
 	// Get the min and max values
-	double min_x = bodies[0]->x, min_y = bodies[0]->y;
-	double max_x = bodies[0]->x, max_y = bodies[0]->y;
-	double max_mass = bodies[0]->mass;
+	double min_x = bodies->x[0], min_y = bodies->y[0];
+	double max_x = bodies->x[0], max_y = bodies->y[0];
+	double max_mass = bodies->mass[0];
 	for (size_t i = 1; i < n_bodies; i++) {
-		min_x = (min_x < bodies[i]->x) ? min_x : bodies[i]->x;
-		min_y = (min_y < bodies[i]->y) ? min_y : bodies[i]->y;
-		max_x = (max_x > bodies[i]->x) ? max_x : bodies[i]->x;
-		max_y = (max_y > bodies[i]->y) ? max_y : bodies[i]->y;
-		max_mass = (max_mass > bodies[i]->mass) ? max_mass : bodies[i]->mass;
+		min_x = (min_x < bodies->x[i]) ? min_x : bodies->x[i];
+		min_y = (min_y < bodies->y[i]) ? min_y : bodies->y[i];
+		max_x = (max_x > bodies->x[i]) ? max_x : bodies->x[i];
+		max_y = (max_y > bodies->y[i]) ? max_y : bodies->y[i];
+		max_mass = (max_mass > bodies->mass[i]) ? max_mass : bodies->mass[i];
 	}
 
 	// Update x positions
@@ -160,7 +169,7 @@ int main(int argc, char** argv) {
 	// Check if invalid window returned
 	if (window == NULL) {
 		printf("Error while attempting to create to window.\n");
-		clean_up(bodies, n_bodies);
+		bodies_destroy(bodies);
 		return 1;
 	}
 	
@@ -177,7 +186,7 @@ int main(int argc, char** argv) {
 	// Check if the renderer creation fails
 	if (renderer == NULL) {
 		printf("Error while creating renderer.\n");
-		clean_up(bodies, n_bodies);
+		bodies_destroy(bodies);
 		return 1;
 	}
 	
@@ -186,6 +195,27 @@ int main(int argc, char** argv) {
 	double x_ratio = (width - width/10)/(max_x + max_y);
 	double y_ratio = (height - height/10)/(max_x + max_y);
 
+	// One thread per core, started once and reused for every frame
+	long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n_threads = n_cores < 1 ? 1 : (size_t)n_cores > n_bodies ? n_bodies : (size_t)n_cores;
+	struct thread_pool* pool = pool_create(n_threads);
+	const struct engine* engine = engine_find("direct");
+	void* state = engine->create(bodies, n_threads, NULL);
+	struct thread_data* tdata = aligned_alloc(CACHE_LINE, sizeof(struct thread_data) * n_threads);
+	if (pool == NULL || state == NULL || tdata == NULL) {
+		printf("Error while starting the threads.\n");
+		free(tdata);
+		engine->destroy(state);
+		pool_destroy(pool);
+		bodies_destroy(bodies);
+		return 1;
+	}
+	for (size_t i = 0; i < n_threads; i++) {
+		tdata[i] = (struct thread_data){ .bodies = bodies, .engine = engine, .state = state, .id = i,
+			.n_threads = n_threads, .n_bodies = n_bodies, .dt = dt, .pool = pool };
+		bodies_slice(n_bodies, n_threads, i, &tdata[i].start, &tdata[i].end);
+	}
+
 	/**
 	 * Render loop of your application
 	 * You will perform your drawing in this loop here
@@ -198,12 +228,12 @@ int main(int argc, char** argv) {
 		SDL_RenderClear(renderer);
 	
 		//Updates the positions of bodies
-		step(bodies, n_bodies, dt);
+		pool_run(pool, step_job, tdata);
 
 		//Draws a circle using a specific colour
 		//Pixel is RGBA (0x(RED)(GREEN)(BLUE)(ALPHA), each 0-255
 		for (size_t i = 0; i < n_bodies; i++) {
-			filledCircleColor(renderer, x_ratio * bodies[i]->x + width/2, y_ratio * bodies[i]->y + height/2, scale_point(2, MAX_RADIUS, 0, max_mass, bodies[i]->mass) * scale, 0xFF0000FF);
+			filledCircleColor(renderer, x_ratio * bodies->x[i] + width/2, y_ratio * bodies->y[i] + height/2, scale_point(2, MAX_RADIUS, 0, max_mass, bodies->mass[i]) * scale, 0xFF0000FF);
 		}
 
 		//Updates the screen with newly renderered image
@@ -219,7 +249,10 @@ int main(int argc, char** argv) {
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	SDL_Quit();	
-	clean_up(bodies, n_bodies);
+	free(tdata);
+	engine->destroy(state);
+	pool_destroy(pool);
+	bodies_destroy(bodies);
 
 	return 0;	
 }
@@ -0,0 +1,371 @@
+#include "nbody.h"
+
+
+/**
+ * Neighbouring cell coordinates along one axis without repeats
+ * @param s, the p3m state
+ * @param c, the cell coordinate
+ * @param neighbours, set to up to three coordinates
+ * @return the number of coordinates
+ */
+static size_t p3m_neighbours(const struct p3m_state* s, size_t c, size_t* neighbours) {
+	size_t n = 0, d = s->dims;
+	for (long offset = -1; offset <= 1; offset++) {
+		long k = (long)c + offset;
+		if (s->mesh->periodic) {
+			k = (k + (long)d) % (long)d;
+		} else if (k < 0 || k >= (long)d) {
+			continue;
+		}
+
+		// Few cells per side wrap onto the same cell
+		int seen = 0;
+		for (size_t i = 0; i < n; i++) {
+			seen |= neighbours[i] == (size_t)k;
+		}
+		if (!seen) {
+			neighbours[n++] = (size_t)k;
+		}
+	}
+	return n;
+}
+
+
+/**
+ * Every neighbouring cell of a cell, the cell itself included
+ * @param s, the p3m state
+ * @param c, the cell
+ * @param cells, set to up to 27 cells
+ * @return the number of cells
+ */
+static size_t p3m_neighbour_cells(const struct p3m_state* s, size_t c, size_t* cells) {
+	size_t d = s->dims;
+	size_t nx[3], ny[3], nz[3];
+	size_t n_x = p3m_neighbours(s, c % d, nx);
+	size_t n_y = p3m_neighbours(s, c / d % d, ny);
+	size_t n_z = p3m_neighbours(s, c / (d * d), nz);
+	size_t n = 0;
+	for (size_t k = 0; k < n_z; k++) {
+		for (size_t j = 0; j < n_y; j++) {
+			for (size_t i = 0; i < n_x; i++) {
+				cells[n++] = (nz[k] * d + ny[j]) * d + nx[i];
+			}
+		}
+	}
+	return n;
+}
+
+
+/**
+ * Sort the bodies into the cell list, called by every thread
+ * Each thread counts its own bodies per cell, thread 0 turns the counts
+ * into offsets in cell then thread order and totals the pairs each cell
+ * will visit, then every thread scatters its own bodies so the order does
+ * not depend on timing
+ * @param s, the p3m state with the mesh placed
+ * @param b, the body store
+ * @param id, the thread
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param pool, the pool running every thread
+ */
+static void p3m_sort(struct p3m_state* s, const struct bodies* b, size_t id, size_t start, size_t end, struct thread_pool* pool) {
+	const struct pm_state* mesh = s->mesh;
+	size_t d = s->dims, n_cells = s->n_cells;
+	double inv_cell = d / (mesh->grid * mesh->h);
+	size_t* counts = s->counts + id * n_cells;
+
+	memset(counts, 0, sizeof(size_t) * n_cells);
+	for (size_t i = start; i < end; i++) {
+		double u[3] = { (b->x[i] - mesh->origin_x) * inv_cell, (b->y[i] - mesh->origin_y) * inv_cell, (b->z[i] - mesh->origin_z) * inv_cell };
+		size_t c[3];
+		for (int axis = 0; axis < 3; axis++) {
+			c[axis] = u[axis] <= 0.0 ? 0 : u[axis] >= d ? d - 1 : (size_t)u[axis];
+		}
+		s->cell_of[i] = (c[2] * d + c[1]) * d + c[0];
+		counts[s->cell_of[i]]++;
+	}
+	pool_wait(pool);
+
+	if (id == 0) {
+		size_t offset = 0;
+		for (size_t c = 0; c < n_cells; c++) {
+			s->cell_start[c] = offset;
+			for (size_t t = 0; t < s->n_threads; t++) {
+				size_t count = s->counts[t * n_cells + c];
+				s->counts[t * n_cells + c] = offset;
+				offset += count;
+			}
+		}
+		s->cell_start[n_cells] = offset;
+
+		// Clustered cells cost far more than sparse ones so threads split the pairs
+		double pairs = 0.0;
+		for (size_t c = 0; c < n_cells; c++) {
+			s->cost[c] = pairs;
+			size_t count = s->cell_start[c + 1] - s->cell_start[c];
+			if (count == 0) {
+				continue;
+			}
+			size_t cells[27];
+			size_t n = p3m_neighbour_cells(s, c, cells);
+			for (size_t k = 0; k < n; k++) {
+				pairs += (double)count * (s->cell_start[cells[k] + 1] - s->cell_start[cells[k]]);
+			}
+		}
+		s->cost[n_cells] = pairs;
+	}
+	pool_wait(pool);
+
+	for (size_t i = start; i < end; i++) {
+		size_t k = counts[s->cell_of[i]]++;
+		s->sorted_x[k] = b->x[i];
+		s->sorted_y[k] = b->y[i];
+		s->sorted_z[k] = b->z[i];
+		s->sorted_mass[k] = b->mass[i];
+		s->sorted_index[k] = i;
+	}
+	pool_wait(pool);
+}
+
+
+/**
+ * Find the first cell of a share of the pairs
+ * @param s, the p3m state with the cells sorted
+ * @param share, the index of the share, n_shares gives n_cells
+ * @param n_shares, the number of shares
+ * @return the first cell of the share
+ */
+static size_t p3m_partition(const struct p3m_state* s, size_t share, size_t n_shares) {
+	double target = s->cost[s->n_cells] * share / n_shares;
+	size_t low = 0, high = s->n_cells;
+	if (share == n_shares) {
+		return high;
+	}
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (s->cost[mid] < target) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+
+/**
+ * Short range accelerations of the bodies of a range of cells
+ * Each body sums the pairs inside the cutoff from the neighbouring cells
+ * with 1 / r^3 from the selected precision scaled by the tabulated
+ * fraction of the force the mesh leaves out
+ * @param s, the p3m state with the cells sorted
+ * @param cell_start, the first cell
+ * @param cell_end, one past the last cell
+ */
+static void p3m_short_range(struct p3m_state* s, size_t cell_start, size_t cell_end) {
+	const struct pm_state* mesh = s->mesh;
+	const double* restrict x = s->sorted_x;
+	const double* restrict y = s->sorted_y;
+	const double* restrict z = s->sorted_z;
+	const double* restrict m = s->sorted_mass;
+	const double* restrict table = s->table;
+	const double min_dist2 = MIN_DISTANCE * MIN_DISTANCE;
+	int newton_steps = force_precision_active()->newton_steps;
+
+	double cutoff = s->cutoff * mesh->h;
+	double cutoff2 = cutoff * cutoff;
+	double scale = P3M_TABLE_SIZE / cutoff2;
+	double box = mesh->grid * mesh->h;
+	int periodic = mesh->periodic;
+
+	for (size_t c = cell_start; c < cell_end; c++) {
+		size_t cells[27];
+		size_t n = p3m_neighbour_cells(s, c, cells);
+
+		for (size_t i = s->cell_start[c]; i < s->cell_start[c + 1]; i++) {
+			register double acc_x = 0, acc_y = 0, acc_z = 0;
+
+			for (size_t k = 0; k < n; k++) {
+				for (size_t j = s->cell_start[cells[k]]; j < s->cell_start[cells[k] + 1]; j++) {
+					double x_dist = x[j] - x[i];
+					double y_dist = y[j] - y[i];
+					double z_dist = z[j] - z[i];
+					if (periodic) {
+						x_dist -= box * nearbyint(x_dist / box);
+						y_dist -= box * nearbyint(y_dist / box);
+						z_dist -= box * nearbyint(z_dist / box);
+					}
+					double dist2 = x_dist * x_dist + y_dist * y_dist + z_dist * z_dist;
+					if (dist2 >= cutoff2 || j == i) {
+						continue;
+					}
+					// Coincident bodies have no direction
+					if (dist2 == 0.0) {
+						dist2 = min_dist2;
+					}
+
+					double u = dist2 * scale;
+					size_t bin = (size_t)u;
+					double fraction = table[bin] + (u - bin) * (table[bin + 1] - table[bin]);
+					double f = m[j] * fraction * inv_dist3_scalar(dist2, newton_steps);
+					acc_x += x_dist * f;
+					acc_y += y_dist * f;
+					acc_z += z_dist * f;
+				}
+			}
+
+			size_t index = s->sorted_index[i];
+			s->acc_x[index] = GCONST * acc_x;
+			s->acc_y[index] = GCONST * acc_y;
+			s->acc_z[index] = GCONST * acc_z;
+		}
+	}
+}
+
+
+/**
+ * Short range accelerations of one share of the cells
+ * @param arg, the p3m state with the cells sorted
+ * @param id, the thread running the task
+ * @param task, the share
+ */
+static void p3m_short_range_task(void* arg, size_t id, size_t task) {
+	struct p3m_state* s = arg;
+	size_t n_tasks = s->n_threads * POOL_TASKS_PER_THREAD;
+	p3m_short_range(s, p3m_partition(s, task, n_tasks), p3m_partition(s, task + 1, n_tasks));
+}
+
+
+/**
+ * Allocate the p3m state for a body store and a number of threads
+ * @param b, the body store
+ * @param n_threads, the number of threads that will call p3m_step
+ * @param params, the engine parameters, grid and periodic set the mesh and
+ * split the scale in cells of the long range part, the pairs are cut off
+ * at P3M_CUTOFF times the split which must fit in half the grid
+ * @return the state or NULL if invalid
+ */
+void* p3m_create(const struct bodies* b, size_t n_threads, const struct engine_params* params) {
+
+	// If the parameters are invalid
+	if (b == NULL || n_threads == 0 || params == NULL || !(params->split > 0.0)
+			|| P3M_CUTOFF * params->split > params->grid / 2.0) {
+		return NULL;
+	}
+
+	struct p3m_state* s = calloc(1, sizeof(struct p3m_state));
+	if (s == NULL) {
+		return NULL;
+	}
+
+	s->mesh = pm_init(b, n_threads, params, params->split);
+	if (s->mesh == NULL) {
+		free(s);
+		return NULL;
+	}
+
+	// Cells are at least the cutoff wide so the neighbours hold every pair
+	s->cutoff = P3M_CUTOFF * params->split;
+	s->dims = (size_t)(params->grid / s->cutoff);
+	s->dims = s->dims < 1 ? 1 : s->dims > P3M_MAX_CELLS ? P3M_MAX_CELLS : s->dims;
+	s->n_cells = s->dims * s->dims * s->dims;
+	s->n_bodies = b->n_bodies;
+	s->n_threads = n_threads;
+
+	size_t n = b->n_bodies;
+	s->counts = malloc(sizeof(size_t) * s->n_cells * n_threads);
+	s->cell_start = malloc(sizeof(size_t) * (s->n_cells + 1));
+	s->cost = malloc(sizeof(double) * (s->n_cells + 1));
+	s->cell_of = malloc(sizeof(size_t) * n);
+	s->sorted_index = malloc(sizeof(size_t) * n);
+	s->sorted_x = malloc(sizeof(double) * n * 4);
+	s->acc_x = malloc(sizeof(double) * n * 3);
+	s->table = malloc(sizeof(double) * (P3M_TABLE_SIZE + 2));
+	if (s->counts == NULL || s->cell_start == NULL || s->cost == NULL || s->cell_of == NULL || s->sorted_index == NULL
+			|| s->sorted_x == NULL || s->acc_x == NULL || s->table == NULL) {
+		p3m_destroy(s);
+		return NULL;
+	}
+	s->sorted_y = s->sorted_x + n;
+	s->sorted_z = s->sorted_x + n * 2;
+	s->sorted_mass = s->sorted_x + n * 3;
+	s->acc_y = s->acc_x + n;
+	s->acc_z = s->acc_x + n * 2;
+
+	// Fraction of the force of erfc(r / 2 split) / r against r^2 / cutoff^2
+	for (size_t i = 0; i < P3M_TABLE_SIZE + 2; i++) {
+		double q = P3M_CUTOFF * sqrt((double)i / P3M_TABLE_SIZE);
+		s->table[i] = erfc(q / 2.0) + q / sqrt(PI) * exp(-q * q / 4.0);
+	}
+	return s;
+}
+
+
+/**
+ * Keep the periodic box of the p3m mesh
+ * @param state, the p3m state
+ * @param params, the parameters, origin and box are set when periodic
+ */
+void p3m_keep(const void* state, struct engine_params* params) {
+	const struct p3m_state* s = state;
+	pm_keep(s->mesh, params);
+}
+
+
+/**
+ * Clear up all memory associated with the p3m state
+ * @param state, the state
+ */
+void p3m_destroy(void* state) {
+	struct p3m_state* s = state;
+
+	// If it is already NULL
+	if (s == NULL) {
+		return;
+	}
+
+	free(s->table);
+	free(s->acc_x);
+	free(s->sorted_x);
+	free(s->sorted_index);
+	free(s->cell_of);
+	free(s->cost);
+	free(s->cell_start);
+	free(s->counts);
+	pm_destroy(s->mesh);
+	free(s);
+}
+
+
+/**
+ * P3M step of one thread, the mesh potential is solved and the bodies are
+ * sorted into cells by every thread, the threads steal shares of the cells
+ * to sum their short range pairs, then each kicks and moves its own bodies
+ * @param state, the p3m state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, unused, the mesh keeps no potential per body
+ */
+void p3m_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential) {
+	struct p3m_state* s = state;
+
+	// Check if the parameters are invalid
+	if (s == NULL || b == NULL || b->n_bodies != s->n_bodies || n_threads != s->n_threads || end > b->n_bodies) {
+		return;
+	}
+
+	pm_solve(s->mesh, b, id, start, end, pool);
+	p3m_sort(s, b, id, start, end, pool);
+
+	// Shares have equal pairs, stealing evens out the rest
+	pool_steal(pool, id, id * POOL_TASKS_PER_THREAD, (id + 1) * POOL_TASKS_PER_THREAD, p3m_short_range_task, s);
+
+	// Every short range sum used the sorted copies so bodies can move
+	pm_move(s->mesh, b, start, end, dt, s->acc_x, s->acc_y, s->acc_z);
+}
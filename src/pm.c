@@ -0,0 +1,574 @@
+#include "nbody.h"
+
+
+/**
+ * In place radix 2 transform of one line of the mesh
+ * @param s, the mesh state holding the twiddles and bit reversal
+ * @param line, the n values of the line
+ * @param inverse, 1 for the unnormalised inverse transform
+ */
+static void pm_fft_line(const struct pm_state* s, double complex* line, int inverse) {
+	size_t n = s->n;
+	for (size_t i = 0; i < n; i++) {
+		size_t j = s->reverse[i];
+		if (i < j) {
+			double complex swap = line[i];
+			line[i] = line[j];
+			line[j] = swap;
+		}
+	}
+
+	for (size_t len = 2; len <= n; len <<= 1) {
+		size_t half = len / 2, step = n / len;
+		for (size_t i = 0; i < n; i += len) {
+			for (size_t k = 0; k < half; k++) {
+				double complex w = inverse ? conj(s->twiddle[k * step]) : s->twiddle[k * step];
+				double complex u = line[i + k];
+				double complex v = line[i + k + half] * w;
+				line[i + k] = u + v;
+				line[i + k + half] = u - v;
+			}
+		}
+	}
+}
+
+
+/**
+ * Transform the lines of one axis whose other two coordinates are below
+ * the given limits, the lines are shared evenly between the threads
+ * @param s, the mesh state
+ * @param id, the thread
+ * @param axis, 0 for x, 1 for y and 2 for z
+ * @param limit_a, the limit of the lower of the other two axes
+ * @param limit_b, the limit of the higher of the other two axes
+ * @param inverse, 1 for the inverse transform
+ */
+static void pm_fft_axis(struct pm_state* s, size_t id, int axis, size_t limit_a, size_t limit_b, int inverse) {
+	size_t n = s->n;
+	size_t stride = axis == 0 ? 1 : axis == 1 ? n : n * n;
+	size_t stride_a = axis == 0 ? n : 1;
+	size_t stride_b = axis == 2 ? n : n * n;
+	size_t n_lines = limit_a * limit_b;
+	double complex* line = s->lines + id * n;
+
+	for (size_t l = id * n_lines / s->n_threads; l < (id + 1) * n_lines / s->n_threads; l++) {
+		double complex* first = s->work + (l % limit_a) * stride_a + (l / limit_a) * stride_b;
+		for (size_t i = 0; i < n; i++) {
+			line[i] = first[i * stride];
+		}
+		pm_fft_line(s, line, inverse);
+		for (size_t i = 0; i < n; i++) {
+			first[i * stride] = line[i];
+		}
+	}
+}
+
+
+/**
+ * Three dimensional transform of the work mesh, called by every thread
+ * Only the masses of the first grid cells per side are ever non zero and
+ * only the potential there is read, so lines outside them are skipped
+ * @param s, the mesh state
+ * @param id, the thread
+ * @param inverse, 1 for the inverse transform
+ * @param pool, the pool running every thread, NULL for a single thread
+ */
+static void pm_fft(struct pm_state* s, size_t id, int inverse, struct thread_pool* pool) {
+	size_t n = s->n, g = s->grid;
+	if (!inverse) {
+		pm_fft_axis(s, id, 0, g, g, 0);
+		pool_wait(pool);
+		pm_fft_axis(s, id, 1, n, g, 0);
+		pool_wait(pool);
+		pm_fft_axis(s, id, 2, n, n, 0);
+	} else {
+		pm_fft_axis(s, id, 2, n, n, 1);
+		pool_wait(pool);
+		pm_fft_axis(s, id, 1, n, g, 1);
+		pool_wait(pool);
+		pm_fft_axis(s, id, 0, g, g, 1);
+	}
+	pool_wait(pool);
+}
+
+
+/**
+ * Wrap a mesh coordinate when periodic
+ * @param s, the mesh state
+ * @param i, the coordinate, at least -grid
+ * @return the coordinate inside the grid
+ */
+static inline size_t pm_wrap(const struct pm_state* s, long i) {
+	long g = (long)s->grid;
+	return s->periodic ? (size_t)((i + g) % g) : (size_t)i;
+}
+
+
+/**
+ * Cloud in cell weights of a position in mesh units
+ * @param s, the mesh state
+ * @param u, the position in mesh units
+ * @param cell, set to the lower of the two cells
+ * @param frac, set to the weight of the upper cell
+ */
+static inline void pm_cic(const struct pm_state* s, double u, long* cell, double* frac) {
+	double lower = floor(u);
+	// Rounding can put a body on the far edge of an isolated mesh
+	if (!s->periodic) {
+		lower = fmin(fmax(lower, 0.0), (double)s->grid - 2.0);
+	}
+	*cell = (long)lower;
+	*frac = u - lower;
+}
+
+
+/**
+ * The potential at a mesh cell
+ * @param s, the mesh state with the inverse transform done
+ * @param x, the x cell
+ * @param y, the y cell
+ * @param z, the z cell
+ * @return the unscaled potential
+ */
+static inline double pm_potential(const struct pm_state* s, long x, long y, long z) {
+	return creal(s->work[(pm_wrap(s, z) * s->n + pm_wrap(s, y)) * s->n + pm_wrap(s, x)]);
+}
+
+
+/**
+ * Choose the mesh cell and origin for this step, called by every thread
+ * An isolated mesh follows the bodies with PM_MARGIN cells on each side so
+ * the differences never read outside the solved region, a periodic mesh
+ * keeps the box it was created with
+ * @param s, the mesh state
+ * @param b, the body store
+ * @param id, the thread
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param pool, the pool running every thread, NULL for a single thread
+ */
+static void pm_place(struct pm_state* s, const struct bodies* b, size_t id, size_t start, size_t end, struct thread_pool* pool) {
+	if (s->periodic) {
+		return;
+	}
+
+	double* bounds = s->bounds + id * 6;
+	bounds[0] = bounds[1] = bounds[2] = INFINITY;
+	bounds[3] = bounds[4] = bounds[5] = -INFINITY;
+	for (size_t i = start; i < end; i++) {
+		bounds[0] = fmin(bounds[0], b->x[i]);
+		bounds[1] = fmin(bounds[1], b->y[i]);
+		bounds[2] = fmin(bounds[2], b->z[i]);
+		bounds[3] = fmax(bounds[3], b->x[i]);
+		bounds[4] = fmax(bounds[4], b->y[i]);
+		bounds[5] = fmax(bounds[5], b->z[i]);
+	}
+	pool_wait(pool);
+
+	// Thread 0 reduces the bounds and the others wait for the mesh
+	if (id != 0) {
+		pool_wait(pool);
+		return;
+	}
+	double low[3] = { INFINITY, INFINITY, INFINITY }, high[3] = { -INFINITY, -INFINITY, -INFINITY };
+	for (size_t t = 0; t < s->n_threads; t++) {
+		for (int axis = 0; axis < 3; axis++) {
+			low[axis] = fmin(low[axis], s->bounds[t * 6 + axis]);
+			high[axis] = fmax(high[axis], s->bounds[t * 6 + 3 + axis]);
+		}
+	}
+	double extent = fmax(fmax(high[0] - low[0], high[1] - low[1]), high[2] - low[2]);
+	double h = extent > 0.0 ? extent * (1.0 + 1e-9) / (s->grid - 2 * PM_MARGIN - 1) : 1.0;
+	s->h = h;
+	s->origin_x = low[0] - PM_MARGIN * h;
+	s->origin_y = low[1] - PM_MARGIN * h;
+	s->origin_z = low[2] - PM_MARGIN * h;
+	pool_wait(pool);
+}
+
+
+/**
+ * Solve for the mesh potential of the current positions, called by every thread
+ * Each thread deposits its own bodies into its own mass grid, the grids are
+ * summed in thread order into the work mesh, then the mesh is transformed,
+ * multiplied by the green's function and transformed back
+ * @param s, the mesh state
+ * @param b, the body store
+ * @param id, the thread
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param pool, the pool running every thread, NULL for a single thread
+ */
+static void pm_solve(struct pm_state* s, const struct bodies* b, size_t id, size_t start, size_t end, struct thread_pool* pool) {
+	size_t g = s->grid, n = s->n;
+	pm_place(s, b, id, start, end, pool);
+
+	double* masses = s->masses + id * g * g * g;
+	memset(masses, 0, sizeof(double) * g * g * g);
+	for (size_t i = start; i < end; i++) {
+		long cx, cy, cz;
+		double fx, fy, fz;
+		pm_cic(s, (b->x[i] - s->origin_x) / s->h, &cx, &fx);
+		pm_cic(s, (b->y[i] - s->origin_y) / s->h, &cy, &fy);
+		pm_cic(s, (b->z[i] - s->origin_z) / s->h, &cz, &fz);
+		for (int corner = 0; corner < 8; corner++) {
+			int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+			double weight = (dx ? fx : 1.0 - fx) * (dy ? fy : 1.0 - fy) * (dz ? fz : 1.0 - fz);
+			masses[(pm_wrap(s, cz + dz) * g + pm_wrap(s, cy + dy)) * g + pm_wrap(s, cx + dx)] += b->mass[i] * weight;
+		}
+	}
+	pool_wait(pool);
+
+	// Sum the grids into this thread's planes, padding planes are cleared
+	for (size_t z = id * n / s->n_threads; z < (id + 1) * n / s->n_threads; z++) {
+		double complex* plane = s->work + z * n * n;
+		memset(plane, 0, sizeof(double complex) * n * n);
+		if (z >= g) {
+			continue;
+		}
+		for (size_t t = 0; t < s->n_threads; t++) {
+			const double* grid = s->masses + t * g * g * g + z * g * g;
+			for (size_t y = 0; y < g; y++) {
+				for (size_t x = 0; x < g; x++) {
+					plane[y * n + x] += grid[y * g + x];
+				}
+			}
+		}
+	}
+	pool_wait(pool);
+
+	pm_fft(s, id, 0, pool);
+	size_t cells = n * n * n;
+	for (size_t k = id * cells / s->n_threads; k < (id + 1) * cells / s->n_threads; k++) {
+		s->work[k] *= s->green[k];
+	}
+	pool_wait(pool);
+	pm_fft(s, id, 1, pool);
+}
+
+
+/**
+ * Acceleration of a mesh cell from fourth order differences of the potential
+ * @param s, the mesh state with the potential solved
+ * @param x, the x cell
+ * @param y, the y cell
+ * @param z, the z cell
+ * @param acc, the x, y and z acceleration to add to, unscaled
+ * @param weight, the cloud in cell weight of the cell
+ */
+static inline void pm_gradient(const struct pm_state* s, long x, long y, long z, double* acc, double weight) {
+	acc[0] -= weight * (2.0 / 3.0 * (pm_potential(s, x + 1, y, z) - pm_potential(s, x - 1, y, z))
+			- 1.0 / 12.0 * (pm_potential(s, x + 2, y, z) - pm_potential(s, x - 2, y, z)));
+	acc[1] -= weight * (2.0 / 3.0 * (pm_potential(s, x, y + 1, z) - pm_potential(s, x, y - 1, z))
+			- 1.0 / 12.0 * (pm_potential(s, x, y + 2, z) - pm_potential(s, x, y - 2, z)));
+	acc[2] -= weight * (2.0 / 3.0 * (pm_potential(s, x, y, z + 1) - pm_potential(s, x, y, z - 1))
+			- 1.0 / 12.0 * (pm_potential(s, x, y, z + 2) - pm_potential(s, x, y, z - 2)));
+}
+
+
+/**
+ * Interpolate the mesh acceleration at a position with the deposit's weights
+ * @param s, the mesh state with the potential solved
+ * @param x, the x position
+ * @param y, the y position
+ * @param z, the z position
+ * @param acc, set to the x, y and z acceleration
+ */
+static void pm_acceleration(const struct pm_state* s, double x, double y, double z, double* acc) {
+	long cx, cy, cz;
+	double fx, fy, fz;
+	pm_cic(s, (x - s->origin_x) / s->h, &cx, &fx);
+	pm_cic(s, (y - s->origin_y) / s->h, &cy, &fy);
+	pm_cic(s, (z - s->origin_z) / s->h, &cz, &fz);
+
+	acc[0] = acc[1] = acc[2] = 0.0;
+	for (int corner = 0; corner < 8; corner++) {
+		int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+		double weight = (dx ? fx : 1.0 - fx) * (dy ? fy : 1.0 - fy) * (dz ? fz : 1.0 - fz);
+		pm_gradient(s, cx + dx, cy + dy, cz + dz, acc, weight);
+	}
+
+	// The green's function was built for a cell of 1 and the inverse is unnormalised
+	double scale = GCONST / (s->h * s->h * (double)s->n * s->n * s->n);
+	acc[0] *= scale;
+	acc[1] *= scale;
+	acc[2] *= scale;
+}
+
+
+/**
+ * Kick bodies with the mesh acceleration and any extra acceleration and
+ * move them, wrapping around the box when periodic
+ * @param s, the mesh state with the potential solved
+ * @param b, the body store
+ * @param start, the first body to move
+ * @param end, one past the last body to move
+ * @param dt, the change in time
+ * @param extra_x, the extra x acceleration of every body or NULL
+ * @param extra_y, the extra y acceleration of every body or NULL
+ * @param extra_z, the extra z acceleration of every body or NULL
+ */
+static void pm_move(const struct pm_state* s, struct bodies* b, size_t start, size_t end, double dt,
+		const double* extra_x, const double* extra_y, const double* extra_z) {
+	for (size_t i = start; i < end; i++) {
+		double acc[3];
+		pm_acceleration(s, b->x[i], b->y[i], b->z[i], acc);
+		if (extra_x != NULL) {
+			acc[0] += extra_x[i];
+			acc[1] += extra_y[i];
+			acc[2] += extra_z[i];
+		}
+		b->velocity_x[i] += acc[0] * dt;
+		b->velocity_y[i] += acc[1] * dt;
+		b->velocity_z[i] += acc[2] * dt;
+		b->x[i] += b->velocity_x[i] * dt;
+		b->y[i] += b->velocity_y[i] * dt;
+		b->z[i] += b->velocity_z[i] * dt;
+		if (s->periodic) {
+			b->x[i] = s->origin_x + fmod(fmod(b->x[i] - s->origin_x, s->box) + s->box, s->box);
+			b->y[i] = s->origin_y + fmod(fmod(b->y[i] - s->origin_y, s->box) + s->box, s->box);
+			b->z[i] = s->origin_z + fmod(fmod(b->z[i] - s->origin_z, s->box) + s->box, s->box);
+		}
+	}
+}
+
+
+/**
+ * Fill the transform of the potential of a unit mass for a cell of 1
+ * Periodic meshes invert the seven point laplacian with the mean removed,
+ * isolated meshes transform -1 / r over the doubled mesh, using the
+ * nearest image so the padding holds the negative distances
+ * With a split only the long range part erf(r / 2 split) / r is kept and
+ * the smoothing of depositing and interpolating with clouds is divided out
+ * @param s, the mesh state with n, grid, split and the transform tables set
+ */
+static void pm_green(struct pm_state* s) {
+	size_t n = s->n;
+	double split = s->split;
+	for (size_t z = 0; z < n; z++) {
+		for (size_t y = 0; y < n; y++) {
+			for (size_t x = 0; x < n; x++) {
+				size_t k = (z * n + y) * n + x;
+				double dx = x < n - x ? x : n - x;
+				double dy = y < n - y ? y : n - y;
+				double dz = z < n - z ? z : n - z;
+				if (s->periodic) {
+					double sx = 2.0 * sin(PI * x / n), sy = 2.0 * sin(PI * y / n), sz = 2.0 * sin(PI * z / n);
+					double k2 = 4.0 * PI * PI * (dx * dx + dy * dy + dz * dz) / (n * n);
+					// The split matches the continuous long range part that the pairs leave out
+					double laplacian = split > 0.0 ? k2 : sx * sx + sy * sy + sz * sz;
+					s->green[k] = k == 0 ? 0.0 : -4.0 * PI / laplacian * exp(-k2 * split * split);
+					continue;
+				}
+				double r = sqrt(dx * dx + dy * dy + dz * dz);
+				if (split > 0.0) {
+					s->work[k] = k == 0 ? -1.0 / (split * sqrt(PI)) : -erf(r / (2.0 * split)) / r;
+				} else {
+					// A mass feels its own cell as if a cell away, the self force cancels
+					s->work[k] = -1.0 / (k == 0 ? 1.0 : r);
+				}
+			}
+		}
+	}
+
+	// The green's function is even so its transform is real
+	if (!s->periodic) {
+		size_t n_threads = s->n_threads, g = s->grid;
+		s->n_threads = 1;
+		s->grid = n;
+		pm_fft(s, 0, 0, NULL);
+		s->grid = g;
+		s->n_threads = n_threads;
+		for (size_t k = 0; k < n * n * n; k++) {
+			s->green[k] = creal(s->work[k]);
+		}
+	}
+	if (split == 0.0) {
+		return;
+	}
+
+	// Each cloud smooths by sinc^2 per axis, the split already damps the high modes
+	for (size_t z = 0; z < n; z++) {
+		for (size_t y = 0; y < n; y++) {
+			for (size_t x = 0; x < n; x++) {
+				double kx = PI * (x < n - x ? x : n - x) / n;
+				double ky = PI * (y < n - y ? y : n - y) / n;
+				double kz = PI * (z < n - z ? z : n - z) / n;
+				double wx = x == 0 ? 1.0 : sin(kx) / kx;
+				double wy = y == 0 ? 1.0 : sin(ky) / ky;
+				double wz = z == 0 ? 1.0 : sin(kz) / kz;
+				double window = wx * wx * wy * wy * wz * wz;
+				s->green[(z * n + y) * n + x] /= window * window;
+			}
+		}
+	}
+}
+
+
+/**
+ * Allocate a particle mesh state
+ * @param b, the body store, a periodic box is fixed around its positions
+ * @param n_threads, the number of threads that will solve the mesh
+ * @param params, the engine parameters, grid is the number of cells per
+ * side, a power of two, and periodic selects the boundary
+ * @param split, the scale in cells of the long range part or 0 for every range
+ * @return the state or NULL if invalid
+ */
+static struct pm_state* pm_init(const struct bodies* b, size_t n_threads, const struct engine_params* params, double split) {
+
+	// If the parameters are invalid
+	if (b == NULL || n_threads == 0 || params == NULL || params->grid < PM_MIN_GRID || params->grid > PM_MAX_GRID
+			|| (params->grid & (params->grid - 1)) != 0 || split < 0.0) {
+		return NULL;
+	}
+
+	struct pm_state* s = calloc(1, sizeof(struct pm_state));
+	if (s == NULL) {
+		return NULL;
+	}
+
+	size_t g = params->grid;
+	size_t n = params->periodic ? g : 2 * g;
+	s->grid = g;
+	s->n = n;
+	s->periodic = params->periodic != 0;
+	s->split = split;
+	s->n_bodies = b->n_bodies;
+	s->n_threads = n_threads;
+	s->bounds = malloc(sizeof(double) * 6 * n_threads);
+	s->masses = malloc(sizeof(double) * g * g * g * n_threads);
+	s->green = malloc(sizeof(double) * n * n * n);
+	s->work = malloc(sizeof(double complex) * n * n * n);
+	s->twiddle = malloc(sizeof(double complex) * n / 2);
+	s->lines = malloc(sizeof(double complex) * n * n_threads);
+	s->reverse = malloc(sizeof(size_t) * n);
+	if (s->bounds == NULL || s->masses == NULL || s->green == NULL || s->work == NULL || s->twiddle == NULL
+			|| s->lines == NULL || s->reverse == NULL) {
+		pm_destroy(s);
+		return NULL;
+	}
+
+	for (size_t k = 0; k < n / 2; k++) {
+		s->twiddle[k] = cexp(-2.0 * PI * I * k / n);
+	}
+	int bits = 0;
+	while (((size_t)1 << bits) < n) {
+		bits++;
+	}
+	for (size_t i = 0; i < n; i++) {
+		size_t r = 0;
+		for (int bit = 0; bit < bits; bit++) {
+			r |= ((i >> bit) & 1) << (bits - 1 - bit);
+		}
+		s->reverse[i] = r;
+	}
+	pm_green(s);
+
+	// A periodic box is the cube around the starting positions unless one is kept from before
+	if (s->periodic && params->box > 0.0) {
+		s->box = params->box;
+		s->h = s->box / g;
+		s->origin_x = params->origin[0];
+		s->origin_y = params->origin[1];
+		s->origin_z = params->origin[2];
+	} else if (s->periodic) {
+		double low[3] = { INFINITY, INFINITY, INFINITY }, high[3] = { -INFINITY, -INFINITY, -INFINITY };
+		for (size_t i = 0; i < b->n_bodies; i++) {
+			low[0] = fmin(low[0], b->x[i]);
+			low[1] = fmin(low[1], b->y[i]);
+			low[2] = fmin(low[2], b->z[i]);
+			high[0] = fmax(high[0], b->x[i]);
+			high[1] = fmax(high[1], b->y[i]);
+			high[2] = fmax(high[2], b->z[i]);
+		}
+		double extent = fmax(fmax(high[0] - low[0], high[1] - low[1]), high[2] - low[2]);
+		s->box = extent > 0.0 ? extent * (1.0 + 1e-9) : 1.0;
+		s->h = s->box / g;
+		s->origin_x = low[0];
+		s->origin_y = low[1];
+		s->origin_z = low[2];
+	}
+	return s;
+}
+
+
+/**
+ * Allocate the particle mesh state for a body store and a number of threads
+ * @param b, the body store, a periodic box is fixed around its positions
+ * @param n_threads, the number of threads that will call pm_step
+ * @param params, the engine parameters, grid is the number of cells per
+ * side, a power of two, and periodic selects the boundary
+ * @return the state or NULL if invalid
+ */
+void* pm_create(const struct bodies* b, size_t n_threads, const struct engine_params* params) {
+	return pm_init(b, n_threads, params, 0.0);
+}
+
+
+/**
+ * Keep the periodic box of a particle mesh so a mesh created again for the
+ * positions it has moved to uses the same box
+ * @param state, the mesh state
+ * @param params, the parameters, origin and box are set when periodic
+ */
+void pm_keep(const void* state, struct engine_params* params) {
+	const struct pm_state* s = state;
+	if (s->periodic) {
+		params->origin[0] = s->origin_x;
+		params->origin[1] = s->origin_y;
+		params->origin[2] = s->origin_z;
+		params->box = s->box;
+	}
+}
+
+
+/**
+ * Clear up all memory associated with the particle mesh state
+ * @param state, the state
+ */
+void pm_destroy(void* state) {
+	struct pm_state* s = state;
+
+	// If it is already NULL
+	if (s == NULL) {
+		return;
+	}
+
+	free(s->reverse);
+	free(s->lines);
+	free(s->twiddle);
+	free(s->work);
+	free(s->green);
+	free(s->masses);
+	free(s->bounds);
+	free(s);
+}
+
+
+/**
+ * Particle mesh step of one thread, the potential is solved by every
+ * thread and this thread's bodies are kicked and moved, wrapping around
+ * the box when periodic
+ * @param state, the mesh state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, unused, the mesh keeps no potential per body
+ */
+void pm_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential) {
+	struct pm_state* s = state;
+
+	// Check if the parameters are invalid
+	if (s == NULL || b == NULL || b->n_bodies != s->n_bodies || n_threads != s->n_threads || end > b->n_bodies) {
+		return;
+	}
+
+	pm_solve(s, b, id, start, end, pool);
+
+	// The mesh holds every mass so bodies can move straight away
+	pm_move(s, b, start, end, dt, NULL, NULL, NULL);
+}
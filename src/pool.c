@@ -0,0 +1,535 @@
+#include "nbody.h"
+#include <sched.h>
+#include <unistd.h>
+#include <immintrin.h>
+
+// Barrier of new pools, spin or pthread
+static int pool_spin_barrier = 1;
+
+// Placement of the threads of new pools, none, cores or nodes
+static int pool_pin = POOL_PIN_NONE;
+
+
+/**
+ * Pack a range of tasks into one word so it can be updated atomically
+ * @param first, the first task
+ * @param last, one past the last task
+ * @return the packed range
+ */
+static inline unsigned long long pool_pack(size_t first, size_t last) {
+	return (unsigned long long)first | (unsigned long long)last << 32;
+}
+
+
+/**
+ * Take the first task of a thread's own range
+ * @param p, the pool
+ * @param id, the thread
+ * @param task, set to the task
+ * @return 1 if a task was taken or 0 if the range is empty
+ */
+static int pool_pop(struct thread_pool* p, size_t id, size_t* task) {
+	_Atomic unsigned long long* range = &p->ranges[id].range;
+	unsigned long long r = atomic_load(range);
+	for (;;) {
+		size_t first = (size_t)(r & 0xFFFFFFFFULL), last = (size_t)(r >> 32);
+		if (first >= last) {
+			return 0;
+		}
+		if (atomic_compare_exchange_weak(range, &r, pool_pack(first + 1, last))) {
+			*task = first;
+			return 1;
+		}
+	}
+}
+
+
+/**
+ * Move the back half of another thread's range into this thread's empty range
+ * Victims are tried in order from the next thread so thieves spread out
+ * @param p, the pool
+ * @param id, the thread
+ * @return 1 if tasks were stolen or 0 if every range is empty
+ */
+static int pool_take(struct thread_pool* p, size_t id) {
+	for (size_t k = 1; k < p->n_threads; k++) {
+		_Atomic unsigned long long* range = &p->ranges[(id + k) % p->n_threads].range;
+		unsigned long long r = atomic_load(range);
+		for (;;) {
+			size_t first = (size_t)(r & 0xFFFFFFFFULL), last = (size_t)(r >> 32);
+			if (first >= last) {
+				break;
+			}
+			size_t split = last - (last - first + 1) / 2;
+			if (atomic_compare_exchange_weak(range, &r, pool_pack(first, split))) {
+				atomic_store(&p->ranges[id].range, pool_pack(split, last));
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Body of every helper thread, it sleeps until a job is posted, runs it and reports back
+ * @param arg, the helper
+ */
+static void* pool_thread(void* arg) {
+	struct pool_helper* helper = arg;
+	struct thread_pool* p = helper->pool;
+	unsigned long seen = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (!p->stop && p->generation == seen) {
+			pthread_cond_wait(&p->wake, &p->lock);
+		}
+		if (p->stop) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		seen = p->generation;
+		void (*job)(void*, size_t) = p->job;
+		void* job_arg = p->arg;
+		pthread_mutex_unlock(&p->lock);
+
+		job(job_arg, helper->id);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->running == 0) {
+			pthread_cond_signal(&p->done);
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+
+/**
+ * Pin every thread of a pool, with cores thread i runs on the i-th cpu so the
+ * threads fill one node before the next, with nodes the threads are dealt to
+ * the nodes in blocks and may run on any cpu of theirs
+ * @param p, the pool, its helpers started
+ */
+static void pool_pin_threads(struct thread_pool* p) {
+	int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE];
+	size_t n_cpus = topology_cpus(cpus, nodes);
+	if (n_cpus == 0) {
+		return;
+	}
+
+	// The cpus are listed node by node
+	int node_ids[TOPOLOGY_MAX_NODES];
+	size_t n_nodes = 0;
+	for (size_t k = 0; k < n_cpus; k++) {
+		if (n_nodes == 0 || node_ids[n_nodes - 1] != nodes[k]) {
+			node_ids[n_nodes++] = nodes[k];
+		}
+	}
+
+	for (size_t i = 0; i < p->n_threads; i++) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (p->pin == POOL_PIN_CORES) {
+			p->helpers[i].cpu = cpus[i % n_cpus];
+			p->helpers[i].node = nodes[i % n_cpus];
+			CPU_SET(cpus[i % n_cpus], &set);
+		} else {
+			p->helpers[i].node = node_ids[i * n_nodes / p->n_threads];
+			for (size_t k = 0; k < n_cpus; k++) {
+				if (nodes[k] == p->helpers[i].node) {
+					CPU_SET(cpus[k], &set);
+				}
+			}
+		}
+		pthread_setaffinity_np(i == 0 ? pthread_self() : p->helpers[i].thread, sizeof(set), &set);
+	}
+}
+
+
+/**
+ * Start a pool of threads that live until it is destroyed
+ * The calling thread is thread 0 of every job so only n_threads - 1 are started
+ * @param n_threads, the number of threads that run each job
+ * @param pin, how the threads are placed
+ * @return the pool or NULL if invalid
+ */
+static struct thread_pool* pool_start(size_t n_threads, int pin) {
+
+	// If the parameter is invalid
+	if (n_threads == 0 || n_threads > 0xFFFFFFFFULL) {
+		return NULL;
+	}
+
+	struct thread_pool* p = aligned_alloc(CACHE_LINE, sizeof(struct thread_pool));
+	if (p == NULL) {
+		return NULL;
+	}
+	memset(p, 0, sizeof(struct thread_pool));
+	atomic_init(&p->arrived, 0);
+	atomic_init(&p->epoch, 0);
+	p->n_threads = n_threads;
+	p->spin = pool_spin_barrier;
+	p->pin = pin;
+
+	// With more threads than cpus the thread being waited for needs the cpu so waiting yields at once
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	p->spins = n_cpus > 0 && n_threads > (size_t)n_cpus ? 0 : POOL_SPINS;
+	p->ranges = aligned_alloc(CACHE_LINE, sizeof(struct pool_range) * n_threads);
+	p->helpers = malloc(sizeof(struct pool_helper) * n_threads);
+	if (p->ranges == NULL || p->helpers == NULL || pthread_barrier_init(&p->barrier, NULL, n_threads)) {
+		free(p->helpers);
+		free(p->ranges);
+		free(p);
+		return NULL;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	for (size_t i = 0; i < n_threads; i++) {
+		atomic_init(&p->ranges[i].range, 0);
+		p->helpers[i].pool = p;
+		p->helpers[i].id = i;
+		p->helpers[i].cpu = -1;
+		p->helpers[i].node = -1;
+	}
+	for (size_t i = 1; i < n_threads; i++) {
+		if (pthread_create(&p->helpers[i].thread, NULL, pool_thread, p->helpers + i)) {
+			p->n_started = i - 1;
+			pool_destroy(p);
+			return NULL;
+		}
+	}
+	p->n_started = n_threads - 1;
+	if (p->pin != POOL_PIN_NONE) {
+		pool_pin_threads(p);
+	}
+	return p;
+}
+
+
+/**
+ * Start a pool of threads placed as pool_pin_select asked
+ * @param n_threads, the number of threads that run each job
+ * @return the pool or NULL if invalid
+ */
+struct thread_pool* pool_create(size_t n_threads) {
+	return pool_start(n_threads, pool_pin);
+}
+
+
+/**
+ * Start a pool of threads that float, for work beside the simulation such
+ * as the trajectory writer, so it never takes the cores of the pinned pool
+ * or pins the thread that starts it
+ * @param n_threads, the number of threads that run each job
+ * @return the pool or NULL if invalid
+ */
+struct thread_pool* pool_create_unpinned(size_t n_threads) {
+	return pool_start(n_threads, POOL_PIN_NONE);
+}
+
+
+/**
+ * Stop the threads and clear up all memory associated with the pool
+ * @param p, the pool
+ */
+void pool_destroy(struct thread_pool* p) {
+
+	// If it is already NULL
+	if (p == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	for (size_t i = 1; i <= p->n_started; i++) {
+		pthread_join(p->helpers[i].thread, NULL);
+	}
+
+	// The caller was thread 0 so it may run anywhere again
+	if (p->pin != POOL_PIN_NONE) {
+		int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE];
+		size_t n_cpus = topology_cpus(cpus, nodes);
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (size_t k = 0; k < n_cpus; k++) {
+			CPU_SET(cpus[k], &set);
+		}
+		if (n_cpus > 0) {
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+	}
+
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+	pthread_barrier_destroy(&p->barrier);
+	free(p->helpers);
+	free(p->ranges);
+	free(p);
+}
+
+
+/**
+ * Run a job on every thread of the pool and wait for all of them
+ * The job is called once per thread with its id, the caller being thread 0,
+ * and may wait on the pool's barrier
+ * @param p, the pool
+ * @param job, the job
+ * @param arg, the argument passed to every call of the job
+ */
+void pool_run(struct thread_pool* p, void (*job)(void* arg, size_t id), void* arg) {
+
+	// If the parameters are invalid
+	if (p == NULL || job == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->job = job;
+	p->arg = arg;
+	p->running = p->n_threads - 1;
+	p->generation++;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	job(arg, 0);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->running > 0) {
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/**
+ * Run a range of tasks with work stealing, called by every thread of a job
+ * Each thread starts on its own range, the ranges together covering every
+ * task once, and takes tasks from the front of it, a thread that runs out
+ * takes the back half of another thread's range, so slow threads and
+ * expensive tasks do not leave the others waiting, every task has run on
+ * some thread when this returns
+ * @param p, the pool
+ * @param id, the thread
+ * @param first, the first task of this thread's range
+ * @param last, one past the last task of this thread's range
+ * @param task, the task, called with the thread that runs it
+ * @param arg, the argument passed to every task
+ */
+void pool_steal(struct thread_pool* p, size_t id, size_t first, size_t last, void (*task)(void* arg, size_t id, size_t task), void* arg) {
+	atomic_store(&p->ranges[id].range, pool_pack(first, last));
+	pool_wait(p);
+
+	size_t k;
+	do {
+		while (pool_pop(p, id, &k)) {
+			task(arg, id, k);
+		}
+	} while (pool_take(p, id));
+	pool_wait(p);
+}
+
+
+/**
+ * Wait until every thread of the pool has reached the barrier
+ * The spin barrier reads the epoch before arriving, the last thread to arrive
+ * resets the count and moves the epoch on, which releases the others, so a
+ * fast thread arriving for the next phase can never be confused with this one
+ * @param p, the pool or NULL for a single thread that never waits
+ */
+void pool_wait(struct thread_pool* p) {
+
+	// If there is no one to wait for
+	if (p == NULL || p->n_threads == 1) {
+		if (p != NULL) {
+			atomic_fetch_add_explicit(&p->epoch, 1, memory_order_relaxed);
+		}
+		return;
+	}
+
+	if (!p->spin) {
+		if (pthread_barrier_wait(&p->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			atomic_fetch_add_explicit(&p->epoch, 1, memory_order_relaxed);
+		}
+		return;
+	}
+
+	unsigned long epoch = atomic_load_explicit(&p->epoch, memory_order_acquire);
+	if (atomic_fetch_add_explicit(&p->arrived, 1, memory_order_acq_rel) == p->n_threads - 1) {
+		atomic_store_explicit(&p->arrived, 0, memory_order_relaxed);
+		atomic_store_explicit(&p->epoch, epoch + 1, memory_order_release);
+		return;
+	}
+
+	// Spinning is cheapest while the others are close, yielding keeps an oversubscribed cpu moving
+	for (size_t spins = 0; atomic_load_explicit(&p->epoch, memory_order_acquire) == epoch; spins++) {
+		if (spins < p->spins) {
+			_mm_pause();
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+
+/**
+ * Select the barrier of pools created after this call
+ * @param name, spin for the atomic spin then yield barrier or pthread
+ * @return 0 if selected or 1 if it is unknown
+ */
+int pool_barrier_select(const char* name) {
+
+	// If the parameter is invalid
+	if (name == NULL) {
+		return 1;
+	}
+
+	if (strcmp(name, "spin") == 0 || strcmp(name, "pthread") == 0) {
+		pool_spin_barrier = strcmp(name, "spin") == 0;
+		return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Get the name of a pool's barrier
+ * @param p, the pool
+ * @return spin or pthread
+ */
+const char* pool_barrier_name(const struct thread_pool* p) {
+	return p != NULL && p->spin ? "spin" : "pthread";
+}
+
+
+/**
+ * Select how the threads of pools created after this call are placed
+ * @param name, none to let them float, cores to pin each to a cpu or nodes to pin each to the cpus of a node
+ * @return 0 if selected or 1 if it is unknown
+ */
+int pool_pin_select(const char* name) {
+
+	// If the parameter is invalid
+	if (name == NULL) {
+		return 1;
+	}
+
+	const char* names[] = { "none", "cores", "nodes" };
+	for (int pin = POOL_PIN_NONE; pin <= POOL_PIN_NODES; pin++) {
+		if (strcmp(name, names[pin]) == 0) {
+			pool_pin = pin;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/**
+ * Get how the threads of a pool are placed
+ * @param p, the pool
+ * @return none, cores or nodes
+ */
+const char* pool_pin_name(const struct thread_pool* p) {
+	const char* names[] = { "none", "cores", "nodes" };
+	return p != NULL ? names[p->pin] : names[POOL_PIN_NONE];
+}
+
+
+/**
+ * Wait a moment for another thread, spinning while every thread of the pool has
+ * a cpu and yielding once the rounds run out or the cpus are shared
+ * @param p, the pool
+ * @param round, how many times this thread has waited in a row
+ */
+void pool_pause(const struct thread_pool* p, size_t round) {
+	if (p != NULL && round < p->spins) {
+		_mm_pause();
+	} else {
+		sched_yield();
+	}
+}
+
+
+/**
+ * Allocate the lanes of a pool's threads
+ * @param n_lanes, the number of lanes, one per thread
+ * @return the lanes, every one empty, or NULL if invalid
+ */
+struct pool_lane* pool_lanes_create(size_t n_lanes) {
+
+	// If the parameter is invalid
+	if (n_lanes == 0) {
+		return NULL;
+	}
+
+	struct pool_lane* lanes = aligned_alloc(CACHE_LINE, sizeof(struct pool_lane) * n_lanes);
+	for (size_t i = 0; lanes != NULL && i < n_lanes; i++) {
+		atomic_init(&lanes[i].busy, 0);
+		atomic_init(&lanes[i].next, 0);
+		lanes[i].end = 0;
+	}
+	return lanes;
+}
+
+
+/**
+ * Give a lane its tasks, no thread may use it at the same time
+ * @param l, the lane
+ * @param first, the first task
+ * @param end, one past the last task
+ */
+void pool_lane_reset(struct pool_lane* l, size_t first, size_t end) {
+	atomic_store_explicit(&l->next, first, memory_order_relaxed);
+	l->end = end;
+}
+
+
+/**
+ * Whether every task of a lane has run
+ * @param l, the lane
+ * @return 1 if done, 0 if tasks are left
+ */
+int pool_lane_done(struct pool_lane* l) {
+	return atomic_load_explicit(&l->next, memory_order_acquire) >= l->end;
+}
+
+
+/**
+ * Try to take a lane to run its next task, without waiting for it
+ * A taken lane is kept from every other thread until pool_lane_leave, and
+ * what the threads before wrote for its tasks is visible
+ * @param l, the lane
+ * @param task, set to the next task of the lane
+ * @return 1 if taken, 0 if another thread has it or it is done
+ */
+int pool_lane_enter(struct pool_lane* l, size_t* task) {
+	if (pool_lane_done(l) || atomic_load_explicit(&l->busy, memory_order_relaxed)
+			|| atomic_exchange_explicit(&l->busy, 1, memory_order_acquire)) {
+		return 0;
+	}
+	*task = atomic_load_explicit(&l->next, memory_order_relaxed);
+	if (*task >= l->end) {
+		atomic_store_explicit(&l->busy, 0, memory_order_release);
+		return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Give back a lane taken with pool_lane_enter
+ * @param l, the lane
+ * @param ran, 1 if its next task was run, 0 if it was left for later
+ */
+void pool_lane_leave(struct pool_lane* l, int ran) {
+	if (ran) {
+		atomic_store_explicit(&l->next, atomic_load_explicit(&l->next, memory_order_relaxed) + 1, memory_order_release);
+	}
+	atomic_store_explicit(&l->busy, 0, memory_order_release);
+}
@@ -0,0 +1,360 @@
+#include "nbody.h"
+
+
+/**
+ * Multiply two words into the high and low words of the product
+ * @param a, the first word
+ * @param b, the second word
+ * @param high, set to the high word
+ * @return the low word
+ */
+static inline uint32_t philox_multiply(uint32_t a, uint32_t b, uint32_t* high) {
+	uint64_t product = (uint64_t)a * b;
+	*high = (uint32_t)(product >> 32);
+	return (uint32_t)product;
+}
+
+
+/**
+ * Philox4x32-10, ten rounds of multiplies and xors with a key bumped by the
+ * Weyl constants between rounds, the same counter and key always give the same block
+ * @param counter, the counter
+ * @param key, the key
+ * @param block, set to the four random words
+ */
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t block[4]) {
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for (int round = 0; round < PHILOX_ROUNDS; round++) {
+		uint32_t high0, high1;
+		uint32_t low0 = philox_multiply(PHILOX_M0, c0, &high0);
+		uint32_t low1 = philox_multiply(PHILOX_M1, c2, &high1);
+		c0 = high1 ^ c1 ^ k0;
+		c1 = low1;
+		c2 = high0 ^ c3 ^ k1;
+		c3 = low0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	block[0] = c0;
+	block[1] = c1;
+	block[2] = c2;
+	block[3] = c3;
+}
+
+
+/**
+ * Start a random stream, every seed and stream pair gives its own sequence
+ * @param r, the stream
+ * @param seed, the seed, the key of every block
+ * @param stream, the number of the stream, such as a body
+ */
+void philox_init(struct philox* r, uint64_t seed, uint64_t stream) {
+	r->key[0] = (uint32_t)seed;
+	r->key[1] = (uint32_t)(seed >> 32);
+	r->counter[0] = 0;
+	r->counter[1] = 0;
+	r->counter[2] = (uint32_t)stream;
+	r->counter[3] = (uint32_t)(stream >> 32);
+	r->used = 4;
+}
+
+
+/**
+ * Take the next word of a random stream, a new block is made every four words
+ * @param r, the stream
+ * @return the word
+ */
+static uint32_t philox_next(struct philox* r) {
+	if (r->used == 4) {
+		philox4x32(r->counter, r->key, r->block);
+		r->counter[0]++;
+		r->counter[1] += r->counter[0] == 0;
+		r->used = 0;
+	}
+	return r->block[r->used++];
+}
+
+
+/**
+ * Draw a uniform number strictly between 0 and 1 from 53 random bits,
+ * so its logarithm and inverse are always finite
+ * @param r, the stream
+ * @return the number
+ */
+double philox_uniform(struct philox* r) {
+	uint64_t high = philox_next(r) >> 5, low = philox_next(r) >> 6;
+	return ((double)(high << 26 | low) + 0.5) * 0x1p-53;
+}
+
+
+/**
+ * Draw a standard normal number with the Box-Muller transform
+ * @param r, the stream
+ * @return the number
+ */
+double philox_normal(struct philox* r) {
+	double radius = sqrt(-2.0 * log(philox_uniform(r)));
+	return radius * cos(2.0 * PI * philox_uniform(r));
+}
+
+
+/**
+ * Point a length in a direction drawn uniformly over the sphere
+ * @param r, the stream
+ * @param length, the length
+ * @param out, set to the three components
+ */
+static void generate_direction(struct philox* r, double length, double out[3]) {
+	double z = 2.0 * philox_uniform(r) - 1.0;
+	double phi = 2.0 * PI * philox_uniform(r);
+	double planar = sqrt(1.0 - z * z);
+	out[0] = length * planar * cos(phi);
+	out[1] = length * planar * sin(phi);
+	out[2] = length * z;
+}
+
+
+/**
+ * Body of the uniform box of the original generator, positions and velocities
+ * within GENERATE_RANDOM_BOUND of 0 and masses up to twice it
+ * @param r, the stream of the body
+ * @param n_bodies, the number of bodies
+ * @param values, set to the seven values of the body
+ */
+static void generate_random(struct philox* r, size_t n_bodies, double values[BODY_ARRAYS]) {
+	for (size_t k = 0; k < 6; k++) {
+		values[k] = GENERATE_RANDOM_BOUND * (2.0 * philox_uniform(r) - 1.0);
+	}
+	values[6] = 2.0 * GENERATE_RANDOM_BOUND * philox_uniform(r);
+}
+
+
+/**
+ * Body of a Plummer sphere of scale radius GENERATE_RADIUS in equilibrium,
+ * drawn as Aarseth, Henon and Wielen do, the radius from the cumulative mass
+ * and the speed by rejection from the distribution function, bodies beyond
+ * PLUMMER_CUTOFF scale radii are drawn again
+ * @param r, the stream of the body
+ * @param n_bodies, the number of bodies
+ * @param values, set to the seven values of the body
+ */
+static void generate_plummer(struct philox* r, size_t n_bodies, double values[BODY_ARRAYS]) {
+	double radius;
+	do {
+		radius = 1.0 / sqrt(pow(philox_uniform(r), -2.0 / 3.0) - 1.0);
+	} while (radius > PLUMMER_CUTOFF);
+
+	double q, g;
+	do {
+		q = philox_uniform(r);
+		g = 0.1 * philox_uniform(r);
+	} while (g > q * q * pow(1.0 - q * q, 3.5));
+	double speed = q * sqrt(2.0) * pow(1.0 + radius * radius, -0.25);
+
+	generate_direction(r, radius * GENERATE_RADIUS, values);
+	generate_direction(r, speed * sqrt(GCONST * GENERATE_MASS / GENERATE_RADIUS), values + 3);
+	values[6] = GENERATE_MASS / n_bodies;
+}
+
+
+/**
+ * Body of a uniform cube of side 2 * GENERATE_RADIUS with normal velocities
+ * whose kinetic energy is half its potential energy, so it starts in virial equilibrium
+ * @param r, the stream of the body
+ * @param n_bodies, the number of bodies
+ * @param values, set to the seven values of the body
+ */
+static void generate_cube(struct philox* r, size_t n_bodies, double values[BODY_ARRAYS]) {
+	double sigma = sqrt(CUBE_ENERGY * GCONST * GENERATE_MASS / (3.0 * 2.0 * GENERATE_RADIUS));
+	for (size_t k = 0; k < 3; k++) {
+		values[k] = GENERATE_RADIUS * (2.0 * philox_uniform(r) - 1.0);
+	}
+	for (size_t k = 3; k < 6; k++) {
+		values[k] = sigma * philox_normal(r);
+	}
+	values[6] = GENERATE_MASS / n_bodies;
+}
+
+
+/**
+ * Body of a cold exponential disk of scale length GENERATE_RADIUS in the
+ * x y plane, the radius has density R exp(-R) in scale lengths, the height
+ * is sech squared with DISK_HEIGHT scale lengths, and each body circles with
+ * the speed the disk mass inside its radius gives
+ * @param r, the stream of the body
+ * @param n_bodies, the number of bodies
+ * @param values, set to the seven values of the body
+ */
+static void generate_disk(struct philox* r, size_t n_bodies, double values[BODY_ARRAYS]) {
+	double radius = -log(philox_uniform(r) * philox_uniform(r));
+	double phi = 2.0 * PI * philox_uniform(r);
+	double height = DISK_HEIGHT * atanh(2.0 * philox_uniform(r) - 1.0);
+	double inside = 1.0 - (1.0 + radius) * exp(-radius);
+	double speed = sqrt(GCONST * GENERATE_MASS * inside / (radius * GENERATE_RADIUS));
+
+	values[0] = radius * GENERATE_RADIUS * cos(phi);
+	values[1] = radius * GENERATE_RADIUS * sin(phi);
+	values[2] = height * GENERATE_RADIUS;
+	values[3] = -speed * sin(phi);
+	values[4] = speed * cos(phi);
+	values[5] = 0.0;
+	values[6] = GENERATE_MASS / n_bodies;
+}
+
+
+/**
+ * Body of a cold collapse, a uniform sphere of radius GENERATE_RADIUS at rest
+ * @param r, the stream of the body
+ * @param n_bodies, the number of bodies
+ * @param values, set to the seven values of the body
+ */
+static void generate_collapse(struct philox* r, size_t n_bodies, double values[BODY_ARRAYS]) {
+	generate_direction(r, GENERATE_RADIUS * cbrt(philox_uniform(r)), values);
+	values[3] = values[4] = values[5] = 0.0;
+	values[6] = GENERATE_MASS / n_bodies;
+}
+
+
+// Every model, the first is the default
+static const struct generator generators[] = {
+	{ "random", generate_random },
+	{ "plummer", generate_plummer },
+	{ "cube", generate_cube },
+	{ "disk", generate_disk },
+	{ "collapse", generate_collapse },
+};
+
+
+/**
+ * Find a model of initial conditions by name
+ * @param name, the name of the model
+ * @return the model or NULL if unknown
+ */
+const struct generator* generator_find(const char* name) {
+
+	// If the parameter is invalid
+	if (name == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < sizeof(generators) / sizeof(generators[0]); i++) {
+		if (strcmp(generators[i].name, name) == 0) {
+			return generators + i;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Fill one chunk of bodies, each from the stream of its own index, and sum
+ * the chunk's mass, mass weighted position and momentum
+ * @param arg, the generate job
+ * @param id, the thread running the task
+ * @param task, the chunk
+ */
+static void generate_task(void* arg, size_t id, size_t task) {
+	struct generate_job* job = arg;
+	struct bodies* b = job->bodies;
+	double* sums = job->sums + task * BODY_ARRAYS;
+	size_t start = task * GENERATE_CHUNK;
+	size_t end = start + GENERATE_CHUNK < b->n_bodies ? start + GENERATE_CHUNK : b->n_bodies;
+	memset(sums, 0, sizeof(double) * BODY_ARRAYS);
+
+	for (size_t i = start; i < end; i++) {
+		struct philox r;
+		double values[BODY_ARRAYS];
+		philox_init(&r, job->seed, i);
+		job->generator->body(&r, b->n_bodies, values);
+		for (size_t k = 0; k < BODY_ARRAYS; k++) {
+			b->x[k * b->stride + i] = values[k];
+		}
+		for (size_t k = 0; k < 6; k++) {
+			sums[k] += values[6] * values[k];
+		}
+		sums[6] += values[6];
+	}
+}
+
+
+/**
+ * Generate one thread's share of the chunks, taking others' when it runs out
+ * @param arg, the generate job
+ * @param id, the thread
+ */
+static void generate_job(void* arg, size_t id) {
+	struct generate_job* job = arg;
+	pool_steal(job->pool, id, id * job->n_chunks / job->n_threads, (id + 1) * job->n_chunks / job->n_threads,
+			generate_task, job);
+}
+
+
+/**
+ * Move one thread's slice of the bodies so the centre of mass is at rest at the origin
+ * @param arg, the generate job
+ * @param id, the thread
+ */
+static void generate_centre_job(void* arg, size_t id) {
+	struct generate_job* job = arg;
+	struct bodies* b = job->bodies;
+	size_t start, end;
+	bodies_slice(b->n_bodies, job->n_threads, id, &start, &end);
+	for (size_t k = 0; k < 6; k++) {
+		double* array = b->x + k * b->stride;
+		for (size_t i = start; i < end; i++) {
+			array[i] -= job->centre[k];
+		}
+	}
+}
+
+
+/**
+ * Generate a body store of initial conditions from a model on a pool of
+ * threads, body i comes from stream i of the seed and the centre of mass is
+ * summed chunk by chunk in order, so a seed gives the same bits on any
+ * number of threads, the centre of mass is then moved to rest at the origin
+ * @param model, the name of the model, random, plummer, cube, disk or collapse
+ * @param n_bodies, the number of bodies
+ * @param seed, the seed
+ * @param n_threads, the number of threads that generate the bodies
+ * @return the body store or NULL if invalid
+ */
+struct bodies* bodies_generate(const char* model, size_t n_bodies, uint64_t seed, size_t n_threads) {
+	const struct generator* generator = generator_find(model);
+
+	// If the parameters are invalid
+	if (generator == NULL || n_bodies == 0 || n_threads == 0) {
+		return NULL;
+	}
+
+	n_threads = n_threads < n_bodies ? n_threads : n_bodies;
+	struct generate_job job = { .generator = generator, .seed = seed, .n_threads = n_threads,
+		.n_chunks = (n_bodies + GENERATE_CHUNK - 1) / GENERATE_CHUNK };
+	job.sums = malloc(sizeof(double) * BODY_ARRAYS * job.n_chunks);
+	job.pool = pool_create(n_threads);
+	job.bodies = bodies_create(n_bodies);
+	if (job.sums == NULL || job.pool == NULL || job.bodies == NULL) {
+		free(job.sums);
+		pool_destroy(job.pool);
+		bodies_destroy(job.bodies);
+		return NULL;
+	}
+	pool_run(job.pool, generate_job, &job);
+
+	double total[BODY_ARRAYS] = { 0 };
+	for (size_t chunk = 0; chunk < job.n_chunks; chunk++) {
+		for (size_t k = 0; k < BODY_ARRAYS; k++) {
+			total[k] += job.sums[chunk * BODY_ARRAYS + k];
+		}
+	}
+	for (size_t k = 0; k < 6; k++) {
+		job.centre[k] = total[k] / total[6];
+	}
+	pool_run(job.pool, generate_centre_job, &job);
+
+	free(job.sums);
+	pool_destroy(job.pool);
+	return job.bodies;
+}
@@ -0,0 +1,147 @@
+#include "nbody.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/**
+ * Checksum an array of doubles as 64 bit words, two running sums so the
+ * order of the words matters as well as their values
+ * @param data, the words
+ * @param n, the number of words
+ * @return the checksum
+ */
+uint64_t snapshot_checksum(const double* data, size_t n) {
+	uint64_t sum = 0, weighted = 0;
+	for (size_t i = 0; i < n; i++) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		sum += word;
+		weighted += sum;
+	}
+	return sum ^ (weighted << 1 | weighted >> 63);
+}
+
+
+/**
+ * Write a body store as a binary snapshot
+ * @param b, the body store
+ * @param file, the file to write to, opened in binary mode
+ * @return 0 if written or 1 if invalid or the write failed
+ */
+int bodies_write_snapshot(const struct bodies* b, FILE* file) {
+
+	// If the parameters are invalid
+	if (b == NULL || file == NULL) {
+		return 1;
+	}
+
+	// The arrays follow each other from x so the store is written in one go
+	size_t n_words = b->stride * BODY_ARRAYS;
+	struct snapshot_header header = { .version = SNAPSHOT_VERSION, .order = SNAPSHOT_ORDER, .arrays = BODY_ARRAYS,
+		.n_bodies = b->n_bodies, .stride = b->stride, .checksum = snapshot_checksum(b->x, n_words) };
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+	char padding[SNAPSHOT_DATA_OFFSET - sizeof(struct snapshot_header)] = { 0 };
+	if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(padding, sizeof(padding), 1, file) != 1
+			|| fwrite(b->x, sizeof(double), n_words, file) != n_words) {
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Map a binary snapshot as a body store without copying it
+ * The mapping is private so the simulation writes to its own pages and the
+ * file is never changed, every page is read once to check the checksum
+ * @param path, the path of the snapshot
+ * @return the body store or NULL if it cannot be mapped or is not a valid snapshot
+ */
+struct bodies* bodies_map_snapshot(const char* path) {
+
+	// If the parameter is invalid
+	if (path == NULL) {
+		return NULL;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < SNAPSHOT_DATA_OFFSET) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = (size_t)st.st_size;
+	void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	// The header must describe exactly the arrays that follow it
+	const struct snapshot_header* header = base;
+	double* arrays = (double*)((char*)base + SNAPSHOT_DATA_OFFSET);
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->version != SNAPSHOT_VERSION
+			|| header->order != SNAPSHOT_ORDER || header->arrays != BODY_ARRAYS || header->n_bodies == 0
+			|| header->stride != bodies_stride(header->n_bodies)
+			|| size != SNAPSHOT_DATA_OFFSET + sizeof(double) * header->stride * BODY_ARRAYS
+			|| snapshot_checksum(arrays, header->stride * BODY_ARRAYS) != header->checksum) {
+		munmap(base, size);
+		return NULL;
+	}
+
+	struct bodies* b = malloc(sizeof(struct bodies));
+	if (b == NULL) {
+		munmap(base, size);
+		return NULL;
+	}
+	b->n_bodies = header->n_bodies;
+	b->stride = header->stride;
+	bodies_attach(b, arrays);
+	b->memory = base;
+	b->mapped = size;
+	b->pages = BODY_PAGES_NORMAL;
+	b->file = -1;
+	return b;
+}
+
+
+/**
+ * Load the bodies of a file, a binary snapshot is mapped, the last frame of a
+ * trajectory is decoded and anything else is parsed as csv, the bodies go
+ * to the file of bodies_store_select when there is one
+ * @param path, the path of the file
+ * @param n_threads, the number of threads that parse a csv or decode a trajectory
+ * @return the body store or NULL if the file cannot be read
+ */
+struct bodies* bodies_load(const char* path, size_t n_threads) {
+
+	// If the parameters are invalid
+	if (path == NULL || n_threads == 0) {
+		return NULL;
+	}
+
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		return NULL;
+	}
+
+	// A snapshot or trajectory is known by its magic
+	char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+	int read = fread(magic, sizeof(magic), 1, file) == 1;
+	if (read && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0) {
+		fclose(file);
+		return bodies_to_store(bodies_map_snapshot(path));
+	}
+	if (read && memcmp(magic, TRAJECTORY_MAGIC, sizeof(magic)) == 0) {
+		fclose(file);
+		return trajectory_load(path, SIZE_MAX, n_threads);
+	}
+
+	fclose(file);
+	return bodies_parse_csv(path, n_threads);
+}
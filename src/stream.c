@@ -0,0 +1,140 @@
+#include "nbody.h"
+
+
+/**
+ * Allocate the j tiles and shares of the streaming engine
+ * Each thread's j tile is an i block of cache_block_sizes, so it fills half of L2
+ * @param b, the body store
+ * @param n_threads, the number of threads that will call stream_step
+ * @param params, the tile of bodies kept in memory per thread, 0 or NULL for STREAM_TILE
+ * @return the state or NULL if invalid
+ */
+void* stream_create(const struct bodies* b, size_t n_threads, const struct engine_params* params) {
+
+	// If the parameters are invalid
+	if (b == NULL || n_threads == 0) {
+		return NULL;
+	}
+
+	struct stream_state* s = malloc(sizeof(struct stream_state));
+	if (s == NULL) {
+		return NULL;
+	}
+	size_t i_block;
+	cache_block_sizes(&i_block, NULL);
+	s->n_threads = n_threads;
+	s->tile = params != NULL && params->tile > 0 ? params->tile : STREAM_TILE;
+	s->potential = 0.0;
+	s->shares = calloc(n_threads, sizeof(double));
+	s->tiles = calloc(n_threads, sizeof(struct body_tiles*));
+	for (size_t i = 0; s->tiles != NULL && i < n_threads; i++) {
+		s->tiles[i] = body_tiles_create(i_block);
+		if (s->tiles[i] == NULL) {
+			stream_destroy(s);
+			return NULL;
+		}
+	}
+	if (s->shares == NULL || s->tiles == NULL) {
+		stream_destroy(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+/**
+ * Clear up all memory associated with the streaming engine
+ * @param state, the state
+ */
+void stream_destroy(void* state) {
+	struct stream_state* s = state;
+
+	// If it is already NULL
+	if (s == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; s->tiles != NULL && i < s->n_threads; i++) {
+		body_tiles_destroy(s->tiles[i]);
+	}
+	free(s->tiles);
+	free(s->shares);
+	free(s);
+}
+
+
+/**
+ * Streaming step of one thread, the bodies of the thread are kicked one i
+ * tile at a time by every j tile of the store in order, each j tile packed
+ * into the thread's own tiles while the window after it is read ahead, so
+ * only an i tile and a j tile need to be in memory and a store kept in a
+ * file is read at the speed of the disk, each i tile's velocities are
+ * written back together once it is done, then after the barrier every
+ * thread moves its bodies and writes its positions back
+ * A body's velocity takes the j tiles in the same order on any number of
+ * threads and tiles, so the positions do not depend on either
+ * @param state, the streaming state
+ * @param b, the body store
+ * @param id, the thread
+ * @param n_threads, the number of threads
+ * @param start, the first body of the thread
+ * @param end, one past the last body of the thread
+ * @param dt, the change in time
+ * @param pool, the pool running every thread
+ * @param with_potential, 1 to leave the potential energy of the starting positions for stream_potential
+ */
+void stream_step(void* state, struct bodies* b, size_t id, size_t n_threads, size_t start, size_t end, double dt, struct thread_pool* pool, int with_potential) {
+	struct stream_state* s = state;
+	struct body_tiles* t = s->tiles[id];
+	size_t n_bodies = b->n_bodies, j_tile = t->n_bodies;
+	double share = 0.0;
+
+	for (size_t i_start = start; i_start < end; i_start += s->tile) {
+		size_t i_end = i_start + s->tile < end ? i_start + s->tile : end;
+		bodies_read_ahead(b, i_start, i_end);
+		bodies_read_ahead(b, 0, STREAM_WINDOW < n_bodies ? STREAM_WINDOW : n_bodies);
+		for (size_t j_start = 0; j_start < n_bodies; j_start += j_tile) {
+			size_t j_end = j_start + j_tile < n_bodies ? j_start + j_tile : n_bodies;
+
+			// The first j tile of a window asks for the window after it
+			size_t window = j_start - j_start % STREAM_WINDOW + STREAM_WINDOW;
+			if (j_start + STREAM_WINDOW - window < j_tile && window < n_bodies) {
+				bodies_read_ahead(b, window, window + STREAM_WINDOW < n_bodies ? window + STREAM_WINDOW : n_bodies);
+			}
+			body_tiles_load(t, b, j_start, j_end);
+			force_kick(t, b, i_start, i_end, dt);
+			if (with_potential) {
+				share += force_potential(b, i_start, i_end, j_start, j_end);
+			}
+		}
+		bodies_write_back(b, 3, 3, i_start, i_end);
+	}
+	s->shares[id] = share;
+
+	// Every thread has read the positions it needs before any body moves
+	pool_wait(pool);
+	if (with_potential && id == 0) {
+		double potential = 0.0;
+		for (size_t i = 0; i < n_threads; i++) {
+			potential += s->shares[i];
+		}
+		s->potential = -GCONST * potential;
+	}
+	for (size_t i = start; i < end; i++) {
+		b->x[i] += b->velocity_x[i] * dt;
+		b->y[i] += b->velocity_y[i] * dt;
+		b->z[i] += b->velocity_z[i] * dt;
+	}
+	bodies_write_back(b, 0, 3, start, end);
+}
+
+
+/**
+ * Potential energy of the positions the last step asked for it started from
+ * @param state, the streaming state
+ * @return the potential energy
+ */
+double stream_potential(void* state) {
+	const struct stream_state* s = state;
+	return s->potential;
+}
@@ -0,0 +1,243 @@
+#include "nbody.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+
+/**
+ * Read the size of a data or unified cache of the first cpu from sysfs
+ * @param level, the cache level, 1 for L1 and so on
+ * @return the size of the cache in bytes or 0 if unknown
+ */
+size_t cache_size(int level) {
+	char path[128];
+
+	// Every index directory describes one cache of cpu0
+	for (int index = 0; index < 8; index++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+		FILE* file = fopen(path, "r");
+		if (file == NULL) {
+			break;
+		}
+		int cache_level = 0;
+		int read = fscanf(file, "%d", &cache_level);
+		fclose(file);
+		if (read != 1 || cache_level != level) {
+			continue;
+		}
+
+		// Instruction caches never hold bodies
+		char type[32] = "";
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+		file = fopen(path, "r");
+		if (file == NULL) {
+			continue;
+		}
+		read = fscanf(file, "%31s", type);
+		fclose(file);
+		if (read != 1 || strcmp(type, "Instruction") == 0) {
+			continue;
+		}
+
+		// The size is given in kilobytes with a K suffix
+		size_t size = 0;
+		char unit = 'K';
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+		file = fopen(path, "r");
+		if (file == NULL) {
+			continue;
+		}
+		read = fscanf(file, "%zu%c", &size, &unit);
+		fclose(file);
+		if (read < 1) {
+			continue;
+		}
+		return unit == 'M' ? size << 20 : size << 10;
+	}
+	return 0;
+}
+
+
+/**
+ * Round a number of bodies down to whole tiles within the given bounds
+ * @param n, the number of bodies
+ * @param min, the smallest result
+ * @param max, the largest result
+ * @return the rounded number of bodies
+ */
+static size_t round_block(size_t n, size_t min, size_t max) {
+	n = n < min ? min : n;
+	n = n > max ? max : n;
+	return n - n % TILE_WIDTH;
+}
+
+
+// Block sizes of the cache blocked symmetric step, detected once
+static size_t i_size, j_size;
+static pthread_once_t block_sizes_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Detect the block sizes from the caches of the first cpu
+ * Run once through pthread_once so threads asking at the same time see both sizes
+ */
+static void cache_block_detect(void) {
+	size_t l1 = cache_size(1);
+	size_t l2 = cache_size(2);
+	l1 = l1 == 0 ? DEFAULT_L1_SIZE : l1;
+	l2 = l2 == 0 ? DEFAULT_L2_SIZE : l2;
+
+	size_t body_size = BODY_ARRAYS * sizeof(double);
+	j_size = round_block(l1 / 2 / body_size, MIN_BLOCK, MAX_BLOCK);
+	i_size = round_block(l2 / 2 / body_size, j_size, MAX_BLOCK * MAX_BLOCK);
+}
+
+
+/**
+ * Choose the block sizes of the cache blocked symmetric step
+ * A j block with its velocities fills half of L1 and an i block fills half
+ * of L2 so the j block is reused by every body of the i block from L1
+ * The sizes are detected once by whichever thread asks first and reused after
+ * @param i_block, set to the number of bodies in an i block
+ * @param j_block, set to the number of bodies in a j block
+ */
+void cache_block_sizes(size_t* i_block, size_t* j_block) {
+	pthread_once(&block_sizes_once, cache_block_detect);
+
+	if (i_block != NULL) {
+		*i_block = i_size;
+	}
+	if (j_block != NULL) {
+		*j_block = j_size;
+	}
+}
+
+
+/**
+ * Add the cpus of a sysfs list such as 0-3,8-11 to a set
+ * @param list, the list
+ * @param set, the set
+ */
+static void topology_parse_list(const char* list, cpu_set_t* set) {
+	while (*list != '\0' && *list != '\n') {
+		char* end;
+		long first = strtol(list, &end, 10);
+		long last = first;
+		if (end == list) {
+			return;
+		}
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+		}
+		for (long cpu = first; cpu <= last && cpu >= 0 && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, set);
+		}
+		list = *end == ',' ? end + 1 : end;
+	}
+}
+
+
+/**
+ * List the cpus the process may run on with the node of each, node by node
+ * The cpus are the ones allowed when first asked, so threads pinned since do
+ * not shrink the list, without NUMA information in sysfs every cpu is on node 0
+ * @param cpus, set to the cpus, CPU_SETSIZE long
+ * @param nodes, set to the node of each cpu, CPU_SETSIZE long
+ * @return the number of cpus
+ */
+size_t topology_cpus(int* cpus, int* nodes) {
+	static cpu_set_t allowed;
+	static int known = 0;
+	if (!known) {
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+			for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++) {
+				CPU_SET(cpu, &allowed);
+			}
+		}
+		known = 1;
+	}
+
+	// Every cpu starts on node 0 and is moved when a node lists it
+	int node_of[CPU_SETSIZE] = { 0 };
+	char path[128], list[4096];
+	for (int node = 0; node < TOPOLOGY_MAX_NODES; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE* file = fopen(path, "r");
+		if (file == NULL) {
+			continue;
+		}
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (fgets(list, sizeof(list), file) != NULL) {
+			topology_parse_list(list, &set);
+		}
+		fclose(file);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			node_of[cpu] = CPU_ISSET(cpu, &set) ? node : node_of[cpu];
+		}
+	}
+
+	size_t n_cpus = 0;
+	for (int node = 0; node < TOPOLOGY_MAX_NODES; node++) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &allowed) && node_of[cpu] == node) {
+				cpus[n_cpus] = cpu;
+				nodes[n_cpus] = node;
+				n_cpus++;
+			}
+		}
+	}
+	return n_cpus;
+}
+
+
+/**
+ * Find the node holding the page of an address
+ * @param address, the address, its page must have been touched
+ * @return the node or -1 if unknown
+ */
+int topology_node_of(const void* address) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	void* page = (void*)((uintptr_t)address & ~(uintptr_t)(page_size - 1));
+	int status = -1;
+
+	// Without target nodes move_pages only reports where each page is
+	if (syscall(SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) != 0 || status < 0) {
+		return -1;
+	}
+	return status;
+}
+
+
+/**
+ * Print where each thread of a pool runs and the node of its slice of the bodies
+ * @param p, the pool
+ * @param b, the body store, sliced by bodies_slice
+ */
+void placement_report(const struct thread_pool* p, const struct bodies* b) {
+
+	// If the parameters are invalid
+	if (p == NULL || b == NULL || p->n_threads > b->n_bodies) {
+		return;
+	}
+
+	printf("Placement: pin %s, pages %s\n", pool_pin_name(p), bodies_pages_name(b));
+	for (size_t i = 0; i < p->n_threads; i++) {
+		size_t start, end;
+		bodies_slice(b->n_bodies, p->n_threads, i, &start, &end);
+		char cpu[16] = "any", node[16] = "any", bodies[16] = "unknown";
+		if (p->helpers[i].cpu >= 0) {
+			snprintf(cpu, sizeof(cpu), "%d", p->helpers[i].cpu);
+		}
+		if (p->helpers[i].node >= 0) {
+			snprintf(node, sizeof(node), "%d", p->helpers[i].node);
+		}
+		int bodies_node = topology_node_of(b->x + start);
+		if (bodies_node >= 0) {
+			snprintf(bodies, sizeof(bodies), "%d", bodies_node);
+		}
+		printf("Thread %zu: cpu %s, node %s, bodies on node %s\n", i, cpu, node, bodies);
+	}
+}
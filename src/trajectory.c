@@ -0,0 +1,1075 @@
+#include "nbody.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+/**
+ * Set up an io_uring for the trajectory writer with raw system calls
+ * @param u, the ring, its fd is left -1 if the kernel has no io_uring or refuses one
+ * @param entries, the most writes in flight
+ */
+static void trajectory_uring_open(struct trajectory_uring* u, unsigned entries) {
+	memset(u, 0, sizeof(struct trajectory_uring));
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	u->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+	if (u->fd < 0) {
+		u->fd = -1;
+		return;
+	}
+
+	// Newer kernels map both rings at once
+	u->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	u->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		u->sq_size = u->cq_size = u->sq_size > u->cq_size ? u->sq_size : u->cq_size;
+	}
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? u->sq_ring
+			: mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		if (u->sqes != MAP_FAILED) {
+			munmap(u->sqes, u->sqes_size);
+		}
+		if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+			munmap(u->cq_ring, u->cq_size);
+		}
+		if (u->sq_ring != MAP_FAILED) {
+			munmap(u->sq_ring, u->sq_size);
+		}
+		close(u->fd);
+		u->fd = -1;
+		return;
+	}
+
+	char* sq = u->sq_ring;
+	char* cq = u->cq_ring;
+	u->entries = params.sq_entries;
+	u->sq_head = (unsigned*)(sq + params.sq_off.head);
+	u->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	u->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + params.sq_off.array);
+	u->cq_head = (unsigned*)(cq + params.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	u->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+
+/**
+ * Unmap and close the io_uring of the trajectory writer
+ * @param u, the ring
+ */
+static void trajectory_uring_close(struct trajectory_uring* u) {
+
+	// If there is no ring
+	if (u->fd < 0) {
+		return;
+	}
+
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_size);
+	}
+	munmap(u->sq_ring, u->sq_size);
+	close(u->fd);
+	u->fd = -1;
+}
+
+
+/**
+ * Write bytes at an offset of a file with pwrite
+ * @param fd, the file
+ * @param data, the bytes
+ * @param size, the number of bytes
+ * @param offset, where they go
+ * @return 0 if written or 1 if the write failed
+ */
+static int trajectory_pwrite(int fd, const void* data, size_t size, uint64_t offset) {
+	const char* bytes = data;
+	for (size_t done = 0; done < size; ) {
+		ssize_t n = pwrite(fd, bytes + done, size - done, (off_t)(offset + done));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 1;
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+
+/**
+ * Find the bytes before the chunks of a frame, its header and the sizes of its chunks
+ * @param n_blobs, the number of chunks of a frame
+ * @return the bytes
+ */
+static inline size_t trajectory_head(size_t n_blobs) {
+	return sizeof(struct trajectory_frame) + sizeof(uint32_t) * n_blobs;
+}
+
+
+/**
+ * Compress the planes of a chunk with the deflate stream of a thread
+ * @param stream, the stream, reset for the next chunk after
+ * @param planes, the planes
+ * @param raw, the bytes of the planes
+ * @param out, where the compressed planes go
+ * @param bound, the most bytes out can take
+ * @return the compressed bytes or 0 if they are no fewer than the planes
+ */
+static size_t trajectory_deflate(z_stream* stream, const unsigned char* planes, size_t raw, unsigned char* out, size_t bound) {
+	stream->next_in = (unsigned char*)planes;
+	stream->avail_in = (uInt)raw;
+	stream->next_out = out;
+	stream->avail_out = (uInt)bound;
+	int status = deflate(stream, Z_FINISH);
+	size_t size = stream->total_out;
+	deflateReset(stream);
+	return status == Z_STREAM_END && size < raw ? size : 0;
+}
+
+
+/**
+ * Quantize one chunk of positions or velocities of a frame into its blob
+ * Each value becomes its nearest multiple q of the quantum, checked to be
+ * within the error of it, a key frame or a chunk stored exactly the frame
+ * before stores q and the others the change in q, less the smallest of the
+ * chunk so the bodies of a block that move alike fit in two bytes each
+ * A value too large for the error, or not finite, is kept as an exception
+ * @param job, the job
+ * @param id, the thread running the task
+ * @param task, the column times the number of chunks plus the chunk
+ */
+static void trajectory_quantize_task(struct trajectory_job* job, size_t id, size_t task) {
+	struct trajectory* t = job->trajectory;
+	size_t column = task / t->n_chunks, start = task % t->n_chunks * t->chunk;
+	size_t count = start + t->chunk < t->n_bodies ? t->chunk : t->n_bodies - start;
+	const double* values = job->values + column * t->n_bodies + start;
+	int64_t* quantized = t->quantized + column * t->n_bodies + start;
+	unsigned char* planes = t->scratch + 3 * id * t->chunk * sizeof(double);
+	uint64_t* residuals = (uint64_t*)(planes + t->chunk * sizeof(double));
+	uint32_t* exceptions = (uint32_t*)(residuals + t->chunk);
+	double quantum = t->error * TRAJECTORY_QUANTUM, inverse = 1.0 / quantum;
+	struct trajectory_block block = { .mode = job->key || t->exact[task] ? TRAJECTORY_ABSOLUTE : TRAJECTORY_DELTA };
+
+	// An exception changes q by nothing, so in a delta block it keeps the q before
+	int64_t base = INT64_MAX;
+	for (size_t i = 0; i < count; i++) {
+		double scaled = nearbyint(values[i] * inverse);
+		int64_t residual = 0;
+		if (fabs(scaled) < TRAJECTORY_QUANTIZED_MAX && fabs(scaled * quantum - values[i]) <= t->error) {
+			int64_t q = (int64_t)scaled;
+			residual = block.mode == TRAJECTORY_DELTA ? q - quantized[i] : q;
+			quantized[i] = q;
+		} else {
+			exceptions[block.n_exceptions++] = (uint32_t)i;
+			quantized[i] = block.mode == TRAJECTORY_DELTA ? quantized[i] : 0;
+		}
+		residuals[i] = (uint64_t)residual;
+		base = residual < base ? residual : base;
+	}
+	uint64_t largest = 0;
+	for (size_t i = 0; i < count; i++) {
+		residuals[i] -= (uint64_t)base;
+		largest = residuals[i] > largest ? residuals[i] : largest;
+	}
+	block.base = base;
+	block.width = largest <= UINT16_MAX ? 2 : largest <= UINT32_MAX ? 4 : 8;
+
+	// A chunk that would grow past its values is stored as them and starts over absolute
+	if (block.width * count + TRAJECTORY_EXCEPTION * block.n_exceptions > sizeof(double) * count) {
+		block = (struct trajectory_block){ .mode = TRAJECTORY_EXACT, .width = sizeof(double) };
+		memcpy(residuals, values, sizeof(double) * count);
+	}
+	t->exact[task] = block.mode == TRAJECTORY_EXACT;
+	for (size_t i = 0; i < count; i++) {
+		for (size_t plane = 0; plane < block.width; plane++) {
+			planes[plane * count + i] = (unsigned char)(residuals[i] >> (8 * plane));
+		}
+	}
+	unsigned char* exception = planes + block.width * count;
+	for (size_t k = 0; k < block.n_exceptions; k++, exception += TRAJECTORY_EXCEPTION) {
+		memcpy(exception, exceptions + k, sizeof(uint32_t));
+		memcpy(exception + sizeof(uint32_t), values + exceptions[k], sizeof(double));
+	}
+
+	unsigned char* blob = job->blobs + task * t->bound;
+	size_t raw = (size_t)(exception - planes);
+	size_t size = trajectory_deflate(t->streams + id, planes, raw, blob + sizeof(block), t->bound - sizeof(block));
+	block.packed = size > 0;
+	if (size == 0) {
+		memcpy(blob + sizeof(block), planes, raw);
+		size = raw;
+	}
+	memcpy(blob, &block, sizeof(block));
+	job->sizes[task] = (uint32_t)(sizeof(block) + size);
+}
+
+
+/**
+ * Encode one chunk of a frame, xor it with the frame before unless it is a
+ * key frame, split its bytes into planes and compress them into its blob
+ * Nearby values of the same column share their sign, exponent and leading
+ * digits, so after the xor most of the high planes are runs of zeros
+ * Positions and velocities of a quantized trajectory are quantized instead
+ * @param arg, the job
+ * @param id, the thread running the task
+ * @param task, the column times the number of chunks plus the chunk
+ */
+static void trajectory_encode_task(void* arg, size_t id, size_t task) {
+	struct trajectory_job* job = arg;
+	struct trajectory* t = job->trajectory;
+	size_t column = task / t->n_chunks, start = task % t->n_chunks * t->chunk;
+	if (t->error > 0 && column < TRAJECTORY_QUANTIZED_COLUMNS) {
+		trajectory_quantize_task(job, id, task);
+		return;
+	}
+	size_t count = start + t->chunk < t->n_bodies ? t->chunk : t->n_bodies - start;
+	const double* values = job->values + column * t->n_bodies + start;
+	double* previous = t->previous + column * t->n_bodies + start;
+	unsigned char* planes = t->scratch + 3 * id * t->chunk * sizeof(double);
+	for (size_t i = 0; i < count; i++) {
+		uint64_t bits, before;
+		memcpy(&bits, values + i, sizeof(bits));
+		memcpy(&before, previous + i, sizeof(before));
+		uint64_t residual = job->key ? bits : bits ^ before;
+		for (size_t plane = 0; plane < sizeof(double); plane++) {
+			planes[plane * count + i] = (unsigned char)(residual >> (8 * plane));
+		}
+	}
+	memcpy(previous, values, sizeof(double) * count);
+
+	// A chunk that does not get smaller is kept as planes, which its size gives away
+	unsigned char* blob = job->blobs + task * t->bound;
+	size_t raw = count * sizeof(double);
+	size_t size = trajectory_deflate(t->streams + id, planes, raw, blob, t->bound);
+	if (size == 0) {
+		memcpy(blob, planes, raw);
+		size = raw;
+	}
+	job->sizes[task] = (uint32_t)size;
+}
+
+
+/**
+ * Decode one quantized chunk of a frame into the values of the frame and the
+ * q of its values
+ * @param job, the job
+ * @param id, the thread running the task
+ * @param task, the column times the number of chunks plus the chunk
+ */
+static void trajectory_dequantize_task(struct trajectory_job* job, size_t id, size_t task) {
+	const struct trajectory_reader* r = job->reader;
+	size_t n_bodies = r->header.n_bodies, chunk = r->header.chunk;
+	size_t column = task / r->n_chunks, start = task % r->n_chunks * chunk;
+	size_t count = start + chunk < n_bodies ? chunk : n_bodies - start;
+	const unsigned char* blob = job->blobs + job->starts[task];
+	struct trajectory_block block;
+	if (job->sizes[task] < sizeof(block)) {
+		atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+		return;
+	}
+	memcpy(&block, blob, sizeof(block));
+	uLongf raw = block.width * count + TRAJECTORY_EXCEPTION * (uLongf)block.n_exceptions;
+	const unsigned char* planes = blob + sizeof(block);
+	if ((block.width != 2 && block.width != 4 && block.width != 8) || block.mode > TRAJECTORY_EXACT
+			|| (block.mode == TRAJECTORY_DELTA && job->key) || raw > sizeof(double) * count) {
+		atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+		return;
+	}
+	if (block.packed) {
+		uLongf expected = raw;
+		unsigned char* scratch = r->scratch + id * chunk * sizeof(double);
+		if (uncompress(scratch, &raw, planes, job->sizes[task] - sizeof(block)) != Z_OK || raw != expected) {
+			atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+			return;
+		}
+		planes = scratch;
+	} else if (job->sizes[task] - sizeof(block) != raw) {
+		atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+		return;
+	}
+
+	double* values = job->values + column * n_bodies + start;
+	int64_t* quantized = r->quantized + column * n_bodies + start;
+	double quantum = r->header.error * TRAJECTORY_QUANTUM;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t residual = 0;
+		for (size_t plane = 0; plane < block.width; plane++) {
+			residual |= (uint64_t)planes[plane * count + i] << (8 * plane);
+		}
+		if (block.mode == TRAJECTORY_EXACT) {
+			memcpy(values + i, &residual, sizeof(residual));
+			continue;
+		}
+		residual += (uint64_t)block.base + (block.mode == TRAJECTORY_DELTA ? (uint64_t)quantized[i] : 0);
+		quantized[i] = (int64_t)residual;
+		values[i] = (double)quantized[i] * quantum;
+	}
+
+	// The exceptions replace the values, not their q
+	const unsigned char* exception = planes + block.width * count;
+	for (size_t k = 0; k < block.n_exceptions; k++, exception += TRAJECTORY_EXCEPTION) {
+		uint32_t i;
+		memcpy(&i, exception, sizeof(i));
+		if (i >= count) {
+			atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+			return;
+		}
+		memcpy(values + i, exception + sizeof(i), sizeof(double));
+	}
+}
+
+
+/**
+ * Decode one chunk of a frame into the values of the frame before it, or over
+ * them for a key frame, quantized chunks are dequantized
+ * @param arg, the job
+ * @param id, the thread running the task
+ * @param task, the column times the number of chunks plus the chunk
+ */
+static void trajectory_decode_task(void* arg, size_t id, size_t task) {
+	struct trajectory_job* job = arg;
+	const struct trajectory_reader* r = job->reader;
+	size_t n_bodies = r->header.n_bodies, chunk = r->header.chunk;
+	size_t column = task / r->n_chunks, start = task % r->n_chunks * chunk;
+	if (r->header.error > 0 && column < TRAJECTORY_QUANTIZED_COLUMNS) {
+		trajectory_dequantize_task(job, id, task);
+		return;
+	}
+	size_t count = start + chunk < n_bodies ? chunk : n_bodies - start;
+	const unsigned char* planes = job->blobs + job->starts[task];
+	uLongf raw = count * sizeof(double);
+	if (job->sizes[task] != raw) {
+		unsigned char* scratch = r->scratch + id * chunk * sizeof(double);
+		if (uncompress(scratch, &raw, planes, job->sizes[task]) != Z_OK || raw != count * sizeof(double)) {
+			atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+			return;
+		}
+		planes = scratch;
+	}
+
+	double* values = job->values + column * n_bodies + start;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t residual = 0, before = 0;
+		for (size_t plane = 0; plane < sizeof(double); plane++) {
+			residual |= (uint64_t)planes[plane * count + i] << (8 * plane);
+		}
+		if (!job->key) {
+			memcpy(&before, values + i, sizeof(before));
+		}
+		residual ^= before;
+		memcpy(values + i, &residual, sizeof(residual));
+	}
+}
+
+
+/**
+ * Steal the chunks of a frame being encoded, each thread starts on an even share
+ * @param arg, the job
+ * @param id, the thread
+ */
+static void trajectory_encode_job(void* arg, size_t id) {
+	struct trajectory_job* job = arg;
+	size_t n_threads = job->trajectory->pool->n_threads, n_tasks = BODY_ARRAYS * job->trajectory->n_chunks;
+	pool_steal(job->trajectory->pool, id, id * n_tasks / n_threads, (id + 1) * n_tasks / n_threads, trajectory_encode_task, arg);
+}
+
+
+/**
+ * Steal the chunks of a frame being decoded, each thread starts on an even share
+ * @param arg, the job
+ * @param id, the thread
+ */
+static void trajectory_decode_job(void* arg, size_t id) {
+	struct trajectory_job* job = arg;
+	size_t n_threads = job->reader->pool->n_threads, n_tasks = BODY_ARRAYS * job->reader->n_chunks;
+	pool_steal(job->reader->pool, id, id * n_tasks / n_threads, (id + 1) * n_tasks / n_threads, trajectory_decode_task, arg);
+}
+
+
+/**
+ * Wait for the write of a set of chunks, a short or failed write is finished
+ * with pwrite and if the ring fails it is closed and the set written with pwrite
+ * @param t, the trajectory
+ * @param set, the set, 0 or 1
+ * @return 0 if written or 1 if a write failed
+ */
+static int trajectory_wait(struct trajectory* t, int set) {
+	struct trajectory_uring* u = &t->uring;
+	int failed = 0;
+	while (t->pending[set] && u->fd >= 0) {
+		unsigned head = *u->cq_head;
+		if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (syscall(SYS_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+				trajectory_uring_close(u);
+			}
+			continue;
+		}
+		const struct io_uring_cqe* cqe = u->cqes + (head & *u->cq_mask);
+		int done = (int)cqe->user_data;
+		size_t written = cqe->res < 0 ? 0 : (size_t)cqe->res;
+		__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+		if (written < t->set_bytes[done]) {
+			failed |= trajectory_pwrite(t->fd, t->sets[done] + written, t->set_bytes[done] - written,
+					t->set_offset[done] + written);
+		}
+		t->pending[done] = 0;
+	}
+
+	// Without a ring the whole set is written again
+	if (t->pending[set]) {
+		failed |= trajectory_pwrite(t->fd, t->sets[set], t->set_bytes[set], t->set_offset[set]);
+		t->pending[set] = 0;
+	}
+	return failed;
+}
+
+
+/**
+ * Start the write of a set of chunks through the io_uring, or write it with
+ * pwrite when there is no ring
+ * @param t, the trajectory
+ * @param set, the set, 0 or 1
+ * @return 0 if written or started or 1 if a write failed
+ */
+static int trajectory_submit(struct trajectory* t, int set) {
+	struct trajectory_uring* u = &t->uring;
+	if (u->fd < 0) {
+		return trajectory_pwrite(t->fd, t->sets[set], t->set_bytes[set], t->set_offset[set]);
+	}
+
+	unsigned tail = *u->sq_tail;
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe* sqe = u->sqes + index;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = t->fd;
+	sqe->addr = (uint64_t)(uintptr_t)t->sets[set];
+	sqe->len = t->set_bytes[set] < INT_MAX ? (unsigned)t->set_bytes[set] : INT_MAX;
+	sqe->off = t->set_offset[set];
+	sqe->user_data = (uint64_t)set;
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	t->pending[set] = 1;
+
+	long entered;
+	do {
+		entered = syscall(SYS_io_uring_enter, u->fd, 1, 0, 0, NULL, 0);
+	} while (entered < 0 && errno == EINTR);
+	if (entered != 1) {
+		trajectory_uring_close(u);
+	}
+	return 0;
+}
+
+
+/**
+ * Encode a captured frame into a set of chunks on the writer's pool and pack
+ * the chunks behind its header and sizes
+ * @param t, the trajectory
+ * @param frame, the frame
+ * @param set, the set to encode into, its last write done
+ */
+static void trajectory_encode(struct trajectory* t, size_t frame, int set) {
+	char* buffer = t->buffers[frame % t->n_buffers];
+	size_t n_blobs = BODY_ARRAYS * t->n_chunks, head = trajectory_head(n_blobs);
+	struct trajectory_frame header;
+	memcpy(&header, buffer, sizeof(header));
+	header.key = frame % TRAJECTORY_KEY_INTERVAL == 0;
+
+	uint32_t* sizes = (uint32_t*)(t->sets[set] + sizeof(struct trajectory_frame));
+	unsigned char* blobs = t->sets[set] + head;
+	struct trajectory_job job = { .trajectory = t, .values = (double*)(buffer + sizeof(struct trajectory_frame)),
+		.blobs = blobs, .sizes = sizes, .key = (int)header.key };
+	pool_run(t->pool, trajectory_encode_job, &job);
+
+	// Every chunk moves down to the end of the one before, never past its own slot
+	size_t size = 0;
+	for (size_t i = 0; i < n_blobs; i++) {
+		memmove(blobs + size, blobs + i * t->bound, sizes[i]);
+		size += sizes[i];
+	}
+	header.size = size;
+	memcpy(t->sets[set], &header, sizeof(header));
+	t->set_bytes[set] = head + size;
+	t->set_offset[set] = t->offset;
+	t->offset += head + size;
+	t->raw_bytes += sizeof(struct trajectory_frame) + BODY_ARRAYS * t->n_bodies * sizeof(double);
+	t->stored_bytes += head + size;
+}
+
+
+/**
+ * Add the frame in a set to the index
+ * @param t, the trajectory
+ * @param set, the set
+ * @return 0 if added or 1 if out of memory
+ */
+static int trajectory_index_add(struct trajectory* t, int set) {
+	if ((t->n_frames & (t->n_frames - 1)) == 0) {
+		struct trajectory_index* index = realloc(t->index, sizeof(struct trajectory_index) * (t->n_frames ? 2 * t->n_frames : 1));
+		if (index == NULL) {
+			return 1;
+		}
+		t->index = index;
+	}
+	struct trajectory_frame header;
+	memcpy(&header, t->sets[set], sizeof(header));
+	t->index[t->n_frames++] = (struct trajectory_index){ .offset = t->set_offset[set], .step = header.step, .time = header.time };
+	return 0;
+}
+
+
+/**
+ * The writer thread, encodes the published frames, frees their buffers and
+ * writes them, the write of one frame runs while the next is encoded, once
+ * the trajectory is closed and every frame written it writes the index
+ * @param arg, the trajectory
+ * @return NULL
+ */
+static void* trajectory_writer(void* arg) {
+	struct trajectory* t = arg;
+	int failed = 0;
+	pthread_mutex_lock(&t->lock);
+	for (;;) {
+		while (t->written == t->published && !t->closing) {
+			pthread_cond_wait(&t->ready, &t->lock);
+		}
+		if (t->written == t->published) {
+			break;
+		}
+		size_t frame = t->written;
+		pthread_mutex_unlock(&t->lock);
+
+		// No thread touches a published buffer until written has passed it
+		int set = (int)(frame % 2);
+		failed |= trajectory_wait(t, set);
+		trajectory_encode(t, frame, set);
+		pthread_mutex_lock(&t->lock);
+		t->written++;
+		pthread_cond_broadcast(&t->free);
+		pthread_mutex_unlock(&t->lock);
+		failed |= trajectory_index_add(t, set);
+		failed |= trajectory_submit(t, set);
+		pthread_mutex_lock(&t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	// The index follows the last frame and the footer at the end of the file finds it
+	failed |= trajectory_wait(t, 0);
+	failed |= trajectory_wait(t, 1);
+	struct trajectory_footer footer = { .n_frames = t->n_frames, .index_offset = t->offset };
+	memcpy(footer.magic, TRAJECTORY_INDEX_MAGIC, sizeof(footer.magic));
+	size_t index_size = sizeof(struct trajectory_index) * t->n_frames;
+	failed |= trajectory_pwrite(t->fd, t->index, index_size, t->offset);
+	failed |= trajectory_pwrite(t->fd, &footer, sizeof(footer), t->offset + index_size);
+
+	pthread_mutex_lock(&t->lock);
+	t->failed |= failed;
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+
+/**
+ * Clear up all memory associated with a trajectory whose writer is not running
+ * @param t, the trajectory
+ */
+static void trajectory_free(struct trajectory* t) {
+	for (size_t i = 0; t->buffers != NULL && i < t->n_buffers; i++) {
+		free(t->buffers[i]);
+	}
+	free(t->buffers);
+	free(t->previous);
+	free(t->quantized);
+	free(t->exact);
+	free(t->scratch);
+	for (size_t i = 0; i < t->n_streams; i++) {
+		deflateEnd(t->streams + i);
+	}
+	free(t->streams);
+	free(t->sets[0]);
+	free(t->sets[1]);
+	free(t->index);
+	if (t->pool != NULL) {
+		pool_destroy(t->pool);
+	}
+	trajectory_uring_close(&t->uring);
+	if (t->fd >= 0) {
+		close(t->fd);
+	}
+	free(t);
+}
+
+
+/**
+ * Create a trajectory file and start its writer thread
+ * @param path, the path of the file
+ * @param n_bodies, the number of bodies of every frame
+ * @param every, the number of steps between frames
+ * @param n_buffers, the number of frames that can wait for the writer
+ * @param n_threads, the number of threads that encode each frame, the writer and n_threads - 1 more
+ * @param dt, the change in time of a step
+ * @param error, the most positions and velocities may be off by, or 0 to store them exactly
+ * @return the trajectory or NULL if invalid or the file cannot be written
+ */
+struct trajectory* trajectory_open(const char* path, size_t n_bodies, size_t every, size_t n_buffers, size_t n_threads,
+		double dt, double error) {
+
+	// If the parameters are invalid
+	if (path == NULL || n_bodies == 0 || every == 0 || n_buffers == 0 || n_threads == 0 || !isfinite(error) || error < 0) {
+		return NULL;
+	}
+
+	struct trajectory* t = aligned_alloc(CACHE_LINE, sizeof(struct trajectory));
+	if (t == NULL) {
+		return NULL;
+	}
+	memset(t, 0, sizeof(struct trajectory));
+	atomic_init(&t->copied, 0);
+	t->uring.fd = -1;
+	t->n_bodies = n_bodies;
+	t->every = every;
+	t->n_buffers = n_buffers;
+	t->error = error;
+	t->frame_size = sizeof(struct trajectory_frame) + BODY_ARRAYS * n_bodies * sizeof(double);
+	t->chunk = n_bodies < TRAJECTORY_CHUNK ? n_bodies : TRAJECTORY_CHUNK;
+	t->n_chunks = (n_bodies + t->chunk - 1) / t->chunk;
+	t->bound = compressBound(t->chunk * sizeof(double)) + sizeof(struct trajectory_block);
+	t->offset = sizeof(struct trajectory_header);
+	size_t n_blobs = BODY_ARRAYS * t->n_chunks;
+
+	// Everything a frame needs is allocated up front so neither a capture nor the writer allocates
+	t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	t->buffers = calloc(n_buffers, sizeof(char*));
+	t->previous = calloc(BODY_ARRAYS * n_bodies, sizeof(double));
+	t->quantized = error > 0 ? malloc(sizeof(int64_t) * TRAJECTORY_QUANTIZED_COLUMNS * n_bodies) : NULL;
+	t->exact = calloc(n_blobs, 1);
+	t->scratch = malloc(3 * n_threads * t->chunk * sizeof(double));
+	t->streams = calloc(n_threads, sizeof(z_stream));
+	t->sets[0] = malloc(trajectory_head(n_blobs) + n_blobs * t->bound);
+	t->sets[1] = malloc(trajectory_head(n_blobs) + n_blobs * t->bound);
+	t->pool = pool_create_unpinned(n_threads);
+	if (t->fd < 0 || t->buffers == NULL || t->previous == NULL || (error > 0 && t->quantized == NULL) || t->exact == NULL
+			|| t->scratch == NULL || t->streams == NULL || t->sets[0] == NULL || t->sets[1] == NULL || t->pool == NULL) {
+		trajectory_free(t);
+		return NULL;
+	}
+
+	// The planes are mostly runs of one byte, which run length matching finds as well as a full search and much sooner
+	for (; t->n_streams < n_threads; t->n_streams++) {
+		if (deflateInit2(t->streams + t->n_streams, TRAJECTORY_LEVEL, Z_DEFLATED, TRAJECTORY_WINDOW,
+				TRAJECTORY_MEMORY, Z_RLE) != Z_OK) {
+			trajectory_free(t);
+			return NULL;
+		}
+	}
+	size_t size = (t->frame_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	for (size_t i = 0; i < n_buffers; i++) {
+		t->buffers[i] = aligned_alloc(CACHE_LINE, size);
+		if (t->buffers[i] == NULL) {
+			trajectory_free(t);
+			return NULL;
+		}
+	}
+
+	struct trajectory_header header = { .version = TRAJECTORY_VERSION, .order = SNAPSHOT_ORDER, .n_bodies = n_bodies,
+		.every = every, .dt = dt, .chunk = t->chunk, .key_interval = TRAJECTORY_KEY_INTERVAL, .error = error };
+	memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+	if (trajectory_pwrite(t->fd, &header, sizeof(header), 0)) {
+		trajectory_free(t);
+		return NULL;
+	}
+
+	trajectory_uring_open(&t->uring, 2);
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->ready, NULL);
+	pthread_cond_init(&t->free, NULL);
+	if (pthread_create(&t->writer, NULL, trajectory_writer, t)) {
+		pthread_mutex_destroy(&t->lock);
+		pthread_cond_destroy(&t->ready);
+		pthread_cond_destroy(&t->free);
+		trajectory_free(t);
+		return NULL;
+	}
+	return t;
+}
+
+
+/**
+ * Check whether a frame is captured after a step, every every steps and after the last
+ * @param t, the trajectory or NULL for none
+ * @param step, the number of steps done
+ * @param iterations, the number of steps of the run
+ * @return 1 if it is captured or 0 if not
+ */
+int trajectory_due(const struct trajectory* t, size_t step, size_t iterations) {
+	return t != NULL && (step % t->every == 0 || step == iterations);
+}
+
+
+/**
+ * Find the next step after which a frame is captured
+ * @param t, the trajectory or NULL for none
+ * @param step, the number of steps done
+ * @param iterations, the number of steps of the run
+ * @return the step, at most iterations
+ */
+size_t trajectory_next(const struct trajectory* t, size_t step, size_t iterations) {
+	size_t next = t != NULL ? (step / t->every + 1) * t->every : iterations;
+	return next < iterations ? next : iterations;
+}
+
+
+/**
+ * Take the buffer of the next frame, called by thread 0 only, before the barrier
+ * that lets every thread call trajectory_copy
+ * Only when every buffer still waits for the writer does it block, which is
+ * counted as the writer falling behind
+ * @param t, the trajectory
+ * @param step, the number of steps done
+ * @param time, the simulated time
+ */
+void trajectory_acquire(struct trajectory* t, size_t step, double time) {
+	pthread_mutex_lock(&t->lock);
+	if (t->published - t->written == t->n_buffers) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		t->stalls++;
+		while (t->published - t->written == t->n_buffers) {
+			pthread_cond_wait(&t->free, &t->lock);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t->stall_seconds += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	struct trajectory_frame frame = { .step = step, .time = time };
+	memcpy(t->buffers[t->published % t->n_buffers], &frame, sizeof(frame));
+}
+
+
+/**
+ * Copy a slice of the body store into the frame being captured, called by every
+ * thread of the pool, the last to finish hands the frame to the writer
+ * @param t, the trajectory
+ * @param b, the body store
+ * @param n_threads, the number of threads copying the frame
+ * @param start, the first body of the slice
+ * @param end, one past the last body of the slice
+ */
+void trajectory_copy(struct trajectory* t, const struct bodies* b, size_t n_threads, size_t start, size_t end) {
+	double* values = (double*)(t->buffers[t->published % t->n_buffers] + sizeof(struct trajectory_frame));
+	for (size_t column = 0; column < BODY_ARRAYS; column++) {
+		memcpy(values + column * t->n_bodies + start, b->x + column * b->stride + start, sizeof(double) * (end - start));
+	}
+
+	// The copies of the other threads are seen by the last through the counter and by the writer through the lock
+	if (atomic_fetch_add_explicit(&t->copied, 1, memory_order_acq_rel) + 1 == n_threads) {
+		atomic_store_explicit(&t->copied, 0, memory_order_relaxed);
+		pthread_mutex_lock(&t->lock);
+		t->published++;
+		t->peak = t->published - t->written > t->peak ? t->published - t->written : t->peak;
+		pthread_cond_signal(&t->ready);
+		pthread_mutex_unlock(&t->lock);
+	}
+}
+
+
+/**
+ * Print how many frames were captured, how small they were stored and how
+ * often the writer fell behind, once the writer has encoded every frame
+ * @param t, the trajectory
+ */
+void trajectory_report(struct trajectory* t) {
+
+	// If the parameter is invalid
+	if (t == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&t->lock);
+	while (t->written != t->published) {
+		pthread_cond_wait(&t->free, &t->lock);
+	}
+	printf("Trajectory: %zu frames every %zu steps stored in %.1f%% of their size on %zu threads and written with %s, "
+			"writer fell behind %zu times for %.3f s, at most %zu of %zu buffers waiting\n", t->published, t->every,
+			t->raw_bytes > 0 ? 100.0 * (double)t->stored_bytes / (double)t->raw_bytes : 100.0, t->pool->n_threads,
+			t->uring.fd >= 0 ? "io_uring" : "pwrite", t->stalls, t->stall_seconds, t->peak, t->n_buffers);
+	if (t->error > 0) {
+		printf("Trajectory: positions and velocities quantized to within %g\n", t->error);
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+
+/**
+ * Wait for the writer to write every captured frame and the index, then close
+ * the file and clear up all memory associated with the trajectory
+ * @param t, the trajectory
+ * @return 0 if every frame was written or 1 if a write failed
+ */
+int trajectory_close(struct trajectory* t) {
+
+	// If it is already NULL
+	if (t == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&t->lock);
+	t->closing = 1;
+	pthread_cond_signal(&t->ready);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->writer, NULL);
+
+	int failed = t->failed;
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->ready);
+	pthread_cond_destroy(&t->free);
+	failed |= close(t->fd) != 0;
+	t->fd = -1;
+	trajectory_free(t);
+	return failed;
+}
+
+
+/**
+ * Rebuild the index of a trajectory whose writer never wrote it by walking
+ * the frames from the header, a frame cut short by the end of the file is dropped
+ * @param r, the reader
+ * @param size, the size of the file
+ * @return 0 if rebuilt or 1 if out of memory
+ */
+static int trajectory_reader_scan(struct trajectory_reader* r, uint64_t size) {
+	size_t head = trajectory_head(BODY_ARRAYS * r->n_chunks), capacity = 0;
+	struct trajectory_frame header;
+	for (uint64_t offset = sizeof(struct trajectory_header); offset + head <= size; offset += head + header.size) {
+		if (pread(r->fd, &header, sizeof(header), (off_t)offset) != sizeof(header) || offset + head + header.size > size) {
+			break;
+		}
+		if (r->n_frames == capacity) {
+			capacity = capacity ? 2 * capacity : 16;
+			struct trajectory_index* index = realloc(r->index, sizeof(struct trajectory_index) * capacity);
+			if (index == NULL) {
+				return 1;
+			}
+			r->index = index;
+		}
+		r->index[r->n_frames++] = (struct trajectory_index){ .offset = offset, .step = header.step, .time = header.time };
+	}
+	return 0;
+}
+
+
+/**
+ * Close a trajectory file and clear up all memory associated with its reader
+ * @param r, the reader
+ */
+void trajectory_reader_close(struct trajectory_reader* r) {
+
+	// If it is already NULL
+	if (r == NULL) {
+		return;
+	}
+
+	if (r->pool != NULL) {
+		pool_destroy(r->pool);
+	}
+	free(r->index);
+	free(r->current);
+	free(r->quantized);
+	free(r->blobs);
+	free(r->sizes);
+	free(r->starts);
+	free(r->scratch);
+	close(r->fd);
+	free(r);
+}
+
+
+/**
+ * Open a trajectory file for random access to its frames
+ * @param path, the path of the file
+ * @param n_threads, the number of threads that decode each frame
+ * @return the reader or NULL if invalid or not a trajectory
+ */
+struct trajectory_reader* trajectory_reader_open(const char* path, size_t n_threads) {
+
+	// If the parameters are invalid
+	if (path == NULL || n_threads == 0) {
+		return NULL;
+	}
+
+	struct trajectory_reader* r = calloc(1, sizeof(struct trajectory_reader));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->decoded = SIZE_MAX;
+	r->fd = open(path, O_RDONLY);
+	struct stat st;
+	if (r->fd < 0 || fstat(r->fd, &st) != 0 || pread(r->fd, &r->header, sizeof(r->header), 0) != sizeof(r->header)
+			|| memcmp(r->header.magic, TRAJECTORY_MAGIC, sizeof(r->header.magic)) != 0
+			|| r->header.version < TRAJECTORY_OLDEST_VERSION || r->header.version > TRAJECTORY_VERSION || r->header.order != SNAPSHOT_ORDER || r->header.n_bodies == 0
+			|| r->header.chunk == 0 || r->header.chunk > r->header.n_bodies || r->header.key_interval == 0
+			|| !isfinite(r->header.error) || r->header.error < 0) {
+		if (r->fd >= 0) {
+			close(r->fd);
+		}
+		free(r);
+		return NULL;
+	}
+	uint64_t size = (uint64_t)st.st_size;
+	size_t n_bodies = r->header.n_bodies, chunk = r->header.chunk;
+	r->n_chunks = (n_bodies + chunk - 1) / chunk;
+	r->bound = compressBound(chunk * sizeof(double)) + sizeof(struct trajectory_block);
+
+	// The footer gives the index unless the writer never got to it
+	struct trajectory_footer footer;
+	int indexed = size >= sizeof(struct trajectory_header) + sizeof(footer)
+			&& pread(r->fd, &footer, sizeof(footer), (off_t)(size - sizeof(footer))) == sizeof(footer)
+			&& memcmp(footer.magic, TRAJECTORY_INDEX_MAGIC, sizeof(footer.magic)) == 0
+			&& footer.index_offset + footer.n_frames * sizeof(struct trajectory_index) + sizeof(footer) == size;
+	int failed = 0;
+	if (indexed) {
+		r->n_frames = footer.n_frames;
+		r->index = malloc(sizeof(struct trajectory_index) * (footer.n_frames ? footer.n_frames : 1));
+		failed = r->index == NULL || pread(r->fd, r->index, sizeof(struct trajectory_index) * footer.n_frames,
+				(off_t)footer.index_offset) != (ssize_t)(sizeof(struct trajectory_index) * footer.n_frames);
+	} else {
+		failed = trajectory_reader_scan(r, size);
+	}
+
+	r->current = malloc(sizeof(double) * BODY_ARRAYS * n_bodies);
+	r->quantized = r->header.error > 0 ? malloc(sizeof(int64_t) * TRAJECTORY_QUANTIZED_COLUMNS * n_bodies) : NULL;
+	r->sizes = malloc(sizeof(uint32_t) * BODY_ARRAYS * r->n_chunks);
+	r->starts = malloc(sizeof(size_t) * BODY_ARRAYS * r->n_chunks);
+	r->scratch = malloc(n_threads * chunk * sizeof(double));
+	r->pool = pool_create_unpinned(n_threads);
+	if (failed || r->current == NULL || (r->header.error > 0 && r->quantized == NULL) || r->sizes == NULL || r->starts == NULL
+			|| r->scratch == NULL || r->pool == NULL) {
+		trajectory_reader_close(r);
+		return NULL;
+	}
+	return r;
+}
+
+
+/**
+ * Decode the frame after the one the reader holds, or a key frame
+ * @param r, the reader
+ * @param frame, the frame
+ * @return 0 if decoded or 1 if the frame cannot be read
+ */
+static int trajectory_decode(struct trajectory_reader* r, size_t frame) {
+	size_t n_blobs = BODY_ARRAYS * r->n_chunks, head = trajectory_head(n_blobs);
+	struct trajectory_frame header;
+	r->decoded = SIZE_MAX;
+	if (pread(r->fd, &header, sizeof(header), (off_t)r->index[frame].offset) != sizeof(header)
+			|| header.size > n_blobs * r->bound || (!header.key && frame % r->header.key_interval == 0)) {
+		return 1;
+	}
+	if (r->blobs_size < head + header.size) {
+		unsigned char* blobs = realloc(r->blobs, head + header.size);
+		if (blobs == NULL) {
+			return 1;
+		}
+		r->blobs = blobs;
+		r->blobs_size = head + header.size;
+	}
+	if (pread(r->fd, r->blobs, head + header.size, (off_t)r->index[frame].offset) != (ssize_t)(head + header.size)) {
+		return 1;
+	}
+
+	// The chunks are packed so each starts where the ones before it end
+	memcpy(r->sizes, r->blobs + sizeof(struct trajectory_frame), sizeof(uint32_t) * n_blobs);
+	size_t start = 0;
+	for (size_t i = 0; i < n_blobs; i++) {
+		r->starts[i] = start;
+		start += r->sizes[i];
+	}
+	if (start != header.size) {
+		return 1;
+	}
+
+	struct trajectory_job job = { .reader = r, .values = r->current, .blobs = r->blobs + head, .sizes = r->sizes,
+		.starts = r->starts, .key = (int)header.key };
+	atomic_init(&job.failed, 0);
+	pool_run(r->pool, trajectory_decode_job, &job);
+	if (atomic_load(&job.failed)) {
+		return 1;
+	}
+	r->decoded = frame;
+	return 0;
+}
+
+
+/**
+ * Read a frame of a trajectory into a body store
+ * The frames from the key frame before it are decoded, or only those after
+ * the last frame read when it is on the way, so reading in order decodes
+ * each frame once and any frame costs at most key_interval decodes
+ * @param r, the reader
+ * @param frame, the frame, from 0 to r->n_frames - 1
+ * @param b, the body store, of the trajectory's number of bodies
+ * @return 0 if read or 1 if invalid or the frame cannot be read
+ */
+int trajectory_read(struct trajectory_reader* r, size_t frame, struct bodies* b) {
+
+	// If the parameters are invalid
+	if (r == NULL || b == NULL || frame >= r->n_frames || b->n_bodies != r->header.n_bodies) {
+		return 1;
+	}
+
+	size_t first = frame - frame % r->header.key_interval;
+	if (r->decoded != SIZE_MAX && r->decoded >= first && r->decoded <= frame) {
+		first = r->decoded + 1;
+	}
+	for (size_t f = first; f <= frame; f++) {
+		if (trajectory_decode(r, f)) {
+			return 1;
+		}
+	}
+
+	size_t n_bodies = r->header.n_bodies;
+	for (size_t column = 0; column < BODY_ARRAYS; column++) {
+		memcpy(b->x + column * b->stride, r->current + column * n_bodies, sizeof(double) * n_bodies);
+	}
+	return 0;
+}
+
+
+/**
+ * Load a frame of a trajectory file as a body store
+ * @param path, the path of the trajectory
+ * @param frame, the frame or SIZE_MAX for the last
+ * @param n_threads, the number of threads that decode it
+ * @return the body store or NULL if the frame cannot be read
+ */
+struct bodies* trajectory_load(const char* path, size_t frame, size_t n_threads) {
+	struct trajectory_reader* r = trajectory_reader_open(path, n_threads);
+	if (r == NULL || r->n_frames == 0) {
+		trajectory_reader_close(r);
+		return NULL;
+	}
+
+	frame = frame == SIZE_MAX ? r->n_frames - 1 : frame;
+	struct bodies* b = bodies_create(r->header.n_bodies);
+	if (b != NULL && trajectory_read(r, frame, b)) {
+		bodies_destroy(b);
+		b = NULL;
+	}
+	trajectory_reader_close(r);
+	return b;
+}
@@ -92,6 +92,11 @@ then
 				sudo perf script > "out/perf/$name.perf"
 				./stackcollapse-perf.pl "out/perf/$name.perf" > "out/folded/$name.folded"
 				./flamegraph.pl --hash "out/folded/$name.folded" > "out/svg/$name.svg"
+
+				### Cache lines the threads contend for, the HITM counts show false sharing
+				mkdir -p out/c2c
+				sudo perf c2c record -o "out/c2c/$name.data" -- ./nbody $line -t $n_threads
+				sudo perf c2c report -i "out/c2c/$name.data" --stdio > "out/c2c/$name.txt"
 			done < "$f"
 		fi
 		rm -f perf_data.old
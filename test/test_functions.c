@@ -245,6 +245,1776 @@ void test_validenergylargerandom_step(void) {
 }
 /* *********************************** */
 
+
+/******** BODY STORE TEST ***********/
+void test_aligned_bodies(void) {
+	struct bodies* b = bodies_create(13);
+	CU_ASSERT_PTR_NOT_NULL(b);
+	CU_ASSERT_EQUAL((size_t)b->x % CACHE_LINE, 0);
+	CU_ASSERT_EQUAL((size_t)b->velocity_x % CACHE_LINE, 0);
+	CU_ASSERT_EQUAL((size_t)b->mass % CACHE_LINE, 0);
+	CU_ASSERT_EQUAL(b->stride % (CACHE_LINE / sizeof(double)), 0);
+	bodies_destroy(b);
+}
+
+
+void test_zero_bodies(void) {
+	CU_ASSERT_PTR_NULL(bodies_create(0));
+	CU_ASSERT_PTR_NULL(bodies_from_structs(NULL, 2));
+}
+
+
+void test_roundtrip_bodies(void) {
+	struct body b1 = { 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0};
+	struct body b2 = { 8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0};
+	struct body* bodies[] = { &b1, &b2 };
+	struct bodies* b = bodies_from_structs(bodies, 2);
+	CU_ASSERT_DOUBLE_EQUAL(b->z[0], 3.0, 0.0);
+	CU_ASSERT_DOUBLE_EQUAL(b->velocity_y[1], 12.0, 0.0);
+	b->mass[1] = 20.0;
+	bodies_to_structs(b, bodies);
+	CU_ASSERT_DOUBLE_EQUAL(b2.mass, 20.0, 0.0);
+	CU_ASSERT_DOUBLE_EQUAL(b1.x, 1.0, 0.0);
+	bodies_destroy(b);
+}
+
+
+void test_bodies_slice(void) {
+	size_t per_line = CACHE_LINE / sizeof(double);
+	CU_ASSERT_EQUAL(sizeof(struct thread_data) % CACHE_LINE, 0);
+	CU_ASSERT_EQUAL(_Alignof(struct thread_data), CACHE_LINE);
+
+	// The slices follow each other, cover every body and start on whole lines
+	size_t counts[] = { 1, 3, 4, 7 };
+	size_t sizes[] = { 7, 64, 301, 1000 };
+	for (size_t k = 0; k < 4; k++) {
+		for (size_t m = 0; m < 4; m++) {
+			size_t previous = 0;
+			for (size_t id = 0; id < counts[k]; id++) {
+				size_t start, end;
+				bodies_slice(sizes[m], counts[k], id, &start, &end);
+				CU_ASSERT_EQUAL(start, previous);
+				CU_ASSERT_EQUAL(start % per_line, 0);
+				CU_ASSERT(end >= start);
+				previous = end;
+			}
+			CU_ASSERT_EQUAL(previous, sizes[m]);
+		}
+	}
+}
+
+
+void test_body_pages(void) {
+	CU_ASSERT_EQUAL(bodies_pages_select("giant"), 1);
+	CU_ASSERT_EQUAL(bodies_pages_select(NULL), 1);
+
+	// Huge pages fall back to transparent ones so the store is always created zeroed
+	const char* names[] = { "thp", "huge", "normal" };
+	for (size_t k = 0; k < 3; k++) {
+		CU_ASSERT_EQUAL(bodies_pages_select(names[k]), 0);
+		struct bodies* b = bodies_create(1000);
+		CU_ASSERT_PTR_NOT_NULL(b);
+		CU_ASSERT_EQUAL((size_t)b->x % CACHE_LINE, 0);
+		CU_ASSERT_EQUAL(b->mass[999], 0.0);
+		CU_ASSERT(k != 2 || strcmp(bodies_pages_name(b), "normal") == 0);
+		bodies_destroy(b);
+	}
+}
+
+/* *********************************** */
+
+
+/******** FORCE KERNEL TEST ***********/
+void test_unknown_kernel(void) {
+	CU_ASSERT_PTR_NULL(force_kernel_find("sse9"));
+	CU_ASSERT_PTR_NULL(force_kernel_find(NULL));
+	CU_ASSERT_PTR_NOT_NULL(force_kernel_find("scalar"));
+	CU_ASSERT_PTR_NOT_NULL(force_kernel_find("auto"));
+}
+
+
+void test_kernels_agree(void) {
+	const char* names[] = { "scalar", "avx2", "avx512" };
+	double expected[3 * 11];
+
+	for (size_t k = 0; k < 3; k++) {
+		const struct force_kernel* kernel = force_kernel_find(names[k]);
+		if (kernel == NULL) {
+			continue;
+		}
+
+		// Eleven bodies so the last tile is partly padding
+		struct bodies* b = bodies_create(11);
+		for (size_t i = 0; i < 11; i++) {
+			b->x[i] = (double)i;
+			b->y[i] = (double)(i * i % 7);
+			b->z[i] = (double)(i % 3);
+			b->mass[i] = 1e10 * (i + 1);
+		}
+		struct body_tiles* t = body_tiles_create(11);
+		body_tiles_pack(t, b, 0, 11);
+		kernel->kick(t, b, 0, 11, 1.0, 0);
+
+		for (size_t i = 0; i < 11; i++) {
+			if (k == 0) {
+				expected[i * 3] = b->velocity_x[i];
+				expected[i * 3 + 1] = b->velocity_y[i];
+				expected[i * 3 + 2] = b->velocity_z[i];
+				continue;
+			}
+			CU_ASSERT_DOUBLE_EQUAL(b->velocity_x[i], expected[i * 3], fabs(expected[i * 3]) * 1e-12);
+			CU_ASSERT_DOUBLE_EQUAL(b->velocity_y[i], expected[i * 3 + 1], fabs(expected[i * 3 + 1]) * 1e-12);
+			CU_ASSERT_DOUBLE_EQUAL(b->velocity_z[i], expected[i * 3 + 2], fabs(expected[i * 3 + 2]) * 1e-12);
+		}
+		body_tiles_destroy(t);
+		bodies_destroy(b);
+	}
+}
+
+
+
+void test_potential_kernels(void) {
+	const char* names[] = { "scalar", "avx2", "avx512" };
+
+	// Eleven bodies so the last group is partly padding, two of them on the same spot
+	struct bodies* b = bodies_create(11);
+	for (size_t i = 0; i < 11; i++) {
+		b->x[i] = (double)(i % 10);
+		b->y[i] = (double)(i * i % 7 % 10);
+		b->z[i] = (double)(i % 3 % 10);
+		b->mass[i] = 1e10 * (i + 1);
+	}
+	double expected = -bodies_energy(b, 0, 11) / GCONST;
+
+	for (size_t k = 0; k < 3; k++) {
+		const struct force_kernel* kernel = force_kernel_find(names[k]);
+		if (kernel == NULL) {
+			continue;
+		}
+		CU_ASSERT_DOUBLE_EQUAL(kernel->potential_block(b, 0, 11, 0, 11), expected, expected * 1e-12);
+
+		// Consecutive j blocks together still cover the triangle once
+		double split = kernel->potential_block(b, 0, 11, 0, 8) + kernel->potential_block(b, 0, 11, 8, 11);
+		CU_ASSERT_DOUBLE_EQUAL(split, expected, expected * 1e-12);
+	}
+	CU_ASSERT_EQUAL(force_potential(b, 0, 11, 3, 11), 0.0);
+	bodies_destroy(b);
+}
+
+void test_tiled_step(void) {
+	struct body b1 = { 1.0, 1.0, 1, 0, 1.0, 1.0, 1.0};
+	struct body b2 = { .x = 2.0, .y = 2.0, .z = 2,0, 
+		.velocity_y = 1.0, .velocity_z = 1.0, .mass = 1.0};
+	struct body* structs[] = { &b1, &b2 };
+	struct bodies* b = bodies_from_structs(structs, 2);
+	struct body_tiles* t = body_tiles_create(2);
+	bodies_step_tiled(b, t, 1);
+	CU_ASSERT_DOUBLE_EQUAL(b->x[0], 1.0, 0.1);
+	CU_ASSERT_DOUBLE_EQUAL(b->y[1], 3.0, 0.1);
+	body_tiles_destroy(t);
+	bodies_destroy(b);
+}
+
+
+void test_rsqrt_error(void) {
+	struct bodies* b = bodies_gen_random(500);
+	struct body_tiles* t = body_tiles_create(500);
+	double velocity = b->velocity_x[0];
+
+	CU_ASSERT_EQUAL(force_precision_select("rsqrt9"), 1);
+	CU_ASSERT_EQUAL(force_precision_select("exact"), 0);
+	CU_ASSERT_DOUBLE_EQUAL(force_error(b, t, 50, NULL), 0.0, 1e-12);
+
+	// Two newton steps are within 1e-4 even from the scalar bit trick
+	CU_ASSERT_EQUAL(force_precision_select("rsqrt2"), 0);
+	double rms_error = -1.0;
+	double max_error = force_error(b, t, 50, &rms_error);
+	CU_ASSERT(max_error < 1e-4);
+	CU_ASSERT(rms_error >= 0.0 && rms_error <= max_error);
+	CU_ASSERT_DOUBLE_EQUAL(b->velocity_x[0], velocity, 0.0);
+
+	force_precision_select("exact");
+	body_tiles_destroy(t);
+	bodies_destroy(b);
+}
+
+
+/**
+ * Step a store by kicking every body with the scalar kernel then moving it
+ */
+void test_reference_step(struct bodies* b, double dt) {
+	struct body_tiles* t = body_tiles_create(b->n_bodies);
+	body_tiles_pack(t, b, 0, b->n_bodies);
+	force_kernel_find("scalar")->kick(t, b, 0, b->n_bodies, dt, 0);
+	for (size_t i = 0; i < b->n_bodies; i++) {
+		b->x[i] += b->velocity_x[i] * dt;
+		b->y[i] += b->velocity_y[i] * dt;
+		b->z[i] += b->velocity_z[i] * dt;
+	}
+	body_tiles_destroy(t);
+}
+
+
+void test_blocked_step(void) {
+	size_t i_block, j_block;
+	cache_block_sizes(&i_block, &j_block);
+	CU_ASSERT(j_block >= MIN_BLOCK && j_block % TILE_WIDTH == 0);
+	CU_ASSERT(i_block >= j_block);
+
+	// Enough bodies for several j blocks and a ragged last block
+	size_t n = j_block * 2 + 5;
+	struct bodies* blocked = bodies_create(n);
+	struct bodies* reference = bodies_create(n);
+	for (size_t i = 0; i < n; i++) {
+		blocked->x[i] = reference->x[i] = (double)(i * 7919 % 1000);
+		blocked->y[i] = reference->y[i] = (double)(i * 104729 % 1000);
+		blocked->z[i] = reference->z[i] = (double)(i % 10);
+		blocked->mass[i] = reference->mass[i] = 1e12;
+	}
+
+	// The blocked step must match a kick from every body then a drift
+	struct body_tiles* t = body_tiles_create(n);
+	bodies_step_tiled(blocked, t, 1.0);
+	test_reference_step(reference, 1.0);
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT_DOUBLE_EQUAL(blocked->velocity_x[i], reference->velocity_x[i], fabs(reference->velocity_x[i]) * 1e-9);
+		CU_ASSERT_DOUBLE_EQUAL(blocked->velocity_y[i], reference->velocity_y[i], fabs(reference->velocity_y[i]) * 1e-9);
+		CU_ASSERT_DOUBLE_EQUAL(blocked->x[i], reference->x[i], 1e-9);
+	}
+	body_tiles_destroy(t);
+	bodies_destroy(reference);
+	bodies_destroy(blocked);
+}
+/* *********************************** */
+
+
+/******** SYMMETRIC PARALLEL STEP TEST ***********/
+struct bodies* test_cluster(size_t n) {
+	struct bodies* b = bodies_create(n);
+	for (size_t i = 0; i < n; i++) {
+		b->x[i] = (double)(i * 7919 % 1000);
+		b->y[i] = (double)(i * 104729 % 1000);
+		b->z[i] = (double)(i % 10);
+		b->mass[i] = 1e12 * (1 + i % 3);
+	}
+	return b;
+}
+
+
+void test_pair_partition(void) {
+	CU_ASSERT_EQUAL(pair_partition(1000, 4, 0), 0);
+	CU_ASSERT_EQUAL(pair_partition(1000, 4, 4), 1000);
+	CU_ASSERT_EQUAL(pair_partition(1000, 4, 5), 1000);
+
+	// Every share holds about a quarter of the triangle
+	for (size_t share = 0; share < 4; share++) {
+		size_t start = pair_partition(1000, 4, share);
+		size_t end = pair_partition(1000, 4, share + 1);
+		double pairs = 0;
+		for (size_t i = start; i < end; i++) {
+			pairs += 999 - i;
+		}
+		CU_ASSERT_DOUBLE_EQUAL(pairs, 1000.0 * 999 / 8, 1000);
+	}
+}
+
+
+void test_symmetric_kernels(void) {
+	const char* names[] = { "scalar", "avx2", "avx512" };
+	size_t n = 301;
+	struct bodies* reference = test_cluster(n);
+	test_reference_step(reference, 1.0);
+
+	for (size_t k = 0; k < 3; k++) {
+		if (force_kernel_select(names[k])) {
+			continue;
+		}
+		struct bodies* b = test_cluster(n);
+		struct body_tiles* t = body_tiles_create(n);
+		bodies_step_tiled(b, t, 1.0);
+		for (size_t i = 0; i < n; i++) {
+			CU_ASSERT_DOUBLE_EQUAL(b->velocity_x[i], reference->velocity_x[i], fabs(reference->velocity_x[i]) * 1e-9);
+			CU_ASSERT_DOUBLE_EQUAL(b->velocity_z[i], reference->velocity_z[i], fabs(reference->velocity_z[i]) * 1e-9);
+		}
+		body_tiles_destroy(t);
+		bodies_destroy(b);
+	}
+	force_kernel_select("auto");
+	bodies_destroy(reference);
+}
+
+
+/**
+ * Run an engine on a pool of threads through the worker as nbody does
+ */
+void test_run_engine(const char* name, struct engine_params* params, struct bodies* b, size_t n_threads, size_t iterations, double dt) {
+	const struct engine* engine = engine_find(name);
+	void* state = engine->create(b, n_threads, params);
+	struct thread_pool* pool = pool_create(n_threads);
+	struct thread_data tdata[8];
+	size_t segment = b->n_bodies / n_threads;
+	for (size_t i = 0; i < n_threads; i++) {
+		tdata[i] = (struct thread_data){ .bodies = b, .engine = engine, .state = state, .id = i, .n_threads = n_threads,
+			.n_bodies = b->n_bodies, .iterations = iterations, .start = i * segment,
+			.end = i == n_threads - 1 ? b->n_bodies : (i + 1) * segment, .dt = dt, .pool = pool };
+	}
+	pool_run(pool, worker, tdata);
+	pool_destroy(pool);
+	engine->destroy(state);
+}
+
+
+void test_parallel_step(void) {
+	size_t n = 301;
+	struct bodies* reference = test_cluster(n);
+	test_reference_step(reference, 1.0);
+	test_reference_step(reference, 1.0);
+
+	struct bodies* b = test_cluster(n);
+	test_run_engine("direct", NULL, b, 3, 2, 1.0);
+
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT_DOUBLE_EQUAL(b->velocity_y[i], reference->velocity_y[i], fabs(reference->velocity_y[i]) * 1e-9);
+		CU_ASSERT_DOUBLE_EQUAL(b->x[i], reference->x[i], 1e-6);
+	}
+
+	// Each buffer takes its lane's shares in order so the same threads give the same bits
+	struct bodies* again = test_cluster(n);
+	test_run_engine("direct", NULL, again, 3, 2, 1.0);
+	CU_ASSERT_EQUAL(memcmp(again->x, b->x, sizeof(double) * b->stride * BODY_ARRAYS), 0);
+	bodies_destroy(again);
+	bodies_destroy(b);
+	bodies_destroy(reference);
+}
+/* *********************************** */
+
+
+
+/******** THREAD POOL TEST ***********/
+struct test_pool_job {
+	struct thread_pool* pool;
+	_Atomic int runs[1000];
+	size_t thread_of[1000];
+	size_t n_tasks;
+};
+
+void test_pool_task(void* arg, size_t id, size_t task) {
+	struct test_pool_job* job = arg;
+	atomic_fetch_add(&job->runs[task], 1);
+	job->thread_of[task] = id;
+}
+
+void test_pool_steal_job(void* arg, size_t id) {
+	struct test_pool_job* job = arg;
+
+	// Thread 0 starts with every task so the others only get work by stealing
+	size_t first = 0, last = id == 0 ? job->n_tasks : 0;
+	pool_steal(job->pool, id, first, last, test_pool_task, job);
+}
+
+void test_pool_steal(void) {
+	CU_ASSERT_PTR_NULL(pool_create(0));
+	struct test_pool_job* job = calloc(1, sizeof(struct test_pool_job));
+	job->pool = pool_create(4);
+	job->n_tasks = 1000;
+
+	// The same threads run every job and every task runs exactly once each time
+	for (int run = 1; run <= 3; run++) {
+		pool_run(job->pool, test_pool_steal_job, job);
+		for (size_t k = 0; k < job->n_tasks; k++) {
+			CU_ASSERT_EQUAL(atomic_load(&job->runs[k]), run);
+			CU_ASSERT(job->thread_of[k] < 4);
+		}
+	}
+	pool_destroy(job->pool);
+	free(job);
+}
+
+struct test_lane_job {
+	struct thread_pool* pool;
+	struct pool_lane* lanes;
+	size_t order[4][50];
+	size_t n_run[4];
+	_Atomic size_t taken;
+};
+
+void test_lane_job(void* arg, size_t id) {
+	struct test_lane_job* job = arg;
+
+	// Thread 0 is late so the others run the tasks of its lane for it
+	if (id == 0) {
+		usleep(100000);
+	}
+	for (size_t k = 0; k < 4; k++) {
+		size_t owner = (id + k) % 4, task;
+		while (!pool_lane_done(job->lanes + owner)) {
+			if (pool_lane_enter(job->lanes + owner, &task)) {
+				job->order[owner][job->n_run[owner]++] = task;
+				if (owner != id) {
+					atomic_fetch_add(&job->taken, 1);
+				}
+				pool_lane_leave(job->lanes + owner, 1);
+			} else {
+				sched_yield();
+			}
+		}
+	}
+}
+
+void test_pool_lanes(void) {
+	CU_ASSERT_PTR_NULL(pool_lanes_create(0));
+	struct test_lane_job* job = calloc(1, sizeof(struct test_lane_job));
+	job->pool = pool_create(4);
+	job->lanes = pool_lanes_create(4);
+	for (size_t i = 0; i < 4; i++) {
+		pool_lane_reset(job->lanes + i, i * 50, (i + 1) * 50);
+	}
+	size_t task;
+	pool_lane_reset(job->lanes + 3, 150, 150);
+	CU_ASSERT(pool_lane_done(job->lanes + 3));
+	CU_ASSERT_EQUAL(pool_lane_enter(job->lanes + 3, &task), 0);
+	pool_lane_reset(job->lanes + 3, 150, 200);
+
+	// Whichever thread runs them, the tasks of a lane run once each and in order
+	pool_run(job->pool, test_lane_job, job);
+	for (size_t i = 0; i < 4; i++) {
+		CU_ASSERT_EQUAL(job->n_run[i], 50);
+		for (size_t k = 0; k < 50; k++) {
+			CU_ASSERT_EQUAL(job->order[i][k], i * 50 + k);
+		}
+	}
+	CU_ASSERT(atomic_load(&job->taken) > 0);
+	free(job->lanes);
+	pool_destroy(job->pool);
+	free(job);
+}
+
+struct test_barrier_job {
+	struct thread_pool* pool;
+	_Atomic size_t arrived;
+	_Atomic int early;
+};
+
+void test_barrier_phases(void* arg, size_t id) {
+	struct test_barrier_job* job = arg;
+	for (size_t phase = 0; phase < 100; phase++) {
+		atomic_fetch_add(&job->arrived, 1);
+		pool_wait(job->pool);
+
+		// Nobody leaves a phase before every thread has arrived
+		if (atomic_load(&job->arrived) != 4 * (phase + 1)) {
+			atomic_store(&job->early, 1);
+		}
+		pool_wait(job->pool);
+	}
+}
+
+void test_pool_barrier(void) {
+	const char* names[] = { "pthread", "spin" };
+	CU_ASSERT_EQUAL(pool_barrier_select("futex"), 1);
+	for (size_t k = 0; k < 2; k++) {
+		CU_ASSERT_EQUAL(pool_barrier_select(names[k]), 0);
+		struct test_barrier_job job = { .pool = pool_create(4) };
+		CU_ASSERT_EQUAL(strcmp(pool_barrier_name(job.pool), names[k]), 0);
+		pool_run(job.pool, test_barrier_phases, &job);
+		atomic_store(&job.arrived, 0);
+		pool_run(job.pool, test_barrier_phases, &job);
+		CU_ASSERT_EQUAL(atomic_load(&job.early), 0);
+		CU_ASSERT_EQUAL(atomic_load(&job.pool->epoch), 400);
+		pool_destroy(job.pool);
+	}
+}
+
+
+void test_parallel_energy(void) {
+	size_t n = 1001;
+	struct bodies* b = test_cluster(n);
+	for (size_t i = 0; i < n; i++) {
+		b->velocity_x[i] = (double)(i % 7);
+	}
+	double expected = bodies_energy(b, 0, n);
+
+	// Shares are summed in order so every thread count gives the same total
+	double totals[3];
+	size_t counts[3] = { 1, 3, 4 };
+	for (size_t k = 0; k < 3; k++) {
+		struct thread_data tdata[4];
+		struct thread_pool* pool = pool_create(counts[k]);
+		for (size_t i = 0; i < counts[k]; i++) {
+			tdata[i] = (struct thread_data){ .bodies = b, .engine = engine_find("direct"), .pool = pool, .iterations = 0 };
+		}
+		pool_run(pool, worker, tdata);
+		totals[k] = tdata[0].initial_energy;
+		for (size_t i = 1; i < counts[k]; i++) {
+			CU_ASSERT_EQUAL(tdata[i].initial_energy, 0.0);
+		}
+		pool_destroy(pool);
+	}
+	CU_ASSERT_DOUBLE_EQUAL(totals[0], expected, fabs(expected) * 1e-12);
+	CU_ASSERT_EQUAL(totals[1], totals[0]);
+	CU_ASSERT_EQUAL(totals[2], totals[0]);
+	bodies_destroy(b);
+}
+
+
+void test_bodies_place(void) {
+	int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE];
+	CU_ASSERT(topology_cpus(cpus, nodes) > 0);
+	CU_ASSERT_EQUAL(pool_pin_select("sockets"), 1);
+
+	// Pinned threads copy their slices and every value survives the move
+	const char* pins[] = { "cores", "nodes" };
+	for (size_t k = 0; k < 2; k++) {
+		CU_ASSERT_EQUAL(pool_pin_select(pins[k]), 0);
+		struct thread_pool* pool = pool_create(3);
+		CU_ASSERT_EQUAL(strcmp(pool_pin_name(pool), pins[k]), 0);
+		CU_ASSERT(pool->helpers[2].node >= 0);
+		CU_ASSERT_EQUAL(pool->helpers[1].cpu >= 0, k == 0);
+		struct bodies* b = test_cluster(301);
+		struct bodies* copy = test_cluster(301);
+		void* memory = b->memory;
+		CU_ASSERT_EQUAL(bodies_place(b, pool), 0);
+		CU_ASSERT(b->memory != memory);
+		for (size_t i = 0; i < 301; i++) {
+			CU_ASSERT_EQUAL(b->x[i], copy->x[i]);
+			CU_ASSERT_EQUAL(b->velocity_z[i], copy->velocity_z[i]);
+			CU_ASSERT_EQUAL(b->mass[i], copy->mass[i]);
+		}
+		CU_ASSERT_EQUAL(bodies_place(b, NULL), 1);
+
+		// A mapped snapshot starts at its header yet its arrays are what moves
+		char path[] = "/tmp/nbody_placeXXXXXX";
+		FILE* file = fdopen(mkstemp(path), "wb");
+		CU_ASSERT_EQUAL(bodies_write_snapshot(copy, file), 0);
+		fclose(file);
+		struct bodies* mapped = bodies_map_snapshot(path);
+		CU_ASSERT(mapped->memory != (void*)mapped->x);
+		CU_ASSERT_EQUAL(bodies_place(mapped, pool), 0);
+		CU_ASSERT_EQUAL(memcmp(mapped->x, copy->x, sizeof(double) * copy->stride * BODY_ARRAYS), 0);
+		bodies_destroy(mapped);
+		unlink(path);
+		bodies_destroy(copy);
+		bodies_destroy(b);
+		pool_destroy(pool);
+	}
+	CU_ASSERT_EQUAL(pool_pin_select("none"), 0);
+}
+/* *********************************** */
+
+
+
+/******** ENERGY DIAGNOSTICS TEST ***********/
+void test_energy_schedule(void) {
+	struct energy_schedule s = { 0 };
+	CU_ASSERT_EQUAL(energy_schedule_parse(&s, "10"), 0);
+	CU_ASSERT_EQUAL(s.every, 10);
+	CU_ASSERT_EQUAL(energy_schedule_parse(&s, "0.5s"), 0);
+	CU_ASSERT_EQUAL(s.every, 0);
+	CU_ASSERT_DOUBLE_EQUAL(s.seconds, 0.5, 1e-15);
+	CU_ASSERT_EQUAL(energy_schedule_parse(&s, "end"), 0);
+	CU_ASSERT_EQUAL(s.seconds, 0.0);
+	CU_ASSERT_EQUAL(energy_schedule_parse(&s, "0"), 1);
+	CU_ASSERT_EQUAL(energy_schedule_parse(&s, "-3"), 1);
+	CU_ASSERT_EQUAL(energy_schedule_parse(&s, "s"), 1);
+	CU_ASSERT_EQUAL(energy_schedule_parse(&s, "2x"), 1);
+	CU_ASSERT_EQUAL(energy_schedule_parse(NULL, "end"), 1);
+
+	// The ends are always measured and steps between on the cadence
+	CU_ASSERT_EQUAL(energy_due(NULL, 0, 7), 1);
+	CU_ASSERT_EQUAL(energy_due(NULL, 3, 7), 0);
+	CU_ASSERT_EQUAL(energy_due(NULL, 7, 7), 1);
+	energy_schedule_parse(&s, "3");
+	CU_ASSERT_EQUAL(energy_due(&s, 3, 7), 1);
+	CU_ASSERT_EQUAL(energy_due(&s, 4, 7), 0);
+}
+
+
+void test_energy_log(void) {
+	size_t n = 200;
+	struct bodies* b = test_cluster(n);
+	struct energy_schedule s = { .every = 2, .log = tmpfile() };
+	const struct engine* engine = engine_find("direct");
+	struct engine_params params = { 0 };
+	struct thread_pool* pool = pool_create(2);
+	void* state = engine->create(b, 2, &params);
+	struct thread_data tdata[2];
+	for (size_t i = 0; i < 2; i++) {
+		tdata[i] = (struct thread_data){ .bodies = b, .engine = engine, .state = state, .id = i, .n_threads = 2,
+			.n_bodies = n, .iterations = 5, .start = i * n / 2, .end = (i + 1) * n / 2, .dt = 1.0, .pool = pool, .schedule = &s };
+	}
+	pool_run(pool, worker, tdata);
+
+	// Steps 0, 2, 4 and the last are measured, the last matches the pair sum
+	CU_ASSERT_EQUAL(s.n_measured, 4);
+	double expected = bodies_energy(b, 0, n);
+	CU_ASSERT_DOUBLE_EQUAL(tdata[0].final_energy, expected, fabs(expected) * 1e-12);
+	rewind(s.log);
+	char line[256];
+	size_t rows = 0, step = 0;
+	while (fgets(line, sizeof(line), s.log) != NULL) {
+		if (rows++ > 0) {
+			CU_ASSERT_EQUAL(sscanf(line, "%zu,", &step), 1);
+		}
+	}
+	CU_ASSERT_EQUAL(rows, 5);
+	CU_ASSERT_EQUAL(step, 5);
+	fclose(s.log);
+	engine->destroy(state);
+	pool_destroy(pool);
+	bodies_destroy(b);
+}
+
+
+void test_energy_from_force(void) {
+	size_t n = 2000;
+	struct bodies* b = test_cluster(n);
+	struct energy_schedule s = { .every = 1, .from_force = 1 };
+	struct engine_params params = { .theta = 0.5, .order = 6 };
+	const struct engine* engine = engine_find("fmm");
+	CU_ASSERT_PTR_NOT_NULL(engine->potential);
+	struct thread_pool* pool = pool_create(3);
+	void* state = engine->create(b, 3, &params);
+	struct thread_data tdata[3];
+	for (size_t i = 0; i < 3; i++) {
+		tdata[i] = (struct thread_data){ .bodies = b, .engine = engine, .state = state, .id = i, .n_threads = 3,
+			.n_bodies = n, .iterations = 2, .start = i * n / 3, .end = (i + 1) * n / 3, .dt = 0.0, .pool = pool, .schedule = &s };
+	}
+	pool_run(pool, worker, tdata);
+
+	// Nothing moves so the force pass potential is the pair sum up to the expansion error
+	CU_ASSERT_EQUAL(s.n_measured, 3);
+	double expected = bodies_energy(b, 0, n);
+	CU_ASSERT_DOUBLE_EQUAL(tdata[0].final_energy, expected, fabs(expected) * 1e-4);
+	CU_ASSERT_NOT_EQUAL(tdata[0].final_energy, tdata[0].initial_energy);
+	engine->destroy(state);
+	pool_destroy(pool);
+	bodies_destroy(b);
+}
+
+
+void test_fused_potential(void) {
+	const char* names[] = { "scalar", "avx2", "avx512" };
+	size_t n = 301;
+	struct bodies* b = test_cluster(n);
+	struct body_tiles* t = body_tiles_create(n);
+	body_tiles_pack(t, b, 0, n);
+	double* velocity = aligned_alloc(CACHE_LINE, sizeof(double) * 3 * t->n_tiles * TILE_WIDTH);
+	memset(velocity, 0, sizeof(double) * 3 * t->n_tiles * TILE_WIDTH);
+	double expected = -bodies_energy(b, 0, n) / GCONST;
+
+	// Every kernel's fused pass sums the same potential as the pair sum
+	for (size_t k = 0; k < 3; k++) {
+		const struct force_kernel* kernel = force_kernel_find(names[k]);
+		if (kernel == NULL) {
+			continue;
+		}
+		double* v = velocity;
+		double sum = kernel->pair_block(t, v, v + t->n_tiles * TILE_WIDTH, v + 2 * t->n_tiles * TILE_WIDTH, 0, n, 0, n, 1.0, 0, 1);
+		CU_ASSERT_DOUBLE_EQUAL(sum, expected, expected * 1e-12);
+		CU_ASSERT_EQUAL(kernel->pair_block(t, v, v + t->n_tiles * TILE_WIDTH, v + 2 * t->n_tiles * TILE_WIDTH, 0, n, 0, n, 1.0, 0, 0), 0.0);
+	}
+	free(velocity);
+	body_tiles_destroy(t);
+
+	// The direct engine measures from its force pass on one thread or several
+	for (size_t n_threads = 1; n_threads <= 3; n_threads += 2) {
+		struct energy_schedule s = { .every = 1, .from_force = 1 };
+		const struct engine* engine = engine_find("direct");
+		struct engine_params params = { 0 };
+		struct thread_pool* pool = pool_create(n_threads);
+		void* state = engine->create(b, n_threads, &params);
+		struct thread_data tdata[3];
+		for (size_t i = 0; i < n_threads; i++) {
+			tdata[i] = (struct thread_data){ .bodies = b, .engine = engine, .state = state, .id = i, .n_threads = n_threads,
+				.n_bodies = n, .iterations = 2, .start = i * n / n_threads, .end = (i + 1) * n / n_threads, .dt = 0.0,
+				.pool = pool, .schedule = &s };
+		}
+		pool_run(pool, worker, tdata);
+		CU_ASSERT_EQUAL(s.n_measured, 3);
+		CU_ASSERT_DOUBLE_EQUAL(engine->potential(state), -GCONST * expected, GCONST * expected * 1e-12);
+		CU_ASSERT_DOUBLE_EQUAL(tdata[0].final_energy, tdata[0].initial_energy, fabs(tdata[0].initial_energy) * 1e-12);
+		engine->destroy(state);
+		pool_destroy(pool);
+	}
+	bodies_destroy(b);
+}
+/* *********************************** */
+
+
+
+/******** BARNES-HUT ENGINE TEST ***********/
+void test_unknown_engine(void) {
+	struct engine_params params = { .theta = -1.0 };
+	struct bodies* b = test_cluster(10);
+	CU_ASSERT_PTR_NULL(engine_find("mesh"));
+	CU_ASSERT_PTR_NULL(engine_find(NULL));
+	CU_ASSERT_PTR_NOT_NULL(engine_find("direct"));
+	CU_ASSERT_PTR_NULL(bh_create(b, 1, &params));
+	bodies_destroy(b);
+}
+
+void test_bh_open_all(void) {
+	size_t n = 700;
+	struct bodies* reference = test_cluster(n);
+	test_reference_step(reference, 1.0);
+
+	// Opening every cell leaves only the leaf sums, the direct sum reordered
+	struct engine_params params = { .theta = 0.0 };
+	struct bodies* b = test_cluster(n);
+	test_run_engine("bh", &params, b, 1, 1, 1.0);
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT_DOUBLE_EQUAL(b->velocity_x[i], reference->velocity_x[i], fabs(reference->velocity_x[i]) * 1e-9);
+		CU_ASSERT_DOUBLE_EQUAL(b->z[i], reference->z[i], 1e-6);
+	}
+	bodies_destroy(b);
+	bodies_destroy(reference);
+}
+
+void test_bh_accuracy(void) {
+	size_t n = 2000;
+	struct bodies* reference = test_cluster(n);
+	test_reference_step(reference, 1.0);
+
+	struct engine_params params = { .theta = 0.5 };
+	struct bodies* b = test_cluster(n);
+	test_run_engine("bh", &params, b, 1, 1, 1.0);
+
+	// Quadrupoles at theta 0.5 keep the rms relative force error well under a percent
+	double error = 0, norm = 0;
+	for (size_t i = 0; i < n; i++) {
+		double dx = b->velocity_x[i] - reference->velocity_x[i];
+		double dy = b->velocity_y[i] - reference->velocity_y[i];
+		double dz = b->velocity_z[i] - reference->velocity_z[i];
+		error += dx * dx + dy * dy + dz * dz;
+		norm += reference->velocity_x[i] * reference->velocity_x[i] + reference->velocity_y[i] * reference->velocity_y[i]
+			+ reference->velocity_z[i] * reference->velocity_z[i];
+	}
+	CU_ASSERT(sqrt(error / norm) < 1e-3);
+	bodies_destroy(b);
+	bodies_destroy(reference);
+}
+
+void test_bh_threads(void) {
+	size_t n = 1500;
+	struct engine_params params = { .theta = 0.7 };
+	struct bodies* single = test_cluster(n);
+	struct bodies* threaded = test_cluster(n);
+	test_run_engine("bh", &params, single, 1, 3, 1.0);
+	test_run_engine("bh", &params, threaded, 4, 3, 1.0);
+
+	// The tree does not depend on how the bodies are split between threads
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT_EQUAL(threaded->velocity_x[i], single->velocity_x[i]);
+		CU_ASSERT_EQUAL(threaded->y[i], single->y[i]);
+	}
+	bodies_destroy(single);
+	bodies_destroy(threaded);
+}
+/* *********************************** */
+
+
+
+/******** FAST MULTIPOLE ENGINE TEST ***********/
+void test_fmm_accuracy(void) {
+	struct bodies* b = test_cluster(3000);
+	struct engine_params low = { .theta = 0.5, .order = 2 };
+	struct engine_params high = { .theta = 0.5, .order = 6 };
+	struct engine_params flat = { .theta = 0.5, .order = 0 };
+	struct engine_params wide = { .theta = 1.0, .order = 4 };
+	double low_force = 0, high_force = 0;
+
+	CU_ASSERT_PTR_NULL(fmm_create(b, 1, &flat));
+	CU_ASSERT_PTR_NULL(fmm_create(b, 1, &wide));
+
+	// A higher order brings the sample closer to the direct sum
+	double low_energy = fmm_error(b, &low, 200, &low_force);
+	double high_energy = fmm_error(b, &high, 200, &high_force);
+	CU_ASSERT(high_energy >= 0.0 && high_energy < 1e-6);
+	CU_ASSERT(high_force < 1e-3);
+	CU_ASSERT(high_force < low_force);
+	CU_ASSERT(low_energy < 1e-2);
+	bodies_destroy(b);
+}
+
+void test_fmm_threads(void) {
+	size_t n = 2500;
+	struct engine_params params = { .theta = 0.6, .order = 4 };
+	struct bodies* single = test_cluster(n);
+	struct bodies* threaded = test_cluster(n);
+	test_run_engine("fmm", &params, single, 1, 2, 1.0);
+	test_run_engine("fmm", &params, threaded, 3, 2, 1.0);
+
+	// Every bucket is walked the same way whichever thread owns it
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT_EQUAL(threaded->velocity_z[i], single->velocity_z[i]);
+		CU_ASSERT_EQUAL(threaded->x[i], single->x[i]);
+	}
+	bodies_destroy(single);
+	bodies_destroy(threaded);
+}
+/* *********************************** */
+
+
+
+/******** PARTICLE MESH ENGINE TEST ***********/
+void test_pm_isolated(void) {
+	size_t n = 201;
+	struct bodies* b = bodies_create(n);
+	struct engine_params params = { .grid = 64, .periodic = 0 };
+	struct engine_params odd = { .grid = 48, .periodic = 0 };
+	CU_ASSERT_PTR_NULL(pm_create(b, 1, &odd));
+
+	// Light bodies around one heavy body only feel the heavy one
+	double mass = 1e12;
+	b->x[0] = b->y[0] = b->z[0] = 500.0;
+	b->mass[0] = mass;
+	for (size_t i = 1; i < n; i++) {
+		double r = 150.0 + (i * 37 % 250), theta = i * 2.399963, height = (double)(i * 53 % 199) / 99.0 - 1.0;
+		double ring = sqrt(1.0 - height * height);
+		b->x[i] = 500.0 + r * ring * cos(theta);
+		b->y[i] = 500.0 + r * ring * sin(theta);
+		b->z[i] = 500.0 + r * height;
+		b->mass[i] = 1.0;
+	}
+	double x[201], y[201], z[201];
+	memcpy(x, b->x, sizeof(x));
+	memcpy(y, b->y, sizeof(y));
+	memcpy(z, b->z, sizeof(z));
+	test_run_engine("pm", &params, b, 1, 1, 1.0);
+
+	// Many cells away the mesh force is within a couple of percent of G M / r^2
+	for (size_t i = 1; i < n; i++) {
+		double dx = x[0] - x[i], dy = y[0] - y[i], dz = z[0] - z[i];
+		double r = sqrt(dx * dx + dy * dy + dz * dz);
+		double expected = GCONST * mass / (r * r);
+		double radial = (b->velocity_x[i] * dx + b->velocity_y[i] * dy + b->velocity_z[i] * dz) / r;
+		CU_ASSERT_DOUBLE_EQUAL(radial, expected, expected * 0.03);
+	}
+	bodies_destroy(b);
+}
+
+void test_pm_periodic(void) {
+	size_t n = 500;
+	struct engine_params params = { .grid = 32, .periodic = 1 };
+	struct bodies* b = test_cluster(n);
+	b->velocity_x[0] = 5000.0;
+	b->velocity_y[1] = -5000.0;
+	test_run_engine("pm", &params, b, 2, 2, 1.0);
+
+	// Bodies wrap into the box around the starting positions
+	double box = 999.0 * (1.0 + 1e-9);
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT(b->x[i] >= 0.0 && b->x[i] <= box);
+		CU_ASSERT(b->y[i] >= 0.0 && b->y[i] <= box);
+		CU_ASSERT(b->z[i] >= 0.0 && b->z[i] <= box);
+	}
+
+	// Mesh forces come in equal and opposite pairs so momentum is kept
+	double momentum = 0, scale = 0;
+	for (size_t i = 0; i < n; i++) {
+		momentum += b->mass[i] * b->velocity_z[i];
+		scale += b->mass[i] * fabs(b->velocity_z[i]);
+	}
+	CU_ASSERT(fabs(momentum) < scale * 1e-2);
+	bodies_destroy(b);
+}
+
+void test_pm_threads(void) {
+	size_t n = 1200;
+	struct engine_params params = { .grid = 32, .periodic = 0 };
+	struct bodies* single = test_cluster(n);
+	struct bodies* threaded = test_cluster(n);
+	test_run_engine("pm", &params, single, 1, 2, 1.0);
+	test_run_engine("pm", &params, threaded, 3, 2, 1.0);
+
+	// Only the order the mass grids are summed in differs
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT_DOUBLE_EQUAL(threaded->velocity_x[i], single->velocity_x[i], fabs(single->velocity_x[i]) * 1e-9 + 1e-9);
+		CU_ASSERT_DOUBLE_EQUAL(threaded->y[i], single->y[i], 1e-6);
+	}
+	bodies_destroy(single);
+	bodies_destroy(threaded);
+}
+/* *********************************** */
+
+
+
+/******** P3M ENGINE TEST ***********/
+void test_p3m_accuracy(void) {
+	size_t n = 2000;
+	struct bodies* reference = test_cluster(n);
+	test_reference_step(reference, 1.0);
+
+	struct engine_params none = { .grid = 32, .split = 0.0 };
+	struct engine_params wide = { .grid = 32, .split = 4.0 };
+	struct engine_params params = { .grid = 32, .split = 1.25 };
+	CU_ASSERT_PTR_NULL(p3m_create(reference, 1, &none));
+	CU_ASSERT_PTR_NULL(p3m_create(reference, 1, &wide));
+
+	struct bodies* mesh = test_cluster(n);
+	struct bodies* hybrid = test_cluster(n);
+	test_run_engine("pm", &params, mesh, 1, 1, 1.0);
+	test_run_engine("p3m", &params, hybrid, 1, 1, 1.0);
+
+	// Close pairs summed directly take the error well below the mesh alone
+	double mesh_error = 0, hybrid_error = 0, norm = 0;
+	for (size_t i = 0; i < n; i++) {
+		double* v[3] = { reference->velocity_x, reference->velocity_y, reference->velocity_z };
+		double* m[3] = { mesh->velocity_x, mesh->velocity_y, mesh->velocity_z };
+		double* h[3] = { hybrid->velocity_x, hybrid->velocity_y, hybrid->velocity_z };
+		for (int axis = 0; axis < 3; axis++) {
+			mesh_error += (m[axis][i] - v[axis][i]) * (m[axis][i] - v[axis][i]);
+			hybrid_error += (h[axis][i] - v[axis][i]) * (h[axis][i] - v[axis][i]);
+			norm += v[axis][i] * v[axis][i];
+		}
+	}
+	CU_ASSERT(sqrt(hybrid_error / norm) < 1e-2);
+	CU_ASSERT(hybrid_error < mesh_error / 100.0);
+	bodies_destroy(hybrid);
+	bodies_destroy(mesh);
+	bodies_destroy(reference);
+}
+
+void test_p3m_threads(void) {
+	size_t n = 1500;
+	struct engine_params params = { .grid = 32, .periodic = 1, .split = 1.0 };
+	struct bodies* single = test_cluster(n);
+	struct bodies* threaded = test_cluster(n);
+	test_run_engine("p3m", &params, single, 1, 2, 1.0);
+	test_run_engine("p3m", &params, threaded, 3, 2, 1.0);
+
+	// The cells keep bodies in index order so only the mesh sums differ
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT_DOUBLE_EQUAL(threaded->velocity_y[i], single->velocity_y[i], fabs(single->velocity_y[i]) * 1e-9 + 1e-9);
+		CU_ASSERT_DOUBLE_EQUAL(threaded->z[i], single->z[i], 1e-6);
+	}
+	bodies_destroy(single);
+	bodies_destroy(threaded);
+}
+/* *********************************** */
+
+
+
+/******** DATAFLOW ENGINE TEST ***********/
+void test_flow_engine(void) {
+	size_t n = 301;
+	struct bodies* reference = test_cluster(n);
+	for (size_t step = 0; step < 5; step++) {
+		test_reference_step(reference, 1.0);
+	}
+
+	// Steps overlap in one run yet every body ends where the serial steps put it
+	for (size_t n_threads = 1; n_threads <= 4; n_threads += 3) {
+		struct bodies* b = test_cluster(n);
+		test_run_engine("flow", NULL, b, n_threads, 5, 1.0);
+		for (size_t i = 0; i < n; i++) {
+			CU_ASSERT_DOUBLE_EQUAL(b->velocity_y[i], reference->velocity_y[i], fabs(reference->velocity_y[i]) * 1e-9);
+			CU_ASSERT_DOUBLE_EQUAL(b->x[i], reference->x[i], 1e-6);
+		}
+
+		// Whichever thread moves a block, each buffer took its pairs in the same order
+		struct bodies* again = test_cluster(n);
+		test_run_engine("flow", NULL, again, n_threads, 5, 1.0);
+		CU_ASSERT_EQUAL(memcmp(again->x, b->x, sizeof(double) * b->stride * BODY_ARRAYS), 0);
+		bodies_destroy(again);
+		bodies_destroy(b);
+	}
+	bodies_destroy(reference);
+
+	// Runs stop where the energy is due and the last step of each sums the potential
+	struct bodies* b = test_cluster(n);
+	double expected = bodies_energy(b, 0, n);
+	struct energy_schedule s = { .every = 2, .from_force = 1 };
+	const struct engine* engine = engine_find("flow");
+	struct thread_pool* pool = pool_create(3);
+	void* state = engine->create(b, 3, NULL);
+	struct thread_data tdata[3];
+	for (size_t i = 0; i < 3; i++) {
+		tdata[i] = (struct thread_data){ .bodies = b, .engine = engine, .state = state, .id = i, .n_threads = 3,
+			.n_bodies = n, .iterations = 5, .dt = 0.0, .pool = pool, .schedule = &s };
+	}
+	pool_run(pool, worker, tdata);
+	CU_ASSERT_EQUAL(s.n_measured, 4);
+	CU_ASSERT_DOUBLE_EQUAL(tdata[0].final_energy, expected, fabs(expected) * 1e-12);
+	CU_ASSERT_EQUAL(energy_next(&s, 4, 5), 5);
+	CU_ASSERT_EQUAL(energy_next(NULL, 0, 5), 5);
+	engine->destroy(state);
+	pool_destroy(pool);
+	bodies_destroy(b);
+}
+
+void test_stream_engine(void) {
+	size_t n = 301;
+	struct bodies* reference = test_cluster(n);
+	for (size_t step = 0; step < 3; step++) {
+		test_reference_step(reference, 1.0);
+	}
+
+	// Tiles smaller than a slice give the serial steps, and the same bits on any threads
+	struct engine_params params = { .tile = 50 };
+	struct bodies* single = test_cluster(n);
+	test_run_engine("stream", NULL, single, 1, 3, 1.0);
+	for (size_t n_threads = 2; n_threads <= 3; n_threads++) {
+		struct bodies* b = test_cluster(n);
+		test_run_engine("stream", &params, b, n_threads, 3, 1.0);
+		for (size_t i = 0; i < n; i++) {
+			CU_ASSERT_DOUBLE_EQUAL(b->velocity_y[i], reference->velocity_y[i], fabs(reference->velocity_y[i]) * 1e-9);
+			CU_ASSERT_DOUBLE_EQUAL(b->x[i], reference->x[i], 1e-6);
+		}
+		CU_ASSERT_EQUAL(memcmp(b->x, single->x, sizeof(double) * b->stride * BODY_ARRAYS), 0);
+		bodies_destroy(b);
+	}
+	bodies_destroy(single);
+	bodies_destroy(reference);
+
+	// A step asked for the potential sums each pair once over the tiles
+	struct bodies* b = test_cluster(n);
+	double expected = bodies_energy(b, 0, n);
+	struct energy_schedule s = { .every = 1, .from_force = 1 };
+	const struct engine* engine = engine_find("stream");
+	struct thread_pool* pool = pool_create(3);
+	void* state = engine->create(b, 3, &params);
+	struct thread_data tdata[3];
+	for (size_t i = 0; i < 3; i++) {
+		tdata[i] = (struct thread_data){ .bodies = b, .engine = engine, .state = state, .id = i, .n_threads = 3,
+			.n_bodies = n, .iterations = 2, .dt = 0.0, .pool = pool, .schedule = &s };
+		bodies_slice(n, 3, i, &tdata[i].start, &tdata[i].end);
+	}
+	pool_run(pool, worker, tdata);
+	CU_ASSERT_EQUAL(s.n_measured, 3);
+	CU_ASSERT_DOUBLE_EQUAL(tdata[0].final_energy, expected, fabs(expected) * 1e-12);
+	engine->destroy(state);
+	pool_destroy(pool);
+	bodies_destroy(b);
+}
+/* *********************************** */
+
+
+
+
+/******** SNAPSHOT TEST ***********/
+void test_snapshot_roundtrip(void) {
+	char path[] = "/tmp/nbody_snapshotXXXXXX";
+	int fd = mkstemp(path);
+	CU_ASSERT(fd >= 0);
+	FILE* file = fdopen(fd, "wb");
+	struct bodies* b = test_cluster(301);
+	CU_ASSERT_EQUAL(bodies_write_snapshot(NULL, file), 1);
+	CU_ASSERT_EQUAL(bodies_write_snapshot(b, file), 0);
+	fclose(file);
+
+	// The mapped store is laid out like an allocated one and holds the same bodies
+	struct bodies* mapped = bodies_load(path, 2);
+	CU_ASSERT_PTR_NOT_NULL(mapped);
+	CU_ASSERT_EQUAL(mapped->n_bodies, 301);
+	CU_ASSERT_EQUAL(mapped->stride, b->stride);
+	CU_ASSERT_EQUAL((size_t)mapped->x % CACHE_LINE, 0);
+	for (size_t i = 0; i < 301; i++) {
+		CU_ASSERT_EQUAL(mapped->y[i], b->y[i]);
+		CU_ASSERT_EQUAL(mapped->velocity_x[i], b->velocity_x[i]);
+		CU_ASSERT_EQUAL(mapped->mass[i], b->mass[i]);
+	}
+
+	// Writes go to private pages so the file still maps to the original bodies
+	mapped->x[0] += 1.0;
+	struct bodies* again = bodies_map_snapshot(path);
+	CU_ASSERT_EQUAL(again->x[0], b->x[0]);
+	bodies_destroy(again);
+	bodies_destroy(mapped);
+	bodies_destroy(b);
+	remove(path);
+}
+
+void test_snapshot_invalid(void) {
+	CU_ASSERT_PTR_NULL(bodies_map_snapshot(NULL));
+	CU_ASSERT_PTR_NULL(bodies_map_snapshot("/nonexistent/snapshot"));
+	CU_ASSERT_PTR_NULL(bodies_load(NULL, 1));
+
+	// A changed value fails the checksum and a short file fails the size check
+	char path[] = "/tmp/nbody_snapshotXXXXXX";
+	FILE* file = fdopen(mkstemp(path), "w+b");
+	struct bodies* b = test_cluster(50);
+	bodies_write_snapshot(b, file);
+	fflush(file);
+	struct bodies* valid = bodies_map_snapshot(path);
+	CU_ASSERT_PTR_NOT_NULL(valid);
+	bodies_destroy(valid);
+	fseek(file, SNAPSHOT_DATA_OFFSET + 8 * sizeof(double), SEEK_SET);
+	fputc(0x7f, file);
+	fflush(file);
+	CU_ASSERT_PTR_NULL(bodies_map_snapshot(path));
+	CU_ASSERT_EQUAL(ftruncate(fileno(file), SNAPSHOT_DATA_OFFSET), 0);
+	CU_ASSERT_PTR_NULL(bodies_map_snapshot(path));
+	fclose(file);
+
+	// Anything without the magic is read as csv
+	file = fopen(path, "w");
+	fprintf(file, "1.0,2.0,3.0,4.0,5.0,6.0,7.0\n8.0,9.0,10.0,11.0,12.0,13.0,14.0\n");
+	fclose(file);
+	struct bodies* csv = bodies_load(path, 1);
+	CU_ASSERT_EQUAL(csv->n_bodies, 2);
+	CU_ASSERT_EQUAL(csv->mass[1], 14.0);
+	bodies_destroy(csv);
+	bodies_destroy(b);
+	remove(path);
+}
+
+void test_body_store(void) {
+	char path[] = "/tmp/nbody_storeXXXXXX", copy_path[] = "/tmp/nbody_storeXXXXXX";
+	close(mkstemp(path));
+	close(mkstemp(copy_path));
+	CU_ASSERT_EQUAL(bodies_store_select(NULL), 1);
+	CU_ASSERT_EQUAL(bodies_store_select(""), 1);
+
+	// Only the next store goes to the file, it stays there and steps like any other
+	CU_ASSERT_EQUAL(bodies_store_select(path), 0);
+	struct bodies* b = bodies_create(301);
+	struct bodies* memory = test_cluster(301);
+	CU_ASSERT_PTR_NOT_NULL(b);
+	CU_ASSERT_EQUAL(b->pages, BODY_PAGES_FILE);
+	CU_ASSERT(b->file >= 0);
+	CU_ASSERT_EQUAL(memory->file, -1);
+	CU_ASSERT_EQUAL(strcmp(bodies_pages_name(b), "file"), 0);
+	CU_ASSERT_EQUAL((size_t)b->x % CACHE_LINE, 0);
+	memcpy(b->x, memory->x, sizeof(double) * b->stride * BODY_ARRAYS);
+	struct thread_pool* pool = pool_create(2);
+	CU_ASSERT_EQUAL(bodies_place(b, pool), 1);
+	pool_destroy(pool);
+	test_run_engine("stream", NULL, b, 2, 2, 1.0);
+	test_run_engine("stream", NULL, memory, 2, 2, 1.0);
+	bodies_read_ahead(b, 0, 301);
+	bodies_write_back(b, 0, BODY_ARRAYS, 0, 301);
+	bodies_destroy(b);
+
+	// The file is left as a snapshot of the stepped bodies
+	struct bodies* mapped = bodies_map_snapshot(path);
+	CU_ASSERT_PTR_NOT_NULL(mapped);
+	CU_ASSERT_EQUAL(mapped->file, -1);
+	CU_ASSERT_EQUAL(memcmp(mapped->x, memory->x, sizeof(double) * memory->stride * BODY_ARRAYS), 0);
+
+	// A loaded snapshot is copied to a selected file and the original is untouched
+	CU_ASSERT(bodies_to_store(mapped) == mapped);
+	CU_ASSERT_EQUAL(bodies_store_select(copy_path), 0);
+	struct bodies* copy = bodies_load(path, 1);
+	CU_ASSERT_PTR_NOT_NULL(copy);
+	CU_ASSERT_EQUAL(copy->pages, BODY_PAGES_FILE);
+	CU_ASSERT_EQUAL(memcmp(copy->x, memory->x, sizeof(double) * memory->stride * BODY_ARRAYS), 0);
+	copy->x[0] += 1.0;
+	bodies_destroy(copy);
+	copy = bodies_map_snapshot(copy_path);
+	CU_ASSERT_EQUAL(copy->x[0], memory->x[0] + 1.0);
+	bodies_destroy(copy);
+	bodies_destroy(mapped);
+	bodies_destroy(memory);
+	remove(path);
+	remove(copy_path);
+}
+/* *********************************** */
+
+
+
+/******** CSV LOADER TEST ***********/
+void test_csv_number(void) {
+	const char* numbers[] = { "0", "-0", "1", "+1.5", "0.1", "-0.3", "123456789012345678", "9007199254740993",
+		"12345678901234567890123", "0.000000000000000000000001", "1e22", "1e23", "1.7976931348623157e308",
+		"4.9e-324", "2.2250738585072014e-308", "3.14159265358979323846", "00012.5000", ".5", "5.", "1E-5",
+		"6.02214076e+23", "-2.5e-3", "1e400", "0.30000000000000004", "350.02717672320341", "18014398509481985",
+		"36028797018963971e-5", "9999999999999999999e-64", "1234567890123456789e40", "2.4703282292062328e-324" };
+	for (size_t k = 0; k < sizeof(numbers) / sizeof(numbers[0]); k++) {
+		double value, expected = strtod(numbers[k], NULL);
+		const char* end = csv_number(numbers[k], numbers[k] + strlen(numbers[k]), &value);
+		CU_ASSERT(end == numbers[k] + strlen(numbers[k]));
+		CU_ASSERT(memcmp(&value, &expected, sizeof(double)) == 0);
+	}
+
+	// Printed doubles of every size parse back to the same bits
+	srand(19);
+	char text[CSV_MAX_NUMBER];
+	for (size_t k = 0; k < 20000; k++) {
+		double original = ((double)rand() / RAND_MAX - 0.5) * pow(10.0, rand() % 60 - 30);
+		int digits = 1 + rand() % 17;
+		int len = snprintf(text, sizeof(text), k % 2 ? "%.*g" : "%.*f", digits, original);
+		double value, expected = strtod(text, NULL);
+		CU_ASSERT(csv_number(text, text + len, &value) == text + len);
+		CU_ASSERT(memcmp(&value, &expected, sizeof(double)) == 0);
+	}
+
+	// The number stops at the first character that cannot continue it
+	double value;
+	const char* comma = "  -7.25,1";
+	CU_ASSERT(csv_number(comma, comma + 9, &value) == comma + 7);
+	CU_ASSERT_EQUAL(value, -7.25);
+	const char* exponent = "2e,";
+	CU_ASSERT(csv_number(exponent, exponent + 3, &value) == exponent + 1);
+	CU_ASSERT_EQUAL(value, 2.0);
+	CU_ASSERT_PTR_NULL(csv_number("-,", "-," + 2, &value));
+	CU_ASSERT_PTR_NULL(csv_number(".", "." + 1, &value));
+}
+
+void test_csv_parse(void) {
+	CU_ASSERT_PTR_NULL(bodies_parse_csv(NULL, 1));
+	CU_ASSERT_PTR_NULL(bodies_parse_csv("/nonexistent/bodies.csv", 1));
+
+	// Large enough for many chunks, with blank lines and carriage returns between bodies
+	char path[] = "/tmp/nbody_csvXXXXXX";
+	FILE* file = fdopen(mkstemp(path), "w");
+	struct bodies* b = test_cluster(5000);
+	for (size_t i = 0; i < 5000; i++) {
+		fprintf(file, "%.17g,%.17g, %.17g,%.17g,%.17g,%.17g,%.17g%s", b->x[i], b->y[i], b->z[i], b->velocity_x[i],
+				b->velocity_y[i], b->velocity_z[i], b->mass[i], i % 7 == 0 ? "\r\n" : "\n");
+		if (i % 1000 == 0) {
+			fprintf(file, "\n  \n");
+		}
+	}
+	fclose(file);
+
+	for (size_t n_threads = 1; n_threads <= 4; n_threads += 3) {
+		struct bodies* csv = bodies_parse_csv(path, n_threads);
+		CU_ASSERT_PTR_NOT_NULL(csv);
+		CU_ASSERT_EQUAL(csv->n_bodies, 5000);
+		for (size_t i = 0; csv != NULL && i < 5000; i++) {
+			CU_ASSERT_EQUAL(csv->x[i], b->x[i]);
+			CU_ASSERT_EQUAL(csv->z[i], b->z[i]);
+			CU_ASSERT_EQUAL(csv->velocity_y[i], b->velocity_y[i]);
+			CU_ASSERT_EQUAL(csv->mass[i], b->mass[i]);
+		}
+		bodies_destroy(csv);
+	}
+	bodies_destroy(b);
+	remove(path);
+}
+
+void test_csv_errors(void) {
+	char path[] = "/tmp/nbody_csvXXXXXX";
+	FILE* file = fdopen(mkstemp(path), "w");
+	fprintf(file, "1,2,3,4,5,6,7\n\n1,2,3,4,5,6\n1,2,3,4,5,6,7\n1,2,x,4,5,6,7\n1,2,3,4,5,6,7,8\n1,2,3,4,5,6,7");
+	fclose(file);
+
+	// Every bad line is reported with its line number, blank lines counted
+	char log[] = "/tmp/nbody_csv_logXXXXXX";
+	int log_fd = mkstemp(log);
+	fflush(stderr);
+	int saved = dup(STDERR_FILENO);
+	dup2(log_fd, STDERR_FILENO);
+	CU_ASSERT_PTR_NULL(bodies_parse_csv(path, 1));
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+
+	char report[512] = { 0 };
+	CU_ASSERT(pread(log_fd, report, sizeof(report) - 1, 0) > 0);
+	close(log_fd);
+	char expected[3][128];
+	snprintf(expected[0], sizeof(expected[0]), "%s:3: fewer than 7 values\n", path);
+	snprintf(expected[1], sizeof(expected[1]), "%s:5: expected a number after a comma\n", path);
+	snprintf(expected[2], sizeof(expected[2]), "%s:6: more than 7 values\n", path);
+	char* first = strstr(report, expected[0]);
+	char* second = strstr(report, expected[1]);
+	char* third = strstr(report, expected[2]);
+	CU_ASSERT(first != NULL && second != NULL && third != NULL);
+	CU_ASSERT(first < second && second < third);
+
+	// An empty file has no bodies
+	file = fopen(path, "w");
+	fprintf(file, "\n\n");
+	fclose(file);
+	CU_ASSERT_PTR_NULL(bodies_parse_csv(path, 2));
+	remove(path);
+	remove(log);
+}
+/* *********************************** */
+
+
+
+/******** TRAJECTORY TEST ***********/
+/**
+ * Read back the steps of a trajectory file and check its last frame against a body store
+ */
+size_t test_read_trajectory(const char* path, const struct bodies* b, size_t* steps) {
+	struct trajectory_reader* r = trajectory_reader_open(path, 2);
+	CU_ASSERT_PTR_NOT_NULL(r);
+	if (r == NULL) {
+		return 0;
+	}
+	CU_ASSERT_EQUAL(r->header.n_bodies, b->n_bodies);
+	for (size_t frame = 0; frame < r->n_frames; frame++) {
+		steps[frame] = r->index[frame].step;
+	}
+
+	struct bodies* last = bodies_create(b->n_bodies);
+	CU_ASSERT_EQUAL(trajectory_read(r, r->n_frames - 1, last), 0);
+	for (size_t i = 0; i < b->n_bodies; i++) {
+		CU_ASSERT_EQUAL(last->x[i], b->x[i]);
+		CU_ASSERT_EQUAL(last->z[i], b->z[i]);
+		CU_ASSERT_EQUAL(last->velocity_y[i], b->velocity_y[i]);
+		CU_ASSERT_EQUAL(last->mass[i], b->mass[i]);
+	}
+	bodies_destroy(last);
+	size_t n_frames = r->n_frames;
+	trajectory_reader_close(r);
+	return n_frames;
+}
+
+void test_trajectory_frames(void) {
+	const char* engines[] = { "direct", "flow" };
+	for (size_t k = 0; k < 2; k++) {
+		char path[] = "/tmp/nbody_trajectoryXXXXXX";
+		close(mkstemp(path));
+		struct bodies* b = test_cluster(301);
+		const struct engine* engine = engine_find(engines[k]);
+		struct thread_pool* pool = pool_create(2);
+		void* state = engine->create(b, 2, NULL);
+		struct trajectory* t = trajectory_open(path, 301, 2, 2, 2, 0.5, 0.0);
+		CU_ASSERT_PTR_NOT_NULL(t);
+		struct thread_data tdata[2];
+		for (size_t i = 0; i < 2; i++) {
+			tdata[i] = (struct thread_data){ .bodies = b, .engine = engine, .state = state, .id = i, .n_threads = 2,
+				.n_bodies = 301, .iterations = 5, .dt = 0.5, .pool = pool, .trajectory = t };
+			bodies_slice(301, 2, i, &tdata[i].start, &tdata[i].end);
+		}
+		pool_run(pool, worker, tdata);
+		CU_ASSERT_EQUAL(trajectory_close(t), 0);
+
+		// Steps 0, 2, 4 and the last are captured, the last holds the final bodies
+		size_t steps[8];
+		CU_ASSERT_EQUAL(test_read_trajectory(path, b, steps), 4);
+		CU_ASSERT(steps[0] == 0 && steps[1] == 2 && steps[2] == 4 && steps[3] == 5);
+		engine->destroy(state);
+		pool_destroy(pool);
+		bodies_destroy(b);
+		remove(path);
+	}
+}
+
+void test_trajectory_ring(void) {
+	CU_ASSERT_PTR_NULL(trajectory_open(NULL, 10, 1, 1, 1, 0.1, 0.0));
+	CU_ASSERT_PTR_NULL(trajectory_open("/tmp/nbody_trajectory", 10, 0, 1, 1, 0.1, 0.0));
+	CU_ASSERT_PTR_NULL(trajectory_open("/nonexistent/trajectory", 10, 1, 1, 1, 0.1, 0.0));
+	CU_ASSERT_EQUAL(trajectory_due(NULL, 0, 5), 0);
+	CU_ASSERT_EQUAL(trajectory_next(NULL, 0, 5), 5);
+	CU_ASSERT_EQUAL(trajectory_close(NULL), 0);
+
+	// A single buffer makes every capture wait for the writer to finish the one before
+	char path[] = "/tmp/nbody_trajectoryXXXXXX";
+	close(mkstemp(path));
+	struct bodies* b = test_cluster(1000);
+	struct trajectory* t = trajectory_open(path, 1000, 3, 1, 1, 0.1, 0.0);
+	CU_ASSERT_EQUAL(trajectory_due(t, 3, 10), 1);
+	CU_ASSERT_EQUAL(trajectory_due(t, 4, 10), 0);
+	CU_ASSERT_EQUAL(trajectory_due(t, 10, 10), 1);
+	CU_ASSERT_EQUAL(trajectory_next(t, 4, 10), 6);
+	CU_ASSERT_EQUAL(trajectory_next(t, 9, 10), 10);
+	for (size_t frame = 0; frame < 50; frame++) {
+		b->x[0] = (double)frame;
+		trajectory_acquire(t, frame, frame * 0.1);
+		trajectory_copy(t, b, 1, 0, 1000);
+	}
+	CU_ASSERT_EQUAL(t->published, 50);
+	CU_ASSERT_EQUAL(t->peak, 1);
+	CU_ASSERT_EQUAL(trajectory_close(t), 0);
+
+	size_t steps[64];
+	CU_ASSERT_EQUAL(test_read_trajectory(path, b, steps), 50);
+	CU_ASSERT_EQUAL(steps[49], 49);
+	bodies_destroy(b);
+	remove(path);
+}
+
+void test_trajectory_random_access(void) {
+	char path[] = "/tmp/nbody_trajectoryXXXXXX";
+	close(mkstemp(path));
+	size_t n = 40000;
+	struct bodies* b = test_cluster(n);
+
+	// Several chunks per column and more frames than a key interval
+	struct trajectory* t = trajectory_open(path, n, 1, 4, 3, 0.01, 0.0);
+	CU_ASSERT_EQUAL(t->n_chunks, 3);
+	double x[40];
+	for (size_t frame = 0; frame < 40; frame++) {
+		for (size_t i = 0; i < n; i++) {
+			b->x[i] += 1e-6 * b->velocity_x[i];
+			b->velocity_z[i] *= 1.0 + 1e-9;
+		}
+		x[frame] = b->x[n - 1];
+		trajectory_acquire(t, frame, frame * 0.01);
+		trajectory_copy(t, b, 1, 0, n);
+	}
+	CU_ASSERT_EQUAL(trajectory_close(t), 0);
+
+	// Frames that barely change are stored in less than their full size
+	struct stat st;
+	stat(path, &st);
+	CU_ASSERT(st.st_size < (off_t)(40 * BODY_ARRAYS * n * sizeof(double)) * 3 / 4);
+
+	struct trajectory_reader* r = trajectory_reader_open(path, 2);
+	CU_ASSERT_EQUAL(r->n_frames, 40);
+	struct bodies* frame = bodies_create(n);
+	size_t order[] = { 37, 3, 16, 17, 39, 0, 15 };
+	for (size_t k = 0; k < sizeof(order) / sizeof(order[0]); k++) {
+		CU_ASSERT_EQUAL(trajectory_read(r, order[k], frame), 0);
+		CU_ASSERT_EQUAL(frame->x[n - 1], x[order[k]]);
+	}
+	CU_ASSERT_EQUAL(frame->mass[5], b->mass[5]);
+	CU_ASSERT_EQUAL(trajectory_read(r, 40, frame), 1);
+	trajectory_reader_close(r);
+
+	// Without its index the frames are found by walking the file, and -f loads the last
+	CU_ASSERT_EQUAL(truncate(path, st.st_size - sizeof(struct trajectory_footer) - 40 * sizeof(struct trajectory_index) - 1), 0);
+	r = trajectory_reader_open(path, 1);
+	CU_ASSERT_EQUAL(r->n_frames, 39);
+	trajectory_reader_close(r);
+	struct bodies* loaded = bodies_load(path, 2);
+	CU_ASSERT_EQUAL(loaded->n_bodies, n);
+	CU_ASSERT_EQUAL(loaded->x[n - 1], x[38]);
+	bodies_destroy(loaded);
+	bodies_destroy(frame);
+	bodies_destroy(b);
+	remove(path);
+}
+
+
+void test_trajectory_quantized(void) {
+	char exact_path[] = "/tmp/nbody_trajectoryXXXXXX", path[] = "/tmp/nbody_trajectoryXXXXXX";
+	close(mkstemp(exact_path));
+	close(mkstemp(path));
+	size_t n = 20000, frames = 20;
+	double error = 1e-4;
+	struct bodies* b = test_cluster(n);
+	struct bodies* written = bodies_create(n);
+	struct trajectory* exact = trajectory_open(exact_path, n, 1, 4, 2, 0.01, 0.0);
+	struct trajectory* t = trajectory_open(path, n, 1, 4, 2, 0.01, error);
+	CU_ASSERT_PTR_NULL(trajectory_open(path, n, 1, 4, 2, 0.01, -1.0));
+
+	for (size_t i = 0; i < n; i++) {
+		b->velocity_x[i] = sin((double)i);
+		b->velocity_y[i] = cos((double)i);
+		b->velocity_z[i] = 1e-3 * (double)(i % 100);
+	}
+
+	// One body far out leaves its chunk of x exact, the other chunks stay quantized
+	b->x[7] = 1e30;
+	for (size_t frame = 0; frame < frames; frame++) {
+		for (size_t i = 0; i < n; i++) {
+			b->x[i] += 1e-3 * b->velocity_x[i];
+			b->y[i] += 1e-3 * b->velocity_y[i];
+			b->velocity_z[i] *= 1.0 + 1e-6;
+		}
+		for (size_t column = 0; frame == frames - 1 && column < BODY_ARRAYS; column++) {
+			memcpy(written->x + column * written->stride, b->x + column * b->stride, sizeof(double) * n);
+		}
+		trajectory_acquire(exact, frame, frame * 0.01);
+		trajectory_copy(exact, b, 1, 0, n);
+		trajectory_acquire(t, frame, frame * 0.01);
+		trajectory_copy(t, b, 1, 0, n);
+	}
+	CU_ASSERT_EQUAL(trajectory_close(exact), 0);
+	CU_ASSERT_EQUAL(trajectory_close(t), 0);
+
+	// Quantized frames are several times smaller than exact ones
+	struct stat exact_st, st;
+	stat(exact_path, &exact_st);
+	stat(path, &st);
+	CU_ASSERT(st.st_size * 5 < exact_st.st_size);
+
+	// Every position and velocity is within the error and masses are exact
+	struct bodies* frame = bodies_create(n);
+	struct trajectory_reader* r = trajectory_reader_open(path, 2);
+	CU_ASSERT_EQUAL(r->header.error, error);
+	CU_ASSERT_EQUAL(trajectory_read(r, frames - 1, frame), 0);
+	double worst = 0.0;
+	for (size_t column = 0; column < TRAJECTORY_QUANTIZED_COLUMNS; column++) {
+		for (size_t i = 0; i < n; i++) {
+			double off = fabs(frame->x[column * frame->stride + i] - written->x[column * written->stride + i]);
+			worst = off > worst ? off : worst;
+		}
+	}
+	CU_ASSERT(worst <= error);
+	CU_ASSERT(worst > 0.0);
+	CU_ASSERT_EQUAL(frame->x[7], written->x[7]);
+	CU_ASSERT_EQUAL(memcmp(frame->mass, written->mass, sizeof(double) * n), 0);
+
+	// A frame between key frames reads the same in order and on its own
+	struct bodies* again = bodies_create(n);
+	CU_ASSERT_EQUAL(trajectory_read(r, 17, frame), 0);
+	trajectory_reader_close(r);
+	r = trajectory_reader_open(path, 1);
+	CU_ASSERT_EQUAL(trajectory_read(r, 17, again), 0);
+	CU_ASSERT_EQUAL(memcmp(frame->x, again->x, sizeof(double) * n), 0);
+	CU_ASSERT_EQUAL(memcmp(frame->velocity_z, again->velocity_z, sizeof(double) * n), 0);
+	trajectory_reader_close(r);
+
+	// An error too small for any value stores every chunk exactly
+	t = trajectory_open(path, n, 1, 1, 1, 0.01, 1e-300);
+	trajectory_acquire(t, 0, 0.0);
+	trajectory_copy(t, written, 1, 0, n);
+	CU_ASSERT_EQUAL(trajectory_close(t), 0);
+	struct bodies* loaded = bodies_load(path, 1);
+	CU_ASSERT_EQUAL(memcmp(loaded->x, written->x, sizeof(double) * n), 0);
+	CU_ASSERT_EQUAL(memcmp(loaded->velocity_y, written->velocity_y, sizeof(double) * n), 0);
+	bodies_destroy(loaded);
+	bodies_destroy(again);
+	bodies_destroy(frame);
+	bodies_destroy(written);
+	bodies_destroy(b);
+	remove(exact_path);
+	remove(path);
+}
+/* *********************************** */
+
+/******** CHECKPOINT TEST ***********/
+/**
+ * Run an engine on a pool of threads through the worker from step first, with checkpoints if given
+ */
+void test_checkpoint_run(const struct engine* engine, struct engine_params* params, struct bodies* b, size_t n_threads,
+		struct energy_schedule* schedule, struct checkpoint* c, size_t first, size_t iterations) {
+	void* state = engine->create(b, n_threads, params);
+	struct thread_pool* pool = pool_create(n_threads);
+	struct thread_data tdata[2];
+	for (size_t i = 0; i < n_threads; i++) {
+		tdata[i] = (struct thread_data){ .bodies = b, .engine = engine, .state = state, .id = i, .n_threads = n_threads,
+			.n_bodies = b->n_bodies, .iterations = iterations, .dt = 1.0, .pool = pool, .schedule = schedule,
+			.first = first, .checkpoint = c };
+		bodies_slice(b->n_bodies, n_threads, i, &tdata[i].start, &tdata[i].end);
+	}
+	pool_run(pool, worker, tdata);
+	pool_destroy(pool);
+	engine->destroy(state);
+}
+
+
+void test_checkpoint_resume(void) {
+	// On the same threads every engine repeats bit for bit, so a resumed run does too
+	const char* engines[] = { "direct", "direct", "flow", "pm" };
+	size_t threads[] = { 1, 2, 2, 2 };
+	struct engine_params engine_params[] = { { 0 }, { 0 }, { 0 }, { .grid = 16, .periodic = 1 } };
+	for (size_t k = 0; k < 4; k++) {
+		char path[] = "/tmp/nbody_checkpointXXXXXX";
+		close(mkstemp(path));
+		const struct engine* engine = engine_find(engines[k]);
+		struct bodies* reference = test_cluster(300);
+		struct bodies* b = test_cluster(300);
+		for (size_t i = 0; i < 300; i++) {
+			reference->velocity_x[i] = b->velocity_x[i] = 3000.0 * sin((double)i);
+		}
+
+		// One run goes straight through, the other writes a checkpoint every 5 steps on the way
+		struct energy_schedule whole = { .every = 4 }, checkpointed = { .every = 4 };
+		struct engine_params params = engine_params[k];
+		test_checkpoint_run(engine, &params, reference, threads[k], &whole, NULL, 0, 12);
+		params = engine_params[k];
+		struct checkpoint* c = checkpoint_open(path, 5, engine, &params, &checkpointed, 12, 1.0, 1, threads[k]);
+		CU_ASSERT_PTR_NOT_NULL(c);
+		test_checkpoint_run(engine, &params, b, threads[k], &checkpointed, c, 0, 12);
+		CU_ASSERT_EQUAL(c->n_written, 2);
+		CU_ASSERT_EQUAL(c->stopped, SIZE_MAX);
+		CU_ASSERT_EQUAL(checkpoint_close(c), 0);
+
+		// The last checkpoint is a snapshot of step 10 that carries on to the same bodies and energies
+		struct checkpoint_state state;
+		CU_ASSERT_EQUAL(checkpoint_read(path, &state), 0);
+		CU_ASSERT_EQUAL(state.step, 10);
+		CU_ASSERT_EQUAL(state.iterations, 12);
+		struct energy_schedule resumed = { 0 };
+		const struct engine* restored = NULL;
+		CU_ASSERT_EQUAL(checkpoint_restore(&state, &restored, &params, &resumed), 0);
+		CU_ASSERT(restored == engine);
+		struct bodies* mapped = bodies_map_snapshot(path);
+		CU_ASSERT_PTR_NOT_NULL(mapped);
+		test_checkpoint_run(restored, &params, mapped, state.n_threads, &resumed, NULL, state.step, state.iterations);
+		for (size_t column = 0; column < BODY_ARRAYS; column++) {
+			CU_ASSERT_EQUAL(memcmp(b->x + column * b->stride, reference->x + column * reference->stride,
+				sizeof(double) * 300), 0);
+			CU_ASSERT_EQUAL(memcmp(mapped->x + column * mapped->stride, reference->x + column * reference->stride,
+				sizeof(double) * 300), 0);
+		}
+		CU_ASSERT_EQUAL(resumed.n_measured, whole.n_measured);
+		CU_ASSERT_EQUAL(resumed.initial, whole.initial);
+		bodies_destroy(mapped);
+		bodies_destroy(b);
+		bodies_destroy(reference);
+		remove(path);
+	}
+}
+
+
+void test_checkpoint_signal(void) {
+	char path[] = "/tmp/nbody_checkpointXXXXXX";
+	close(mkstemp(path));
+	const struct engine* engine = engine_find("direct");
+	struct engine_params params = { 0 };
+	struct checkpoint_state state;
+	CU_ASSERT_PTR_NULL(checkpoint_open(NULL, 5, engine, &params, NULL, 12, 1.0, 1, 2));
+	CU_ASSERT_PTR_NULL(checkpoint_open(path, 5, engine, &params, NULL, 12, 1.0, 1, 0));
+	CU_ASSERT_EQUAL(checkpoint_read(path, &state), 1);
+	CU_ASSERT_EQUAL(checkpoint_read("/nonexistent/checkpoint", &state), 1);
+	CU_ASSERT_EQUAL(checkpoint_due(NULL, 3, 0, 12), CHECKPOINT_NONE);
+	CU_ASSERT_EQUAL(checkpoint_next(NULL, 3, 12), 12);
+	CU_ASSERT_EQUAL(checkpoint_close(NULL), 0);
+
+	// SIGTERM writes a checkpoint after the step the run is on and stops it there
+	struct bodies* start = test_cluster(300);
+	struct bodies* b = test_cluster(300);
+	struct checkpoint* c = checkpoint_open(path, 0, engine, &params, NULL, 12, 1.0, 1, 2);
+	raise(SIGTERM);
+	test_checkpoint_run(engine, &params, b, 2, NULL, c, 0, 12);
+	CU_ASSERT_EQUAL(c->stopped, 0);
+	CU_ASSERT_EQUAL(c->n_written, 1);
+	CU_ASSERT_EQUAL(checkpoint_close(c), 0);
+	CU_ASSERT_EQUAL(checkpoint_read(path, &state), 0);
+	CU_ASSERT_EQUAL(state.step, 0);
+	struct bodies* mapped = bodies_map_snapshot(path);
+	CU_ASSERT_EQUAL(memcmp(mapped->x, start->x, sizeof(double) * 300), 0);
+	CU_ASSERT_EQUAL(memcmp(mapped->mass, start->mass, sizeof(double) * 300), 0);
+
+	// A file that is a snapshot but not a checkpoint is refused
+	FILE* file = fopen(path, "wb");
+	CU_ASSERT_EQUAL(bodies_write_snapshot(start, file), 0);
+	fclose(file);
+	CU_ASSERT_EQUAL(checkpoint_read(path, &state), 1);
+	bodies_destroy(mapped);
+	bodies_destroy(b);
+	bodies_destroy(start);
+	remove(path);
+}
+/* *********************************** */
+
+
+/******** RANDOM GENERATOR TEST ***********/
+void test_philox_known(void) {
+	// Known answers of Philox4x32-10 from its authors
+	uint32_t counters[3][4] = { { 0, 0, 0, 0 }, { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff },
+		{ 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 } };
+	uint32_t keys[3][2] = { { 0, 0 }, { 0xffffffff, 0xffffffff }, { 0xa4093822, 0x299f31d0 } };
+	uint32_t expected[3][4] = { { 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 },
+		{ 0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd }, { 0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 } };
+	for (size_t k = 0; k < 3; k++) {
+		uint32_t block[4];
+		philox4x32(counters[k], keys[k], block);
+		CU_ASSERT_EQUAL(memcmp(block, expected[k], sizeof(block)), 0);
+	}
+
+	// Uniform numbers stay strictly inside (0, 1) with the mean and spread they should have
+	struct philox r;
+	philox_init(&r, 42, 3);
+	double sum = 0.0, squares = 0.0;
+	for (size_t i = 0; i < 100000; i++) {
+		double u = philox_uniform(&r);
+		CU_ASSERT(u > 0.0 && u < 1.0);
+		double g = philox_normal(&r);
+		sum += u;
+		squares += g * g;
+	}
+	CU_ASSERT_DOUBLE_EQUAL(sum / 100000, 0.5, 0.01);
+	CU_ASSERT_DOUBLE_EQUAL(squares / 100000, 1.0, 0.02);
+
+	// Streams of other seeds and bodies differ
+	struct philox other;
+	philox_init(&r, 42, 3);
+	philox_init(&other, 42, 4);
+	CU_ASSERT_NOT_EQUAL(philox_uniform(&r), philox_uniform(&other));
+	philox_init(&other, 43, 3);
+	CU_ASSERT_NOT_EQUAL(philox_uniform(&r), philox_uniform(&other));
+}
+
+
+/**
+ * Split the energy of a generated store into its kinetic and potential parts
+ */
+void test_generated_energy(const struct bodies* b, double* kinetic, double* potential) {
+	*kinetic = 0.0;
+	for (size_t i = 0; i < b->n_bodies; i++) {
+		*kinetic += 0.5 * b->mass[i] * (b->velocity_x[i] * b->velocity_x[i] + b->velocity_y[i] * b->velocity_y[i]
+				+ b->velocity_z[i] * b->velocity_z[i]);
+	}
+	*potential = bodies_energy(b, 0, b->n_bodies) - *kinetic;
+}
+
+
+void test_generate_threads(void) {
+	const char* models[] = { "random", "plummer", "cube", "disk", "collapse" };
+	CU_ASSERT_PTR_NULL(generator_find("sphere"));
+	CU_ASSERT_PTR_NULL(bodies_generate("sphere", 100, 1, 1));
+	CU_ASSERT_PTR_NULL(bodies_generate("plummer", 0, 1, 1));
+	CU_ASSERT_PTR_NULL(bodies_generate("plummer", 100, 1, 0));
+
+	// A seed gives the same bits on any number of threads, and the centre of mass rests at the origin
+	size_t n = 3 * GENERATE_CHUNK + 100;
+	for (size_t k = 0; k < 5; k++) {
+		struct bodies* single = bodies_generate(models[k], n, 11, 1);
+		struct bodies* b = bodies_generate(models[k], n, 11, 3);
+		struct bodies* other = bodies_generate(models[k], n, 12, 3);
+		CU_ASSERT_EQUAL(memcmp(b->x, single->x, sizeof(double) * b->stride * BODY_ARRAYS), 0);
+		CU_ASSERT_NOT_EQUAL(memcmp(b->x, other->x, sizeof(double) * b->stride * BODY_ARRAYS), 0);
+		double mass = 0.0, centre = 0.0, momentum = 0.0, extent = 0.0, speed = 0.0;
+		for (size_t i = 0; i < n; i++) {
+			CU_ASSERT(b->mass[i] > 0.0);
+			mass += b->mass[i];
+			centre += b->mass[i] * b->y[i];
+			momentum += b->mass[i] * b->velocity_x[i];
+			extent += b->mass[i] * fabs(b->y[i]);
+			speed += b->mass[i] * fabs(b->velocity_x[i]);
+		}
+		CU_ASSERT(fabs(centre) <= extent * 1e-12);
+		CU_ASSERT(fabs(momentum) <= speed * 1e-12);
+		if (k > 0) {
+			CU_ASSERT_DOUBLE_EQUAL(mass, GENERATE_MASS, GENERATE_MASS * 1e-12);
+		}
+		bodies_destroy(other);
+		bodies_destroy(b);
+		bodies_destroy(single);
+	}
+
+	// The original generator gives the same bodies on every call
+	struct bodies* first = bodies_gen_random(500);
+	struct bodies* again = bodies_gen_random(500);
+	CU_ASSERT_EQUAL(memcmp(first->x, again->x, sizeof(double) * first->stride * BODY_ARRAYS), 0);
+	bodies_destroy(again);
+	bodies_destroy(first);
+}
+
+
+void test_generate_models(void) {
+	size_t n = 3000;
+	double kinetic, potential;
+
+	// The Plummer sphere and the cube start near virial equilibrium, the collapse at rest
+	struct bodies* b = bodies_generate("plummer", n, 5, 2);
+	test_generated_energy(b, &kinetic, &potential);
+	CU_ASSERT_DOUBLE_EQUAL(2.0 * kinetic / -potential, 1.0, 0.1);
+	CU_ASSERT_DOUBLE_EQUAL(kinetic + potential, -3.0 * PI / 64.0 * GCONST * GENERATE_MASS * GENERATE_MASS / GENERATE_RADIUS,
+			0.1 * GCONST * GENERATE_MASS * GENERATE_MASS / GENERATE_RADIUS);
+	bodies_destroy(b);
+	b = bodies_generate("cube", n, 5, 2);
+	test_generated_energy(b, &kinetic, &potential);
+	CU_ASSERT_DOUBLE_EQUAL(2.0 * kinetic / -potential, 1.0, 0.1);
+
+	// The cube stays in its box but for the small shift of its centre of mass
+	for (size_t i = 0; i < n; i++) {
+		CU_ASSERT(fabs(b->x[i]) < 1.05 * GENERATE_RADIUS && fabs(b->z[i]) < 1.05 * GENERATE_RADIUS);
+	}
+	bodies_destroy(b);
+	b = bodies_generate("collapse", n, 5, 2);
+	test_generated_energy(b, &kinetic, &potential);
+	CU_ASSERT_EQUAL(kinetic, 0.0);
+	CU_ASSERT_DOUBLE_EQUAL(potential, -0.6 * GCONST * GENERATE_MASS * GENERATE_MASS / GENERATE_RADIUS,
+			0.05 * GCONST * GENERATE_MASS * GENERATE_MASS / GENERATE_RADIUS);
+	bodies_destroy(b);
+
+	// The disk is thin, its mean radius is two scale lengths and it turns one way
+	b = bodies_generate("disk", n, 5, 2);
+	double radius = 0.0, height = 0.0, spin = 0.0;
+	for (size_t i = 0; i < n; i++) {
+		radius += sqrt(b->x[i] * b->x[i] + b->y[i] * b->y[i]) / n;
+		height += fabs(b->z[i]) / n;
+		spin += b->x[i] * b->velocity_y[i] - b->y[i] * b->velocity_x[i] > 0.0;
+	}
+	CU_ASSERT_DOUBLE_EQUAL(radius, 2.0 * GENERATE_RADIUS, 0.1 * GENERATE_RADIUS);
+	CU_ASSERT(height < 0.15 * GENERATE_RADIUS);
+	CU_ASSERT(spin > 0.99 * n);
+	bodies_destroy(b);
+}
+/* *********************************** */
+
 void* testcases[] = {
 	&test_valid_distance,
 	&test_zero_distance,
@@ -266,6 +2036,57 @@ void* testcases[] = {
 	&test_validenergy_step,
 	&test_validenergylarge_step,
 	&test_validenergylargerandom_step,
+	&test_aligned_bodies,
+	&test_zero_bodies,
+	&test_roundtrip_bodies,
+	&test_bodies_slice,
+	&test_body_pages,
+	&test_unknown_kernel,
+	&test_kernels_agree,
+	&test_potential_kernels,
+	&test_tiled_step,
+	&test_rsqrt_error,
+	&test_blocked_step,
+	&test_pair_partition,
+	&test_symmetric_kernels,
+	&test_parallel_step,
+	&test_pool_steal,
+	&test_pool_lanes,
+	&test_pool_barrier,
+	&test_parallel_energy,
+	&test_bodies_place,
+	&test_energy_schedule,
+	&test_energy_log,
+	&test_energy_from_force,
+	&test_fused_potential,
+	&test_unknown_engine,
+	&test_bh_open_all,
+	&test_bh_accuracy,
+	&test_bh_threads,
+	&test_fmm_accuracy,
+	&test_fmm_threads,
+	&test_pm_isolated,
+	&test_pm_periodic,
+	&test_pm_threads,
+	&test_p3m_accuracy,
+	&test_p3m_threads,
+	&test_flow_engine,
+	&test_stream_engine,
+	&test_snapshot_roundtrip,
+	&test_snapshot_invalid,
+	&test_body_store,
+	&test_csv_number,
+	&test_csv_parse,
+	&test_csv_errors,
+	&test_trajectory_frames,
+	&test_trajectory_ring,
+	&test_trajectory_random_access,
+	&test_trajectory_quantized,
+	&test_checkpoint_resume,
+	&test_checkpoint_signal,
+	&test_philox_known,
+	&test_generate_threads,
+	&test_generate_models,
 };
 
 char* testcase_description[] = {
@@ -289,6 +2110,57 @@ char* testcase_description[] = {
 	"test_validenergy_step",
 	"test_validenergylarge_step",
 	"test_validenergylargerandom_step",
+	"test_aligned_bodies",
+	"test_zero_bodies",
+	"test_roundtrip_bodies",
+	"test_bodies_slice",
+	"test_body_pages",
+	"test_unknown_kernel",
+	"test_kernels_agree",
+	"test_potential_kernels",
+	"test_tiled_step",
+	"test_rsqrt_error",
+	"test_blocked_step",
+	"test_pair_partition",
+	"test_symmetric_kernels",
+	"test_parallel_step",
+	"test_pool_steal",
+	"test_pool_lanes",
+	"test_pool_barrier",
+	"test_parallel_energy",
+	"test_bodies_place",
+	"test_energy_schedule",
+	"test_energy_log",
+	"test_energy_from_force",
+	"test_fused_potential",
+	"test_unknown_engine",
+	"test_bh_open_all",
+	"test_bh_accuracy",
+	"test_bh_threads",
+	"test_fmm_accuracy",
+	"test_fmm_threads",
+	"test_pm_isolated",
+	"test_pm_periodic",
+	"test_pm_threads",
+	"test_p3m_accuracy",
+	"test_p3m_threads",
+	"test_flow_engine",
+	"test_stream_engine",
+	"test_snapshot_roundtrip",
+	"test_snapshot_invalid",
+	"test_body_store",
+	"test_csv_number",
+	"test_csv_parse",
+	"test_csv_errors",
+	"test_trajectory_frames",
+	"test_trajectory_ring",
+	"test_trajectory_random_access",
+	"test_trajectory_quantized",
+	"test_checkpoint_resume",
+	"test_checkpoint_signal",
+	"test_philox_known",
+	"test_generate_threads",
+	"test_generate_models",
 };
 
 int init_suite(void) {
@@ -315,7 +2187,7 @@ int main() {
 	}
 
 	// Add all the tests to the suite
-	for (int i = 0; i < 20; i++) {
+	for (int i = 0; i < sizeof(testcases) / sizeof(testcases[0]); i++) {
 		if (CU_add_test(p_suite, testcase_description[i], testcases[i]) == NULL) {
 			CU_cleanup_registry();
 			return CU_get_error();